@@ -0,0 +1,45 @@
+#!/bin/sh
+# Throughput of the bytecode interpreter (neo --interp) against native code
+# on the example programs. Both run in process, the native code through
+# --run, & the best of RUNS execution times reported by --time-passes is
+# kept, so neither includes compiling nor starting a process. Compile-time
+# evaluation is turned off, as it would fold the programs, whose inputs
+# are constants, down to their result.
+#
+# usage: bench/interp.sh [-O<level>] [programs...]
+
+NEO=${NEO:-build/neo}
+RUNS=${RUNS:-5}
+OPT=-O2
+
+case "$1" in
+  -O*) OPT=$1; shift ;;
+esac
+[ $# -gt 0 ] || set -- examples/*.ns
+
+# Best execution time in milliseconds of `neo $OPT <mode> program`, reported
+# as the phase named `phase`
+best_time() {
+  mode=$1 phase=$2 program=$3 best=
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    t=$("$NEO" $OPT -fno-ctfe "$mode" --time-passes "$program" 2>&1 >/dev/null |
+      awk -v phase="$phase" '$1 == phase { print $3 }')
+    [ -n "$t" ] || return 1
+    best=$(awk -v a="$best" -v b="$t" 'BEGIN { print (a == "" || b < a) ? b : a }')
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+printf "%-20s %12s %12s %10s\n" "program" "native (ms)" "interp (ms)" "slowdown"
+for program in "$@"; do
+  name=$(basename "$program")
+  if ! native=$(best_time --run run "$program") || ! interp=$(best_time --interp interp "$program"); then
+    printf "%-20s %12s\n" "$name" "(failed)"
+    continue
+  fi
+
+  printf "%-20s %12.3f %12.3f %10s\n" "$name" "$native" "$interp" \
+    "$(awk -v a="$native" -v b="$interp" 'BEGIN { if (a > 0) printf "%.1fx", b / a; else print "-" }')"
+done
@@ -42,6 +42,7 @@ typedef enum {
   UN_NOT,
   UN_DEREF,
   UN_ADDR,
+  UN_CONV,       /* Implicit conversion to the type of the expression */
   BIN_ADD,
   BIN_SUB,
   BIN_MUL,
@@ -97,6 +98,8 @@ typedef struct {
 } Value;
 
 void dump_value(Value *val);
+const Type *value_type(const Value *val);
+bool convert_value(Value *val, const Type *type);
 uint8_t *copy_value(Value *val, size_t *val_size);
 
 typedef enum {
@@ -129,6 +132,7 @@ struct Node {
     char *ref;
   };
   bool visited;
+  Node *decl;          /* Declaration a reference or assignment binds to */
   Span span;
   const Type *type;
   Node *next;
@@ -0,0 +1,53 @@
+#ifndef NEO_CALLGRAPH_H
+#define NEO_CALLGRAPH_H
+
+#include <stdbool.h>
+
+#include "ast.h"
+#include "compiler.h"
+#include "hashmap.h"
+#include "ir.h"
+
+typedef struct CallGraphNode CallGraphNode;
+struct CallGraphNode {
+  char *name;
+  Node *decl;                /* Declaration, for graphs built from the AST */
+  BasicBlock *entry;         /* Block holding the OP_DEF of the function */
+
+  /* One entry per call site, so a callee may appear more than once */
+  int ncallees;
+  CallGraphNode **callees;
+  int nsites;                /* Number of call sites targeting this function */
+
+  bool recursive;            /* Part of a cycle in the call graph */
+  bool reachable;            /* Reachable from one of the roots */
+
+  /* Declarations of the globals the function refers to */
+  int nglobals;
+  Node **globals;
+
+  int seq;                   /* Order in which the node was created */
+
+  /* Tarjan's SCC bookkeeping */
+  int index, lowlink;
+  bool on_stack;
+};
+
+typedef struct {
+  HashMap nodes;             /* name -> CallGraphNode */
+
+  /* Functions in bottom-up order: callees come before their callers */
+  int nnodes;
+  CallGraphNode **order;
+} CallGraph;
+
+void callgraph_build(CallGraph *cg, BasicBlock *prog);
+void callgraph_build_ast(CallGraph *cg, CompilationUnit *units, size_t nunits);
+void callgraph_mark_reachable(CallGraph *cg, const char *root);
+void callgraph_free(CallGraph *cg);
+CallGraphNode *callgraph_lookup(CallGraph *cg, const char *name);
+void dump_callgraph(CallGraph *cg);
+
+void eliminate_dead_functions(BasicBlock *prog);
+
+#endif
@@ -1,15 +1,30 @@
 #ifndef NEO_CODEGEN_H
 #define NEO_CODEGEN_H
 
+#include <stdbool.h>
+#include <stdio.h>
+
 #include "ir.h"
+#include "profile.h"
 
-#define BUILD_ARTIFACT "/tmp/neo-build-artifact"
+typedef enum {
+  REGALLOC_LINEAR,  /* Linear scan, fast (default) */
+  REGALLOC_GRAPH    /* Graph coloring with move coalescing */
+} RegAllocKind;
 
 typedef struct {
-  size_t code_size;
-  char *code;
-} Target;
+  RegAllocKind regalloc;
+  bool select;      /* Compile branches over single assignments to setcc/cmovcc */
+  bool omit_frame_pointer;  /* Address the frame from rsp, without saving rbp */
+  bool profile_cycles;      /* Time every function & report on exit */
+
+  /* -fprofile-generate: counters numbered by profile_instrument, & the file
+   * the program writes them to on exit. NULL otherwise. */
+  Profile *profile;
+  const char *profile_path;
+} CodegenOptions;
 
-Target nasm_x86_64_generate(BasicBlock *prog);
+/* Writes the program as a C99 translation unit, see c_codegen.c */
+void c_generate(BasicBlock *prog, FILE *out);
 
 #endif
@@ -8,7 +8,7 @@
 typedef struct {
   int id;
   size_t size;
-  char *filepath;
+  const char *filepath;
   char *contents;
 } File;
 
@@ -1,6 +1,7 @@
 #ifndef NEO_IR_H
 #define NEO_IR_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "ast.h"
@@ -15,6 +16,7 @@ typedef enum {
   OP_NOT         = UN_NOT,
   OP_DEREF       = UN_DEREF,
   OP_ADDR        = UN_ADDR,
+  OP_CONV        = UN_CONV,
   OP_ADD         = BIN_ADD,
   OP_SUB         = BIN_SUB,
   OP_MUL         = BIN_MUL,
@@ -25,8 +27,16 @@ typedef enum {
   OP_CMP_GT      = BIN_CMP_GT,
   OP_CMP_LT_EQ   = BIN_CMP_LT_EQ,
   OP_CMP_GT_EQ   = BIN_CMP_GT_EQ,
+  OP_SHL,         /* Machine-level operations introduced by the optimizer */
+  OP_SHR,
+  OP_SAR,
+  OP_MULHI,
+  OP_UMULHI,
   OP_DEF,
   OP_ASSIGN,
+  OP_PARAM,      /* x := param i, binds the i-th argument of the function */
+  OP_ARG,        /* arg v, pushes an argument for the following call */
+  OP_CALL,       /* x := call f, n (the n preceding OP_ARGs are consumed) */
   OP_JMP,
   OP_BR,
   OP_RET,
@@ -49,6 +59,7 @@ typedef struct {
     char *var;
     char *label;
   };
+  int vreg;      /* Virtual register of a variable, numbered by the backend */
 } Operand;
 
 #define MAX_OPERANDS 2
@@ -57,12 +68,18 @@ struct Instruction {
   Opcode opcode;
   int start, end;
   char *assignee;
+  int vreg;      /* Virtual register of the assignee */
 
   uint8_t nopers;
   Operand operands[MAX_OPERANDS];
 
   Span span;
-  Type *type;
+  const Type *type;
+
+  /* Calls only: profile counter of the call site (-1 if not instrumented),
+   * & times it was executed in the profile (-1 without one) */
+  int counter;
+  int64_t count;
 
   Instruction *next;
   Instruction *prev;
@@ -72,6 +89,13 @@ struct Instruction {
 #define IS_VARIABLE(o)  (o.kind == O_VARIABLE)
 #define IS_LABEL(o)     (o.kind == O_LABEL)
 
+#define IS_UNARY_OP(op)   ((op) >= OP_NEG && (op) <= OP_CONV)
+#define IS_BINARY_OP(op)  ((op) >= OP_ADD && (op) <= OP_UMULHI)
+#define IS_COMPARISON_OP(op) ((op) >= OP_CMP && (op) <= OP_CMP_GT_EQ)
+
+#define IS_TERMINATOR(inst) \
+  ((inst)->opcode == OP_JMP || (inst)->opcode == OP_BR || (inst)->opcode == OP_RET)
+
 typedef struct BasicBlock BasicBlock;
 struct BasicBlock {
   int id;
@@ -79,11 +103,38 @@ struct BasicBlock {
 
   Instruction *head, *tail;
 
+  /* Control flow edges. For a block ending in OP_BR, succ[0] is the target
+   * taken when the condition is true and succ[1] the one taken otherwise. */
+  int npreds, nsuccs;
   BasicBlock **pred, **succ;
   BasicBlock *next, *prev;
+
+  /* Profile counters the block increments, those of the blocks & inlined
+   * calls merged into it, & times it was executed in the profile (-1
+   * without one), see profile.h */
+  int *counters;
+  int ncounters;
+  int64_t count;
 };
 
-BasicBlock *lower_to_ir(Node *node);
+#define IS_FUNCTION_ENTRY(block) ((block)->head && (block)->head->opcode == OP_DEF)
+
+Instruction *instruction_create(Opcode opcode, Span span, const Type *type);
+char *make_temporary();
+
+BasicBlock *block_create(int id, char *tag);
+void block_insert_before(BasicBlock *block, Instruction *at, Instruction *inst);
+void block_append(BasicBlock *block, Instruction *inst);
+void block_add_edge(BasicBlock *from, BasicBlock *to);
+void block_remove_edge(BasicBlock *from, BasicBlock *to);
+void block_unlink(BasicBlock *block);
+void block_add_counter(BasicBlock *block, int counter);
+BasicBlock *function_end(BasicBlock *entry);
+void merge_blocks(BasicBlock *prog);
+
+BasicBlock *lower_to_ir(Node **functions, size_t nfunctions, bool cse);
+void compute_liveness(BasicBlock *prog);
+void eliminate_dead_code(BasicBlock *prog);
 void dump_ir(BasicBlock *prog);
 void dump_instruction(Instruction *inst);
 
@@ -0,0 +1,10 @@
+#ifndef NEO_JIT_H
+#define NEO_JIT_H
+
+#include "object.h"
+
+/* Loads an object file into executable memory & calls `entry`, returning
+ * its result, or 0 when it returns nothing */
+int jit_run(ObjectFile *obj, const char *entry, bool returns_void);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef NEO_OBJECT_H
+#define NEO_OBJECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashmap.h"
+
+/* Relocatable object files */
+
+typedef enum {
+  SEC_TEXT,
+  SEC_DATA,
+  SEC_BSS,
+  SEC_RODATA,
+  SEC_RODATA_STR,      /* String literals */
+  NUM_SECTIONS
+} SectionID;
+
+typedef struct {
+  uint8_t *data;       /* NULL for .bss, which only has a size */
+  size_t size, capacity;
+  size_t align;
+} Section;
+
+#define SECTION_UNDEF -1
+
+typedef struct {
+  char *name;
+  int section;         /* SectionID, or SECTION_UNDEF for external symbols */
+  size_t offset;
+  size_t size;
+  bool global;
+  bool function;
+} ObjSymbol;
+
+typedef enum {
+  RELOC_PC32,          /* 32-bit PC-relative reference to data */
+  RELOC_PLT32,         /* 32-bit PC-relative call through the PLT */
+  RELOC_ABS64          /* 64-bit address of a symbol, held in data */
+} RelocKind;
+
+typedef struct {
+  SectionID section;   /* Patched, .text or .data */
+  size_t offset;
+  int symbol;
+  RelocKind kind;
+  int64_t addend;
+} Relocation;
+
+typedef struct {
+  Section sections[NUM_SECTIONS];
+
+  ObjSymbol *symbols;
+  size_t nsymbols;
+  HashMap symbol_index;  /* name -> index + 1 */
+
+  Relocation *relocs;
+  size_t nrelocs;
+} ObjectFile;
+
+void object_init(ObjectFile *obj);
+void object_free(ObjectFile *obj);
+
+void section_emit(Section *section, const void *bytes, size_t size);
+void section_align(Section *section, size_t align);
+
+int object_symbol(ObjectFile *obj, const char *name);
+void object_define(ObjectFile *obj, int symbol, SectionID section, size_t offset, size_t size);
+void object_relocate(ObjectFile *obj, SectionID section, size_t offset, int symbol, RelocKind kind,
+    int64_t addend);
+
+void object_write_elf64(ObjectFile *obj, const char *path);
+
+#endif
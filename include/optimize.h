@@ -1,10 +1,33 @@
 #ifndef NEO_OPTIMIZE_H
 #define NEO_OPTIMIZE_H
 
-#include "ast.h"
+#include <stdbool.h>
 
-#define CONSTANT_FOLDING (1 << 1)
+#include "ast.h"
+#include "ir.h"
 
 void fold_constants(Node *node);
 
+bool value_is_truthy(const Value *v);
+bool fold_value_unary(int un_op, const Value *v, Value *out);
+bool fold_value_binary(int bin_op, const Value *lhs, const Value *rhs, Value *out);
+
+/* Initial value of a global, false unless its initializer is constant */
+bool global_value(const Node *decl, Value *out);
+/* Label of the literal a global initialized to a string points to, which is
+ * marked in use */
+const char *global_string(const Value *value);
+/* Marks the literals of the globals the program uses, before the string
+ * pool is laid out */
+void use_global_strings(BasicBlock *prog);
+/* Fills `used` & `stored` (either may be NULL) with the globals the
+ * instructions refer to & assign */
+void scan_globals(BasicBlock *prog, HashMap *used, HashMap *stored);
+void propagate_globals(BasicBlock *prog);
+
+void propagate_constants(BasicBlock *prog);
+void simplify_instructions(BasicBlock *prog);
+void inline_functions(BasicBlock *prog);
+void evaluate_calls(BasicBlock *prog);
+
 #endif
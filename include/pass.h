@@ -0,0 +1,53 @@
+#ifndef NEO_PASS_H
+#define NEO_PASS_H
+
+#include <stdbool.h>
+
+#include "ast.h"
+#include "ir.h"
+
+#define DEFAULT_OPT_LEVEL 1
+#define MAX_OPT_LEVEL     2
+
+typedef enum {
+  PASS_AST,      /* Runs on the AST of every compilation unit */
+  PASS_LOWERING, /* Performed while lowering to IR, can only be toggled */
+  PASS_IR,       /* Runs on the lowered program */
+  PASS_MACHINE   /* Runs on the machine instructions, can only be toggled */
+} PassKind;
+
+typedef struct {
+  const char *name;
+  const char *description;
+  PassKind kind;
+  int level;     /* Lowest -O level that enables the pass */
+  union {
+    void (*ast)(Node *);
+    void (*ir)(BasicBlock *);
+  } run;
+
+  bool enabled;
+
+  /* Statistics for --time-passes */
+  int runs;
+  double seconds;
+  long ir_delta;
+} Pass;
+
+void passes_init(int opt_level, bool timed);
+bool passes_toggle(const char *arg);
+bool pass_enabled(const char *name);
+int pass_opt_level();
+void passes_list();
+
+void run_ast_passes(Node *ast);
+void run_ir_passes(BasicBlock *prog);
+
+/* Compiler phases outside of the pass pipeline are timed by hand */
+double timer_now();
+void record_phase(const char *name, double start);
+
+long count_instructions(BasicBlock *prog);
+void print_pass_timings();
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef NEO_PROFILE_H
+#define NEO_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashmap.h"
+#include "ir.h"
+
+/* Profile-Guided Optimization
+ *
+ * -fprofile-generate gives every block & call site of the program, as
+ * lowered before any optimization, a 64-bit counter in .bss that the
+ * generated code increments. Merged blocks keep all their counters, the
+ * inliner's clones share those of the originals, & the block an inlined call
+ * returns to counts the call, so the profile describes the program as it
+ * was lowered whatever the optimizer does to it. On exit, through the
+ * _start path, the program writes the counters to a .neoprof file.
+ *
+ * -fprofile-use annotates the freshly lowered program of a later build with
+ * the counts, which the optimizer keeps up to date as it transforms the
+ * program: they steer inlining, block layout, spill costs & the splitting of
+ * code that never ran away from the rest. Functions are matched by name &
+ * by a hash of their control flow, so a function that changed since the
+ * profile was taken is compiled without it.
+ *
+ * A .neoprof file starts with a text header, written by the compiler:
+ *
+ *   neoprof 1 <functions> <counters>
+ *   <name> <cfg hash> <blocks> <call sites>     (one line per function)
+ *
+ * followed by the counters as little-endian 64-bit integers: for each
+ * function, those of its blocks in layout order, then those of its call
+ * sites in order. */
+
+#define PROFILE_VERSION 1
+
+typedef struct {
+  char *name;
+  uint64_t hash;
+  int nblocks, ncalls;
+  int base;              /* Index of its first counter */
+} ProfiledFunction;
+
+typedef struct {
+  ProfiledFunction *functions;
+  size_t nfunctions;
+  HashMap index;         /* name -> index + 1 */
+
+  int ncounters;
+  uint64_t *counts;      /* Read from a file, NULL in instrumented builds */
+} Profile;
+
+/* Numbers the blocks & call sites of a freshly lowered program */
+void profile_instrument(BasicBlock *prog, Profile *profile);
+
+/* Header of the .neoprof files written by the instrumented program */
+char *profile_header(Profile *profile);
+
+void profile_read(Profile *profile, const char *path);
+
+/* Sets the counts of the blocks & call sites of a freshly lowered program,
+ * leaving functions without a matching profile alone */
+void profile_annotate(BasicBlock *prog, Profile *profile);
+
+void profile_free(Profile *profile);
+
+/* Times a block runs per call of its function, 1 without a profile. Blocks
+ * that never ran get a small positive frequency, so they still weigh in. */
+double block_frequency(BasicBlock *entry, BasicBlock *block);
+
+#endif
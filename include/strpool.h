@@ -0,0 +1,59 @@
+#ifndef NEO_STRPOOL_H
+#define NEO_STRPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashmap.h"
+
+/* String Pool
+ *
+ * Every string literal of the program is interned here, whichever unit it
+ * appears in, so identical literals share one copy. Once code generation has
+ * marked the strings it refers to, the layout places each string that ends
+ * another one inside it (suffix merging), & the pool is emitted as a single
+ * .rodata.str section whose labels are addressed relative to rip. */
+
+typedef struct {
+  char *text;        /* NUL-terminated copy, owned by the pool */
+  size_t len;
+  char *label;       /* Symbol of the string, "str.N" */
+  bool used;         /* Referred to by the generated code */
+  int root;          /* String it is stored in, itself unless it is a suffix */
+  size_t offset;     /* Within the section, set by the layout */
+} PooledString;
+
+typedef struct {
+  PooledString *strings;
+  size_t nstrings, capacity;
+  HashMap index;     /* text -> index + 1 */
+  HashMap labels;    /* label -> index + 1 */
+
+  /* Set by strpool_layout: the contents of the section, & the used strings
+   * by increasing offset */
+  uint8_t *data;
+  size_t size;
+  int *order;
+  size_t norder;
+} StringPool;
+
+extern StringPool STRINGS;
+
+void strpool_init(StringPool *pool);
+void strpool_free(StringPool *pool);
+
+/* Index of the string, which is added unless an identical one exists */
+int strpool_intern(StringPool *pool, const char *text, size_t len);
+
+/* Marks the string with the given label as used, returns false if there is
+ * no such string */
+bool strpool_use(StringPool *pool, const char *label);
+
+/* String with the given label, NULL if there is none */
+PooledString *strpool_find(StringPool *pool, const char *label);
+
+/* Lays the used strings out, merging suffixes into the strings they end */
+void strpool_layout(StringPool *pool);
+
+#endif
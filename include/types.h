@@ -1,6 +1,8 @@
 #ifndef NEO_TYPES_H
 #define NEO_TYPES_H
 
+#include <stdbool.h>
+
 typedef enum {
   /* Primitive types */
   TY_VOID,
@@ -17,6 +19,7 @@ typedef enum {
 } TypeKind;
 
 #define IS_PRIMITIVE(ty) (ty >= TY_VOID && ty <= TY_BOOL)
+#define IS_FLOATING(ty) (ty == TY_FLOAT || ty == TY_DOUBLE)
 
 typedef struct {
   TypeKind kind;
@@ -29,4 +32,26 @@ typedef struct {
 extern const Type PRIMITIVES[];
 #define NUM_PRIMTIIVES sizeof(PRIMITIVES) / sizeof(PRIMITIVES[0])
 
+/* Type of string literals, which are the address of their first character */
+extern const Type CHAR_POINTER;
+
+/* Type a pointer points to, NULL if it is not a pointer to a primitive */
+const Type *pointee_type(const Type *type);
+
+/* Layout Engine
+ *
+ * Places the stack slots of a frame. Each item is aligned to its natural
+ * alignment; reordering places the most aligned items first, so that items
+ * whose size is a multiple of their alignment need no padding between them. */
+
+typedef struct {
+  int size;
+  int align;
+  int offset;  /* Set by the layout */
+} LayoutItem;
+
+/* Lays the items out one after another, returns the size padded to the
+ * largest alignment, which is stored in *align unless NULL */
+int layout_pack(LayoutItem *items, int n, bool reorder, int *align);
+
 #endif
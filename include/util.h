@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #ifdef DEBUG
 #define UNUSED(x) (void)x
@@ -45,5 +46,7 @@ int count_digits(int n);
 
 char *readfile(const char *filename, size_t *size);
 int spawn_subprocess(char *prog, char *const args[]);
+pid_t spawn_pipe(char *prog, char *const args[], int *fd);
+int wait_subprocess(pid_t pid);
 
 #endif
@@ -0,0 +1,134 @@
+#ifndef NEO_VM_H
+#define NEO_VM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashmap.h"
+#include "ir.h"
+
+/* Bytecode Interpreter
+ *
+ * Runs a program without an assembler or a linker (neo --interp). The
+ * optimized IR of each function is translated into a register-based
+ * bytecode, every variable getting a register in the frame of its function,
+ * & executed by a dispatch loop threaded with computed goto where the C
+ * compiler supports it (a switch otherwise, or when built with
+ * -DNEO_VM_SWITCH).
+ *
+ * Instructions have a fixed width of 16 bytes: an opcode, three register
+ * operands & a 64-bit immediate. Pairs common in the IR are fused into
+ * superinstructions: a comparison only read by the branch after it becomes a
+ * compare & branch, & an operation on a small integer constant takes it as
+ * an immediate. */
+
+/* Integer values are kept in 64 bits, extended from their type: int, bool
+ * & char are sign-extended, uint zero-extended. _I operations wrap &
+ * compare like int, _U ones like uint, on the low 32 bits of their operands;
+ * _P ones work on all 64 bits of a pointer. */
+#define VM_OPCODES(X) \
+  X(MOV)       /* a = b */ \
+  X(LOADI)     /* a = imm */ \
+  X(GETG)      /* a = globals[imm] */ \
+  X(SETG)      /* globals[imm] = a */ \
+  X(ADD_I) X(ADD_U) X(ADD_P) \
+  X(SUB_I) X(SUB_U) X(SUB_P) \
+  X(MUL_I) X(MUL_U) \
+  X(DIV_I) X(DIV_U) \
+  X(SHL_I) X(SHL_U) \
+  X(SHR_I) X(SHR_U) \
+  X(SAR_I) X(SAR_U) \
+  X(MULHI_I) X(MULHI_U) \
+  X(UMULHI_I) X(UMULHI_U) \
+  /* a = b op imm */ \
+  X(ADDI_I) X(ADDI_U) \
+  X(SUBI_I) X(SUBI_U) \
+  X(MULI_I) X(MULI_U) \
+  X(SHLI_I) X(SHLI_U) \
+  X(SHRI_I) X(SHRI_U) \
+  X(SARI_I) X(SARI_U) \
+  X(NEG_I) X(NEG_U) \
+  X(NOT) \
+  X(FADD) X(FSUB) X(FMUL) X(FDIV) X(FNEG) \
+  X(DADD) X(DSUB) X(DMUL) X(DDIV) X(DNEG) \
+  /* a = b cmp c, as 0 or 1 */ \
+  X(EQ_I) X(NE_I) X(LT_I) X(GT_I) X(LE_I) X(GE_I) \
+  X(EQ_U) X(NE_U) X(LT_U) X(GT_U) X(LE_U) X(GE_U) \
+  X(EQ_P) X(NE_P) X(LT_P) X(GT_P) X(LE_P) X(GE_P) \
+  X(FEQ) X(FNE) X(FLT) X(FGT) X(FLE) X(FGE) \
+  X(DEQ) X(DNE) X(DLT) X(DGT) X(DLE) X(DGE) \
+  /* Conversions, a = b */ \
+  X(SEXT8) X(SEXT32) X(ZEXT32) \
+  X(ITOF) X(ITOD) \
+  X(FTOI) X(DTOI) \
+  X(FTOU) X(DTOU) \
+  X(FTOB) X(DTOB) \
+  X(FTOD) X(DTOF) \
+  X(LOADB)     /* a = *(char *)b */ \
+  /* Jumps to `target`: always, when a is (not) zero, when a cmp b holds,
+   * & when a cmp k holds */ \
+  X(JMP) X(JNZ) X(JZ) \
+  X(JEQ_I) X(JNE_I) X(JLT_I) X(JGT_I) X(JLE_I) X(JGE_I) \
+  X(JEQ_U) X(JNE_U) X(JLT_U) X(JGT_U) X(JLE_U) X(JGE_U) \
+  X(JEQ_P) X(JNE_P) X(JLT_P) X(JGT_P) X(JLE_P) X(JGE_P) \
+  X(JEQI_I) X(JNEI_I) X(JLTI_I) X(JGTI_I) X(JLEI_I) X(JGEI_I) \
+  X(JEQI_U) X(JNEI_U) X(JLTI_U) X(JGTI_U) X(JLEI_U) X(JGEI_U) \
+  X(JEQI_P) X(JNEI_P) X(JLTI_P) X(JGTI_P) X(JLEI_P) X(JGEI_P) \
+  X(CALL)      /* a = functions[c](b...), the arguments from register b on */ \
+  X(RET)       /* Returns a */ \
+  X(RETV)      /* Returns nothing */
+
+#define VM_OPCODE_ENUM(op) VM_##op,
+typedef enum {
+  VM_OPCODES(VM_OPCODE_ENUM)
+  NUM_VM_OPCODES
+} VMOpcode;
+#undef VM_OPCODE_ENUM
+
+typedef struct {
+  uint16_t op;
+  uint16_t a, b, c;
+  union {
+    int64_t i;
+    float f;
+    double d;
+    struct {
+      int32_t k;        /* Constant of a compare & branch */
+      int32_t target;   /* Index of the instruction jumped to */
+    };
+  };
+} VMInst;
+
+typedef union {
+  int64_t i;
+  float f;
+  double d;
+} VMValue;
+
+typedef struct {
+  char *name;
+  size_t entry;     /* Index of its first instruction */
+  int nregs;        /* Frame size, the arguments of its calls included */
+} VMFunction;
+
+typedef struct {
+  VMInst *code;
+  size_t ncode, capacity;
+
+  VMFunction *functions;
+  size_t nfunctions;
+  HashMap function_index;  /* name -> index + 1 */
+
+  VMValue *globals;
+  size_t nglobals;
+  HashMap global_index;    /* name -> index + 1 */
+} VMProgram;
+
+void vm_compile(BasicBlock *prog, VMProgram *vp);
+void vm_free(VMProgram *vp);
+void vm_dump(VMProgram *vp);
+
+/* Calls `entry` & returns its result */
+int vm_run(VMProgram *vp, const char *entry);
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef NEO_X86_64_H
+#define NEO_X86_64_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "codegen.h"
+#include "ir.h"
+#include "object.h"
+#include "strpool.h"
+
+/* x86_64 registers, machine instructions & register allocation, shared by
+ * instruction selection, the register allocators, the encoder and the NASM
+ * printer */
+
+typedef enum {
+  RAX,
+  RBX,
+  RCX,
+  RDX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+  XMM0,
+  XMM1,
+  XMM2,
+  XMM3,
+  XMM4,
+  XMM5,
+  XMM6,
+  XMM7,
+  XMM8,
+  XMM9,
+  XMM10,
+  XMM11,
+  XMM12,
+  XMM13,
+  XMM14,
+  XMM15,
+  NUM_REGISTERS
+} RegisterID;
+
+const char *regname(RegisterID rid);
+const char *regname32(RegisterID rid);
+
+/* Integers live in general-purpose registers, float & double values in the
+ * low lane of XMM registers */
+typedef enum {
+  RC_GPR,
+  RC_XMM,
+  NUM_REGCLASSES
+} RegClass;
+
+#define REGCLASS(rid) ((rid) >= XMM0 ? RC_XMM : RC_GPR)
+
+/* Registers handed out by the allocators, caller-saved ones first within
+ * each class. RSP & RBP hold the stack frame, R10 & R11 and XMM14 & XMM15
+ * are kept free for spill code. */
+extern const RegisterID ALLOCATABLE[];
+extern const uint32_t CLASS_REGISTERS[NUM_REGCLASSES];  /* Bits of ALLOCATABLE by class */
+int register_priority(RegisterID rid);  /* Index in ALLOCATABLE, or -1 */
+
+/* System V AMD64 calling convention: calls preserve RBX, RBP & R12-R15 and
+ * clobber everything else. Arguments are passed in the registers below,
+ * integers & floating point values each taking the next one of their
+ * class, & the rest on the stack; results are returned in RAX or XMM0. */
+extern const uint32_t CALLEE_SAVED;  /* Bits of ALLOCATABLE preserved by calls */
+#define NUM_ARG_REGISTERS(cls) ((cls) == RC_XMM ? 8 : 6)
+int argument_register(RegClass cls, int index);  /* -1 past the last one */
+
+/* Register the index-th parameter of a function arrives in, or -1 when it is
+ * passed on the stack, as the *stack-th stack argument */
+int parameter_register(const char *func, int index, int *stack);
+#define RETURN_REGISTER(cls) ((cls) == RC_XMM ? XMM0 : RAX)
+
+#define NUM_ALLOCATABLE 26
+#define SCRATCH  R11
+#define SCRATCH2 R10
+#define SCRATCH_XMM  XMM15
+#define SCRATCH_XMM2 XMM14
+
+#define SLOT_SIZE 8  /* Of slots holding general purpose registers */
+
+typedef struct RegisterData RegisterData;
+struct RegisterData {
+  int start, end;      /* Live interval, in instructions from the function entry */
+  int uses;            /* Number of instructions reading or writing the variable */
+  double cost;         /* Of those uses, weighted by how often their block runs */
+  char *var;
+  const Type *type;    /* Type of the values assigned to the variable */
+  RegClass cls;
+  bool global;         /* Lives in static memory for its whole lifetime */
+  bool crosses_call;   /* Live across a call, so kept in a callee-saved register */
+  int hint;            /* Register the value arrives in or leaves from, or -1 */
+  int slot;            /* Spill slot, or -1 when the variable has a register */
+  int rid;             /* Register assigned to the variable */
+  RegisterData *next;  /* Next interval in the active list, or in the pool */
+};
+
+/* Where every variable of a function lives. Variables are numbered in order
+ * of first occurrence, and the number is stored in the `vreg` field of the
+ * operands and instructions referring to them. */
+typedef struct {
+  RegisterData **intervals;  /* vreg -> RegisterData, by increasing start point */
+  size_t nintervals;
+  int nslots;
+} Allocation;
+
+void allocate_registers(Allocation *alloc, RegAllocKind kind, BasicBlock *entry, BasicBlock *end);
+void free_allocation(Allocation *alloc);
+RegisterData *allocation_lookup(Allocation *alloc, int vreg);
+
+/* Allocators, run on the intervals collected by allocate_registers */
+void linear_scan(Allocation *alloc);
+void color_graph(Allocation *alloc, BasicBlock *entry, BasicBlock *end);
+
+/* Machine Instructions
+ *
+ * Instruction selection produces a flat stream of machine instructions for
+ * the whole program, which is then either encoded straight into an object
+ * file or printed as NASM source (-S). */
+
+typedef enum {
+  MI_LABEL,      /* Pseudo-instruction defining `operands[0].sym` here */
+  MI_MOV,
+  MI_MOVSXD,     /* Sign-extends a 32-bit source into a 64-bit register */
+  MI_LEA,
+  MI_ADD,
+  MI_SUB,
+  MI_XOR,
+  MI_INC,
+  MI_DEC,
+  MI_IMUL,       /* Two or three operand forms */
+  MI_IDIV,
+  MI_DIV,
+  MI_CDQ,
+  MI_SHL,
+  MI_SHR,
+  MI_SAR,
+  MI_PUSH,
+  MI_POP,
+  MI_SYSCALL,
+  MI_RDTSC,      /* Time stamp counter into edx:eax */
+  MI_RDTSCP,     /* Same, once earlier instructions are done; clobbers ecx */
+  MI_CMP,
+  MI_TEST,
+  MI_MOVZX,      /* Zero-extends an 8-bit register into a 32-bit one */
+  MI_MOVSX,      /* Sign-extends an 8-bit register into a 32-bit one */
+  MI_SETCC,      /* Conditional instructions take their condition in `cc` */
+  MI_CMOV,
+  MI_JMP,        /* Jumps to the label `operands[0].sym` */
+  MI_JCC,
+  MI_NEG,
+  MI_MOVSS,      /* Scalar SSE, on the low lane of XMM registers */
+  MI_MOVSD,
+  MI_ADDSS,
+  MI_ADDSD,
+  MI_SUBSS,
+  MI_SUBSD,
+  MI_MULSS,
+  MI_MULSD,
+  MI_DIVSS,
+  MI_DIVSD,
+  MI_UCOMISS,
+  MI_UCOMISD,
+  MI_CVTSI2SS,   /* `size` is the width of the integer source */
+  MI_CVTSI2SD,
+  MI_CVTTSS2SI,  /* `size` is the width of the integer destination */
+  MI_CVTTSD2SI,
+  MI_CVTSS2SD,
+  MI_CVTSD2SS,
+  MI_XORPS,      /* Takes a 16-byte aligned memory operand */
+  MI_CALL,       /* Calls the function `operands[0].sym` */
+  MI_RET,
+  NUM_MOPCODES
+} MOpcode;
+
+extern const char *MOPCODES[];
+
+/* Condition codes, numbered as in the jcc/setcc/cmovcc opcodes */
+typedef enum {
+  CC_B  = 0x2,
+  CC_AE = 0x3,
+  CC_E  = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A  = 0x7,
+  CC_P  = 0xA,
+  CC_NP = 0xB,
+  CC_L  = 0xC,
+  CC_GE = 0xD,
+  CC_LE = 0xE,
+  CC_G  = 0xF,
+  NUM_CONDITIONS
+} CondCode;
+
+/* The opposite condition only differs in the lowest bit */
+#define CC_NEGATE(cc) ((CondCode)((cc) ^ 1))
+
+extern const char *CONDITIONS[];
+
+typedef enum {
+  MO_NONE = 0,
+  MO_REG,
+  MO_IMM,
+  MO_MEM,        /* [base + index*scale + disp], or [sym + disp] when sym is set */
+  MO_SYM         /* A label, by name */
+} MOperandKind;
+
+#define NO_REG -1
+
+typedef struct {
+  MOperandKind kind;
+  int reg;       /* MO_REG register, or MO_MEM base */
+  int index;
+  int scale;
+  int32_t disp;
+  int64_t imm;
+  const char *sym;
+} MOperand;
+
+#define MAX_MOPERANDS 3
+/* Labels starting with .L are local to the assembly, as in GNU as: they
+ * name the blocks of a function and never become symbols */
+#define LOCAL_LABEL_PREFIX ".L"
+
+typedef struct {
+  MOpcode op;
+  uint8_t size;  /* Operand width in bytes (1, 4, 8 or 16) */
+  uint8_t nopers;
+  MOperand operands[MAX_MOPERANDS];
+  bool global;   /* MI_LABEL: the symbol is visible to the linker */
+  CondCode cc;
+} MInst;
+
+/* Statically allocated variables */
+typedef struct {
+  const char *name;
+  size_t size;
+  size_t align;
+  uint64_t bits;       /* Initial value in the low bytes, zero in .bss */
+  const char *label;   /* Of the string literal whose address is the initial value */
+} MData;
+
+/* Read-only constants, loaded relative to rip */
+typedef struct {
+  char *name;
+  uint64_t bits;       /* Bit pattern of the value, in the low bytes */
+  size_t size;         /* 4, 8, or 16 (zero-extended) for packed operands */
+} MConst;
+
+typedef struct {
+  MInst *insts;
+  size_t ninsts, capacity;
+
+  MData *bss;
+  size_t nbss;
+
+  MData *data;         /* Initialized variables that are stored to */
+  size_t ndata;
+
+  MConst *consts;      /* Owned by the program */
+  size_t nconsts;
+
+  StringPool *strings; /* Literals, laid out for .rodata.str */
+
+  char **labels;       /* Names of the block labels, owned by the program */
+  size_t nlabels;
+
+  bool frame_pointer;  /* Frames are chained through rbp */
+} MProgram;
+
+MProgram x86_64_generate(BasicBlock *prog, CodegenOptions opts);
+void mprogram_free(MProgram *mp);
+
+void x86_64_peephole(MProgram *mp);
+
+void x86_64_encode(MProgram *mp, ObjectFile *obj);
+ssize_t nasm_x86_64_emit(MProgram *mp, int fd);
+ssize_t gas_x86_64_emit(MProgram *mp, int fd);
+
+#endif
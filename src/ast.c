@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "ast.h"
+#include "types.h"
 #include "util.h"
 
 static const char unary_ops[] = {
@@ -73,9 +74,12 @@ static void dump_assign_stmt(AssignStmt *assign, int level) {
   dump_node(assign->value, level + 2);
 }
 
-static void dump_unary_expr(UnaryExpr *unary, int level) {
+static void dump_unary_expr(UnaryExpr *unary, const Type *type, int level) {
   dump(level, "unary:\n");
-  dump(level, " op: %c\n", unary_ops[unary->un_op]);
+  if (unary->un_op == UN_CONV)
+    dump(level, " op: (%s)\n", type->name);
+  else
+    dump(level, " op: %c\n", unary_ops[unary->un_op]);
   dump(level, " expr:\n");
   dump_node(unary->expr, level + 2);
 }
@@ -113,7 +117,7 @@ void dump_node(Node *node, int level) {
     case ND_COND_STMT: dump_cond_stmt(&node->cond, level); break;
     case ND_CALL_EXPR: dump_call_expr(&node->call, level); break;
     case ND_ASSIGN_STMT: dump_assign_stmt(&node->assign, level); break;
-    case ND_UNARY_EXPR: dump_unary_expr(&node->unary, level); break;
+    case ND_UNARY_EXPR: dump_unary_expr(&node->unary, node->type, level); break;
     case ND_BINARY_EXPR: dump_binary_expr(&node->binary, level); break;
     case ND_VALUE_EXPR: dump_value_expr(&node->value, level); break;
     case ND_REF_EXPR: dump(level, "ref: %s\n", node->ref); break;
@@ -150,6 +154,74 @@ void dump_value(Value *val) {
   }
 }
 
+/* Primitive type of a constant, NULL for strings */
+const Type *value_type(const Value *val) {
+  switch (val->kind) {
+    case VAL_INT: return &PRIMITIVES[TY_INT];
+    case VAL_UINT: return &PRIMITIVES[TY_UINT];
+    case VAL_FLOAT: return &PRIMITIVES[TY_FLOAT];
+    case VAL_DOUBLE: return &PRIMITIVES[TY_DOUBLE];
+    case VAL_CHAR: return &PRIMITIVES[TY_CHAR];
+    case VAL_BOOL: return &PRIMITIVES[TY_BOOL];
+    default: return NULL;
+  }
+}
+
+/* Converts a constant to a primitive type the way the generated code does:
+ * floating-point values are truncated towards zero, & those out of range of
+ * the integer type become the "integer indefinite" value of cvttsd2si.
+ * Returns false if the value cannot be converted. */
+bool convert_value(Value *val, const Type *type) {
+  bool floating = val->kind == VAL_FLOAT || val->kind == VAL_DOUBLE;
+  int64_t n = 0;
+  double d = 0;
+
+  switch (val->kind) {
+    case VAL_INT: n = val->i_val; break;
+    case VAL_UINT: n = val->u_val; break;
+    case VAL_FLOAT: d = val->f_val; break;
+    case VAL_DOUBLE: d = val->d_val; break;
+    case VAL_CHAR: n = val->c_val; break;
+    case VAL_BOOL: n = val->b_val; break;
+    default: return false;
+  }
+  if (!floating)
+    d = (double)n;
+
+  switch (type->kind) {
+    case TY_INT:
+      val->kind = VAL_INT;
+      val->i_val = !floating ? (int32_t)n
+        : d > -2147483649.0 && d < 2147483648.0 ? (int32_t)d : INT32_MIN;
+      return true;
+    case TY_UINT:
+      /* Converted through a 64-bit integer */
+      val->kind = VAL_UINT;
+      val->u_val = !floating ? (uint32_t)n
+        : d > -9223372036854775809.0 && d < 9223372036854775808.0 ? (uint32_t)(int64_t)d : 0;
+      return true;
+    case TY_CHAR:
+      val->kind = VAL_CHAR;
+      val->c_val = !floating ? (char)n
+        : d > -2147483649.0 && d < 2147483648.0 ? (char)(int32_t)d : 0;
+      return true;
+    case TY_BOOL:
+      val->kind = VAL_BOOL;
+      val->b_val = floating ? d != 0 : n != 0;
+      return true;
+    case TY_FLOAT:
+      val->kind = VAL_FLOAT;
+      val->f_val = (float)d;
+      return true;
+    case TY_DOUBLE:
+      val->kind = VAL_DOUBLE;
+      val->d_val = d;
+      return true;
+    default:
+      return false;
+  }
+}
+
 uint8_t *copy_value(Value *val, size_t *value_size) {
   uint8_t *bytes = NULL;
   size_t size = 0;
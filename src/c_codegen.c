@@ -0,0 +1,715 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "codegen.h"
+#include "ir.h"
+#include "optimize.h"
+#include "strpool.h"
+#include "symtab.h"
+#include "util.h"
+
+/* C Backend
+ *
+ * Translates the optimized IR into a single C99 translation unit for the
+ * system C compiler (--target=c). Every variable of a function becomes a
+ * local of the type it is declared with, temporaries of the type of their
+ * first assignment, blocks become labels & the edges between them gotos, so
+ * the C compiler sees plain SSA-like code it can optimize on its own.
+ * Integer arithmetic goes through the unsigned type of the same width to
+ * wrap like the generated machine code, & conversions from floating point
+ * use the same out of range results. */
+
+static FILE *out;
+
+/* A local of the function being generated */
+typedef struct {
+  char *name;          /* C identifier */
+  int index;           /* In the order the variables appear */
+  const Type *type;    /* Declared or of its first assignment, NULL until known */
+} Local;
+
+static HashMap locals;  /* IR variable -> Local */
+static int nlocals;
+
+/* Bools are held in a whole int as in the registers of the native code,
+ * where arithmetic on them is not brought back to 0 or 1 */
+static const char *C_TYPES[] = {
+  [TY_VOID]   = "void",
+  [TY_INT]    = "int32_t",
+  [TY_UINT]   = "uint32_t",
+  [TY_FLOAT]  = "float",
+  [TY_DOUBLE] = "double",
+  [TY_CHAR]   = "int8_t",
+  [TY_BOOL]   = "int32_t",
+};
+
+/* Unsigned types integer arithmetic wraps in, by type */
+static const char *C_UNSIGNED[] = {
+  [TY_INT]    = "uint32_t",
+  [TY_UINT]   = "uint32_t",
+  [TY_CHAR]   = "uint8_t",
+  [TY_BOOL]   = "uint32_t",
+};
+
+/* Signed types of the same width, for arithmetic shifts & mulhi */
+static const char *C_SIGNED[] = {
+  [TY_INT]    = "int32_t",
+  [TY_UINT]   = "int32_t",
+  [TY_CHAR]   = "int8_t",
+  [TY_BOOL]   = "int32_t",
+};
+
+static const char *C_OPERATORS[] = {
+  [OP_ADD]       = "+",
+  [OP_SUB]       = "-",
+  [OP_MUL]       = "*",
+  [OP_DIV]       = "/",
+  [OP_CMP]       = "==",
+  [OP_CMP_NOT]   = "!=",
+  [OP_CMP_LT]    = "<",
+  [OP_CMP_GT]    = ">",
+  [OP_CMP_LT_EQ] = "<=",
+  [OP_CMP_GT_EQ] = ">=",
+  [OP_SHL]       = "<<",
+  [OP_SHR]       = ">>",
+  [OP_SAR]       = ">>",
+};
+
+/* Helpers the generated code relies on. Conversions from floating point
+ * truncate towards zero, & values out of range of the integer type give
+ * the result of cvttsd2si as convert_value does. */
+static const char *PRELUDE =
+  "#include <stdbool.h>\n"
+  "#include <stdint.h>\n"
+  "#include <string.h>\n"
+  "\n"
+  "static inline int32_t neo_ftoi(double d) {\n"
+  "  return d > -2147483649.0 && d < 2147483648.0 ? (int32_t)d : INT32_MIN;\n"
+  "}\n"
+  "\n"
+  "static inline uint32_t neo_ftou(double d) {\n"
+  "  return d > -9223372036854775809.0 && d < 9223372036854775808.0 ? (uint32_t)(int64_t)d : 0;\n"
+  "}\n"
+  "\n"
+  "static inline float neo_f32(uint32_t bits) {\n"
+  "  float f;\n"
+  "  memcpy(&f, &bits, sizeof(f));\n"
+  "  return f;\n"
+  "}\n"
+  "\n"
+  "static inline double neo_f64(uint64_t bits) {\n"
+  "  double d;\n"
+  "  memcpy(&d, &bits, sizeof(d));\n"
+  "  return d;\n"
+  "}\n";
+
+static bool is_floating(const Type *type) {
+  return !type->ptr && IS_FLOATING(type->kind);
+}
+
+static bool is_integer(const Type *type) {
+  return type && !type->ptr && type->kind != TY_VOID && !IS_FLOATING(type->kind);
+}
+
+static const char *c_type(const Type *type) {
+  return type->ptr ? "const char *" : C_TYPES[type->kind];
+}
+
+/* Space between a type & a declared name, pointers keeping the name by
+ * their star */
+static const char *c_space(const Type *type) {
+  return type->ptr ? "" : " ";
+}
+
+static Symbol *global_variable(const char *var) {
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)var, strlen(var));
+  return symbol && symbol->kind == SYM_VAR ? symbol : NULL;
+}
+
+static const FuncDecl *function_decl(const char *name) {
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)name, strlen(name));
+  if (!symbol || symbol->kind != SYM_FUNC)
+    LOG_FATAL("no declaration for function '%s'", name);
+  return &symbol->node->func;
+}
+
+/* Locals are numbered, & keep the last part of their name to stay readable:
+ * `$first.0.s` becomes v3_s */
+static Local *local_of(const char *var) {
+  Local *local = hashmap_lookup(&locals, var);
+  if (local)
+    return local;
+
+  const char *base = strrchr(var, '.');
+  base = base ? base + 1 : var;
+  if (*base == '$')
+    base++;
+
+  local = calloc(1, sizeof(Local));
+  if (!local)
+    LOG_FATAL("calloc failed in local_of");
+  local->name = *base ? format("v%d_%s", nlocals, base) : format("v%d", nlocals);
+  local->index = nlocals++;
+  hashmap_insert(&locals, var, local);
+  return local;
+}
+
+static void free_local(MapEntry *entry) {
+  Local *local = entry->value;
+  free(local->name);
+  free(local);
+}
+
+static const Type *variable_type(const char *var) {
+  Symbol *symbol = global_variable(var);
+  if (symbol)
+    return symbol->node->var.type;
+  Local *local = hashmap_lookup(&locals, var);
+  return local && local->type ? local->type : &PRIMITIVES[TY_INT];
+}
+
+static const Type *operand_type(Operand *operand) {
+  if (IS_VARIABLE((*operand)))
+    return variable_type(operand->var);
+  const Type *type = value_type(&operand->val);
+  return type ? type : &PRIMITIVES[TY_INT];
+}
+
+/* Type of the value an instruction assigns. Copies of an integer keep the
+ * integer type they are declared with, `var k: uint = 0 - 1` holding a uint;
+ * others take the type of their source, as the optimizer rewrites
+ * instructions in place & e.g. a float comparison folded into a copy of its
+ * result keeps the type of its operands */
+static const Type *assigned_type(Instruction *inst) {
+  if (IS_COMPARISON_OP(inst->opcode))
+    return &PRIMITIVES[TY_BOOL];
+  if (inst->opcode == OP_ASSIGN && inst->nopers == 1) {
+    const Type *src = operand_type(&inst->operands[0]);
+    return is_integer(inst->type) && is_integer(src) ? inst->type : src;
+  }
+  if (inst->type && inst->type->kind != TY_VOID)
+    return inst->type;
+  return inst->nopers ? operand_type(&inst->operands[0]) : &PRIMITIVES[TY_INT];
+}
+
+/* Type an operation is carried out in */
+static const Type *operation_type(Instruction *inst) {
+  if (inst->type && inst->type->kind != TY_VOID)
+    return inst->type;
+  return operand_type(&inst->operands[0]);
+}
+
+static void write_value(const Value *val) {
+  switch (val->kind) {
+    case VAL_INT:
+      if (val->i_val == INT32_MIN)
+        fprintf(out, "INT32_MIN");
+      else
+        fprintf(out, "%d", val->i_val);
+      break;
+    case VAL_UINT:
+      fprintf(out, "%uu", val->u_val);
+      break;
+    case VAL_CHAR:
+      fprintf(out, "%d", val->c_val);
+      break;
+    case VAL_BOOL:
+      fprintf(out, "%s", val->b_val ? "true" : "false");
+      break;
+    case VAL_FLOAT: {
+      /* Hexadecimal literals are exact, the rest goes through the bits */
+      if (isfinite(val->f_val)) {
+        fprintf(out, "%af", (double)val->f_val);
+      } else {
+        uint32_t bits;
+        memcpy(&bits, &val->f_val, sizeof(bits));
+        fprintf(out, "neo_f32(0x%xu)", bits);
+      }
+      break;
+    }
+    case VAL_DOUBLE: {
+      if (isfinite(val->d_val)) {
+        fprintf(out, "%a", val->d_val);
+      } else {
+        uint64_t bits;
+        memcpy(&bits, &val->d_val, sizeof(bits));
+        fprintf(out, "neo_f64(0x%llxull)", (unsigned long long)bits);
+      }
+      break;
+    }
+    default: LOG_FATAL("value kind %d has no C literal", val->kind);
+  }
+}
+
+static void write_operand(Operand *operand) {
+  switch (operand->kind) {
+    case O_VALUE:
+      write_value(&operand->val);
+      break;
+    case O_VARIABLE:
+      if (global_variable(operand->var))
+        fprintf(out, "g_%s", operand->var);
+      else
+        fprintf(out, "%s", local_of(operand->var)->name);
+      break;
+    default: LOG_FATAL("shouldn't have gotten here...");
+  }
+}
+
+static void write_cast(const char *type, Operand *operand) {
+  fprintf(out, "(%s)", type);
+  write_operand(operand);
+}
+
+/* Integer arithmetic is done in the unsigned type of the same width, so
+ * that it wraps instead of overflowing. Divisions & comparisons cast their
+ * operands to the type of the operation, as an operand may hold a value of
+ * the same width but another signedness, e.g. an int copied into a uint. */
+static void write_binary(Instruction *inst) {
+  const Type *type = operation_type(inst);
+  Operand *lhs = &inst->operands[0], *rhs = &inst->operands[1];
+  const char *op = C_OPERATORS[inst->opcode];
+  bool plain = !is_integer(type);
+
+  switch (inst->opcode) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+      if (plain)
+        break;
+      fprintf(out, "(%s)(", c_type(type));
+      write_cast(C_UNSIGNED[type->kind], lhs);
+      fprintf(out, " %s ", op);
+      write_cast(C_UNSIGNED[type->kind], rhs);
+      fprintf(out, ")");
+      return;
+    case OP_DIV:
+      if (plain)
+        break;
+      fprintf(out, "(%s)(", c_type(type));
+      write_cast(c_type(type), lhs);
+      fprintf(out, " / ");
+      write_cast(c_type(type), rhs);
+      fprintf(out, ")");
+      return;
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+      if (plain)
+        break;
+      write_cast(c_type(type), lhs);
+      fprintf(out, " %s ", op);
+      write_cast(c_type(type), rhs);
+      return;
+    case OP_SHL:
+    case OP_SHR:
+    case OP_SAR:
+      fprintf(out, "(%s)(", c_type(type));
+      write_cast(inst->opcode == OP_SAR ? C_SIGNED[type->kind] : C_UNSIGNED[type->kind], lhs);
+      fprintf(out, " %s (", op);
+      write_operand(rhs);
+      fprintf(out, " & 31))");
+      return;
+    case OP_MULHI:
+    case OP_UMULHI: {
+      bool is_signed = inst->opcode == OP_MULHI;
+      const char *half = is_signed ? C_SIGNED[type->kind] : C_UNSIGNED[type->kind];
+      fprintf(out, "(%s)(((%s)(%s)", c_type(type), is_signed ? "int64_t" : "uint64_t", half);
+      write_operand(lhs);
+      fprintf(out, " * (%s)", half);
+      write_operand(rhs);
+      fprintf(out, ") >> 32)");
+      return;
+    }
+    default:
+      break;
+  }
+
+  write_operand(lhs);
+  fprintf(out, " %s ", op);
+  write_operand(rhs);
+}
+
+static void write_conversion(Instruction *inst) {
+  Operand *src = &inst->operands[0];
+  const Type *from = operand_type(src), *to = operation_type(inst);
+
+  if (!is_floating(from) || is_floating(to)) {
+    write_cast(c_type(to), src);
+    return;
+  }
+
+  switch (to->kind) {
+    case TY_BOOL:
+      write_operand(src);
+      fprintf(out, " != 0");
+      break;
+    case TY_UINT:
+      fprintf(out, "neo_ftou(");
+      write_operand(src);
+      fprintf(out, ")");
+      break;
+    default:
+      fprintf(out, "(%s)neo_ftoi(", c_type(to));
+      write_operand(src);
+      fprintf(out, ")");
+  }
+}
+
+/* Instructions computing a value, written as the right hand side of the
+ * assignment to their variable */
+static void write_expression(Instruction *inst) {
+  Operand *src = &inst->operands[0];
+  const Type *type = operation_type(inst);
+
+  switch (inst->opcode) {
+    case OP_ASSIGN:
+      write_operand(src);
+      break;
+    case OP_NEG:
+      if (is_floating(type)) {
+        fprintf(out, "-");
+        write_operand(src);
+      } else {
+        fprintf(out, "(%s)-", c_type(type));
+        write_cast(C_UNSIGNED[type->kind], src);
+      }
+      break;
+    case OP_NOT:
+      fprintf(out, "!");
+      write_operand(src);
+      break;
+    case OP_CONV:
+      write_conversion(inst);
+      break;
+    case OP_DEREF:
+      fprintf(out, "(int8_t)*");
+      write_operand(src);
+      break;
+    case OP_ADDR: {
+      PooledString *s = strpool_find(&STRINGS, src->label);
+      if (!s)
+        LOG_FATAL("no string literal labeled '%s'", src->label);
+      fprintf(out, "neo_strings + %zu", s->offset);
+      break;
+    }
+    default:
+      write_binary(inst);
+  }
+}
+
+/* Successors a block jumps to, rather than falls through into */
+static int block_gotos(BasicBlock *block, BasicBlock *next, BasicBlock *end, BasicBlock **gotos) {
+  Instruction *tail = block->tail;
+  if (tail && tail->opcode == OP_RET)
+    return 0;
+
+  int n = 0;
+  if (tail && tail->opcode == OP_BR) {
+    gotos[n++] = block->succ[0];
+    if (block->succ[1] != next)
+      gotos[n++] = block->succ[1];
+  } else if (block->nsuccs == 1 && block->succ[0] != end && block->succ[0] != next) {
+    gotos[n++] = block->succ[0];
+  }
+  return n;
+}
+
+static void write_block(BasicBlock *block, BasicBlock *next, BasicBlock *end,
+    const Type *returns, bool *targets) {
+  if (targets[block->id])
+    fprintf(out, "b%d:\n", block->id);
+
+  for (Instruction *inst = block->head; inst; inst = inst->next) {
+    switch (inst->opcode) {
+      case OP_DEF:
+      case OP_DEAD:
+      case OP_JMP:
+      case OP_BR:
+        continue;
+      case OP_ARG:
+        continue;
+      case OP_PARAM:
+        fprintf(out, "  ");
+        write_operand(&(Operand){ .kind = O_VARIABLE, .var = inst->assignee });
+        fprintf(out, " = p%d;\n", inst->operands[0].val.i_val);
+        continue;
+      case OP_CALL: {
+        /* The arguments of a call directly precede it */
+        int nargs = inst->operands[1].val.i_val;
+        Instruction *arg = inst;
+        for (int i = 0; i < nargs; i++)
+          arg = arg->prev;
+
+        fprintf(out, "  ");
+        if (inst->assignee) {
+          write_operand(&(Operand){ .kind = O_VARIABLE, .var = inst->assignee });
+          fprintf(out, " = ");
+        }
+        fprintf(out, "f_%s(", inst->operands[0].label);
+        for (int i = 0; i < nargs; i++, arg = arg->next) {
+          assert(arg->opcode == OP_ARG);
+          fprintf(out, "%s", i ? ", " : "");
+          write_operand(&arg->operands[0]);
+        }
+        fprintf(out, ");\n");
+        continue;
+      }
+      case OP_RET:
+        if (returns->kind == TY_VOID || inst->nopers == 0) {
+          fprintf(out, "  return;\n");
+        } else {
+          fprintf(out, "  return ");
+          write_operand(&inst->operands[0]);
+          fprintf(out, ";\n");
+        }
+        continue;
+      default:
+        break;
+    }
+
+    /* Uninitialized variables only need a declaration */
+    if (!inst->assignee || (inst->opcode == OP_ASSIGN && inst->nopers == 0))
+      continue;
+
+    fprintf(out, "  ");
+    write_operand(&(Operand){ .kind = O_VARIABLE, .var = inst->assignee });
+    fprintf(out, " = ");
+    write_expression(inst);
+    fprintf(out, ";\n");
+  }
+
+  BasicBlock *gotos[2];
+  int n = block_gotos(block, next, end, gotos);
+  if (block->tail && block->tail->opcode == OP_BR) {
+    fprintf(out, "  if (");
+    write_operand(&block->tail->operands[0]);
+    fprintf(out, ") goto b%d;\n", gotos[0]->id);
+    if (n == 2)
+      fprintf(out, "  goto b%d;\n", gotos[1]->id);
+  } else if (n == 1) {
+    fprintf(out, "  goto b%d;\n", gotos[0]->id);
+  }
+}
+
+static void write_signature(const char *name, const FuncDecl *decl, const Type *returns) {
+  fprintf(out, "static %s%sf_%s(", c_type(returns), c_space(returns), name);
+  int i = 0;
+  for (Node *param = decl->params; param; param = param->next, i++)
+    fprintf(out, "%s%s%sp%d", i ? ", " : "", c_type(param->var.type), c_space(param->var.type), i);
+  fprintf(out, "%s)", i ? "" : "void");
+}
+
+/* Types every variable by its first assignment, in program order */
+static void collect_locals(BasicBlock *entry, BasicBlock *end) {
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_DEAD)
+        continue;
+
+      for (int i = 0; i < inst->nopers; i++) {
+        if (IS_VARIABLE(inst->operands[i]) && !global_variable(inst->operands[i].var))
+          local_of(inst->operands[i].var);
+      }
+      if (inst->assignee && !global_variable(inst->assignee)) {
+        Local *local = local_of(inst->assignee);
+        if (!local->type)
+          local->type = assigned_type(inst);
+      }
+    }
+  }
+}
+
+static void begin_function(BasicBlock *entry, BasicBlock *end) {
+  hashmap_init(&locals);
+  nlocals = 0;
+  collect_locals(entry, end);
+}
+
+static void end_function(void) {
+  hashmap_foreach(&locals, free_local);
+  hashmap_free(&locals);
+}
+
+/* Functions declared without a return type may still return a value, as
+ * main does for the exit status, & then return the type of the first one */
+static const Type *return_type(BasicBlock *entry, BasicBlock *end, const FuncDecl *decl) {
+  if (decl->return_type->kind != TY_VOID)
+    return decl->return_type;
+
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_RET && inst->nopers)
+        return operand_type(&inst->operands[0]);
+    }
+  }
+  return decl->return_type;
+}
+
+static int compare_locals(const void *a, const void *b) {
+  const Local *x = *(Local **)a, *y = *(Local **)b;
+  return x->index - y->index;
+}
+
+static void write_function(BasicBlock *entry, BasicBlock *end) {
+  const char *name = entry->head->operands[0].label;
+  const FuncDecl *decl = function_decl(name);
+
+  begin_function(entry, end);
+  const Type *returns = return_type(entry, end, decl);
+  write_signature(name, decl, returns);
+  fprintf(out, " {\n");
+
+  /* Declarations in the order the variables appear */
+  Local **order = calloc(locals.size ? locals.size : 1, sizeof(Local *));
+  if (!order)
+    LOG_FATAL("calloc failed in write_function");
+  size_t n = 0;
+  for (size_t i = 0; i < locals.capacity; i++) {
+    if (locals.entries[i].key)
+      order[n++] = locals.entries[i].value;
+  }
+  qsort(order, n, sizeof(Local *), compare_locals);
+  for (size_t i = 0; i < n; i++) {
+    const Type *type = order[i]->type ? order[i]->type : &PRIMITIVES[TY_INT];
+    fprintf(out, "  %s%s%s = 0;\n", c_type(type), c_space(type), order[i]->name);
+  }
+  free(order);
+
+  /* Labels are only written for the blocks something jumps to */
+  int nblocks = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    if (block->id >= nblocks)
+      nblocks = block->id + 1;
+  }
+  bool *targets = calloc(nblocks, sizeof(bool));
+  if (!targets)
+    LOG_FATAL("calloc failed in write_function");
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    BasicBlock *gotos[2];
+    int count = block_gotos(block, block->next, end, gotos);
+    for (int i = 0; i < count; i++)
+      targets[gotos[i]->id] = true;
+  }
+
+  for (BasicBlock *block = entry; block != end; block = block->next)
+    write_block(block, block->next, end, returns, targets);
+  fprintf(out, "}\n\n");
+
+  free(targets);
+  end_function();
+}
+
+/* Bytes of the string pool; octal escapes are always three digits, so they
+ * cannot run into a digit that follows */
+static void write_strings(void) {
+  StringPool *pool = &STRINGS;
+  if (!pool->size)
+    return;
+
+  fprintf(out, "static const char neo_strings[%zu] =\n  \"", pool->size);
+  for (size_t i = 0; i < pool->size; i++) {
+    uint8_t c = pool->data[i];
+    if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?')
+      fputc(c, out);
+    else
+      fprintf(out, "\\%03o", c);
+    if (c == 0 && i + 1 < pool->size)
+      fprintf(out, "\"\n  \"");
+  }
+  fprintf(out, "\";\n\n");
+}
+
+/* Globals keep their initial value, .bss & .data alike */
+static void write_globals(BasicBlock *prog) {
+  HashMap used;
+  hashmap_init(&used);
+  scan_globals(prog, &used, NULL);
+
+  bool any = false;
+  for (size_t i = 0; i < SYMTAB.symbols.capacity; i++) {
+    MapEntry entry = SYMTAB.symbols.entries[i];
+    if (!entry.key)
+      continue;
+
+    Symbol *symbol = entry.value;
+    if (!symbol->name || symbol->kind != SYM_VAR || !hashmap_lookup(&used, symbol->name))
+      continue;
+
+    Value value;
+    if (!global_value(symbol->node, &value))
+      LOG_FATAL("initializer of global '%s' is not a constant", symbol->name);
+    const Type *type = symbol->node->var.type;
+    fprintf(out, "static %s%sg_%s = ", c_type(type), c_space(type), symbol->name);
+    if (value.kind == VAL_STRING)
+      fprintf(out, "neo_strings + %zu", strpool_find(&STRINGS, global_string(&value))->offset);
+    else
+      write_value(&value);
+    fprintf(out, ";\n");
+    any = true;
+  }
+  if (any)
+    fprintf(out, "\n");
+
+  hashmap_free(&used);
+}
+
+void c_generate(BasicBlock *prog, FILE *file) {
+  out = file;
+  fprintf(out, "/* Generated by neo */\n%s\n", PRELUDE);
+
+  /* Mark the strings in use so the pool only lays those out */
+  for (BasicBlock *block = prog; block; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_ADDR && IS_LABEL(inst->operands[0]))
+        strpool_use(&STRINGS, inst->operands[0].label);
+    }
+  }
+  use_global_strings(prog);
+  strpool_layout(&STRINGS);
+  write_strings();
+  write_globals(prog);
+
+  const Type *main_returns = &PRIMITIVES[TY_VOID];
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (IS_FUNCTION_ENTRY(block)) {
+      const char *name = block->head->operands[0].label;
+      BasicBlock *end = function_end(block);
+      begin_function(block, end);
+      const Type *returns = return_type(block, end, function_decl(name));
+      end_function();
+
+      write_signature(name, function_decl(name), returns);
+      fprintf(out, ";\n");
+      if (strcmp(name, "main") == 0)
+        main_returns = returns;
+    }
+  }
+  fprintf(out, "\n");
+
+  /* The code outside of functions only delimits them */
+  for (BasicBlock *block = prog; block; ) {
+    if (IS_FUNCTION_ENTRY(block)) {
+      BasicBlock *end = function_end(block);
+      write_function(block, end);
+      block = end;
+    } else {
+      block = block->next;
+    }
+  }
+
+  /* The exit status is the result of main, as from _start */
+  if (main_returns->kind == TY_VOID || main_returns->ptr)
+    fprintf(out, "int main(void) {\n  f_main();\n  return 0;\n}\n");
+  else
+    fprintf(out, "int main(void) {\n  return (int)f_main();\n}\n");
+  out = NULL;
+}
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "callgraph.h"
+#include "symtab.h"
+#include "util.h"
+
+static CallGraphNode *callgraph_node_new(CallGraph *cg, char *name) {
+  CallGraphNode *node = calloc(1, sizeof(CallGraphNode));
+  if (!node)
+    LOG_FATAL("calloc failed for CallGraphNode in callgraph_node_new");
+
+  node->name = name;
+  node->seq = cg->nodes.size;
+  node->index = -1;
+  hashmap_insert(&cg->nodes, name, node);
+  return node;
+}
+
+static void add_callee(CallGraphNode *caller, CallGraphNode *callee) {
+  CallGraphNode **tmp = realloc(caller->callees, sizeof(CallGraphNode *) * (caller->ncallees + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in add_callee");
+
+  tmp[caller->ncallees++] = callee;
+  caller->callees = tmp;
+  callee->nsites++;
+  if (callee == caller)
+    caller->recursive = true;
+}
+
+typedef struct {
+  int index;
+  int depth;
+  CallGraphNode **stack;
+  int norder;
+} Tarjan;
+
+/* Tarjan's algorithm emits strongly connected components callees-first,
+ * which is exactly the bottom-up order wanted by interprocedural passes */
+static void strong_connect(CallGraph *cg, Tarjan *t, CallGraphNode *node) {
+  node->index = node->lowlink = t->index++;
+  node->on_stack = true;
+  t->stack[t->depth++] = node;
+
+  for (int i = 0; i < node->ncallees; i++) {
+    CallGraphNode *callee = node->callees[i];
+    if (callee->index < 0) {
+      strong_connect(cg, t, callee);
+      if (callee->lowlink < node->lowlink)
+        node->lowlink = callee->lowlink;
+    } else if (callee->on_stack && callee->index < node->lowlink) {
+      node->lowlink = callee->index;
+    }
+  }
+
+  if (node->lowlink != node->index)
+    return;
+
+  /* Pop the component rooted at this node */
+  int start = t->depth;
+  do {
+    start--;
+  } while (t->stack[start] != node);
+
+  bool cycle = t->depth - start > 1;
+  for (int i = start; i < t->depth; i++) {
+    CallGraphNode *member = t->stack[i];
+    member->on_stack = false;
+    member->recursive |= cycle;
+    cg->order[t->norder++] = member;
+  }
+  t->depth = start;
+}
+
+/* Computes the bottom-up order, starting from the nodes with the lowest
+ * definition order to keep the result stable */
+static void callgraph_order(CallGraph *cg) {
+  size_t n = cg->nodes.size ? cg->nodes.size : 1;
+  cg->order = calloc(n, sizeof(CallGraphNode *));
+  CallGraphNode **defined = calloc(n, sizeof(CallGraphNode *));
+  Tarjan t = { 0 };
+  t.stack = calloc(n, sizeof(CallGraphNode *));
+  if (!cg->order || !defined || !t.stack)
+    LOG_FATAL("calloc failed in callgraph_order");
+
+  for (size_t i = 0; i < cg->nodes.capacity; i++) {
+    CallGraphNode *node = cg->nodes.entries[i].value;
+    if (cg->nodes.entries[i].key)
+      defined[node->seq] = node;
+  }
+
+  for (size_t i = 0; i < cg->nodes.size; i++) {
+    if (defined[i]->index < 0)
+      strong_connect(cg, &t, defined[i]);
+  }
+
+  cg->nnodes = t.norder;
+  free(defined);
+  free(t.stack);
+}
+
+void callgraph_build(CallGraph *cg, BasicBlock *prog) {
+  hashmap_init(&cg->nodes);
+  cg->nnodes = 0;
+  cg->order = NULL;
+
+  /* Every function defined in the program is a node */
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (!IS_FUNCTION_ENTRY(block))
+      continue;
+
+    char *name = block->head->operands[0].label;
+    CallGraphNode *node = callgraph_lookup(cg, name);
+    if (!node)
+      node = callgraph_node_new(cg, name);
+    node->entry = block;
+  }
+
+  /* Every call site is an edge */
+  CallGraphNode *caller = NULL;
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (IS_FUNCTION_ENTRY(block))
+      caller = callgraph_lookup(cg, block->head->operands[0].label);
+    if (!caller)
+      continue;
+
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode != OP_CALL)
+        continue;
+
+      CallGraphNode *callee = callgraph_lookup(cg, inst->operands[0].label);
+      if (!callee)
+        callee = callgraph_node_new(cg, inst->operands[0].label);
+      add_callee(caller, callee);
+    }
+  }
+
+  callgraph_order(cg);
+}
+
+static void add_global(CallGraphNode *node, Node *decl) {
+  for (int i = 0; i < node->nglobals; i++) {
+    if (node->globals[i] == decl)
+      return;
+  }
+
+  Node **tmp = realloc(node->globals, sizeof(Node *) * (node->nglobals + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in add_global");
+
+  tmp[node->nglobals++] = decl;
+  node->globals = tmp;
+}
+
+typedef struct {
+  CallGraph *cg;
+  CallGraphNode *caller;
+  HashMap locals;
+} ASTWalk;
+
+static void reference_variable(ASTWalk *w, char *name) {
+  if (hashmap_lookup(&w->locals, name))
+    return;
+
+  Symbol *symbol = find_symbol(&SYMTAB, name, strlen(name));
+  if (symbol && symbol->kind == SYM_VAR)
+    add_global(w->caller, symbol->node);
+}
+
+/* NOTE: the `next` pointer of expression nodes is not meaningful, only
+ * statement lists and call arguments are chained */
+static void walk_expression(ASTWalk *w, Node *node) {
+  if (!node) return;
+
+  switch (node->kind) {
+    case ND_CALL_EXPR: {
+      CallGraphNode *callee = callgraph_lookup(w->cg, node->call.name);
+      if (!callee)
+        callee = callgraph_node_new(w->cg, node->call.name);
+      add_callee(w->caller, callee);
+
+      for (Node *arg = node->call.args; arg; arg = arg->next)
+        walk_expression(w, arg);
+      break;
+    }
+    case ND_UNARY_EXPR:
+      walk_expression(w, node->unary.expr);
+      break;
+    case ND_BINARY_EXPR:
+      walk_expression(w, node->binary.lhs);
+      walk_expression(w, node->binary.rhs);
+      break;
+    case ND_REF_EXPR:
+      reference_variable(w, node->ref);
+      break;
+    default: break;
+  }
+}
+
+static void walk_statements(ASTWalk *w, Node *node) {
+  for (; node; node = node->next) {
+    switch (node->kind) {
+      case ND_VAR_DECL:
+        hashmap_insert(&w->locals, node->var.name, node);
+        walk_expression(w, node->var.value);
+        break;
+      case ND_ASSIGN_STMT:
+        reference_variable(w, node->assign.name);
+        walk_expression(w, node->assign.value);
+        break;
+      case ND_RET_STMT:
+        walk_expression(w, node->ret.value);
+        break;
+      case ND_COND_STMT:
+        walk_expression(w, node->cond.expr);
+        walk_statements(w, node->cond.body);
+        break;
+      default:
+        walk_expression(w, node);
+        break;
+    }
+  }
+}
+
+void callgraph_build_ast(CallGraph *cg, CompilationUnit *units, size_t nunits) {
+  hashmap_init(&cg->nodes);
+  cg->nnodes = 0;
+  cg->order = NULL;
+
+  for (size_t id = 0; id < nunits; id++) {
+    for (Node *decl = units[id].ast; decl; decl = decl->next) {
+      if (decl->kind != ND_FUNC_DECL)
+        continue;
+
+      CallGraphNode *node = callgraph_lookup(cg, decl->func.name);
+      if (!node)
+        node = callgraph_node_new(cg, decl->func.name);
+      node->decl = decl;
+    }
+  }
+
+  for (size_t id = 0; id < nunits; id++) {
+    for (Node *decl = units[id].ast; decl; decl = decl->next) {
+      if (decl->kind != ND_FUNC_DECL)
+        continue;
+
+      ASTWalk w = { .cg = cg, .caller = callgraph_lookup(cg, decl->func.name) };
+      hashmap_init(&w.locals);
+      for (Node *param = decl->func.params; param; param = param->next)
+        hashmap_insert(&w.locals, param->var.name, param);
+
+      walk_statements(&w, decl->func.body);
+      hashmap_free(&w.locals);
+    }
+  }
+
+  callgraph_order(cg);
+}
+
+static void mark_reachable(CallGraphNode *node) {
+  if (node->reachable)
+    return;
+
+  node->reachable = true;
+  for (int i = 0; i < node->nglobals; i++)
+    node->globals[i]->visited = true;
+  for (int i = 0; i < node->ncallees; i++)
+    mark_reachable(node->callees[i]);
+}
+
+/* Marks every function reachable from `root`, along with the globals they
+ * refer to (through the `visited` flag of their declarations) */
+void callgraph_mark_reachable(CallGraph *cg, const char *root) {
+  CallGraphNode *node = callgraph_lookup(cg, root);
+  if (node)
+    mark_reachable(node);
+}
+
+static void free_node(MapEntry *entry) {
+  CallGraphNode *node = entry->value;
+  free(node->callees);
+  free(node->globals);
+  free(node);
+}
+
+void callgraph_free(CallGraph *cg) {
+  hashmap_foreach(&cg->nodes, free_node);
+  hashmap_free(&cg->nodes);
+  free(cg->order);
+  cg->order = NULL;
+  cg->nnodes = 0;
+}
+
+CallGraphNode *callgraph_lookup(CallGraph *cg, const char *name) {
+  return hashmap_lookup(&cg->nodes, name);
+}
+
+void dump_callgraph(CallGraph *cg) {
+  for (int i = 0; i < cg->nnodes; i++) {
+    CallGraphNode *node = cg->order[i];
+    printf("%s%s%s ->", node->name, node->entry || node->decl ? "" : " (external)",
+        node->recursive ? " (recursive)" : "");
+    for (int j = 0; j < node->ncallees; j++)
+      printf(" %s", node->callees[j]->name);
+    printf("\n");
+  }
+}
+
+/* Removes the functions that can no longer be called, typically because
+ * every call to them has been inlined */
+void eliminate_dead_functions(BasicBlock *prog) {
+  if (!prog) return;
+
+  CallGraph cg;
+  callgraph_build(&cg, prog);
+  callgraph_mark_reachable(&cg, "main");
+
+  BasicBlock *block = prog;
+  while (block) {
+    if (!IS_FUNCTION_ENTRY(block)) {
+      block = block->next;
+      continue;
+    }
+
+    CallGraphNode *node = callgraph_lookup(&cg, block->head->operands[0].label);
+    BasicBlock *end = function_end(block);
+    if (node->reachable) {
+      block = end;
+      continue;
+    }
+
+    LOG_INFO("removing dead function '%s'", node->name);
+    while (block != end) {
+      BasicBlock *next = block->next;
+      block_unlink(block);
+      block = next;
+    }
+  }
+
+  callgraph_free(&cg);
+}
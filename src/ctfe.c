@@ -0,0 +1,395 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "callgraph.h"
+#include "hashmap.h"
+#include "ir.h"
+#include "optimize.h"
+#include "pass.h"
+#include "symtab.h"
+#include "util.h"
+
+/* Compile-Time Function Evaluation
+ *
+ * A call whose arguments are all constants is run by an interpreter of the
+ * IR & replaced by its result. Purity is decided by the path the evaluation
+ * takes: reading or storing a global, taking an address, calling a function
+ * without a body or running out of budget abandons it, & the call is left
+ * for runtime. Operations fold exactly like they do in SCCP.
+ *
+ * Results are memoized by function & arguments, which also keeps recursive
+ * definitions like fib linear in the number of distinct calls. */
+
+#define CTFE_STEP_LIMIT     (1 << 14)   /* Instructions per call site */
+#define CTFE_STEP_LIMIT_O2  (1 << 20)
+#define CTFE_MEMORY_LIMIT   (64 << 10)  /* Bytes of variables live at once */
+#define CTFE_MAX_DEPTH      256         /* Nested calls */
+
+typedef enum {
+  CTFE_OK,
+  CTFE_IMPURE,   /* Cannot be evaluated, whatever the budget */
+  CTFE_BUDGET    /* Ran out of steps, memory or depth */
+} CTFEStatus;
+
+typedef struct {
+  CTFEStatus status;
+  bool has_value;
+  Value value;
+} CTFEResult;
+
+typedef struct {
+  CallGraph cg;
+  HashMap memo;          /* "function(args)" -> CTFEResult */
+
+  long steps, step_limit;
+  size_t memory;
+  int depth;
+} CTFE;
+
+typedef struct {
+  HashMap vars;          /* Local -> Value */
+  const Value *args;
+  int nargs;
+  size_t memory;         /* Bytes taken by vars */
+} Frame;
+
+static CTFEStatus evaluate_call(CTFE *c, const char *name, const Value *args, int nargs, CTFEResult *out);
+
+static bool is_global(const char *name) {
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)name, strlen(name));
+  return symbol && symbol->kind == SYM_VAR;
+}
+
+static bool is_scalar(const Value *v) {
+  return v->kind != VAL_STRING;
+}
+
+/* Whether `v` is what a value of `type` holds, pointers excluded */
+static bool has_type(const Value *v, const Type *type) {
+  return type && !type->ptr && value_type(v) && value_type(v)->kind == type->kind;
+}
+
+static uint64_t value_bits(const Value *v) {
+  uint32_t f;
+  uint64_t d;
+  switch (v->kind) {
+    case VAL_INT: return (uint32_t)v->i_val;
+    case VAL_UINT: return v->u_val;
+    case VAL_FLOAT: memcpy(&f, &v->f_val, sizeof(f)); return f;
+    case VAL_DOUBLE: memcpy(&d, &v->d_val, sizeof(d)); return d;
+    case VAL_CHAR: return (unsigned char)v->c_val;
+    case VAL_BOOL: return v->b_val;
+    case VAL_STRING: break;
+  }
+  return 0;
+}
+
+static char *memo_key(const char *name, const Value *args, int nargs) {
+  char *key = format("%s(", name);
+  for (int i = 0; i < nargs; i++) {
+    char *next = format("%s%d:%llx,", key, args[i].kind,
+        (unsigned long long)value_bits(&args[i]));
+    free(key);
+    key = next;
+  }
+  return key;
+}
+
+static bool read_operand(Frame *f, const Operand *o, Value *out) {
+  if (IS_VALUE((*o))) {
+    *out = o->val;
+    return is_scalar(out);
+  }
+  if (!IS_VARIABLE((*o)))
+    return false;
+
+  /* Globals are never in the frame, so reading one fails as well */
+  Value *v = hashmap_lookup(&f->vars, o->var);
+  if (!v)
+    return false;
+  *out = *v;
+  return true;
+}
+
+static CTFEStatus write_variable(CTFE *c, Frame *f, const char *name, const Value *v) {
+  if (is_global(name))
+    return CTFE_IMPURE;
+
+  Value *slot = hashmap_lookup(&f->vars, name);
+  if (!slot) {
+    if (c->memory + sizeof(Value) > CTFE_MEMORY_LIMIT)
+      return CTFE_BUDGET;
+    c->memory += sizeof(Value);
+    f->memory += sizeof(Value);
+
+    slot = malloc(sizeof(Value));
+    if (!slot)
+      LOG_FATAL("malloc failed in write_variable");
+    hashmap_insert(&f->vars, name, slot);
+  }
+  *slot = *v;
+  return CTFE_OK;
+}
+
+static CTFEStatus execute_call(CTFE *c, Frame *f, Instruction *call, Value *out, bool *has_value) {
+  int nargs = call->operands[1].val.i_val;
+  Value *args = calloc(nargs ? nargs : 1, sizeof(Value));
+  if (!args)
+    LOG_FATAL("calloc failed in execute_call");
+
+  CTFEStatus status = CTFE_OK;
+  Instruction *arg = call->prev;
+  for (int i = nargs - 1; i >= 0; i--, arg = arg->prev) {
+    if (!arg || arg->opcode != OP_ARG || !read_operand(f, &arg->operands[0], &args[i])) {
+      status = CTFE_IMPURE;
+      break;
+    }
+  }
+
+  CTFEResult result;
+  if (status == CTFE_OK)
+    status = evaluate_call(c, call->operands[0].label, args, nargs, &result);
+  free(args);
+
+  if (status == CTFE_OK) {
+    *out = result.value;
+    *has_value = result.has_value;
+  }
+  return status;
+}
+
+/* Executes an instruction that is not a terminator */
+static CTFEStatus execute(CTFE *c, Frame *f, Instruction *inst) {
+  Value lhs, rhs, result;
+  bool has_value = true;
+  CTFEStatus status;
+
+  switch (inst->opcode) {
+    case OP_DEF:
+    case OP_ARG:
+    case OP_DEAD:
+      return CTFE_OK;
+    case OP_PARAM: {
+      int index = inst->operands[0].val.i_val;
+      if (index >= f->nargs || !has_type(&f->args[index], inst->type))
+        return CTFE_IMPURE;
+      result = f->args[index];
+      break;
+    }
+    case OP_ASSIGN:
+      /* A declaration without an initializer leaves the variable undefined */
+      if (!inst->nopers)
+        return CTFE_OK;
+      if (!read_operand(f, &inst->operands[0], &result))
+        return CTFE_IMPURE;
+      break;
+    case OP_NEG:
+    case OP_NOT:
+      if (!read_operand(f, &inst->operands[0], &lhs)
+          || !fold_value_unary(inst->opcode, &lhs, &result))
+        return CTFE_IMPURE;
+      break;
+    case OP_CONV:
+      if (!inst->type || inst->type->ptr || !read_operand(f, &inst->operands[0], &result)
+          || !convert_value(&result, inst->type))
+        return CTFE_IMPURE;
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_SAR:
+    case OP_MULHI:
+    case OP_UMULHI:
+      if (!read_operand(f, &inst->operands[0], &lhs) || !read_operand(f, &inst->operands[1], &rhs)
+          || !fold_value_binary(inst->opcode, &lhs, &rhs, &result))
+        return CTFE_IMPURE;
+      break;
+    case OP_CALL:
+      status = execute_call(c, f, inst, &result, &has_value);
+      if (status != CTFE_OK)
+        return status;
+      if (!inst->assignee)
+        return CTFE_OK;
+      if (!has_value || !has_type(&result, inst->type))
+        return CTFE_IMPURE;
+      break;
+    default:
+      /* Memory accesses */
+      return CTFE_IMPURE;
+  }
+
+  return inst->assignee ? write_variable(c, f, inst->assignee, &result) : CTFE_OK;
+}
+
+static void free_entry_value(MapEntry *entry) {
+  free(entry->value);
+}
+
+static CTFEStatus run_function(CTFE *c, BasicBlock *entry, const Value *args, int nargs, CTFEResult *out) {
+  Frame f = { .args = args, .nargs = nargs };
+  hashmap_init(&f.vars);
+
+  CTFEStatus status = CTFE_OK;
+  out->has_value = false;
+
+  BasicBlock *end = function_end(entry);
+  BasicBlock *block = entry;
+  while (block && block != end && status == CTFE_OK) {
+    BasicBlock *next = block->next;
+
+    for (Instruction *inst = block->head; inst && status == CTFE_OK; inst = inst->next) {
+      if (++c->steps > c->step_limit) {
+        status = CTFE_BUDGET;
+        break;
+      }
+
+      Value cond;
+      switch (inst->opcode) {
+        case OP_JMP:
+          next = block->nsuccs ? block->succ[0] : NULL;
+          break;
+        case OP_BR:
+          if (block->nsuccs < 2 || !read_operand(&f, &inst->operands[0], &cond))
+            status = CTFE_IMPURE;
+          else
+            next = block->succ[value_is_truthy(&cond) ? 0 : 1];
+          break;
+        case OP_RET:
+          if (inst->nopers) {
+            out->has_value = true;
+            if (!read_operand(&f, &inst->operands[0], &out->value))
+              status = CTFE_IMPURE;
+          }
+          next = NULL;
+          break;
+        default:
+          status = execute(c, &f, inst);
+          break;
+      }
+      if (IS_TERMINATOR(inst))
+        break;
+    }
+
+    /* Falling off the end of the function returns nothing */
+    block = next;
+  }
+
+  c->memory -= f.memory;
+  hashmap_foreach(&f.vars, free_entry_value);
+  hashmap_free(&f.vars);
+  return status;
+}
+
+static CTFEStatus evaluate_call(CTFE *c, const char *name, const Value *args, int nargs, CTFEResult *out) {
+  CallGraphNode *node = callgraph_lookup(&c->cg, name);
+  if (!node || !node->entry)
+    return CTFE_IMPURE;
+
+  char *key = memo_key(name, args, nargs);
+  CTFEResult *memo = hashmap_lookup(&c->memo, key);
+  if (memo) {
+    free(key);
+    *out = *memo;
+    return out->status;
+  }
+
+  if (c->depth >= CTFE_MAX_DEPTH) {
+    free(key);
+    return CTFE_BUDGET;
+  }
+
+  c->depth++;
+  out->status = run_function(c, node->entry, args, nargs, out);
+  c->depth--;
+
+  /* Running out of budget depends on the caller, so only outcomes that are
+   * the same whatever the budget are kept */
+  if (out->status != CTFE_BUDGET) {
+    memo = malloc(sizeof(CTFEResult));
+    if (!memo)
+      LOG_FATAL("malloc failed in evaluate_call");
+    *memo = *out;
+    hashmap_insert(&c->memo, key, memo);
+  }
+  free(key);
+  return out->status;
+}
+
+/* Replaces `call` by its result if it can be evaluated */
+static void fold_call(CTFE *c, Instruction *call) {
+  int nargs = call->operands[1].val.i_val;
+  Value *args = calloc(nargs ? nargs : 1, sizeof(Value));
+  if (!args)
+    LOG_FATAL("calloc failed in fold_call");
+
+  Instruction *arg = call->prev;
+  for (int i = nargs - 1; i >= 0; i--, arg = arg->prev) {
+    if (!arg || arg->opcode != OP_ARG || !IS_VALUE(arg->operands[0]) || !is_scalar(&arg->operands[0].val)) {
+      free(args);
+      return;
+    }
+    args[i] = arg->operands[0].val;
+  }
+
+  c->steps = 0;
+  CTFEResult result;
+  CTFEStatus status = evaluate_call(c, call->operands[0].label, args, nargs, &result);
+  free(args);
+
+  if (status != CTFE_OK) {
+    LOG_TRACE("not evaluating call to '%s' at line %d, col %d: %s",
+        call->operands[0].label, call->span.line, call->span.col,
+        status == CTFE_BUDGET ? "over budget" : "not constant");
+    return;
+  }
+  if (call->assignee && (!result.has_value || !has_type(&result.value, call->type)))
+    return;
+
+  LOG_INFO("evaluated call to '%s' at line %d, col %d",
+      call->operands[0].label, call->span.line, call->span.col);
+
+  arg = call->prev;
+  for (int i = 0; i < nargs; i++, arg = arg->prev)
+    arg->opcode = OP_DEAD;
+
+  /* The result becomes a copy of the constant, or nothing at all when it
+   * goes unused */
+  if (call->assignee) {
+    call->opcode = OP_ASSIGN;
+    call->nopers = 1;
+    call->operands[0].kind = O_VALUE;
+    call->operands[0].val = result.value;
+  } else {
+    call->opcode = OP_DEAD;
+  }
+}
+
+void evaluate_calls(BasicBlock *prog) {
+  if (!prog) return;
+
+  CTFE c = { 0 };
+  callgraph_build(&c.cg, prog);
+  hashmap_init(&c.memo);
+  c.step_limit = pass_opt_level() >= 2 ? CTFE_STEP_LIMIT_O2 : CTFE_STEP_LIMIT;
+
+  for (BasicBlock *block = prog; block; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_CALL)
+        fold_call(&c, inst);
+    }
+  }
+
+  hashmap_foreach(&c.memo, free_entry_value);
+  hashmap_free(&c.memo);
+  callgraph_free(&c.cg);
+}
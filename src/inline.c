@@ -0,0 +1,356 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "callgraph.h"
+#include "hashmap.h"
+#include "ir.h"
+#include "optimize.h"
+#include "pass.h"
+#include "symtab.h"
+#include "util.h"
+
+/* Inlining budget, measured in IR instructions of the callee */
+#define INLINE_THRESHOLD          8
+#define INLINE_THRESHOLD_O2       24
+#define INLINE_CONSTANT_ARG_BONUS 4   /* Per argument SCCP can fold into the body */
+#define INLINE_CALL_OVERHEAD      2   /* call + ret, on top of one move per argument */
+#define INLINE_SINGLE_SITE_LIMIT  64  /* Callees with one caller die once inlined */
+#define INLINE_GROWTH_LIMIT       512 /* Largest a caller may grow to */
+#define INLINE_HOT_THRESHOLD      64  /* For calls the profile says are hot */
+#define INLINE_HOT_FRACTION       8   /* Of the hottest call, to count as hot */
+
+/* Times the most executed call of the program ran, 0 without a profile */
+static int64_t hottest_call;
+
+static int function_size(BasicBlock *entry) {
+  int size = 0;
+  BasicBlock *end = function_end(entry);
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode != OP_DEF && inst->opcode != OP_PARAM && inst->opcode != OP_DEAD)
+        size++;
+    }
+  }
+  return size;
+}
+
+static bool should_inline(CallGraphNode *callee, Instruction *call, int caller_size) {
+  if (!callee->entry || callee->recursive)
+    return false;
+
+  /* Growing the code for a call that never ran is not worth it */
+  if (call->count == 0 && callee->nsites > 1)
+    return false;
+
+  int size = function_size(callee->entry);
+  if (caller_size + size > INLINE_GROWTH_LIMIT)
+    return false;
+
+  /* Weigh the callee's size against the work that goes away with the call */
+  int nargs = call->operands[1].val.i_val;
+  int budget = pass_opt_level() >= 2 ? INLINE_THRESHOLD_O2 : INLINE_THRESHOLD;
+  budget += nargs + INLINE_CALL_OVERHEAD;
+
+  Instruction *arg = call->prev;
+  for (int i = 0; i < nargs; i++, arg = arg->prev) {
+    if (IS_VALUE(arg->operands[0]))
+      budget += INLINE_CONSTANT_ARG_BONUS;
+  }
+
+  if (callee->nsites == 1 && budget < INLINE_SINGLE_SITE_LIMIT)
+    budget = INLINE_SINGLE_SITE_LIMIT;
+  if (call->count > 0 && call->count * INLINE_HOT_FRACTION >= hottest_call && budget < INLINE_HOT_THRESHOLD)
+    budget = INLINE_HOT_THRESHOLD;
+
+  return size <= budget;
+}
+
+static bool is_global(const char *name) {
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)name, strlen(name));
+  return symbol && symbol->kind == SYM_VAR;
+}
+
+static char *rename_variable(HashMap *names, char *var) {
+  char *renamed = hashmap_lookup(names, var);
+  return renamed ? renamed : var;
+}
+
+typedef struct {
+  HashMap names;             /* Callee local -> caller-unique name */
+  Instruction **args;
+  int nargs;
+
+  Instruction *call;
+  BasicBlock *cont;          /* Where control resumes after the call */
+
+  int nblocks;
+  BasicBlock **from, **to;   /* Callee blocks and their clones */
+
+  /* Times the call & the callee ran in the profile, -1 without one */
+  int64_t count, entry_count;
+} InlineSite;
+
+/* Share of a count of the callee that belongs to the call being inlined */
+static int64_t scale_count(InlineSite *site, int64_t count) {
+  if (count < 0 || site->count < 0 || site->entry_count < 0)
+    return -1;
+  if (site->entry_count == 0)
+    return 0;
+  return (int64_t)((double)count * (double)site->count / (double)site->entry_count);
+}
+
+static char *rename_label(InlineSite *site, char *label) {
+  for (int i = 0; i < site->nblocks; i++) {
+    if (strcmp(site->from[i]->tag, label) == 0)
+      return site->to[i]->tag;
+  }
+  return label;
+}
+
+static void append_jump(BasicBlock *block, BasicBlock *target, Instruction *origin) {
+  Instruction *jmp = instruction_create(OP_JMP, origin->span, NULL);
+  jmp->nopers = 1;
+  jmp->operands[0].kind = O_LABEL;
+  jmp->operands[0].label = target->tag;
+  block_append(block, jmp);
+  block_add_edge(block, target);
+}
+
+static void clone_block(InlineSite *site, BasicBlock *from, BasicBlock *to) {
+  for (Instruction *inst = from->head; inst; inst = inst->next) {
+    if (inst->opcode == OP_DEF || inst->opcode == OP_DEAD)
+      continue;
+
+    Instruction *copy = instruction_create(inst->opcode, inst->span, inst->type);
+    copy->counter = inst->counter;
+    copy->count = scale_count(site, inst->count);
+    if (inst->assignee)
+      copy->assignee = rename_variable(&site->names, inst->assignee);
+
+    copy->nopers = inst->nopers;
+    for (int i = 0; i < inst->nopers; i++) {
+      copy->operands[i] = inst->operands[i];
+      if (IS_VARIABLE(copy->operands[i]))
+        copy->operands[i].var = rename_variable(&site->names, copy->operands[i].var);
+      else if (IS_LABEL(copy->operands[i]) && inst->opcode != OP_CALL)
+        copy->operands[i].label = rename_label(site, copy->operands[i].label);
+    }
+
+    switch (inst->opcode) {
+      case OP_PARAM: {
+        /* Parameters become copies of the arguments */
+        int index = inst->operands[0].val.i_val;
+        copy->opcode = OP_ASSIGN;
+        copy->nopers = 0;
+        if (index < site->nargs) {
+          copy->nopers = 1;
+          copy->operands[0] = site->args[index]->operands[0];
+        }
+        break;
+      }
+      case OP_RET:
+        /* Returns become a copy of the result & a jump past the call */
+        if (site->call->assignee && copy->nopers) {
+          copy->opcode = OP_ASSIGN;
+          copy->assignee = site->call->assignee;
+          copy->type = site->call->type;
+          block_append(to, copy);
+        } else {
+          free(copy);
+        }
+        append_jump(to, site->cont, inst);
+        return;
+      default:
+        break;
+    }
+
+    block_append(to, copy);
+  }
+}
+
+static void inline_call(BasicBlock *block, Instruction *call, CallGraphNode *callee, int *next_id) {
+  static int nsites = 0;
+  int id = nsites++;
+
+  InlineSite site = { 0 };
+  site.call = call;
+  site.count = call->count;
+  site.entry_count = callee->entry->count;
+  site.nargs = call->operands[1].val.i_val;
+  site.args = calloc(site.nargs ? site.nargs : 1, sizeof(Instruction *));
+  if (!site.args)
+    LOG_FATAL("calloc failed in inline_call");
+
+  Instruction *first = call;
+  for (int i = site.nargs - 1; i >= 0; i--) {
+    first = first->prev;
+    assert(first && first->opcode == OP_ARG);
+    site.args[i] = first;
+  }
+
+  /* Give every local of the callee a name that is unique in the caller */
+  char *prefix = format("$%s.%d.", callee->name, id);
+  hashmap_init(&site.names);
+
+  BasicBlock *end = function_end(callee->entry);
+  for (BasicBlock *b = callee->entry; b != end; b = b->next) {
+    site.nblocks++;
+    for (Instruction *inst = b->head; inst; inst = inst->next) {
+      if (inst->assignee && !is_global(inst->assignee) && !hashmap_lookup(&site.names, inst->assignee))
+        hashmap_insert(&site.names, inst->assignee, format("%s%s", prefix, inst->assignee));
+    }
+  }
+
+  /* Split the caller's block right after the call */
+  site.cont = block_create((*next_id)++, format("%sret", prefix));
+  site.cont->count = block->count;
+  if (call->counter >= 0)
+    block_add_counter(site.cont, call->counter);
+  site.cont->head = call->next;
+  if (call->next) {
+    call->next->prev = NULL;
+    site.cont->tail = block->tail;
+  }
+
+  block->tail = first->prev;
+  if (block->tail)
+    block->tail->next = NULL;
+  else
+    block->head = NULL;
+
+  while (block->nsuccs) {
+    BasicBlock *succ = block->succ[0];
+    block_remove_edge(block, succ);
+    block_add_edge(site.cont, succ);
+  }
+
+  /* Clone the callee's body between the two halves */
+  site.from = calloc(site.nblocks, sizeof(BasicBlock *));
+  site.to = calloc(site.nblocks, sizeof(BasicBlock *));
+  if (!site.from || !site.to)
+    LOG_FATAL("calloc failed in inline_call");
+
+  int i = 0;
+  for (BasicBlock *b = callee->entry; b != end; b = b->next, i++) {
+    site.from[i] = b;
+    site.to[i] = block_create((*next_id)++, format("%s%s", prefix, b->tag));
+  }
+
+  for (i = 0; i < site.nblocks; i++) {
+    BasicBlock *from = site.from[i], *to = site.to[i];
+    for (int c = 0; c < from->ncounters; c++)
+      block_add_counter(to, from->counters[c]);
+    to->count = scale_count(&site, from->count);
+    clone_block(&site, from, to);
+  }
+
+  /* What ran through the clones no longer runs in the callee */
+  for (i = 0; i < site.nblocks; i++) {
+    BasicBlock *from = site.from[i];
+    if (from->count >= 0 && site.to[i]->count >= 0)
+      from->count -= site.to[i]->count;
+    for (Instruction *inst = from->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_CALL && inst->count >= 0)
+        inst->count -= scale_count(&site, inst->count);
+    }
+  }
+
+  for (i = 0; i < site.nblocks; i++) {
+    BasicBlock *from = site.from[i], *to = site.to[i];
+    bool terminated = to->tail && IS_TERMINATOR(to->tail);
+
+    for (int s = 0; s < from->nsuccs; s++) {
+      for (int j = 0; j < site.nblocks; j++) {
+        if (site.from[j] == from->succ[s])
+          block_add_edge(to, site.to[j]);
+      }
+    }
+
+    /* Falling off the end of the callee returns to the caller */
+    if (!terminated && to->nsuccs == 0)
+      append_jump(to, site.cont, call);
+  }
+
+  /* Layout: block, clones..., continuation */
+  BasicBlock *after = block->next;
+  BasicBlock *prev = block;
+  for (i = 0; i < site.nblocks; i++) {
+    prev->next = site.to[i];
+    site.to[i]->prev = prev;
+    prev = site.to[i];
+  }
+  prev->next = site.cont;
+  site.cont->prev = prev;
+  site.cont->next = after;
+  if (after)
+    after->prev = site.cont;
+
+  block_add_edge(block, site.to[0]);
+
+  LOG_INFO("inlined call to '%s' at line %d, col %d",
+      callee->name, call->span.line, call->span.col);
+
+  for (i = 0; i < site.nargs; i++)
+    free(site.args[i]);
+  free(call);
+  free(site.args);
+  free(site.from);
+  free(site.to);
+  free(prefix);
+  hashmap_free(&site.names);
+}
+
+static void inline_calls_in(CallGraph *cg, CallGraphNode *caller, int *next_id) {
+  int size = function_size(caller->entry);
+  BasicBlock *end = function_end(caller->entry);
+
+  /* NOTE: inlining splits the current block; the instructions after the
+   * call move to a new block that the walk reaches later on */
+  for (BasicBlock *block = caller->entry; block != end; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode != OP_CALL)
+        continue;
+
+      CallGraphNode *callee = callgraph_lookup(cg, inst->operands[0].label);
+      if (!callee || callee == caller || !should_inline(callee, inst, size)) {
+        LOG_TRACE("not inlining call to '%s' at line %d, col %d",
+            inst->operands[0].label, inst->span.line, inst->span.col);
+        continue;
+      }
+
+      size += function_size(callee->entry);
+      inline_call(block, inst, callee, next_id);
+      break;
+    }
+  }
+}
+
+/* Inlines calls bottom-up over the call graph, so callees have already
+ * absorbed their own callees by the time their size is weighed */
+void inline_functions(BasicBlock *prog) {
+  if (!prog) return;
+
+  CallGraph cg;
+  callgraph_build(&cg, prog);
+
+  int next_id = 0;
+  hottest_call = 0;
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (block->id >= next_id)
+      next_id = block->id + 1;
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_CALL && inst->count > hottest_call)
+        hottest_call = inst->count;
+    }
+  }
+
+  for (int i = 0; i < cg.nnodes; i++) {
+    if (cg.order[i]->entry)
+      inline_calls_in(&cg, cg.order[i], &next_id);
+  }
+
+  merge_blocks(prog);
+  callgraph_free(&cg);
+}
@@ -4,6 +4,8 @@
 #include <string.h>
 
 #include "ir.h"
+#include "strpool.h"
+#include "symtab.h"
 #include "util.h"
 
 const char *OPCODES[] = {
@@ -13,12 +15,26 @@ const char *OPCODES[] = {
   [OP_MUL] = "*",
   [OP_DIV] = "/",
   [OP_NOT] = "!",
+  [OP_DEREF] = "*",
+  [OP_ADDR] = "addr ",
+  [OP_CONV] = "conv",
   [OP_CMP] = "==",
   [OP_CMP_NOT] = "!=",
   [OP_CMP_LT] = "<",
   [OP_CMP_GT] = ">",
   [OP_CMP_LT_EQ] = "<=",
   [OP_CMP_GT_EQ] = ">=",
+  [OP_SHL] = "<<",
+  [OP_SHR] = ">>>",
+  [OP_SAR] = ">>",
+  [OP_MULHI] = "*h",
+  [OP_UMULHI] = "*hu",
+  [OP_PARAM] = "param",
+  [OP_ARG] = "arg",
+  [OP_CALL] = "call",
+  [OP_JMP] = "jmp",
+  [OP_BR] = "br",
+  [OP_RET] = "ret",
 };
 
 typedef struct {
@@ -26,21 +42,27 @@ typedef struct {
   int ntemps;
   int nblocks;
 
+  bool cse;
   HashMap exprs;
+  HashMap versions;
 
   BasicBlock *head, *tail;
 } IREmitter;
 
 static void emit(IREmitter *, Node *);
+static void emit_node(IREmitter *, Node *);
+static void emitter_add_instruction(IREmitter *, Instruction *);
 
 static void emitter_init(IREmitter *e) {
   e->pc = e->ntemps = e->nblocks = 0;
   hashmap_init(&e->exprs);
+  hashmap_init(&e->versions);
   e->head = e->tail = NULL;
 }
 
 static void emitter_deinit(IREmitter *e) {
   hashmap_free(&e->exprs);
+  hashmap_free(&e->versions);
 }
 
 static char *emitter_make_temporary(IREmitter *e) {
@@ -49,60 +71,246 @@ static char *emitter_make_temporary(IREmitter *e) {
   return temp_name;
 }
 
-static BasicBlock *block_new(int id, char *tag) {
+BasicBlock *block_create(int id, char *tag) {
   BasicBlock *block = calloc(1, sizeof(BasicBlock));
   if (!block)
-    LOG_FATAL("calloc failed for BasicBlock in block_new");
+    LOG_FATAL("calloc failed for BasicBlock in block_create");
 
   block->id = id;
   block->tag = tag;
 
   block->head = block->tail = NULL;
+  block->npreds = block->nsuccs = 0;
   block->pred = block->succ = NULL;
   block->next = block->prev = NULL;
+  block->counters = NULL;
+  block->ncounters = 0;
+  block->count = -1;
 
   return block;
 }
 
-static void emitter_add_block(IREmitter *e, char *tag) {
-  BasicBlock *new_block = block_new(e->nblocks++, tag);
+static void append_edge(BasicBlock ***edges, int *nedges, BasicBlock *block) {
+  BasicBlock **tmp = realloc(*edges, sizeof(BasicBlock *) * (*nedges + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in append_edge");
+  tmp[(*nedges)++] = block;
+  *edges = tmp;
+}
+
+static void erase_edge(BasicBlock **edges, int *nedges, BasicBlock *block) {
+  for (int i = 0; i < *nedges; i++) {
+    if (edges[i] == block) {
+      memmove(&edges[i], &edges[i + 1], sizeof(BasicBlock *) * (*nedges - i - 1));
+      (*nedges)--;
+      return;
+    }
+  }
+}
+
+void block_add_edge(BasicBlock *from, BasicBlock *to) {
+  append_edge(&from->succ, &from->nsuccs, to);
+  append_edge(&to->pred, &to->npreds, from);
+}
+
+void block_remove_edge(BasicBlock *from, BasicBlock *to) {
+  erase_edge(from->succ, &from->nsuccs, to);
+  erase_edge(to->pred, &to->npreds, from);
+}
+
+/* Detaches a block from the CFG & the block list. The first block of the
+ * program can never be unlinked. */
+void block_unlink(BasicBlock *block) {
+  assert(block->prev);
+  while (block->nsuccs)
+    block_remove_edge(block, block->succ[0]);
+  while (block->npreds)
+    block_remove_edge(block->pred[0], block);
+
+  block->prev->next = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+}
+
+void block_add_counter(BasicBlock *block, int counter) {
+  int *tmp = realloc(block->counters, sizeof(int) * (block->ncounters + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in block_add_counter");
+  tmp[block->ncounters++] = counter;
+  block->counters = tmp;
+}
+
+/* Returns the block following the last block of the function starting at `entry` */
+BasicBlock *function_end(BasicBlock *entry) {
+  BasicBlock *block = entry->next;
+  while (block && !IS_FUNCTION_ENTRY(block) && strcmp(block->tag, "$exit") != 0)
+    block = block->next;
+  return block;
+}
+
+/* Merges every block into its layout predecessor when that predecessor is
+ * its only way in and control flows straight from one into the other */
+void merge_blocks(BasicBlock *prog) {
+  BasicBlock *block = prog;
+  while (block) {
+    BasicBlock *next = block->next;
+    if (!next || block->nsuccs != 1 || block->succ[0] != next || next->npreds != 1
+        || IS_FUNCTION_ENTRY(next) || strcmp(next->tag, "$exit") == 0) {
+      block = next;
+      continue;
+    }
+
+    Instruction *tail = block->tail;
+    if (tail && tail->opcode == OP_JMP) {
+      block->tail = tail->prev;
+      if (block->tail)
+        block->tail->next = NULL;
+      else
+        block->head = NULL;
+      free(tail);
+    } else if (tail && IS_TERMINATOR(tail)) {
+      block = next;
+      continue;
+    }
+
+    LOG_TRACE("merging block '%s#%d' into '%s#%d'", next->tag, next->id, block->tag, block->id);
+
+    /* Splice instructions */
+    if (next->head) {
+      if (block->tail) {
+        block->tail->next = next->head;
+        next->head->prev = block->tail;
+      } else {
+        block->head = next->head;
+      }
+      block->tail = next->tail;
+    }
+
+    /* Both blocks run as often, & the merged block keeps counting for both */
+    for (int i = 0; i < next->ncounters; i++)
+      block_add_counter(block, next->counters[i]);
+    if (next->count > block->count)
+      block->count = next->count;
+
+    /* Take over outgoing edges, keeping their order */
+    block_remove_edge(block, next);
+    while (next->nsuccs) {
+      BasicBlock *succ = next->succ[0];
+      block_remove_edge(next, succ);
+      block_add_edge(block, succ);
+    }
+
+    block->next = next->next;
+    if (next->next)
+      next->next->prev = block;
+    free(next->pred);
+    free(next->succ);
+    free(next->counters);
+    free(next);
+  }
+}
+
+/* Appends a block; when `fallthrough` is set and the current block does not
+ * end in a terminator, control flows from it into the new block */
+static void emitter_append_block(IREmitter *e, BasicBlock *new_block, bool fallthrough) {
+  hashmap_clear(&e->exprs);
   if (!e->tail) {
     e->head = e->tail = new_block;
   } else {
+    BasicBlock *prev = e->tail;
+    if (fallthrough && !(prev->tail && IS_TERMINATOR(prev->tail)))
+      block_add_edge(prev, new_block);
+
     new_block->prev = e->tail;
     e->tail->next = new_block;
     e->tail = new_block;
   }
 }
 
-static Instruction* instruction_new(Opcode opcode, Span span) {
+static void emitter_add_block(IREmitter *e, char *tag, bool fallthrough) {
+  emitter_append_block(e, block_create(e->nblocks++, tag), fallthrough);
+}
+
+/* Blocks of control flow statements, created before they are appended */
+static BasicBlock *emitter_new_block(IREmitter *e, const char *kind) {
+  int id = e->nblocks++;
+  return block_create(id, format("$%s%d", kind, id));
+}
+
+Instruction *instruction_create(Opcode opcode, Span span, const Type *type) {
   Instruction *inst = calloc(1, sizeof(Instruction));
   if (!inst)
-    LOG_FATAL("calloc failed in instruction_new");
+    LOG_FATAL("calloc failed in instruction_create");
 
   inst->opcode = opcode;
   // inst->start = inst->end = 0;
   // inst->assignee = NULL;
   // inst->nopers = 0;
   inst->span = span;
+  inst->type = type;
+  inst->counter = -1;
+  inst->count = -1;
   return inst;
 }
 
-static char *encode_instruction(Instruction *inst) {
-  size_t size = 1 + (sizeof(inst->operands[0]) * inst->nopers);
-  char *buf = calloc(size, sizeof(char));
-  if (!buf)
-    LOG_FATAL("calloc failed in encode_instruction");
+static Instruction* instruction_new(Opcode opcode, Node *node) {
+  return instruction_create(opcode, node->span, node->type);
+}
 
-  memcpy(buf, &inst->opcode, 1);
+/* Temporaries created by passes after lowering */
+char *make_temporary() {
+  static int ntemps = 0;
+  return format("$v%d", ntemps++);
+}
 
-  for (uint8_t i = 0; i < inst->nopers; i++)
-    memcpy(buf, &inst->operands[i], sizeof(inst->operands[0]));
+void block_append(BasicBlock *block, Instruction *inst) {
+  inst->next = NULL;
+  inst->prev = block->tail;
+  if (block->tail)
+    block->tail->next = inst;
+  else
+    block->head = inst;
+  block->tail = inst;
+}
 
-  uint64_t hash = fnv1a64_2(buf, size);
-  char *encoded = format("%zu", hash);
+void block_insert_before(BasicBlock *block, Instruction *at, Instruction *inst) {
+  inst->next = at;
+  inst->prev = at->prev;
+  if (at->prev)
+    at->prev->next = inst;
+  else
+    block->head = inst;
+  at->prev = inst;
+}
+
+/* Encodes the computation performed by an instruction as a string key.
+ * Variables are tagged with the number of times they have been assigned so
+ * far, so a computation is never matched against stale operand values. */
+static char *encode_instruction(IREmitter *e, Instruction *inst) {
+  /* A conversion is told apart by the type it converts to */
+  char *encoded = inst->opcode == OP_CONV
+    ? format("%d:%d", inst->opcode, inst->type->kind)
+    : format("%d", inst->opcode);
+
+  for (uint8_t i = 0; i < inst->nopers; i++) {
+    Operand *operand = &inst->operands[i];
+    char *part = NULL;
+    if (IS_VARIABLE((*operand))) {
+      int version = (int)(intptr_t)hashmap_lookup(&e->versions, operand->var);
+      part = format("%s|%s#%d", encoded, operand->var, version);
+    } else if (IS_LABEL((*operand))) {
+      part = format("%s|@%s", encoded, operand->label);
+    } else {
+      size_t size = 0;
+      uint8_t *bytes = copy_value(&operand->val, &size);
+      uint64_t hash = fnv1a64_2((char *)bytes, size);
+      part = format("%s|%d:%zu:%llx", encoded, operand->val.kind, size, (unsigned long long)hash);
+      free(bytes);
+    }
+    free(encoded);
+    encoded = part;
+  }
 
-  free(buf);
   return encoded;
 }
 
@@ -125,9 +333,23 @@ static void instruction_add_operand(Instruction *inst, void *value, int kind) {
   inst->nopers++;
 }
 
+/* t := addr str.N, the address of a literal in the string pool */
+static void emit_string(IREmitter *e, Node *node) {
+  int id = strpool_intern(&STRINGS, node->value.s_val, node->value.s_len);
+  Instruction *inst = instruction_new(OP_ADDR, node);
+  instruction_add_operand(inst, STRINGS.strings[id].label, O_LABEL);
+  inst->assignee = emitter_make_temporary(e);
+  emitter_add_instruction(e, inst);
+}
+
 static void instruction_add_operands_from_node(IREmitter *e, Instruction *inst, Node *node) {
   switch (node->kind) {
     case ND_VALUE_EXPR:
+      if (node->value.kind == VAL_STRING) {
+        emit_string(e, node);
+        instruction_add_operand(inst, e->tail->tail->assignee, O_VARIABLE);
+        break;
+      }
       instruction_add_operand(inst, &node->value, O_VALUE);
       break;
     case ND_REF_EXPR:
@@ -136,7 +358,7 @@ static void instruction_add_operands_from_node(IREmitter *e, Instruction *inst,
     default:
       /* Generate temporary instruction of more complex expression and
        * assign the value to this instruction */
-      emit(e, node);
+      emit_node(e, node);
       Instruction *temp = e->tail->tail;
       LOG_TRACE("inserting temporary instruction for operation at line %d, col %d",
           node->span.line, node->span.col);
@@ -149,8 +371,10 @@ static void emitter_add_instruction(IREmitter *e, Instruction *inst) {
   if (!curr_block)
     LOG_FATAL("no block to add instruction to");
 
-  if (inst->assignee) {
-    char *encoded = encode_instruction(inst);
+  /* Local common-subexpression elimination. Only temporaries are reused
+   * since they are assigned exactly once. */
+  if (e->cse && inst->assignee && (IS_UNARY_OP(inst->opcode) || IS_BINARY_OP(inst->opcode))) {
+    char *encoded = encode_instruction(e, inst);
     char *exists = (char *)hashmap_lookup(&e->exprs, encoded);
     if (exists) {
       LOG_INFO("eliminating redundant calculation for variable '%s'", inst->assignee);
@@ -158,38 +382,49 @@ static void emitter_add_instruction(IREmitter *e, Instruction *inst) {
       inst->nopers = 0;
       memset(inst->operands, 0, sizeof(inst->operands[0]) * MAX_OPERANDS);
       instruction_add_operand(inst, exists, O_VARIABLE);
-    } else {
+    } else if (inst->assignee[0] == '$') {
       hashmap_insert(&e->exprs, encoded, inst->assignee);
     }
+    free(encoded);
   }
 
-  /* Add instruction to instruction list of tail block */
-  if (!curr_block->tail) {
-    curr_block->head = curr_block->tail = inst;
-  } else {
-    inst->prev = curr_block->tail;
-    curr_block->tail->next = inst;
-    curr_block->tail = inst;
+  if (inst->assignee) {
+    int version = (int)(intptr_t)hashmap_lookup(&e->versions, inst->assignee);
+    hashmap_insert(&e->versions, inst->assignee, (void *)(intptr_t)(version + 1));
   }
 
+  /* Add instruction to instruction list of tail block */
+  block_append(curr_block, inst);
+
   e->pc++;
 }
 
 static void emit_function(IREmitter *e, Node *node) {
-  emitter_add_block(e, node->func.name);
+  emitter_add_block(e, node->func.name, false);
 
-  Instruction *inst = instruction_new(OP_DEF, node->span);
+  Instruction *inst = instruction_new(OP_DEF, node);
   instruction_add_operand(inst, node->func.name, O_LABEL);
 
   emitter_add_instruction(e, inst);
 
-  emit(e, node->func.params);
+  int index = 0;
+  for (Node *param = node->func.params; param; param = param->next) {
+    param->visited = true;
+
+    Instruction *bind = instruction_create(OP_PARAM, param->span, param->var.type);
+    bind->assignee = param->var.name;
+    Value i = { .kind = VAL_INT, .i_val = index++ };
+    instruction_add_operand(bind, &i, O_VALUE);
+    emitter_add_instruction(e, bind);
+  }
+
   emit(e, node->func.body);
 }
 
 static void emit_variable(IREmitter *e, Node *node) {
-  Instruction *inst = instruction_new(OP_ASSIGN, node->span);
+  Instruction *inst = instruction_new(OP_ASSIGN, node);
   inst->assignee = node->var.name;
+  inst->type = node->var.type;
 
   if (node->var.value)
     instruction_add_operands_from_node(e, inst, node->var.value);
@@ -198,30 +433,100 @@ static void emit_variable(IREmitter *e, Node *node) {
 }
 
 static void emit_assignment(IREmitter *e, Node *node) {
-  Instruction *inst = instruction_new(OP_ASSIGN, node->span);
+  Instruction *inst = instruction_new(OP_ASSIGN, node);
   inst->assignee = node->assign.name;
 
   instruction_add_operands_from_node(e, inst, node->assign.value);
   emitter_add_instruction(e, inst);
 }
 
-static void emit_conditional(IREmitter *e, Node *node) {
-  LOG_FATAL("conditional translation to IR is not implemented yet");
+static void emit_jump(IREmitter *e, BasicBlock *target, Span span) {
+  BasicBlock *block = e->tail;
+  if (block->tail && IS_TERMINATOR(block->tail))
+    return;
+
+  Instruction *inst = instruction_create(OP_JMP, span, NULL);
+  instruction_add_operand(inst, target->tag, O_LABEL);
+  emitter_add_instruction(e, inst);
+  block_add_edge(block, target);
+}
+
+/* if <expr> { ... } [else { ... }]
+ *
+ * The condition ends the current block with `br cond, then`, the false edge
+ * leading to the else block if there is one, or to the join block. */
+static void emit_conditional(IREmitter *e, Node *node, Node *otherwise) {
+  if (!node->cond.expr)
+    LOG_FATAL("else without an if at line %d, col %d", node->span.line, node->span.col);
+
+  Instruction *br = instruction_new(OP_BR, node);
+  instruction_add_operands_from_node(e, br, node->cond.expr);
+
+  BasicBlock *cond = e->tail;
+  BasicBlock *then = emitter_new_block(e, "then");
+  BasicBlock *join = emitter_new_block(e, "join");
+  BasicBlock *other = otherwise ? emitter_new_block(e, "else") : join;
+
+  instruction_add_operand(br, then->tag, O_LABEL);
+  emitter_add_instruction(e, br);
+  block_add_edge(cond, then);
+  block_add_edge(cond, other);
+
+  emitter_append_block(e, then, false);
+  emit(e, node->cond.body);
+
+  if (otherwise) {
+    otherwise->visited = true;
+    emit_jump(e, join, otherwise->span);
+    emitter_append_block(e, other, false);
+    emit(e, otherwise->cond.body);
+  }
+
+  emitter_append_block(e, join, true);
 }
 
 static void emit_return(IREmitter *e, Node *node) {
-  Instruction *inst = instruction_new(OP_RET, node->span);
+  Instruction *inst = instruction_new(OP_RET, node);
 
   instruction_add_operands_from_node(e, inst, node->ret.value);
   emitter_add_instruction(e, inst);
 }
 
 static void emit_call(IREmitter *e, Node *node) {
-  LOG_FATAL("call translation to IR is not implemented yet");
+  /* Evaluate every argument before passing any of them, so the OP_ARGs
+   * always immediately precede their call */
+  int nargs = 0;
+  for (Node *arg = node->call.args; arg; arg = arg->next)
+    nargs++;
+
+  Instruction **args = calloc(nargs ? nargs : 1, sizeof(Instruction *));
+  if (!args)
+    LOG_FATAL("calloc failed in emit_call");
+
+  int i = 0;
+  for (Node *arg = node->call.args; arg; arg = arg->next) {
+    arg->visited = true;
+    args[i] = instruction_new(OP_ARG, arg);
+    instruction_add_operands_from_node(e, args[i], arg);
+    i++;
+  }
+
+  for (i = 0; i < nargs; i++)
+    emitter_add_instruction(e, args[i]);
+  free(args);
+
+  Instruction *inst = instruction_new(OP_CALL, node);
+  instruction_add_operand(inst, node->call.name, O_LABEL);
+  Value n = { .kind = VAL_INT, .i_val = nargs };
+  instruction_add_operand(inst, &n, O_VALUE);
+
+  if (node->type && node->type->kind != TY_VOID)
+    inst->assignee = emitter_make_temporary(e);
+  emitter_add_instruction(e, inst);
 }
 
 static void emit_unary_op(IREmitter *e, Node *node) {
-  Instruction *inst = instruction_new(node->unary.un_op, node->span);
+  Instruction *inst = instruction_new(node->unary.un_op, node);
 
   instruction_add_operands_from_node(e, inst, node->unary.expr);
 
@@ -231,28 +536,31 @@ static void emit_unary_op(IREmitter *e, Node *node) {
 }
 
 static void emit_binary_op(IREmitter *e, Node *node) {
-  Instruction *inst = instruction_new(node->binary.bin_op, node->span);
+  Instruction *inst = instruction_new(node->binary.bin_op, node);
 
   instruction_add_operands_from_node(e, inst, node->binary.lhs);
   instruction_add_operands_from_node(e, inst, node->binary.rhs);
 
+  /* Comparisons carry the type of their operands, the result is a bool */
+  if (node->binary.bin_op >= BIN_CMP && node->binary.bin_op <= BIN_CMP_GT_EQ)
+    inst->type = node->binary.lhs->type;
+
   /* NOTE: The line below relies on the operands created from above, do not move the order around */
   inst->assignee = emitter_make_temporary(e);
   emitter_add_instruction(e, inst);
 }
 
-static void emit(IREmitter *e, Node *node) {
-  if (!node) return;
-
+/* Emits a single node. Expression nodes must go through here since their
+ * `next` pointers are not meaningful (see pop_node). */
+static void emit_node(IREmitter *e, Node *node) {
   node->visited = true;
-  Node *next = node->next;
 
   switch (node->kind) {
     case ND_NOOP: free(node); break;
     case ND_FUNC_DECL: emit_function(e, node); break;
     case ND_VAR_DECL: emit_variable(e, node); break;
     case ND_ASSIGN_STMT: emit_assignment(e, node); break;
-    case ND_COND_STMT: emit_conditional(e, node); break;
+    case ND_COND_STMT: emit_conditional(e, node, NULL); break;
     case ND_RET_STMT: emit_return(e, node); break;
     case ND_CALL_EXPR: emit_call(e, node); break;
     case ND_UNARY_EXPR: emit_unary_op(e, node); break;
@@ -261,40 +569,93 @@ static void emit(IREmitter *e, Node *node) {
     case ND_REF_EXPR:
     default: LOG_FATAL("cannot emit IR from node: %d", node->kind);
   }
+}
+
+/* Emits a list of statements */
+static void emit(IREmitter *e, Node *node) {
+  while (node) {
+    Node *next = node->next;
+
+    /* An else block belongs to the if statement right before it */
+    if (node->kind == ND_COND_STMT && next && next->kind == ND_COND_STMT && !next->cond.expr) {
+      node->visited = true;
+      emit_conditional(e, node, next);
+      next = next->next;
+    } else {
+      emit_node(e, node);
+    }
+    node = next;
+  }
+}
 
-  emit(e, next);
+static bool is_global(const char *name) {
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)name, strlen(name));
+  return symbol && symbol->kind == SYM_VAR;
 }
 
-void calculate_live_intervals(IREmitter *e) {
+/* Computes live intervals for every assignment. When `eliminate` is set,
+ * assignments whose value is never used afterwards are marked as dead
+ * (OP_DEAD) instead. Globals may be read by any function called later or
+ * returned to, so they are live at every call, return & function end: a
+ * store to a global lives at least until the end of its function. */
+static void analyze_liveness(BasicBlock *prog, bool eliminate) {
   HashMap live;
   hashmap_init(&live);
 
-  BasicBlock *block = e->tail;
+  int pc = 0;
+  BasicBlock *block = prog, *last = NULL;
+  while (block) {
+    for (Instruction *inst = block->head; inst; inst = inst->next)
+      pc++;
+    last = block;
+    block = block->next;
+  }
+
+  /* NOTE: positions are stored off by one so that pc 0 is not a NULL entry */
+  int function_end = -1;
+  block = last;
   while (block) {
     Instruction *inst = block->tail;
     while (inst) {
-      e->pc--;
+      pc--;
+      if (function_end < 0)
+        function_end = pc;
+
+      if (inst->opcode == OP_DEAD)
+        goto next;
 
       if (inst->assignee) {
-        int end = (int)hashmap_lookup(&live, inst->assignee);
-        if (e->pc > end) {
+        int end = (int)(intptr_t)hashmap_lookup(&live, inst->assignee) - 1;
+        if (end < function_end && is_global(inst->assignee))
+          end = function_end;
+
+        if (pc > end && !eliminate) {
+          end = pc;
+        } else if (pc > end && inst->opcode == OP_CALL) {
+          /* Calls may have side effects, only their result is dropped */
+          inst->assignee = NULL;
+          goto uses;
+        } else if (pc > end) {
           inst->opcode = OP_DEAD;
           LOG_TRACE("dead variable '%s' at line %d, col %d",
               inst->assignee, inst->span.line, inst->span.col);
           goto next;
         }
 
-        inst->start = e->pc;
+        inst->start = pc;
         inst->end = end;
       }
 
+uses:
       for (int i = 0; i < inst->nopers; i++) {
         if (IS_VARIABLE(inst->operands[i]) && !hashmap_lookup(&live, inst->operands[i].var)) {
-          hashmap_insert(&live, inst->operands[i].var, (void *)e->pc);
+          hashmap_insert(&live, inst->operands[i].var, (void *)(intptr_t)(pc + 1));
         }
       }
 
 next:
+      if (inst->opcode == OP_DEF)
+        function_end = -1;
       inst = inst->prev;
     }
 
@@ -304,17 +665,24 @@ next:
   hashmap_free(&live);
 }
 
-BasicBlock *lower_to_ir(Node *node) {
+void compute_liveness(BasicBlock *prog) {
+  analyze_liveness(prog, false);
+}
+
+void eliminate_dead_code(BasicBlock *prog) {
+  analyze_liveness(prog, true);
+}
+
+BasicBlock *lower_to_ir(Node **functions, size_t nfunctions, bool cse) {
   IREmitter e;
   emitter_init(&e);
+  e.cse = cse;
 
   /* Create basic blocks */
-  emitter_add_block(&e, "$entry");
-  emit(&e, node);
-  emitter_add_block(&e, "$exit");
-
-  /* Do liveness analysis */
-  calculate_live_intervals(&e);
+  emitter_add_block(&e, "$entry", false);
+  for (size_t i = 0; i < nfunctions; i++)
+    emit_node(&e, functions[i]);
+  emitter_add_block(&e, "$exit", true);
 
   emitter_deinit(&e);
   return e.head;
@@ -343,17 +711,46 @@ void dump_instruction(Instruction *inst) {
       dump_operand(&inst->operands[0]);
       break;
     case OP_ASSIGN:
-      assert(inst->nopers == 1);
       printf("  %s := ", inst->assignee);
+      if (inst->nopers)
+        dump_operand(&inst->operands[0]);
+      else
+        printf("undef");
+      break;
+    case OP_PARAM:
+      assert(inst->nopers == 1);
+      printf("  %s := param ", inst->assignee);
+      dump_operand(&inst->operands[0]);
+      break;
+    case OP_ARG:
+      assert(inst->nopers == 1);
+      printf("  arg ");
       dump_operand(&inst->operands[0]);
       break;
+    case OP_CALL:
+      assert(inst->nopers == 2);
+      if (inst->assignee)
+        printf("  %s := call ", inst->assignee);
+      else
+        printf("  call ");
+      dump_operand(&inst->operands[0]);
+      printf(", ");
+      dump_operand(&inst->operands[1]);
+      break;
     case OP_NEG:
     case OP_NOT:
+    case OP_DEREF:
+    case OP_ADDR:
       assert(inst->nopers == 1);
       printf("  %s := ", inst->assignee);
       printf(OPCODES[inst->opcode]);
       dump_operand(&inst->operands[0]);
       break;
+    case OP_CONV:
+      assert(inst->nopers == 1);
+      printf("  %s := (%s) ", inst->assignee, inst->type->name);
+      dump_operand(&inst->operands[0]);
+      break;
     case OP_ADD: // Binary Ops
     case OP_SUB:
     case OP_MUL:
@@ -364,12 +761,29 @@ void dump_instruction(Instruction *inst) {
     case OP_CMP_GT:
     case OP_CMP_LT_EQ:
     case OP_CMP_GT_EQ:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_SAR:
+    case OP_MULHI:
+    case OP_UMULHI:
       assert(inst->nopers == 2);
       printf("  %s := ", inst->assignee);
       dump_operand(&inst->operands[0]);
       printf(OPCODES[inst->opcode]);
       dump_operand(&inst->operands[1]);
       break;
+    case OP_JMP:
+      assert(inst->nopers == 1);
+      printf("  jmp ");
+      dump_operand(&inst->operands[0]);
+      break;
+    case OP_BR:
+      assert(inst->nopers == 2);
+      printf("  br ");
+      dump_operand(&inst->operands[0]);
+      printf(", ");
+      dump_operand(&inst->operands[1]);
+      break;
     case OP_RET:
       assert(inst->nopers == 1);
       printf("  ret ");
@@ -0,0 +1,109 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "util.h"
+
+/* In-process execution: the sections of the object file are laid out in a
+ * single mapping so every PC-relative reference stays within 32 bits. The
+ * mapping is writable while it is loaded & relocated, then code is flipped
+ * to read/execute. */
+
+static size_t align_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  size_t offsets[NUM_SECTIONS];  /* Of every section, from base */
+  size_t code_size;              /* .text & the read-only data, mapped read-only */
+} Image;
+
+static void load_image(Image *image, ObjectFile *obj) {
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  /* Read-only sections first, so one mprotect covers them */
+  static const SectionID ORDER[NUM_SECTIONS] = { SEC_TEXT, SEC_RODATA, SEC_RODATA_STR, SEC_DATA, SEC_BSS };
+  size_t size = 0;
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    Section *section = &obj->sections[ORDER[i]];
+    if (ORDER[i] == SEC_DATA)
+      size = image->code_size = align_up(size, page);
+
+    size = align_up(size, section->align ? section->align : 1);
+    image->offsets[ORDER[i]] = size;
+    size += section->size;
+  }
+  image->size = align_up(size ? size : 1, page);
+
+  image->base = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (image->base == MAP_FAILED)
+    LOG_FATAL("mmap failed in load_image");
+
+  /* .bss is already zeroed by the anonymous mapping */
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    Section *section = &obj->sections[i];
+    if (section->data)
+      memcpy(image->base + image->offsets[i], section->data, section->size);
+  }
+}
+
+static uint8_t *symbol_address(Image *image, ObjectFile *obj, int index) {
+  ObjSymbol *symbol = &obj->symbols[index];
+  if (symbol->section == SECTION_UNDEF)
+    LOG_FATAL("undefined symbol '%s'", symbol->name);
+  return image->base + image->offsets[symbol->section] + symbol->offset;
+}
+
+static void relocate_image(Image *image, ObjectFile *obj) {
+  for (size_t i = 0; i < obj->nrelocs; i++) {
+    Relocation *r = &obj->relocs[i];
+    uint8_t *place = image->base + image->offsets[r->section] + r->offset;
+    if (r->kind == RELOC_ABS64) {
+      uint8_t *address = symbol_address(image, obj, r->symbol) + r->addend;
+      memcpy(place, &address, sizeof(address));
+      continue;
+    }
+
+    /* Both kinds are S + A - P, calls never go through a PLT here */
+    int64_t value = (int64_t)(symbol_address(image, obj, r->symbol) - place) + r->addend;
+    if (value < INT32_MIN || value > INT32_MAX)
+      LOG_FATAL("relocation against '%s' is out of range", obj->symbols[r->symbol].name);
+
+    int32_t rel = (int32_t)value;
+    memcpy(place, &rel, sizeof(rel));
+  }
+}
+
+int jit_run(ObjectFile *obj, const char *entry, bool returns_void) {
+  int index = (int)(intptr_t)hashmap_lookup(&obj->symbol_index, entry) - 1;
+  if (index < 0 || obj->symbols[index].section != SEC_TEXT)
+    LOG_FATAL("entry point '%s' is not defined", entry);
+
+  Image image = { 0 };
+  load_image(&image, obj);
+  relocate_image(&image, obj);
+
+  if (image.code_size && mprotect(image.base, image.code_size, PROT_READ | PROT_EXEC) != 0)
+    LOG_FATAL("mprotect failed in jit_run");
+
+  /* The program may leave through the exit syscall, skipping stdio */
+  fflush(stdout);
+  fflush(stderr);
+
+  int (*fn)(void);
+  uint8_t *address = symbol_address(&image, obj, index);
+  memcpy(&fn, &address, sizeof(fn));
+  int status = fn();
+  if (returns_void)
+    status = 0;
+
+  munmap(image.base, image.size);
+  return status;
+}
@@ -135,11 +135,24 @@ static Token *lex_alpha() {
   return tok;
 }
 
-/* TODO: add support for binary/octal/hexadecimal numbers & floating point numbers */
+/* TODO: add support for binary/octal/hexadecimal numbers */
 static Token *lex_number() {
   Token *tok = token_new(TOK_NUMBER);
 
   while (match_pattern(is_numeric));
+
+  /* Floating point numbers have a fraction and/or an exponent */
+  if (peek() == '.' && is_numeric(p[1])) {
+    next();
+    while (match_pattern(is_numeric));
+  }
+  if ((peek() == 'e' || peek() == 'E')
+      && (is_numeric(p[1]) || ((p[1] == '+' || p[1] == '-') && is_numeric(p[2])))) {
+    next();
+    if (!match('+'))
+      match('-');
+    while (match_pattern(is_numeric));
+  }
   tok->len = p - start;
 
   return tok;
@@ -224,7 +237,9 @@ Token *lex(File *file) {
     }
 
     /* Skip comments */
-    if (match('/')) {
+    if (c == '/' && (p[1] == '/' || p[1] == '*')) {
+      next();
+
       /* Single-line */
       if (match('/')) {
         for (;;) {
@@ -1,21 +1,32 @@
+#define _DEFAULT_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "ast.h"
+#include "callgraph.h"
 #include "codegen.h"
 #include "compiler.h"
 #include "lex.h"
 #include "ir.h"
-#include "optimize.h"
+#include "jit.h"
 #include "parse.h"
+#include "pass.h"
+#include "profile.h"
+#include "strpool.h"
 #include "symtab.h"
 #include "types.h"
 #include "util.h"
+#include "vm.h"
+#include "x86_64.h"
 
 #define NEO_VERSION "0.1.0"
 
@@ -23,32 +34,73 @@
 #define DUMP_AST      (1 << 2)
 #define DUMP_SYMBOLS  (1 << 3)
 #define DUMP_IR       (1 << 4)
+#define DUMP_ASM      (1 << 5)
+#define DUMP_BYTECODE (1 << 6)
 
-#define DEFAULT_FEATURES (CONSTANT_FOLDING)
+#define FEATURE_OMIT_FRAME_POINTER (1 << 0)
+#define FEATURE_PROFILE_CYCLES     (1 << 1)
 
-typedef struct {
-  char *name;
-  int val;
-} Feature;
+#define DEFAULT_FEATURES 0
+
+typedef enum {
+  TARGET_X86_64,         /* Native code, assembled & linked by neo (default) */
+  TARGET_C               /* C99 source, compiled by the system C compiler */
+} TargetKind;
 
 typedef struct {
   int dflags;
   int fflags;
+  int opt_level;
+  RegAllocKind regalloc;
 
   char *output;
+  bool output_set;
+  bool assembly;         /* -S: write NASM source instead of a binary */
 
   char **sources;
   size_t nsources;
 
   bool verbose;
+  bool time_passes;
+  bool run;              /* --run: execute in memory instead of linking */
+  bool interp;           /* --interp: execute with the bytecode interpreter */
+  char *assembler;       /* --assembler: external assembler, NULL for the built-in one */
+  TargetKind target;     /* --target */
+
+  char *profile_generate; /* -fprofile-generate: where the program writes its profile */
+  char *profile_use;      /* -fprofile-use: profile to optimize with */
 } CompilerOpts;
 
-#define OPTSTRING "d:f:o:v"
+/* Options of -f besides the pass toggles. A name ending with '=' takes the
+ * rest of the argument as its value; the others toggle `val` in fflags
+ * unless they have a setter */
+typedef struct {
+  char *name;
+  char *value;           /* Placeholder for the value in the listing */
+  int val;
+  void (*set)(CompilerOpts *opts, const char *value);
+  char *description;
+} Feature;
+
+enum {
+  OPT_TIME_PASSES = 256,
+  OPT_RUN,
+  OPT_ASSEMBLER,
+  OPT_TARGET,
+  OPT_INTERP,
+};
+
+#define OPTSTRING "d:f:o:vO:S"
 static struct option long_options[] = {
   {"dump", required_argument, 0, 'd'},
   {"feature", required_argument, 0, 'f'},
   {"output", required_argument, 0, 'o'},
   {"verbose", no_argument, 0, 'v'},
+  {"time-passes", no_argument, 0, OPT_TIME_PASSES},
+  {"run", no_argument, 0, OPT_RUN},
+  {"assembler", required_argument, 0, OPT_ASSEMBLER},
+  {"target", required_argument, 0, OPT_TARGET},
+  {"interp", no_argument, 0, OPT_INTERP},
   {0, 0, 0, 0}
 };
 
@@ -58,35 +110,101 @@ void set_dump_flag(int *dflags, const char *arg) {
     [DUMP_AST] = "ast",
     [DUMP_SYMBOLS] = "sym",
     [DUMP_IR] = "ir",
+    [DUMP_ASM] = "asm",
+    [DUMP_BYTECODE] = "bc",
   };
 
-  for (int i = DUMP_TOKENS; i <= DUMP_IR; i <<= 1) {
+  for (int i = DUMP_TOKENS; i <= DUMP_BYTECODE; i <<= 1) {
     if (strcmp(arg, dump_map[i]) == 0)
       *dflags |= i;
   }
 }
 
-void set_feature_flag(int *fflags, const char *arg) {
-  static const Feature feature_map[] = {
-    {"no-fold", CONSTANT_FOLDING},
-    {NULL, 0},
-  };
+static void set_regalloc(CompilerOpts *opts, const char *arg) {
+  if (strcmp(arg, "linear") == 0)
+    opts->regalloc = REGALLOC_LINEAR;
+  else if (strcmp(arg, "graph") == 0)
+    opts->regalloc = REGALLOC_GRAPH;
+  else
+    LOG_FATAL("unknown register allocator '%s' (expected 'linear' or 'graph')", arg);
+}
+
+/* Without a file, the profile goes next to the binary */
+static void set_profile_generate(CompilerOpts *opts, const char *arg) {
+  opts->profile_generate = (char *)arg;
+}
+
+static void set_profile_use(CompilerOpts *opts, const char *arg) {
+  opts->profile_use = (char *)arg;
+}
+
+static const Feature feature_map[] = {
+  {"regalloc=", "linear|graph", 0, set_regalloc, "register allocator"},
+  {"profile-generate", NULL, 0, set_profile_generate, "instrument the binary to write a profile"},
+  {"profile-generate=", "FILE", 0, set_profile_generate, "instrument the binary to write FILE"},
+  {"profile-use=", "FILE", 0, set_profile_use, "optimize with the profile in FILE"},
+  {"omit-frame-pointer", NULL, FEATURE_OMIT_FRAME_POINTER, NULL, "don't chain frames through rbp"},
+  {"profile-cycles", NULL, FEATURE_PROFILE_CYCLES, NULL, "count the cycles spent in each function"},
+  {NULL, NULL, 0, NULL, NULL},
+};
 
+void set_feature_flag(CompilerOpts *opts, const char *arg) {
   for (const Feature *f = feature_map; f->name; f++) {
-    if (strcmp(arg, f->name) == 0)
-      *fflags ^= f->val;
+    size_t len = strlen(f->name);
+    bool takes_value = f->name[len - 1] == '=';
+    if (takes_value ? strncmp(arg, f->name, len) != 0 : strcmp(arg, f->name) != 0)
+      continue;
+
+    if (f->set)
+      f->set(opts, arg + len);
+    else
+      opts->fflags ^= f->val;
+    return;
   }
+
+  /* Optimization passes are toggled by name through the pass manager */
+  if (passes_toggle(arg))
+    return;
+
+  LOG_WARN("unknown feature '%s', available options & passes are:", arg);
+  for (const Feature *f = feature_map; f->name; f++) {
+    char *name = format("%s%s", f->name, f->value ? f->value : "");
+    fprintf(stderr, "  %-22s %s\n", name, f->description);
+    free(name);
+  }
+  passes_list();
+}
+
+static int parse_opt_level(const char *arg) {
+  if (strlen(arg) != 1 || arg[0] < '0' || arg[0] > '0' + MAX_OPT_LEVEL)
+    LOG_FATAL("invalid optimization level '-O%s' (expected -O0 to -O%d)", arg, MAX_OPT_LEVEL);
+  return arg[0] - '0';
 }
 
 static CompilerOpts parse_opts(int argc, char **argv) {
   CompilerOpts opts = {
     .dflags = 0,
     .fflags = DEFAULT_FEATURES,
+    .opt_level = DEFAULT_OPT_LEVEL,
     .output = "a.out",
     .sources = NULL,
     .nsources = 0,
   };
 
+  /* The optimization level decides which passes -f toggles start from */
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-O") == 0 && i + 1 < argc)
+      opts.opt_level = parse_opt_level(argv[i + 1]);
+    else if (strncmp(argv[i], "-O", 2) == 0)
+      opts.opt_level = parse_opt_level(argv[i] + 2);
+    else if (strcmp(argv[i], "--time-passes") == 0)
+      opts.time_passes = true;
+  }
+  passes_init(opts.opt_level, opts.time_passes);
+
+  /* Graph coloring pays off at -O2, linear scan is the fast default */
+  opts.regalloc = opts.opt_level >= 2 ? REGALLOC_GRAPH : REGALLOC_LINEAR;
+
   int c, idx;
   while ((c = getopt_long(argc, argv, OPTSTRING, long_options, &idx)) != -1) {
     switch (c) {
@@ -94,10 +212,36 @@ static CompilerOpts parse_opts(int argc, char **argv) {
         set_dump_flag(&opts.dflags, optarg);
         break;
       case 'f':
-        set_feature_flag(&opts.fflags, optarg);
+        set_feature_flag(&opts, optarg);
+        break;
+      case 'O':
+      case OPT_TIME_PASSES:
         break;
       case 'o':
         opts.output = optarg;
+        opts.output_set = true;
+        break;
+      case 'S':
+        opts.assembly = true;
+        break;
+      case OPT_RUN:
+        opts.run = true;
+        break;
+      case OPT_INTERP:
+        opts.interp = true;
+        break;
+      case OPT_ASSEMBLER:
+        if (strcmp(optarg, "nasm") != 0 && strcmp(optarg, "as") != 0)
+          LOG_FATAL("unknown assembler '%s' (expected 'nasm' or 'as')", optarg);
+        opts.assembler = optarg;
+        break;
+      case OPT_TARGET:
+        if (strcmp(optarg, "x86_64") == 0)
+          opts.target = TARGET_X86_64;
+        else if (strcmp(optarg, "c") == 0)
+          opts.target = TARGET_C;
+        else
+          LOG_FATAL("unknown target '%s' (expected 'x86_64' or 'c')", optarg);
         break;
       case 'v':
         opts.verbose = true;
@@ -119,6 +263,13 @@ static CompilerOpts parse_opts(int argc, char **argv) {
   for (int i = optind; i < argc; i++)
     opts.sources[opts.nsources++] = argv[i];
 
+  /* Counters are only written out by the _start of native binaries */
+  bool native = !opts.run && !opts.interp && opts.target != TARGET_C;
+  if (opts.profile_generate && !native)
+    LOG_FATAL("-fprofile-generate needs a native binary, not --run, --interp or --target=c");
+  if ((opts.fflags & FEATURE_PROFILE_CYCLES) && !native)
+    LOG_FATAL("-fprofile-cycles needs a native binary, not --run, --interp or --target=c");
+
   return opts;
 }
 
@@ -126,14 +277,6 @@ void dump_symbols() {
   hashmap_foreach(&SYMTAB.symbols, print_symbols);
 }
 
-void assemble_target(char *obj_filepath) {
-  char *asm_prog = "nasm";
-  char *const asm_args[] = { asm_prog, "-felf64", "-o", obj_filepath, BUILD_ARTIFACT, NULL };
-  spawn_subprocess(asm_prog, asm_args);
-  LOG_INFO("finished assembling target.");
-  LOG_INFO("created object file: %s", obj_filepath);
-}
-
 void link_target(char *obj_filepath, char *outpath) {
   char *link_prog = "ld";
   char *const link_args[] = { link_prog, "-o", outpath, obj_filepath, NULL };
@@ -142,6 +285,37 @@ void link_target(char *obj_filepath, char *outpath) {
   LOG_INFO("created binary: %s", outpath);
 }
 
+/* Streams the listing into the assembler's stdin, so it assembles while the
+ * listing is still being written instead of after a round trip to disk */
+static void assemble_external(MProgram *mp, char *assembler, char *obj_filepath) {
+  char *const nasm_args[] = { "nasm", "-felf64", "-o", obj_filepath, "-", NULL };
+  char *const as_args[] = { "as", "--64", "-o", obj_filepath, NULL };
+  bool nasm = strcmp(assembler, "nasm") == 0;
+
+  int fd;
+  pid_t pid = spawn_pipe(assembler, nasm ? nasm_args : as_args, &fd);
+  if (pid < 0)
+    LOG_FATAL("couldn't start assembler '%s': %s", assembler, strerror(errno));
+
+  /* An assembler exiting early is reported by its status, not by SIGPIPE:
+   * the listing stops at the closed pipe & its error goes to the terminal */
+  void (*handler)(int) = signal(SIGPIPE, SIG_IGN);
+  ssize_t written = nasm ? nasm_x86_64_emit(mp, fd) : gas_x86_64_emit(mp, fd);
+  close(fd);
+  signal(SIGPIPE, handler);
+
+  int status = wait_subprocess(pid);
+  if (status < 0)
+    LOG_FATAL("couldn't wait for assembler '%s': %s", assembler, strerror(errno));
+  if (WIFSIGNALED(status))
+    LOG_FATAL("assembler '%s' was killed by signal %d", assembler, WTERMSIG(status));
+  if (WEXITSTATUS(status) != 0)
+    LOG_FATAL("assembler '%s' failed with exit status %d", assembler, WEXITSTATUS(status));
+  if (written < 0)
+    LOG_FATAL("assembler '%s' exited before reading all of the assembly", assembler);
+  LOG_INFO("finished assembling with %s.", assembler);
+}
+
 char *change_extension(char *filename, char *new_extension) {
   char *curr_extension = NULL;
   size_t filename_len = strlen(filename);
@@ -161,6 +335,57 @@ char *change_extension(char *filename, char *new_extension) {
   return result;
 }
 
+static void write_assembly(MProgram *mp, const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    LOG_FATAL("couldn't open outfile '%s' for writing: %s", path, strerror(errno));
+
+  nasm_x86_64_emit(mp, fd);
+  close(fd);
+
+  LOG_INFO("created assembly file: %s", path);
+}
+
+/* With --target=c the program is written as C, & unless only the source is
+ * asked for with -S, compiled by the system C compiler which does the
+ * optimizing & linking */
+static void build_c(BasicBlock *prog, CompilerOpts *opts) {
+  if (opts->run)
+    LOG_FATAL("--run needs the x86_64 target");
+
+  char c_filepath[] = "/tmp/neo-XXXXXX.c";
+  char *path = c_filepath;
+  if (opts->assembly) {
+    path = opts->output_set ? opts->output : change_extension(opts->sources[0], ".c");
+  } else {
+    int fd = mkstemps(c_filepath, 2);
+    if (fd < 0)
+      LOG_FATAL("couldn't create C file: %s", strerror(errno));
+    close(fd);
+  }
+
+  FILE *file = fopen(path, "w");
+  if (!file)
+    LOG_FATAL("couldn't open outfile '%s' for writing: %s", path, strerror(errno));
+  c_generate(prog, file);
+  fclose(file);
+  LOG_INFO("created C file: %s", path);
+
+  if (opts->assembly) {
+    if (path != opts->output)
+      free(path);
+    return;
+  }
+
+  char *cc_prog = "cc";
+  char *const cc_args[] = { cc_prog, "-std=c99", "-O2", "-o", opts->output, c_filepath, NULL };
+  int status = spawn_subprocess(cc_prog, cc_args);
+  unlink(c_filepath);
+  if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    LOG_FATAL("C compiler '%s' failed", cc_prog);
+  LOG_INFO("created binary: %s", opts->output);
+}
+
 void cleanup() {
 }
 
@@ -174,6 +399,9 @@ void init_globals(CompilerOpts *opts) {
   SYMTAB.parent = NULL;
   hashmap_init(&SYMTAB.symbols);
 
+  /* String literals of every unit go into one pool */
+  strpool_init(&STRINGS);
+
   /* Add primitive data types to global scope */
   for (TypeKind ty = TY_VOID; ty <= TY_BOOL; ty++) {
     const Type *primitive = &PRIMITIVES[ty];
@@ -184,6 +412,51 @@ void init_globals(CompilerOpts *opts) {
   }
 }
 
+/* Collects the functions reachable from the entry point, entry point first */
+static Node **collect_functions(CompilerOpts *opts, CallGraph *cg, Node *entry, size_t *nfunctions) {
+  Node **functions = calloc(cg->nodes.size ? cg->nodes.size : 1, sizeof(Node *));
+  if (!functions)
+    LOG_FATAL("calloc failed in collect_functions");
+
+  functions[0] = entry;
+  *nfunctions = 1;
+  for (size_t id = 0; id < opts->nsources; id++) {
+    for (Node *node = units[id].ast; node; node = node->next) {
+      if (node->kind != ND_FUNC_DECL || node == entry)
+        continue;
+
+      CallGraphNode *cgn = callgraph_lookup(cg, node->func.name);
+      if (cgn && cgn->reachable)
+        functions[(*nfunctions)++] = node;
+    }
+  }
+  return functions;
+}
+
+/* Lists the functions & globals that did not make it into the program */
+static void report_eliminated(CompilerOpts *opts, CallGraph *cg, BasicBlock *prog) {
+  HashMap emitted;
+  hashmap_init(&emitted);
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (IS_FUNCTION_ENTRY(block))
+      hashmap_insert(&emitted, block->head->operands[0].label, block);
+  }
+
+  for (size_t id = 0; id < opts->nsources; id++) {
+    for (Node *node = units[id].ast; node; node = node->next) {
+      if (node->kind == ND_FUNC_DECL && !hashmap_lookup(&emitted, node->func.name)) {
+        CallGraphNode *cgn = callgraph_lookup(cg, node->func.name);
+        LOG_INFO("eliminated function '%s' (%s)", node->func.name,
+            cgn && cgn->reachable ? "inlined into every caller" : "unreachable from main");
+      } else if (node->kind == ND_VAR_DECL && !node->visited) {
+        LOG_INFO("eliminated global '%s' (unreferenced)", node->var.name);
+      }
+    }
+  }
+
+  hashmap_free(&emitted);
+}
+
 int main(int argc, char **argv) {
   atexit(cleanup);
   CompilerOpts opts = parse_opts(argc, argv);
@@ -198,18 +471,21 @@ int main(int argc, char **argv) {
     file_open(&unit->file, filepath, id);
 
     /* Lexing */
+    double start = timer_now();
     Token *tokens = lex(&unit->file);
+    record_phase("lex", start);
     if (opts.dflags & DUMP_TOKENS)
       dump_tokens(tokens);
 
     /* Parsing */
+    start = timer_now();
     unit->ast = parse(&unit->file, tokens);
+    record_phase("parse", start);
     if (opts.dflags & DUMP_AST)
       dump_node(unit->ast, 0);
 
-    /* Constant folding optimization */
-    if (opts.fflags & CONSTANT_FOLDING)
-      fold_constants(unit->ast);
+    /* AST optimizations */
+    run_ast_passes(unit->ast);
 
     /* Free file contents & tokens */
     free_tokens(tokens);
@@ -226,7 +502,45 @@ int main(int argc, char **argv) {
     LOG_FATAL("symbol 'main' is not a function!");
 
   /* Control flow analysis */
-  BasicBlock *prog = lower_to_ir(entry_point->node);
+  double start = timer_now();
+  CallGraph cg;
+  callgraph_build_ast(&cg, units, opts.nsources);
+  callgraph_mark_reachable(&cg, "main");
+
+  size_t nfunctions = 0;
+  Node **functions = collect_functions(&opts, &cg, entry_point->node, &nfunctions);
+  BasicBlock *prog = lower_to_ir(functions, nfunctions, pass_enabled("cse"));
+  free(functions);
+  record_phase("lower", start);
+
+  /* Profiles describe the program as lowered, before any optimization. The
+   * counts read from one are kept by the IR from then on. */
+  Profile profile = { 0 };
+  if (opts.profile_use) {
+    start = timer_now();
+    profile_read(&profile, opts.profile_use);
+    profile_annotate(prog, &profile);
+    profile_free(&profile);
+    record_phase("profile", start);
+  } else if (opts.profile_generate) {
+    start = timer_now();
+    if (!*opts.profile_generate)
+      opts.profile_generate = change_extension(opts.output, ".neoprof");
+    profile_instrument(prog, &profile);
+    record_phase("profile", start);
+  }
+
+  /* IR optimizations */
+  run_ir_passes(prog);
+
+  if (opts.verbose)
+    report_eliminated(&opts, &cg, prog);
+  callgraph_free(&cg);
+
+  /* Liveness analysis */
+  start = timer_now();
+  compute_liveness(prog);
+  record_phase("liveness", start);
 
   if (opts.dflags & DUMP_IR)
     dump_ir(prog);
@@ -238,35 +552,118 @@ int main(int argc, char **argv) {
     warn_unused(unit->ast);
   }
 
+  if (opts.interp) {
+    start = timer_now();
+    VMProgram vp;
+    vm_compile(prog, &vp);
+    record_phase("bytecode", start);
+
+    if (opts.dflags & DUMP_BYTECODE) {
+      vm_dump(&vp);
+      fflush(stdout);
+    }
+    free(opts.sources);
+
+    start = timer_now();
+    int status = vm_run(&vp, "main");
+    record_phase("interp", start);
+    vm_free(&vp);
+
+    if (opts.time_passes)
+      print_pass_timings();
+    return status;
+  }
+
+  if (opts.target == TARGET_C) {
+    start = timer_now();
+    build_c(prog, &opts);
+    record_phase("codegen", start);
+
+    if (opts.time_passes)
+      print_pass_timings();
+    free(opts.sources);
+    return 0;
+  }
+
   /* Codegen */
-  Target target = nasm_x86_64_generate(prog);
+  start = timer_now();
+  CodegenOptions codegen = {
+    .regalloc = opts.regalloc,
+    /* Arms folded into a select would not be counted */
+    .select = pass_enabled("select") && !opts.profile_generate,
+    .omit_frame_pointer = opts.fflags & FEATURE_OMIT_FRAME_POINTER,
+    .profile_cycles = opts.fflags & FEATURE_PROFILE_CYCLES,
+    .profile = opts.profile_generate ? &profile : NULL,
+    .profile_path = opts.profile_generate,
+  };
+  MProgram mp = x86_64_generate(prog, codegen);
+  record_phase("codegen", start);
+  profile_free(&profile);
+
+  if (pass_enabled("peephole")) {
+    start = timer_now();
+    x86_64_peephole(&mp);
+    record_phase("peephole", start);
+  }
 
 #ifdef DEBUG
-  printf("GENERATED CODE:\n%.*s", (int)target.code_size, target.code);
+  printf("GENERATED CODE:\n");
+  opts.dflags |= DUMP_ASM;
 #endif
 
-  FILE *outfile = fopen(BUILD_ARTIFACT, "w");
-  if (!outfile) {
-    LOG_FATAL("couldn't open outfile '%s' for writing: %s",
-        BUILD_ARTIFACT, strerror(errno));
+  if (opts.dflags & DUMP_ASM) {
+    fflush(stdout);
+    nasm_x86_64_emit(&mp, STDOUT_FILENO);
   }
 
-  LOG_INFO("created temporary file: '%s'", BUILD_ARTIFACT);
+  if (opts.assembly) {
+    char *asm_filepath = opts.output_set ? opts.output : change_extension(opts.sources[0], ".asm");
+    write_assembly(&mp, asm_filepath);
+    if (asm_filepath != opts.output)
+      free(asm_filepath);
+  } else if (opts.run) {
+    ObjectFile obj;
+    x86_64_encode(&mp, &obj);
+    mprogram_free(&mp);
+    free(opts.sources);
+
+    start = timer_now();
+    int status = jit_run(&obj, "main", entry_point->node->func.return_type->kind == TY_VOID);
+    record_phase("run", start);
+    object_free(&obj);
+
+    if (opts.time_passes)
+      print_pass_timings();
+    return status;
+  } else {
+    /* A unique object file keeps concurrent builds from clobbering each other */
+    char obj_filepath[] = "/tmp/neo-XXXXXX.o";
+    int obj_fd = mkstemps(obj_filepath, 2);
+    if (obj_fd < 0)
+      LOG_FATAL("couldn't create object file: %s", strerror(errno));
+    close(obj_fd);
+
+    start = timer_now();
+    if (opts.assembler) {
+      assemble_external(&mp, opts.assembler, obj_filepath);
+    } else {
+      ObjectFile obj;
+      x86_64_encode(&mp, &obj);
+      object_write_elf64(&obj, obj_filepath);
+      object_free(&obj);
+    }
+    record_phase("assemble", start);
+    LOG_INFO("created object file: %s", obj_filepath);
 
-  size_t nwritten = fwrite(target.code, sizeof(char), target.code_size, outfile);
-  if (nwritten != target.code_size) {
-    LOG_FATAL("only wrote %zu/%zu bytes of code to '%s': %s",
-        nwritten, target.code_size, BUILD_ARTIFACT, strerror(errno));
+    start = timer_now();
+    link_target(obj_filepath, opts.output);
+    record_phase("link", start);
+    unlink(obj_filepath);
   }
-  fclose(outfile);
-
-  char *obj_filepath = change_extension(opts.output, ".o");
-
-  assemble_target(obj_filepath);
-  link_target(obj_filepath, opts.output);
-  free(obj_filepath);
+  mprogram_free(&mp);
 
-  unlink(BUILD_ARTIFACT);
+  if (opts.time_passes)
+    print_pass_timings();
 
   free(opts.sources);
 
@@ -0,0 +1,524 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "x86_64.h"
+
+/* NASM x86_64 (Linux), and the GNU as dialect of the same listing for
+ * streaming into `as` (--assembler=as)
+ *
+ * The listing is rendered without any printf-style formatting: mnemonics &
+ * register names are pre-rendered strings, integers go through a small
+ * formatter, and the text accumulates in fixed-size chunks that are handed
+ * to writev a batch at a time. */
+
+typedef struct {
+  const char *s;
+  size_t len;
+} Str;
+
+#define STR(s) { s, sizeof(s) - 1 }
+
+/* Mnemonics, with the separator from the first operand */
+static const Str MNEMONICS[NUM_MOPCODES] = {
+  [MI_MOV]       = STR("mov "),
+  [MI_MOVSXD]    = STR("movsxd "),
+  [MI_LEA]       = STR("lea "),
+  [MI_ADD]       = STR("add "),
+  [MI_SUB]       = STR("sub "),
+  [MI_XOR]       = STR("xor "),
+  [MI_INC]       = STR("inc "),
+  [MI_DEC]       = STR("dec "),
+  [MI_IMUL]      = STR("imul "),
+  [MI_IDIV]      = STR("idiv "),
+  [MI_DIV]       = STR("div "),
+  [MI_CDQ]       = STR("cdq "),
+  [MI_SHL]       = STR("shl "),
+  [MI_SHR]       = STR("shr "),
+  [MI_SAR]       = STR("sar "),
+  [MI_PUSH]      = STR("push "),
+  [MI_POP]       = STR("pop "),
+  [MI_SYSCALL]   = STR("syscall "),
+  [MI_RDTSC]     = STR("rdtsc "),
+  [MI_RDTSCP]    = STR("rdtscp "),
+  [MI_CMP]       = STR("cmp "),
+  [MI_TEST]      = STR("test "),
+  [MI_MOVZX]     = STR("movzx "),
+  [MI_MOVSX]     = STR("movsx "),
+  [MI_SETCC]     = STR("set"),
+  [MI_CMOV]      = STR("cmov"),
+  [MI_JMP]       = STR("jmp "),
+  [MI_JCC]       = STR("j"),
+  [MI_NEG]       = STR("neg "),
+  [MI_MOVSS]     = STR("movss "),
+  [MI_MOVSD]     = STR("movsd "),
+  [MI_ADDSS]     = STR("addss "),
+  [MI_ADDSD]     = STR("addsd "),
+  [MI_SUBSS]     = STR("subss "),
+  [MI_SUBSD]     = STR("subsd "),
+  [MI_MULSS]     = STR("mulss "),
+  [MI_MULSD]     = STR("mulsd "),
+  [MI_DIVSS]     = STR("divss "),
+  [MI_DIVSD]     = STR("divsd "),
+  [MI_UCOMISS]   = STR("ucomiss "),
+  [MI_UCOMISD]   = STR("ucomisd "),
+  [MI_CVTSI2SS]  = STR("cvtsi2ss "),
+  [MI_CVTSI2SD]  = STR("cvtsi2sd "),
+  [MI_CVTTSS2SI] = STR("cvttss2si "),
+  [MI_CVTTSD2SI] = STR("cvttsd2si "),
+  [MI_CVTSS2SD]  = STR("cvtss2sd "),
+  [MI_CVTSD2SS]  = STR("cvtsd2ss "),
+  [MI_XORPS]     = STR("xorps "),
+  [MI_CALL]      = STR("call "),
+  [MI_RET]       = STR("ret "),
+};
+
+#define XMM_NAMES \
+  [XMM0] = STR("xmm0"), [XMM1] = STR("xmm1"), [XMM2] = STR("xmm2"), [XMM3] = STR("xmm3"), \
+  [XMM4] = STR("xmm4"), [XMM5] = STR("xmm5"), [XMM6] = STR("xmm6"), [XMM7] = STR("xmm7"), \
+  [XMM8] = STR("xmm8"), [XMM9] = STR("xmm9"), [XMM10] = STR("xmm10"), [XMM11] = STR("xmm11"), \
+  [XMM12] = STR("xmm12"), [XMM13] = STR("xmm13"), [XMM14] = STR("xmm14"), [XMM15] = STR("xmm15")
+
+static const Str REG64[NUM_REGISTERS] = {
+  [RAX] = STR("rax"), [RBX] = STR("rbx"), [RCX] = STR("rcx"), [RDX] = STR("rdx"),
+  [RSP] = STR("rsp"), [RBP] = STR("rbp"), [RSI] = STR("rsi"), [RDI] = STR("rdi"),
+  [R8] = STR("r8"), [R9] = STR("r9"), [R10] = STR("r10"), [R11] = STR("r11"),
+  [R12] = STR("r12"), [R13] = STR("r13"), [R14] = STR("r14"), [R15] = STR("r15"),
+  XMM_NAMES,
+};
+
+static const Str REG32[NUM_REGISTERS] = {
+  [RAX] = STR("eax"), [RBX] = STR("ebx"), [RCX] = STR("ecx"), [RDX] = STR("edx"),
+  [RSP] = STR("esp"), [RBP] = STR("ebp"), [RSI] = STR("esi"), [RDI] = STR("edi"),
+  [R8] = STR("r8d"), [R9] = STR("r9d"), [R10] = STR("r10d"), [R11] = STR("r11d"),
+  [R12] = STR("r12d"), [R13] = STR("r13d"), [R14] = STR("r14d"), [R15] = STR("r15d"),
+  XMM_NAMES,
+};
+
+static const Str REG8[NUM_REGISTERS] = {
+  [RAX] = STR("al"), [RBX] = STR("bl"), [RCX] = STR("cl"), [RDX] = STR("dl"),
+  [RSP] = STR("spl"), [RBP] = STR("bpl"), [RSI] = STR("sil"), [RDI] = STR("dil"),
+  [R8] = STR("r8b"), [R9] = STR("r9b"), [R10] = STR("r10b"), [R11] = STR("r11b"),
+  [R12] = STR("r12b"), [R13] = STR("r13b"), [R14] = STR("r14b"), [R15] = STR("r15b"),
+};
+
+/* Directives defining constants, by size */
+static const Str DEFINE_NASM[] = {
+  [1] = STR(": db "),
+  [4] = STR(": dd "),
+  [8] = STR(": dq "),
+};
+
+static const Str DEFINE_GAS[] = {
+  [1] = STR(": .byte "),
+  [4] = STR(": .long "),
+  [8] = STR(": .quad "),
+};
+
+/* Directives reserving memory, by element size */
+static const Str RESERVE[] = {
+  [1] = STR(": resb "),
+  [4] = STR(": resd "),
+  [8] = STR(": resq "),
+};
+
+typedef struct {
+  bool gas;
+  Str header;
+  Str bss, data, rodata, rodata_str, text;
+  Str global;
+  Str byte, dword, qword, xmmword;  /* Memory operands, up to the opening bracket */
+  Str rip;               /* Prefix of rip-relative symbols */
+} Dialect;
+
+static const Dialect NASM = {
+  .gas = false,
+  /* Static variables are addressed relative to rip, as in object files */
+  .header = STR("default rel\n"),
+  .bss = STR("section .bss\n"),
+  .data = STR("section .data\n"),
+  .rodata = STR("section .rodata\n"),
+  .rodata_str = STR("section .rodata.str progbits alloc noexec nowrite align=1\n"),
+  .text = STR("section .text\n"),
+  .global = STR("global "),
+  .byte = STR("byte ["),
+  .dword = STR("dword ["),
+  .qword = STR("qword ["),
+  .xmmword = STR("oword ["),
+  .rip = STR(""),
+};
+
+static const Dialect GAS = {
+  .gas = true,
+  .header = STR(".intel_syntax noprefix\n"),
+  .bss = STR(".section .bss\n"),
+  .data = STR(".section .data\n"),
+  .rodata = STR(".section .rodata\n"),
+  .rodata_str = STR(".section .rodata.str,\"a\",@progbits\n"),
+  .text = STR(".section .text\n"),
+  .global = STR(".globl "),
+  .byte = STR("byte ptr ["),
+  .dword = STR("dword ptr ["),
+  .qword = STR("qword ptr ["),
+  .xmmword = STR("xmmword ptr ["),
+  .rip = STR("rip+"),
+};
+
+static const Dialect *dialect;
+
+/* Output Buffer */
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_CHUNKS 16
+
+typedef struct {
+  int fd;
+  char *chunks[MAX_CHUNKS];
+  struct iovec iov[MAX_CHUNKS];
+  int nchunks;           /* Chunks holding text, the last one being filled */
+  size_t written;
+  bool closed;           /* The reader went away, the rest is dropped */
+} Emitter;
+
+static Emitter out;
+
+static void flush_output() {
+  struct iovec *iov = out.iov;
+  int count = out.nchunks;
+
+  while (count > 0 && !out.closed) {
+    ssize_t n = writev(out.fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      /* An assembler exiting early closes its end of the pipe */
+      if (errno == EPIPE) {
+        out.closed = true;
+        break;
+      }
+      LOG_FATAL("couldn't write assembly: %s", strerror(errno));
+    }
+
+    out.written += n;
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  out.nchunks = 1;
+  out.iov[0].iov_base = out.chunks[0];
+  out.iov[0].iov_len = 0;
+}
+
+/* Moves on to the next chunk, flushing every chunk once all are full */
+static void next_chunk() {
+  if (out.nchunks == MAX_CHUNKS) {
+    flush_output();
+    return;
+  }
+
+  int i = out.nchunks++;
+  if (!out.chunks[i] && !(out.chunks[i] = malloc(CHUNK_SIZE)))
+    LOG_FATAL("malloc failed in next_chunk");
+
+  out.iov[i].iov_base = out.chunks[i];
+  out.iov[i].iov_len = 0;
+}
+
+static void _write(const char *s, size_t len) {
+  while (len > 0) {
+    struct iovec *chunk = &out.iov[out.nchunks - 1];
+    size_t room = CHUNK_SIZE - chunk->iov_len;
+    if (room == 0) {
+      next_chunk();
+      continue;
+    }
+
+    size_t n = len < room ? len : room;
+    memcpy((char *)chunk->iov_base + chunk->iov_len, s, n);
+    chunk->iov_len += n;
+    s += n;
+    len -= n;
+  }
+}
+
+static void _write_str(Str str) {
+  _write(str.s, str.len);
+}
+
+static void _write_cstr(const char *s) {
+  _write(s, strlen(s));
+}
+
+static void _write_char(char c) {
+  _write(&c, 1);
+}
+
+static void _write_int(int64_t v) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+
+  /* Negated in unsigned arithmetic, so INT64_MIN does not overflow */
+  uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+
+  if (v < 0)
+    *--p = '-';
+  _write(p, buf + sizeof(buf) - p);
+}
+
+/* `size` is the width of the operand in bytes; lea takes an address and
+ * gets no size specifier */
+static void _write_moperand(MOperand *operand, int size, bool address) {
+  switch (operand->kind) {
+    case MO_REG:
+      _write_str(size == 1 ? REG8[operand->reg] : size == 4 ? REG32[operand->reg] : REG64[operand->reg]);
+      break;
+    case MO_IMM:
+      _write_int(operand->imm);
+      break;
+    case MO_MEM:
+      if (address)
+        _write_char('[');
+      else
+        _write_str(size == 1 ? dialect->byte : size == 4 ? dialect->dword
+            : size == 16 ? dialect->xmmword : dialect->qword);
+
+      if (operand->sym) {
+        _write_str(dialect->rip);
+        _write_cstr(operand->sym);
+      } else {
+        _write_str(REG64[operand->reg]);
+      }
+      if (operand->index != NO_REG) {
+        _write_char('+');
+        _write_str(REG64[operand->index]);
+        _write_char('*');
+        _write_int(operand->scale);
+      }
+      if (operand->disp) {
+        if (operand->disp > 0)
+          _write_char('+');
+        _write_int(operand->disp);
+      }
+      _write_char(']');
+      break;
+    case MO_SYM:
+      _write_cstr(operand->sym);
+      break;
+    default: LOG_FATAL("shouldn't have gotten here...");
+  }
+}
+
+static void _write_minst(MInst *inst) {
+  if (inst->op == MI_LABEL) {
+    if (inst->global) {
+      _write_str(dialect->global);
+      _write_cstr(inst->operands[0].sym);
+      _write_char('\n');
+    }
+    _write_cstr(inst->operands[0].sym);
+    _write(":\n", 2);
+    return;
+  }
+
+  /* Drop the separator of instructions without operands */
+  Str mnemonic = MNEMONICS[inst->op];
+  if (inst->op == MI_SETCC || inst->op == MI_CMOV || inst->op == MI_JCC) {
+    _write_str(mnemonic);
+    _write_cstr(CONDITIONS[inst->cc]);
+    _write_char(' ');
+  } else {
+    _write(mnemonic.s, inst->nopers ? mnemonic.len : mnemonic.len - 1);
+  }
+
+  for (int i = 0; i < inst->nopers; i++) {
+    /* movsxd always reads a doubleword, movzx & movsx a byte, & the truncating
+     * conversions a float or a double whatever the integer width */
+    int size = inst->size;
+    if (i == 1 && (inst->op == MI_MOVSXD || inst->op == MI_CVTTSS2SI))
+      size = 4;
+    else if (i == 1 && (inst->op == MI_MOVZX || inst->op == MI_MOVSX))
+      size = 1;
+    else if (i == 1 && inst->op == MI_CVTTSD2SI)
+      size = 8;
+    if (i)
+      _write(", ", 2);
+    _write_moperand(&inst->operands[i], size, inst->op == MI_LEA);
+  }
+  _write_char('\n');
+}
+
+static void alloc_global_symbols(MProgram *mp) {
+  static const Str BALIGN = STR(".balign "), ALIGNB = STR("alignb "), ZERO = STR(": .zero ");
+  _write_str(dialect->bss);
+
+  for (size_t i = 0; i < mp->nbss; i++) {
+    MData *data = &mp->bss[i];
+
+    _write_str(dialect->gas ? BALIGN : ALIGNB);
+    _write_int(data->align);
+    _write_char('\n');
+    if (dialect->gas) {
+      _write_cstr(data->name);
+      _write_str(ZERO);
+      _write_int(data->size);
+      _write_char('\n');
+      continue;
+    }
+
+    /* Reserve memory using the directive matching the alignment */
+    size_t unit = data->align == 8 || data->align == 4 ? data->align : 1;
+    _write_cstr(data->name);
+    _write_str(RESERVE[unit]);
+    _write_int(data->size / unit);
+    _write_char('\n');
+  }
+}
+
+/* Value of the low `unit` bytes of a bit pattern, as written out */
+static int64_t data_bits(uint64_t bits, size_t unit) {
+  switch (unit) {
+    case 1:  return (uint8_t)bits;
+    case 4:  return (uint32_t)bits;
+    default: return (int64_t)bits;
+  }
+}
+
+/* Initialized variables, 1, 4 or 8 bytes each */
+static void define_data(MProgram *mp) {
+  static const Str ALIGN = STR("align "), BALIGN = STR(".balign ");
+  if (!mp->ndata)
+    return;
+  _write_str(dialect->data);
+
+  for (size_t i = 0; i < mp->ndata; i++) {
+    MData *data = &mp->data[i];
+    size_t unit = data->size == 1 || data->size == 4 ? data->size : 8;
+
+    _write_str(dialect->gas ? BALIGN : ALIGN);
+    _write_int(data->align);
+    _write_char('\n');
+    _write_cstr(data->name);
+    _write_str(dialect->gas ? DEFINE_GAS[unit] : DEFINE_NASM[unit]);
+    if (data->label)
+      _write_cstr(data->label);
+    else
+      _write_int(data_bits(data->bits, unit));
+    _write_char('\n');
+  }
+}
+
+/* Constants, aligned to their size; 16-byte ones are zero-extended */
+static void define_constants(MProgram *mp) {
+  static const Str ALIGN = STR("align "), BALIGN = STR(".balign ");
+  if (!mp->nconsts)
+    return;
+  _write_str(dialect->rodata);
+
+  for (size_t i = 0; i < mp->nconsts; i++) {
+    MConst *c = &mp->consts[i];
+    size_t unit = c->size == 1 || c->size == 4 ? c->size : 8;
+
+    _write_str(dialect->gas ? BALIGN : ALIGN);
+    _write_int(c->size);
+    _write_char('\n');
+    _write_cstr(c->name);
+    _write_str(dialect->gas ? DEFINE_GAS[unit] : DEFINE_NASM[unit]);
+    _write_int(data_bits(c->bits, unit));
+    if (c->size == 16)
+      _write(", 0", 3);
+    _write_char('\n');
+  }
+}
+
+/* Bytes of a string, from `from` up to `to`, on one line */
+static void define_bytes(const uint8_t *bytes, size_t from, size_t to) {
+  static const Str DB = STR("db "), BYTE = STR(".byte ");
+  if (from == to)
+    return;
+
+  _write_str(dialect->gas ? BYTE : DB);
+  for (size_t i = from; i < to; i++) {
+    if (i > from)
+      _write(", ", 2);
+    _write_int(bytes[i]);
+  }
+  _write_char('\n');
+}
+
+/* String literals, the labels of merged suffixes falling inside the strings
+ * they end */
+static void define_strings(MProgram *mp) {
+  StringPool *pool = mp->strings;
+  if (!pool || !pool->norder)
+    return;
+  _write_str(dialect->rodata_str);
+
+  size_t pos = 0;
+  for (size_t i = 0; i < pool->norder; i++) {
+    PooledString *s = &pool->strings[pool->order[i]];
+    define_bytes(pool->data, pos, s->offset);
+    pos = s->offset;
+    _write_cstr(s->label);
+    _write(":\n", 2);
+  }
+  define_bytes(pool->data, pos, pool->size);
+}
+
+static ssize_t emit_listing(MProgram *mp, const Dialect *d, int fd) {
+  dialect = d;
+  out.fd = fd;
+  out.nchunks = 0;
+  out.written = 0;
+  out.closed = false;
+  next_chunk();
+
+  _write_str(dialect->header);
+
+  /* Allocate space for global variables */
+  alloc_global_symbols(mp);
+  define_data(mp);
+  define_constants(mp);
+  define_strings(mp);
+
+  _write_str(dialect->text);
+  /* TODO: define external linkage here */
+
+  for (size_t i = 0; i < mp->ninsts && !out.closed; i++)
+    _write_minst(&mp->insts[i]);
+
+  flush_output();
+  for (int i = 0; i < MAX_CHUNKS; i++) {
+    free(out.chunks[i]);
+    out.chunks[i] = NULL;
+  }
+  if (out.closed) {
+    errno = EPIPE;
+    return -1;
+  }
+  return out.written;
+}
+
+/* Write the listing of the program to `fd` & return its size, or -1 with
+ * errno set to EPIPE when `fd` is a pipe whose reader exited */
+ssize_t nasm_x86_64_emit(MProgram *mp, int fd) {
+  return emit_listing(mp, &NASM, fd);
+}
+
+ssize_t gas_x86_64_emit(MProgram *mp, int fd) {
+  return emit_listing(mp, &GAS, fd);
+}
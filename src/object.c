@@ -0,0 +1,293 @@
+#include <elf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "util.h"
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t flags;
+  size_t align;
+} SECTIONS[NUM_SECTIONS] = {
+  [SEC_TEXT]       = { ".text",       SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16 },
+  [SEC_DATA]       = { ".data",       SHT_PROGBITS, SHF_ALLOC | SHF_WRITE,     8 },
+  [SEC_BSS]        = { ".bss",        SHT_NOBITS,   SHF_ALLOC | SHF_WRITE,     8 },
+  [SEC_RODATA]     = { ".rodata",     SHT_PROGBITS, SHF_ALLOC,                 8 },
+  [SEC_RODATA_STR] = { ".rodata.str", SHT_PROGBITS, SHF_ALLOC,                 1 },
+};
+
+void object_init(ObjectFile *obj) {
+  memset(obj, 0, sizeof(ObjectFile));
+  for (int i = 0; i < NUM_SECTIONS; i++)
+    obj->sections[i].align = SECTIONS[i].align;
+  hashmap_init(&obj->symbol_index);
+}
+
+void object_free(ObjectFile *obj) {
+  for (int i = 0; i < NUM_SECTIONS; i++)
+    free(obj->sections[i].data);
+  for (size_t i = 0; i < obj->nsymbols; i++)
+    free(obj->symbols[i].name);
+  free(obj->symbols);
+  free(obj->relocs);
+  hashmap_free(&obj->symbol_index);
+}
+
+static void section_reserve(Section *section, size_t size) {
+  if (section->size + size <= section->capacity)
+    return;
+
+  size_t capacity = section->capacity ? section->capacity : 256;
+  while (capacity < section->size + size)
+    capacity <<= 1;
+
+  uint8_t *tmp = realloc(section->data, capacity);
+  if (!tmp)
+    LOG_FATAL("realloc failed in section_reserve");
+
+  section->data = tmp;
+  section->capacity = capacity;
+}
+
+void section_emit(Section *section, const void *bytes, size_t size) {
+  if (!size)
+    return;
+
+  section_reserve(section, size);
+  if (bytes)
+    memcpy(section->data + section->size, bytes, size);
+  else
+    memset(section->data + section->size, 0, size);
+  section->size += size;
+}
+
+/* Pads with zeros; .bss has no contents and is laid out by size only */
+void section_align(Section *section, size_t align) {
+  size_t padding = (align - section->size % align) % align;
+  if (padding)
+    section_emit(section, NULL, padding);
+  if (align > section->align)
+    section->align = align;
+}
+
+/* Looks up a symbol by name, creating it undefined the first time */
+int object_symbol(ObjectFile *obj, const char *name) {
+  void *index = hashmap_lookup(&obj->symbol_index, name);
+  if (index)
+    return (int)(intptr_t)index - 1;
+
+  ObjSymbol *tmp = realloc(obj->symbols, sizeof(ObjSymbol) * (obj->nsymbols + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in object_symbol");
+
+  ObjSymbol *symbol = &tmp[obj->nsymbols];
+  memset(symbol, 0, sizeof(ObjSymbol));
+  symbol->name = format("%s", name);
+  symbol->section = SECTION_UNDEF;
+
+  obj->symbols = tmp;
+  hashmap_insert(&obj->symbol_index, symbol->name, (void *)(intptr_t)(obj->nsymbols + 1));
+  return obj->nsymbols++;
+}
+
+void object_define(ObjectFile *obj, int symbol, SectionID section, size_t offset, size_t size) {
+  ObjSymbol *s = &obj->symbols[symbol];
+  if (s->section != SECTION_UNDEF)
+    LOG_FATAL("symbol '%s' is defined more than once", s->name);
+
+  s->section = section;
+  s->offset = offset;
+  s->size = size;
+}
+
+void object_relocate(ObjectFile *obj, SectionID section, size_t offset, int symbol, RelocKind kind,
+    int64_t addend) {
+  Relocation *tmp = realloc(obj->relocs, sizeof(Relocation) * (obj->nrelocs + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in object_relocate");
+
+  tmp[obj->nrelocs++] = (Relocation){ section, offset, symbol, kind, addend };
+  obj->relocs = tmp;
+}
+
+/* ELF64 Writer
+ *
+ * Layout: header, section contents, .rela.text, .rela.data, .symtab, .strtab,
+ * .shstrtab
+ * and finally the section header table. */
+
+enum {
+  SH_NULL,
+  SH_TEXT,             /* SectionID + 1 */
+  SH_DATA,
+  SH_BSS,
+  SH_RODATA,
+  SH_RODATA_STR,
+  SH_RELA_TEXT,
+  SH_RELA_DATA,
+  SH_SYMTAB,
+  SH_STRTAB,
+  SH_SHSTRTAB,
+  NUM_SHDRS
+};
+
+static size_t add_string(Section *strtab, const char *s) {
+  size_t offset = strtab->size;
+  section_emit(strtab, s, strlen(s) + 1);
+  return offset;
+}
+
+static void emit_aligned(Section *out, Elf64_Shdr *shdr, const void *bytes, size_t size, size_t align) {
+  section_align(out, align);
+  shdr->sh_offset = out->size;
+  shdr->sh_size = size;
+  shdr->sh_addralign = align;
+  section_emit(out, bytes, size);
+}
+
+void object_write_elf64(ObjectFile *obj, const char *path) {
+  Section out = { 0 }, strtab = { 0 }, shstrtab = { 0 };
+  Elf64_Shdr shdrs[NUM_SHDRS] = { 0 };
+
+  add_string(&strtab, "");
+  add_string(&shstrtab, "");
+  section_emit(&out, NULL, sizeof(Elf64_Ehdr));
+
+  for (int i = 0; i < NUM_SECTIONS; i++) {
+    Section *section = &obj->sections[i];
+    Elf64_Shdr *shdr = &shdrs[SH_TEXT + i];
+    shdr->sh_name = add_string(&shstrtab, SECTIONS[i].name);
+    shdr->sh_type = SECTIONS[i].type;
+    shdr->sh_flags = SECTIONS[i].flags;
+
+    if (SECTIONS[i].type == SHT_NOBITS) {
+      shdr->sh_offset = out.size;
+      shdr->sh_size = section->size;
+      shdr->sh_addralign = section->align;
+    } else {
+      emit_aligned(&out, shdr, section->data, section->size, section->align);
+    }
+  }
+
+  /* Local symbols must come before global ones */
+  int *elf_index = calloc(obj->nsymbols + 1, sizeof(int));
+  Elf64_Sym *syms = calloc(obj->nsymbols + 1, sizeof(Elf64_Sym));
+  if (!elf_index || !syms)
+    LOG_FATAL("calloc failed in object_write_elf64");
+
+  size_t nsyms = 1, first_global = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1)
+      first_global = nsyms;
+
+    for (size_t i = 0; i < obj->nsymbols; i++) {
+      ObjSymbol *s = &obj->symbols[i];
+      bool global = s->global || s->section == SECTION_UNDEF;
+      if (global != (pass == 1))
+        continue;
+
+      Elf64_Sym *sym = &syms[nsyms];
+      sym->st_name = add_string(&strtab, s->name);
+      sym->st_value = s->offset;
+      sym->st_size = s->size;
+      if (s->section == SECTION_UNDEF) {
+        sym->st_shndx = SHN_UNDEF;
+        sym->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+      } else {
+        sym->st_shndx = SH_TEXT + s->section;
+        sym->st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL,
+            s->function ? STT_FUNC : STT_OBJECT);
+      }
+      elf_index[i] = nsyms++;
+    }
+  }
+
+  Elf64_Rela *relas = calloc(obj->nrelocs + 1, sizeof(Elf64_Rela));
+  if (!relas)
+    LOG_FATAL("calloc failed in object_write_elf64");
+
+  /* One relocation section for each section patched */
+  static const struct { SectionID section; int shdr; const char *name; } RELAS[] = {
+    { SEC_TEXT, SH_RELA_TEXT, ".rela.text" },
+    { SEC_DATA, SH_RELA_DATA, ".rela.data" },
+  };
+  for (size_t k = 0; k < sizeof(RELAS) / sizeof(RELAS[0]); k++) {
+    size_t nrelas = 0;
+    for (size_t i = 0; i < obj->nrelocs; i++) {
+      Relocation *r = &obj->relocs[i];
+      if (r->section != RELAS[k].section)
+        continue;
+
+      uint32_t type = r->kind == RELOC_PLT32 ? R_X86_64_PLT32
+        : r->kind == RELOC_ABS64 ? R_X86_64_64 : R_X86_64_PC32;
+      relas[nrelas].r_offset = r->offset;
+      relas[nrelas].r_info = ELF64_R_INFO(elf_index[r->symbol], type);
+      relas[nrelas].r_addend = r->addend;
+      nrelas++;
+    }
+
+    Elf64_Shdr *rela = &shdrs[RELAS[k].shdr];
+    rela->sh_name = add_string(&shstrtab, RELAS[k].name);
+    rela->sh_type = SHT_RELA;
+    rela->sh_flags = SHF_INFO_LINK;
+    rela->sh_link = SH_SYMTAB;
+    rela->sh_info = SH_TEXT + RELAS[k].section;
+    rela->sh_entsize = sizeof(Elf64_Rela);
+    emit_aligned(&out, rela, relas, sizeof(Elf64_Rela) * nrelas, 8);
+  }
+
+  Elf64_Shdr *symtab = &shdrs[SH_SYMTAB];
+  symtab->sh_name = add_string(&shstrtab, ".symtab");
+  symtab->sh_type = SHT_SYMTAB;
+  symtab->sh_link = SH_STRTAB;
+  symtab->sh_info = first_global;
+  symtab->sh_entsize = sizeof(Elf64_Sym);
+  emit_aligned(&out, symtab, syms, sizeof(Elf64_Sym) * nsyms, 8);
+
+  shdrs[SH_STRTAB].sh_name = add_string(&shstrtab, ".strtab");
+  shdrs[SH_STRTAB].sh_type = SHT_STRTAB;
+  emit_aligned(&out, &shdrs[SH_STRTAB], strtab.data, strtab.size, 1);
+
+  shdrs[SH_SHSTRTAB].sh_name = add_string(&shstrtab, ".shstrtab");
+  shdrs[SH_SHSTRTAB].sh_type = SHT_STRTAB;
+  emit_aligned(&out, &shdrs[SH_SHSTRTAB], shstrtab.data, shstrtab.size, 1);
+
+  section_align(&out, 8);
+  size_t shoff = out.size;
+  section_emit(&out, shdrs, sizeof(shdrs));
+
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr *)out.data;
+  memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+  ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  ehdr->e_type = ET_REL;
+  ehdr->e_machine = EM_X86_64;
+  ehdr->e_version = EV_CURRENT;
+  ehdr->e_shoff = shoff;
+  ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr->e_shentsize = sizeof(Elf64_Shdr);
+  ehdr->e_shnum = NUM_SHDRS;
+  ehdr->e_shstrndx = SH_SHSTRTAB;
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    LOG_FATAL("couldn't open object file '%s' for writing: %s", path, strerror(errno));
+
+  size_t nwritten = fwrite(out.data, 1, out.size, f);
+  if (nwritten != out.size)
+    LOG_FATAL("only wrote %zu/%zu bytes to '%s': %s", nwritten, out.size, path, strerror(errno));
+  fclose(f);
+
+  free(elf_index);
+  free(syms);
+  free(relas);
+  free(out.data);
+  free(strtab.data);
+  free(shstrtab.data);
+}
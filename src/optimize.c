@@ -1,9 +1,14 @@
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "ast.h"
+#include "hashmap.h"
+#include "ir.h"
 #include "optimize.h"
+#include "strpool.h"
+#include "symtab.h"
 #include "util.h"
 
 int32_t fold_int_unary(int un_op, int32_t n) {
@@ -68,7 +73,13 @@ void fold_constants(Node *node) {
       break;
     case ND_UNARY_EXPR:
       Node *expr = node->unary.expr;
-      if (expr->kind == ND_VALUE_EXPR) {
+      if (expr->kind == ND_VALUE_EXPR && node->unary.un_op == UN_CONV) {
+        Value converted = expr->value;
+        if (convert_value(&converted, node->type)) {
+          node->kind = ND_VALUE_EXPR;
+          node->value = converted;
+        }
+      } else if (expr->kind == ND_VALUE_EXPR) {
         LOG_INFO("folding constant unary expression of on line %d, col %d",
             node->span.line, node->span.col);
 
@@ -129,3 +140,1275 @@ end:
   fold_constants(next);
 }
 
+
+static bool values_equal(const Value *a, const Value *b) {
+  if (a->kind != b->kind)
+    return false;
+
+  switch (a->kind) {
+    case VAL_INT: return a->i_val == b->i_val;
+    case VAL_UINT: return a->u_val == b->u_val;
+    case VAL_FLOAT: return memcmp(&a->f_val, &b->f_val, sizeof(float)) == 0;
+    case VAL_DOUBLE: return memcmp(&a->d_val, &b->d_val, sizeof(double)) == 0;
+    case VAL_CHAR: return a->c_val == b->c_val;
+    case VAL_BOOL: return a->b_val == b->b_val;
+    case VAL_STRING:
+      return a->s_len == b->s_len && memcmp(a->s_val, b->s_val, a->s_len) == 0;
+  }
+  return false;
+}
+
+bool value_is_truthy(const Value *v) {
+  switch (v->kind) {
+    case VAL_INT: return v->i_val != 0;
+    case VAL_UINT: return v->u_val != 0;
+    case VAL_FLOAT: return v->f_val != 0;
+    case VAL_DOUBLE: return v->d_val != 0;
+    case VAL_CHAR: return v->c_val != 0;
+    case VAL_BOOL: return v->b_val;
+    case VAL_STRING: return true;
+  }
+  return false;
+}
+
+#define FOLD_COMPARISON(op, l, r, out) \
+  switch (op) { \
+    case BIN_CMP: out = (l) == (r); break; \
+    case BIN_CMP_NOT: out = (l) != (r); break; \
+    case BIN_CMP_LT: out = (l) < (r); break; \
+    case BIN_CMP_GT: out = (l) > (r); break; \
+    case BIN_CMP_LT_EQ: out = (l) <= (r); break; \
+    case BIN_CMP_GT_EQ: out = (l) >= (r); break; \
+    default: return false; \
+  }
+
+#define IS_COMPARISON(op) ((op) >= BIN_CMP && (op) <= BIN_CMP_GT_EQ)
+
+/* Folds a unary operator over a constant of any ValueKind. Returns false if
+ * the operation cannot (or must not) be evaluated at compile time. */
+bool fold_value_unary(int un_op, const Value *v, Value *out) {
+  out->kind = v->kind;
+  switch (v->kind) {
+    case VAL_INT:
+      if (un_op == UN_NEG) out->i_val = (int32_t)(0u - (uint32_t)v->i_val);
+      else if (un_op == UN_NOT) out->i_val = !v->i_val;
+      else return false;
+      return true;
+    case VAL_UINT:
+      if (un_op == UN_NEG) out->u_val = 0u - v->u_val;
+      else if (un_op == UN_NOT) out->u_val = !v->u_val;
+      else return false;
+      return true;
+    case VAL_CHAR:
+      if (un_op == UN_NEG) out->c_val = (char)(0u - (unsigned char)v->c_val);
+      else if (un_op == UN_NOT) out->c_val = !v->c_val;
+      else return false;
+      return true;
+    case VAL_FLOAT:
+      if (un_op != UN_NEG) return false;
+      out->f_val = -v->f_val;
+      return true;
+    case VAL_DOUBLE:
+      if (un_op != UN_NEG) return false;
+      out->d_val = -v->d_val;
+      return true;
+    case VAL_BOOL:
+      if (un_op != UN_NOT) return false;
+      out->b_val = !v->b_val;
+      return true;
+    case VAL_STRING:
+      return false;
+  }
+  return false;
+}
+
+/* Folds a binary operator (or one of the IR's machine-level opcodes) over
+ * two constants of the same ValueKind. Integer arithmetic wraps like the
+ * generated code does; division by zero and signed overflow of division are
+ * left for runtime. */
+bool fold_value_binary(int bin_op, const Value *lhs, const Value *rhs, Value *out) {
+  if (lhs->kind != rhs->kind)
+    return false;
+
+  if (IS_COMPARISON(bin_op)) {
+    bool result = false;
+    switch (lhs->kind) {
+      case VAL_INT: FOLD_COMPARISON(bin_op, lhs->i_val, rhs->i_val, result); break;
+      case VAL_UINT: FOLD_COMPARISON(bin_op, lhs->u_val, rhs->u_val, result); break;
+      case VAL_FLOAT: FOLD_COMPARISON(bin_op, lhs->f_val, rhs->f_val, result); break;
+      case VAL_DOUBLE: FOLD_COMPARISON(bin_op, lhs->d_val, rhs->d_val, result); break;
+      case VAL_CHAR: FOLD_COMPARISON(bin_op, lhs->c_val, rhs->c_val, result); break;
+      case VAL_BOOL: FOLD_COMPARISON(bin_op, lhs->b_val, rhs->b_val, result); break;
+      case VAL_STRING:
+        if (bin_op == BIN_CMP) result = values_equal(lhs, rhs);
+        else if (bin_op == BIN_CMP_NOT) result = !values_equal(lhs, rhs);
+        else return false;
+        break;
+    }
+    out->kind = VAL_BOOL;
+    out->b_val = result;
+    return true;
+  }
+
+  out->kind = lhs->kind;
+  switch (lhs->kind) {
+    case VAL_INT: {
+      uint32_t l = (uint32_t)lhs->i_val, r = (uint32_t)rhs->i_val;
+      switch (bin_op) {
+        case BIN_ADD: out->i_val = (int32_t)(l + r); break;
+        case BIN_SUB: out->i_val = (int32_t)(l - r); break;
+        case BIN_MUL: out->i_val = (int32_t)(l * r); break;
+        case BIN_DIV:
+          if (rhs->i_val == 0 || (lhs->i_val == INT32_MIN && rhs->i_val == -1))
+            return false;
+          out->i_val = lhs->i_val / rhs->i_val;
+          break;
+        case OP_SHL: out->i_val = (int32_t)(l << (r & 31)); break;
+        case OP_SHR: out->i_val = (int32_t)(l >> (r & 31)); break;
+        case OP_SAR: out->i_val = lhs->i_val >> (r & 31); break;
+        case OP_MULHI: out->i_val = (int32_t)(((int64_t)lhs->i_val * rhs->i_val) >> 32); break;
+        case OP_UMULHI: out->i_val = (int32_t)(((uint64_t)l * r) >> 32); break;
+        default: return false;
+      }
+      return true;
+    }
+    case VAL_UINT:
+      switch (bin_op) {
+        case BIN_ADD: out->u_val = lhs->u_val + rhs->u_val; break;
+        case BIN_SUB: out->u_val = lhs->u_val - rhs->u_val; break;
+        case BIN_MUL: out->u_val = lhs->u_val * rhs->u_val; break;
+        case BIN_DIV:
+          if (rhs->u_val == 0) return false;
+          out->u_val = lhs->u_val / rhs->u_val;
+          break;
+        case OP_SHL: out->u_val = lhs->u_val << (rhs->u_val & 31); break;
+        case OP_SHR: out->u_val = lhs->u_val >> (rhs->u_val & 31); break;
+        case OP_SAR: out->u_val = (uint32_t)((int32_t)lhs->u_val >> (rhs->u_val & 31)); break;
+        case OP_MULHI:
+          out->u_val = (uint32_t)(((int64_t)(int32_t)lhs->u_val * (int32_t)rhs->u_val) >> 32);
+          break;
+        case OP_UMULHI: out->u_val = (uint32_t)(((uint64_t)lhs->u_val * rhs->u_val) >> 32); break;
+        default: return false;
+      }
+      return true;
+    case VAL_CHAR: {
+      unsigned char l = (unsigned char)lhs->c_val, r = (unsigned char)rhs->c_val;
+      switch (bin_op) {
+        case BIN_ADD: out->c_val = (char)(l + r); break;
+        case BIN_SUB: out->c_val = (char)(l - r); break;
+        case BIN_MUL: out->c_val = (char)(l * r); break;
+        default: return false;
+      }
+      return true;
+    }
+    case VAL_FLOAT:
+      switch (bin_op) {
+        case BIN_ADD: out->f_val = lhs->f_val + rhs->f_val; break;
+        case BIN_SUB: out->f_val = lhs->f_val - rhs->f_val; break;
+        case BIN_MUL: out->f_val = lhs->f_val * rhs->f_val; break;
+        case BIN_DIV: out->f_val = lhs->f_val / rhs->f_val; break;
+        default: return false;
+      }
+      return true;
+    case VAL_DOUBLE:
+      switch (bin_op) {
+        case BIN_ADD: out->d_val = lhs->d_val + rhs->d_val; break;
+        case BIN_SUB: out->d_val = lhs->d_val - rhs->d_val; break;
+        case BIN_MUL: out->d_val = lhs->d_val * rhs->d_val; break;
+        case BIN_DIV: out->d_val = lhs->d_val / rhs->d_val; break;
+        default: return false;
+      }
+      return true;
+    case VAL_BOOL:
+    case VAL_STRING:
+      return false;
+  }
+  return false;
+}
+
+/* Constant Globals
+ *
+ * The program is compiled as a whole, so a global that no instruction stores
+ * to keeps its initial value for the whole run. Its reads are replaced by
+ * that value, & what is left of it is placed in read-only memory. A string
+ * initializer is the address of the literal, which the global holds. */
+
+/* Initializers refer to other globals through at most this many steps */
+#define MAX_CONSTANT_DEPTH 16
+
+static bool initial_value(const Node *decl, Value *out, int depth);
+
+static bool evaluate_constant(const Node *node, Value *out, int depth) {
+  if (!node || depth > MAX_CONSTANT_DEPTH)
+    return false;
+
+  Value lhs, rhs;
+  switch (node->kind) {
+    case ND_VALUE_EXPR:
+      *out = node->value;
+      return true;
+    case ND_REF_EXPR: {
+      Symbol *symbol = find_symbol(&SYMTAB, node->ref, strlen(node->ref));
+      if (!symbol || symbol->kind != SYM_VAR)
+        return false;
+      return initial_value(symbol->node, out, depth + 1);
+    }
+    case ND_UNARY_EXPR:
+      if (!evaluate_constant(node->unary.expr, &lhs, depth + 1))
+        return false;
+      if (node->unary.un_op == UN_CONV) {
+        *out = lhs;
+        return convert_value(out, node->type);
+      }
+      return fold_value_unary(node->unary.un_op, &lhs, out);
+    case ND_BINARY_EXPR:
+      return evaluate_constant(node->binary.lhs, &lhs, depth + 1)
+        && evaluate_constant(node->binary.rhs, &rhs, depth + 1)
+        && fold_value_binary(node->binary.bin_op, &lhs, &rhs, out);
+    default:
+      return false;
+  }
+}
+
+static bool initial_value(const Node *decl, Value *out, int depth) {
+  *out = (Value){ .kind = VAL_INT, .i_val = 0 };
+  if (decl->var.value && !evaluate_constant(decl->var.value, out, depth))
+    return false;
+  if (out->kind == VAL_STRING)
+    return decl->var.type->ptr > 0;
+  return convert_value(out, decl->var.type);
+}
+
+bool global_value(const Node *decl, Value *out) {
+  return initial_value(decl, out, 0);
+}
+
+const char *global_string(const Value *value) {
+  int id = strpool_intern(&STRINGS, value->s_val, value->s_len);
+  const char *label = STRINGS.strings[id].label;
+  strpool_use(&STRINGS, label);
+  return label;
+}
+
+void use_global_strings(BasicBlock *prog) {
+  HashMap used;
+  hashmap_init(&used);
+  scan_globals(prog, &used, NULL);
+
+  for (size_t i = 0; i < SYMTAB.symbols.capacity; i++) {
+    MapEntry entry = SYMTAB.symbols.entries[i];
+    if (!entry.key)
+      continue;
+
+    Symbol *symbol = entry.value;
+    Value value;
+    if (symbol->name && symbol->kind == SYM_VAR && hashmap_lookup(&used, symbol->name)
+        && global_value(symbol->node, &value) && value.kind == VAL_STRING)
+      global_string(&value);
+  }
+
+  hashmap_free(&used);
+}
+
+static bool is_global(const char *name) {
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)name, strlen(name));
+  return symbol && symbol->kind == SYM_VAR;
+}
+
+void scan_globals(BasicBlock *prog, HashMap *used, HashMap *stored) {
+  for (BasicBlock *block = prog; block; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_DEAD)
+        continue;
+
+      if (inst->assignee && is_global(inst->assignee)) {
+        if (used)
+          hashmap_insert(used, inst->assignee, inst);
+        if (stored)
+          hashmap_insert(stored, inst->assignee, inst);
+      }
+      for (int i = 0; used && i < inst->nopers; i++) {
+        if (IS_VARIABLE(inst->operands[i]) && is_global(inst->operands[i].var))
+          hashmap_insert(used, inst->operands[i].var, inst);
+      }
+    }
+  }
+}
+
+void propagate_globals(BasicBlock *prog) {
+  HashMap stored;
+  hashmap_init(&stored);
+  scan_globals(prog, NULL, &stored);
+
+  for (BasicBlock *block = prog; block; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_DEAD)
+        continue;
+
+      for (int i = 0; i < inst->nopers; i++) {
+        Operand *operand = &inst->operands[i];
+        if (!IS_VARIABLE((*operand)) || hashmap_lookup(&stored, operand->var))
+          continue;
+
+        Symbol *symbol = find_symbol(&SYMTAB, operand->var, strlen(operand->var));
+        Value value;
+        if (!symbol || symbol->kind != SYM_VAR || !global_value(symbol->node, &value)
+            || value.kind == VAL_STRING)
+          continue;
+
+        LOG_INFO("propagated constant global '%s' at line %d, col %d",
+            operand->var, inst->span.line, inst->span.col);
+        operand->kind = O_VALUE;
+        operand->val = value;
+      }
+    }
+  }
+
+  hashmap_free(&stored);
+}
+
+/* Sparse Conditional Constant Propagation (Wegman & Zadeck)
+ *
+ * The IR is not in SSA form, so def-use chains come from a reaching
+ * definitions analysis instead: every assignment gets its own lattice cell
+ * and a use evaluates to the meet of the definitions that reach it from
+ * executable blocks. Each function entry defines every variable as
+ * overdefined, which covers globals and parameters, & so does every call
+ * for the globals, which the callee may store to.
+ *
+ * Functions are propagated one at a time, their blocks numbered from 0, so
+ * the sets of reaching definitions only span the variables of a function
+ * rather than every variable of the program. */
+
+typedef enum {
+  LAT_TOP,
+  LAT_CONST,
+  LAT_BOTTOM
+} LatticeKind;
+
+typedef struct {
+  LatticeKind kind;
+  Value val;
+} LatticeCell;
+
+typedef struct {
+  size_t length, capacity;
+  int *items;
+} IntList;
+
+typedef struct {
+  char *var;
+  int inst;             /* -1 for the definition at function entry */
+  int block;
+  LatticeCell cell;
+  IntList users;
+} Definition;
+
+typedef struct {
+  Instruction *inst;
+  BasicBlock *block;
+  int def;
+  IntList clobbers;     /* Definitions of globals a call may store to */
+  IntList reach[MAX_OPERANDS];
+} SCCPInst;
+
+typedef struct {
+  size_t ninsts;
+  SCCPInst *insts;
+
+  size_t ndefs, defs_capacity;
+  Definition *defs;
+  HashMap defs_by_var;  /* var -> IntList* of definitions */
+
+  BasicBlock *first, *end;  /* Blocks of the function */
+  int *index;           /* block id -> index in the function, -1 outside */
+  int nblocks;
+  int *first_inst;      /* by block index */
+  bool *executable;     /* by block index */
+
+  IntList work;
+} SCCP;
+
+static const LatticeCell OVERDEFINED = { .kind = LAT_BOTTOM };
+static const LatticeCell UNDEFINED = { .kind = LAT_TOP };
+
+static void intlist_push(IntList *list, int item) {
+  if (list->length == list->capacity) {
+    list->capacity = list->capacity ? list->capacity << 1 : 8;
+    int *tmp = realloc(list->items, sizeof(int) * list->capacity);
+    if (!tmp)
+      LOG_FATAL("realloc failed in intlist_push");
+    list->items = tmp;
+  }
+  list->items[list->length++] = item;
+}
+
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+#define BITSET_TEST(set, i) ((set)[(i) / 64] & (1ULL << ((i) % 64)))
+#define BITSET_SET(set, i) ((set)[(i) / 64] |= (1ULL << ((i) % 64)))
+#define BITSET_CLEAR(set, i) ((set)[(i) / 64] &= ~(1ULL << ((i) % 64)))
+
+/* Definitions at function entry & those of globals at calls are
+ * overdefined from the start */
+static int sccp_add_def(SCCP *s, char *var, int inst, int block, bool unknown) {
+  if (s->ndefs == s->defs_capacity) {
+    s->defs_capacity = s->defs_capacity ? s->defs_capacity << 1 : 64;
+    Definition *tmp = realloc(s->defs, sizeof(Definition) * s->defs_capacity);
+    if (!tmp)
+      LOG_FATAL("realloc failed in sccp_add_def");
+    s->defs = tmp;
+  }
+
+  int id = s->ndefs++;
+  s->defs[id] = (Definition){ .var = var, .inst = inst, .block = block };
+  s->defs[id].cell.kind = unknown ? LAT_BOTTOM : LAT_TOP;
+
+  IntList *list = hashmap_lookup(&s->defs_by_var, var);
+  if (!list) {
+    if (!(list = calloc(1, sizeof(IntList))))
+      LOG_FATAL("calloc failed in sccp_add_def");
+    hashmap_insert(&s->defs_by_var, var, list);
+  }
+  intlist_push(list, id);
+  return id;
+}
+
+static int sccp_index(SCCP *s, BasicBlock *block) {
+  return s->index[block->id];
+}
+
+static void sccp_mark_executable(SCCP *s, BasicBlock *block) {
+  int b = sccp_index(s, block);
+  if (b < 0 || s->executable[b])
+    return;
+
+  s->executable[b] = true;
+  for (int i = s->first_inst[b]; i < s->ninsts && s->insts[i].block == block; i++)
+    intlist_push(&s->work, i);
+
+  /* Blocks without a terminator fall through to all of their successors */
+  if (!block->tail || !IS_TERMINATOR(block->tail)) {
+    for (int i = 0; i < block->nsuccs; i++)
+      sccp_mark_executable(s, block->succ[i]);
+  }
+}
+
+static bool sccp_def_executable(SCCP *s, Definition *def) {
+  return def->inst < 0 || s->executable[sccp_index(s, s->insts[def->inst].block)];
+}
+
+static LatticeCell sccp_operand(SCCP *s, SCCPInst *si, int i) {
+  Operand *operand = &si->inst->operands[i];
+  if (operand->kind == O_VALUE)
+    return (LatticeCell){ .kind = LAT_CONST, .val = operand->val };
+  if (operand->kind != O_VARIABLE || si->reach[i].length == 0)
+    return OVERDEFINED;
+
+  LatticeCell result = UNDEFINED;
+  for (size_t j = 0; j < si->reach[i].length; j++) {
+    Definition *def = &s->defs[si->reach[i].items[j]];
+    if (!sccp_def_executable(s, def) || def->cell.kind == LAT_TOP)
+      continue;
+
+    if (def->cell.kind == LAT_BOTTOM)
+      return OVERDEFINED;
+    if (result.kind == LAT_CONST && !values_equal(&result.val, &def->cell.val))
+      return OVERDEFINED;
+    result = def->cell;
+  }
+  return result;
+}
+
+/* Operand of an operation, with the signedness the operation is carried
+ * out in (that of its operands for comparisons): constants keep the kind of
+ * their literal, so `0 - 1` assigned to a uint is still a VAL_INT. Other
+ * kinds are left as they are, a bool compared to an int is not narrowed. */
+static LatticeCell sccp_typed_operand(SCCP *s, SCCPInst *si, int i) {
+  LatticeCell cell = sccp_operand(s, si, i);
+  const Type *type = si->inst->type;
+  if (cell.kind != LAT_CONST || !type || type->ptr
+      || (type->kind != TY_INT && type->kind != TY_UINT)
+      || (cell.val.kind != VAL_INT && cell.val.kind != VAL_UINT))
+    return cell;
+  convert_value(&cell.val, type);
+  return cell;
+}
+
+static LatticeCell sccp_evaluate(SCCP *s, SCCPInst *si) {
+  Instruction *inst = si->inst;
+  LatticeCell result = { .kind = LAT_CONST };
+  LatticeCell lhs, rhs;
+
+  switch (inst->opcode) {
+    case OP_ASSIGN:
+      return inst->nopers ? sccp_operand(s, si, 0) : OVERDEFINED;
+    case OP_NEG:
+    case OP_NOT:
+      lhs = sccp_typed_operand(s, si, 0);
+      if (lhs.kind != LAT_CONST)
+        return lhs;
+      if (!fold_value_unary(inst->opcode, &lhs.val, &result.val))
+        return OVERDEFINED;
+      return result;
+    case OP_CONV:
+      lhs = sccp_operand(s, si, 0);
+      if (lhs.kind != LAT_CONST)
+        return lhs;
+      result.val = lhs.val;
+      if (!convert_value(&result.val, inst->type))
+        return OVERDEFINED;
+      return result;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_SAR:
+    case OP_MULHI:
+    case OP_UMULHI:
+      lhs = sccp_typed_operand(s, si, 0);
+      rhs = sccp_typed_operand(s, si, 1);
+      if (lhs.kind == LAT_BOTTOM || rhs.kind == LAT_BOTTOM)
+        return OVERDEFINED;
+      if (lhs.kind == LAT_TOP || rhs.kind == LAT_TOP)
+        return UNDEFINED;
+      if (!fold_value_binary(inst->opcode, &lhs.val, &rhs.val, &result.val))
+        return OVERDEFINED;
+      return result;
+    default:
+      return OVERDEFINED;
+  }
+}
+
+static void sccp_visit(SCCP *s, SCCPInst *si) {
+  Instruction *inst = si->inst;
+  BasicBlock *block = si->block;
+  LatticeCell cond;
+
+  switch (inst->opcode) {
+    case OP_JMP:
+      for (int i = 0; i < block->nsuccs; i++)
+        sccp_mark_executable(s, block->succ[i]);
+      return;
+    case OP_BR:
+      cond = sccp_operand(s, si, 0);
+      if (cond.kind == LAT_CONST) {
+        int taken = value_is_truthy(&cond.val) ? 0 : 1;
+        if (taken < block->nsuccs)
+          sccp_mark_executable(s, block->succ[taken]);
+      } else if (cond.kind == LAT_BOTTOM) {
+        for (int i = 0; i < block->nsuccs; i++)
+          sccp_mark_executable(s, block->succ[i]);
+      }
+      return;
+    default:
+      break;
+  }
+
+  if (si->def < 0)
+    return;
+
+  Definition *def = &s->defs[si->def];
+  if (def->cell.kind == LAT_BOTTOM)
+    return;
+
+  LatticeCell value = sccp_evaluate(s, si);
+  if (value.kind == LAT_TOP)
+    return;
+  if (value.kind == LAT_CONST && def->cell.kind == LAT_CONST
+      && values_equal(&value.val, &def->cell.val))
+    return;
+
+  /* Cells only ever move down the lattice */
+  def->cell = def->cell.kind == LAT_TOP ? value : OVERDEFINED;
+
+  for (size_t i = 0; i < def->users.length; i++)
+    intlist_push(&s->work, def->users.items[i]);
+}
+
+/* Applies the definitions of an instruction to the set of reaching ones */
+static void sccp_kill(SCCP *s, uint64_t *curr, int def) {
+  IntList *same_var = hashmap_lookup(&s->defs_by_var, s->defs[def].var);
+  for (size_t j = 0; j < same_var->length; j++)
+    BITSET_CLEAR(curr, same_var->items[j]);
+  BITSET_SET(curr, def);
+}
+
+static void sccp_transfer(SCCP *s, SCCPInst *si, uint64_t *curr) {
+  for (size_t i = 0; i < si->clobbers.length; i++)
+    sccp_kill(s, curr, si->clobbers.items[i]);
+  if (si->def >= 0)
+    sccp_kill(s, curr, si->def);
+}
+
+/* Builds def-use chains from a reaching definitions analysis */
+static void sccp_reaching_definitions(SCCP *s) {
+  size_t words = BITSET_WORDS(s->ndefs);
+  uint64_t *in = calloc(words * s->nblocks, sizeof(uint64_t));
+  uint64_t *out = calloc(words * s->nblocks, sizeof(uint64_t));
+  uint64_t *curr = calloc(words, sizeof(uint64_t));
+  if (!in || !out || !curr)
+    LOG_FATAL("calloc failed in sccp_reaching_definitions");
+
+  /* Function entries define every variable */
+  for (size_t d = 0; d < s->ndefs; d++) {
+    if (s->defs[d].inst < 0)
+      BITSET_SET(in + words * s->defs[d].block, d);
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (BasicBlock *block = s->first; block != s->end; block = block->next) {
+      int b = sccp_index(s, block);
+      uint64_t *block_in = in + words * b;
+      uint64_t *block_out = out + words * b;
+
+      for (int p = 0; p < block->npreds; p++) {
+        int pred = sccp_index(s, block->pred[p]);
+        if (pred < 0)
+          continue;
+        for (size_t w = 0; w < words; w++)
+          block_in[w] |= out[words * pred + w];
+      }
+
+      memcpy(curr, block_in, words * sizeof(uint64_t));
+      for (int i = s->first_inst[b]; i < s->ninsts && s->insts[i].block == block; i++)
+        sccp_transfer(s, &s->insts[i], curr);
+
+      if (memcmp(curr, block_out, words * sizeof(uint64_t)) != 0) {
+        memcpy(block_out, curr, words * sizeof(uint64_t));
+        changed = true;
+      }
+    }
+  }
+
+  /* Resolve the definitions reaching every use */
+  for (BasicBlock *block = s->first; block != s->end; block = block->next) {
+    int b = sccp_index(s, block);
+    memcpy(curr, in + words * b, words * sizeof(uint64_t));
+    for (int i = s->first_inst[b]; i < s->ninsts && s->insts[i].block == block; i++) {
+      SCCPInst *si = &s->insts[i];
+      for (int j = 0; j < si->inst->nopers; j++) {
+        if (!IS_VARIABLE(si->inst->operands[j]))
+          continue;
+
+        IntList *candidates = hashmap_lookup(&s->defs_by_var, si->inst->operands[j].var);
+        for (size_t k = 0; candidates && k < candidates->length; k++) {
+          int d = candidates->items[k];
+          if (BITSET_TEST(curr, d)) {
+            intlist_push(&si->reach[j], d);
+            intlist_push(&s->defs[d].users, i);
+          }
+        }
+      }
+
+      sccp_transfer(s, si, curr);
+    }
+  }
+
+  free(in);
+  free(out);
+  free(curr);
+}
+
+static void collect_variable(HashMap *vars, char *var) {
+  if (!hashmap_lookup(vars, var))
+    hashmap_insert(vars, var, var);
+}
+
+/* Sets up the function of blocks `first` up to `end`, whose entry defines
+ * the variables it references: its locals, parameters & the globals it
+ * touches */
+static void sccp_init(SCCP *s, BasicBlock *first, BasicBlock *end, int *index) {
+  memset(s, 0, sizeof(SCCP));
+  hashmap_init(&s->defs_by_var);
+  s->first = first;
+  s->end = end;
+  s->index = index;
+
+  HashMap vars;
+  hashmap_init(&vars);
+
+  for (BasicBlock *block = first; block != end; block = block->next) {
+    index[block->id] = s->nblocks++;
+
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      s->ninsts++;
+      if (inst->assignee)
+        collect_variable(&vars, inst->assignee);
+      for (int i = 0; i < inst->nopers; i++) {
+        if (IS_VARIABLE(inst->operands[i]))
+          collect_variable(&vars, inst->operands[i].var);
+      }
+    }
+  }
+
+  s->insts = calloc(s->ninsts, sizeof(SCCPInst));
+  s->first_inst = calloc(s->nblocks, sizeof(int));
+  s->executable = calloc(s->nblocks, sizeof(bool));
+  if (!s->insts || !s->first_inst || !s->executable)
+    LOG_FATAL("calloc failed in sccp_init");
+
+  IntList globals = { 0 };
+  for (size_t i = 0; i < vars.capacity; i++) {
+    if (vars.entries[i].key) {
+      sccp_add_def(s, vars.entries[i].value, -1, 0, true);
+      if (is_global(vars.entries[i].key))
+        intlist_push(&globals, (int)i);
+    }
+  }
+
+  int idx = 0;
+  for (BasicBlock *block = first; block != end; block = block->next) {
+    int b = sccp_index(s, block);
+    s->first_inst[b] = idx;
+
+    for (Instruction *inst = block->head; inst; inst = inst->next, idx++) {
+      SCCPInst *si = &s->insts[idx];
+      si->inst = inst;
+      si->block = block;
+      si->def = (inst->assignee && inst->opcode != OP_DEAD)
+        ? sccp_add_def(s, inst->assignee, idx, b, false) : -1;
+
+      /* The callee may store to any global */
+      if (inst->opcode == OP_CALL) {
+        for (size_t i = 0; i < globals.length; i++)
+          intlist_push(&si->clobbers, sccp_add_def(s, vars.entries[globals.items[i]].value, idx, b, true));
+      }
+    }
+  }
+
+  free(globals.items);
+  hashmap_free(&vars);
+  sccp_reaching_definitions(s);
+}
+
+static void free_intlist(MapEntry *entry) {
+  IntList *list = entry->value;
+  free(list->items);
+  free(list);
+}
+
+static void sccp_deinit(SCCP *s) {
+  for (size_t i = 0; i < s->ninsts; i++) {
+    for (int j = 0; j < MAX_OPERANDS; j++)
+      free(s->insts[i].reach[j].items);
+    free(s->insts[i].clobbers.items);
+  }
+  for (size_t i = 0; i < s->ndefs; i++)
+    free(s->defs[i].users.items);
+
+  hashmap_foreach(&s->defs_by_var, free_intlist);
+  hashmap_free(&s->defs_by_var);
+  free(s->insts);
+  free(s->defs);
+  free(s->first_inst);
+  free(s->executable);
+  free(s->work.items);
+}
+
+static void sccp_rewrite(SCCP *s, SCCPInst *si) {
+  Instruction *inst = si->inst;
+  BasicBlock *block = si->block;
+
+  if (inst->opcode == OP_DEAD || inst->opcode == OP_DEF)
+    return;
+
+  /* Replace computations that always produce the same value */
+  if (si->def >= 0
+      && (IS_UNARY_OP(inst->opcode) || IS_BINARY_OP(inst->opcode) || inst->opcode == OP_ASSIGN)) {
+    LatticeCell *cell = &s->defs[si->def].cell;
+    if (cell->kind == LAT_CONST && !(inst->opcode == OP_ASSIGN && IS_VALUE(inst->operands[0]))) {
+      LOG_INFO("folding variable '%s' to a constant at line %d, col %d",
+          inst->assignee, inst->span.line, inst->span.col);
+      inst->opcode = OP_ASSIGN;
+      inst->nopers = 1;
+      memset(inst->operands, 0, sizeof(inst->operands[0]) * MAX_OPERANDS);
+      inst->operands[0].kind = O_VALUE;
+      inst->operands[0].val = cell->val;
+      return;
+    }
+  }
+
+  /* Substitute known constants into operands, in the type of the operation
+   * for arithmetic. An operation whose operands are all constant but which
+   * could not be folded keeps them as they are, since the backends expect a
+   * variable among the operands. */
+  bool typed = inst->opcode == OP_NEG || inst->opcode == OP_NOT || IS_BINARY_OP(inst->opcode);
+  if (si->def >= 0 && (IS_UNARY_OP(inst->opcode) || IS_BINARY_OP(inst->opcode))) {
+    bool constant = true;
+    for (int i = 0; i < inst->nopers; i++)
+      constant = constant && sccp_operand(s, si, i).kind == LAT_CONST;
+    if (constant)
+      return;
+  }
+
+  for (int i = 0; i < inst->nopers; i++) {
+    if (!IS_VARIABLE(inst->operands[i]))
+      continue;
+
+    LatticeCell value = typed ? sccp_typed_operand(s, si, i) : sccp_operand(s, si, i);
+    if (value.kind == LAT_CONST) {
+      LOG_INFO("propagating constant '%s' into operation at line %d, col %d",
+          inst->operands[i].var, inst->span.line, inst->span.col);
+      inst->operands[i].kind = O_VALUE;
+      inst->operands[i].val = value.val;
+    }
+  }
+
+  /* Turn branches on constant conditions into jumps */
+  if (inst->opcode == OP_BR && IS_VALUE(inst->operands[0]) && block->nsuccs == 2) {
+    int taken = value_is_truthy(&inst->operands[0].val) ? 0 : 1;
+    BasicBlock *target = block->succ[taken];
+    BasicBlock *pruned = block->succ[1 - taken];
+
+    LOG_INFO("pruning branch to block '%s' at line %d, col %d",
+        pruned->tag, inst->span.line, inst->span.col);
+
+    block_remove_edge(block, pruned);
+    inst->opcode = OP_JMP;
+    inst->nopers = 1;
+    memset(inst->operands, 0, sizeof(inst->operands[0]) * MAX_OPERANDS);
+    inst->operands[0].kind = O_LABEL;
+    inst->operands[0].label = target->tag;
+  }
+}
+
+static void propagate_function(BasicBlock *first, BasicBlock *end, int *index) {
+  SCCP s;
+  sccp_init(&s, first, end, index);
+
+  /* The entry of the function (or of the program) is executable */
+  sccp_mark_executable(&s, first);
+
+  while (s.work.length) {
+    SCCPInst *si = &s.insts[s.work.items[--s.work.length]];
+    if (s.executable[sccp_index(&s, si->block)])
+      sccp_visit(&s, si);
+  }
+
+  for (size_t i = 0; i < s.ninsts; i++) {
+    if (s.executable[sccp_index(&s, s.insts[i].block)])
+      sccp_rewrite(&s, &s.insts[i]);
+  }
+
+  /* Unlink blocks that can never execute */
+  BasicBlock *block = first->next;
+  while (block != end) {
+    BasicBlock *next = block->next;
+    if (!s.executable[sccp_index(&s, block)]) {
+      LOG_INFO("removing unreachable block '%s#%d'", block->tag, block->id);
+      block_unlink(block);
+    }
+    index[block->id] = -1;
+    block = next;
+  }
+  index[first->id] = -1;
+
+  sccp_deinit(&s);
+}
+
+void propagate_constants(BasicBlock *prog) {
+  if (!prog) return;
+
+  int nblocks = 0;
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (block->id >= nblocks)
+      nblocks = block->id + 1;
+  }
+
+  int *index = malloc(sizeof(int) * nblocks);
+  if (!index)
+    LOG_FATAL("malloc failed in propagate_constants");
+  for (int i = 0; i < nblocks; i++)
+    index[i] = -1;
+
+  /* The program entry & every function are propagated on their own */
+  BasicBlock *first = prog;
+  while (first) {
+    BasicBlock *end = first->next;
+    while (end && !(end->head && end->head->opcode == OP_DEF))
+      end = end->next;
+
+    propagate_function(first, end, index);
+    first = end;
+  }
+
+  free(index);
+}
+
+/* Algebraic Simplification & Strength Reduction
+ *
+ * Constants are moved to the right-hand side of commutative operations so
+ * that the identities below (and the backend) only need to look there.
+ * Multiplications by small constants become shifts, adds and subtracts
+ * (multiplications by 3, 5 and 9 are left for the backend to select `lea`),
+ * and divisions by constants become multiply-high sequences using the magic
+ * numbers from Hacker's Delight, chapter 10. */
+
+static bool is_integer_operand(const Operand *o) {
+  return IS_VALUE((*o)) && (o->val.kind == VAL_INT || o->val.kind == VAL_UINT);
+}
+
+static int64_t operand_integer(const Operand *o) {
+  return o->val.kind == VAL_UINT ? (int64_t)o->val.u_val : (int64_t)o->val.i_val;
+}
+
+static bool operand_equals(const Operand *o, int64_t n) {
+  return is_integer_operand(o) && operand_integer(o) == n;
+}
+
+static bool is_integer_type(const Type *type) {
+  return type && (type->kind == TY_INT || type->kind == TY_UINT
+      || type->kind == TY_CHAR || type->kind == TY_BOOL);
+}
+
+static Operand integer_operand(bool is_unsigned, int64_t n) {
+  Operand o = { .kind = O_VALUE };
+  if (is_unsigned) {
+    o.val.kind = VAL_UINT;
+    o.val.u_val = (uint32_t)n;
+  } else {
+    o.val.kind = VAL_INT;
+    o.val.i_val = (int32_t)n;
+  }
+  return o;
+}
+
+static Operand variable_operand(char *var) {
+  return (Operand){ .kind = O_VARIABLE, .var = var };
+}
+
+static void set_operation(Instruction *inst, Opcode opcode, int nopers, Operand lhs, Operand rhs) {
+  inst->opcode = opcode;
+  inst->nopers = nopers;
+  memset(inst->operands, 0, sizeof(inst->operands[0]) * MAX_OPERANDS);
+  inst->operands[0] = lhs;
+  if (nopers > 1)
+    inst->operands[1] = rhs;
+}
+
+/* Inserts `$vN := lhs <op> rhs` before `at` and returns $vN as an operand */
+static Operand emit_operation(BasicBlock *block, Instruction *at, Opcode opcode,
+                              Operand lhs, Operand rhs) {
+  Instruction *inst = instruction_create(opcode, at->span, at->type);
+  inst->assignee = make_temporary();
+  set_operation(inst, opcode, IS_UNARY_OP(opcode) ? 1 : 2, lhs, rhs);
+  block_insert_before(block, at, inst);
+  return variable_operand(inst->assignee);
+}
+
+static int log2_exact(uint64_t n) {
+  if (n == 0 || (n & (n - 1)) != 0)
+    return -1;
+
+  int k = 0;
+  while (n >>= 1)
+    k++;
+  return k;
+}
+
+static Opcode mirror_comparison(Opcode opcode) {
+  switch (opcode) {
+    case OP_CMP_LT: return OP_CMP_GT;
+    case OP_CMP_GT: return OP_CMP_LT;
+    case OP_CMP_LT_EQ: return OP_CMP_GT_EQ;
+    case OP_CMP_GT_EQ: return OP_CMP_LT_EQ;
+    default: return opcode;
+  }
+}
+
+static void canonicalize_operands(Instruction *inst) {
+  if (!IS_VALUE(inst->operands[0]) || !IS_VARIABLE(inst->operands[1]))
+    return;
+
+  switch (inst->opcode) {
+    case OP_ADD:
+    case OP_MUL:
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+      inst->opcode = mirror_comparison(inst->opcode);
+      Operand tmp = inst->operands[0];
+      inst->operands[0] = inst->operands[1];
+      inst->operands[1] = tmp;
+      break;
+    default: break;
+  }
+}
+
+/* Returns true if the instruction was rewritten */
+static bool apply_identities(Instruction *inst) {
+  Operand *lhs = &inst->operands[0];
+  Operand *rhs = &inst->operands[1];
+  bool integral = is_integer_type(inst->type);
+  bool is_unsigned = inst->type && inst->type->kind == TY_UINT;
+
+  switch (inst->opcode) {
+    case OP_ADD:
+      if (operand_equals(rhs, 0)) goto copy_lhs;
+      break;
+    case OP_SUB:
+      if (operand_equals(rhs, 0)) goto copy_lhs;
+      if (integral && operand_equals(lhs, 0)) {
+        set_operation(inst, OP_NEG, 1, *rhs, *rhs);
+        return true;
+      }
+      if (integral && inst->type->kind != TY_CHAR && IS_VARIABLE((*lhs)) && IS_VARIABLE((*rhs))
+          && strcmp(lhs->var, rhs->var) == 0) {
+        set_operation(inst, OP_ASSIGN, 1, integer_operand(is_unsigned, 0), *rhs);
+        return true;
+      }
+      break;
+    case OP_MUL:
+      if (operand_equals(rhs, 1)) goto copy_lhs;
+      if (integral && operand_equals(rhs, 0)) {
+        set_operation(inst, OP_ASSIGN, 1, *rhs, *rhs);
+        return true;
+      }
+      if (integral && operand_equals(rhs, -1) && rhs->val.kind == VAL_INT) {
+        set_operation(inst, OP_NEG, 1, *lhs, *lhs);
+        return true;
+      }
+      break;
+    case OP_DIV:
+      if (operand_equals(rhs, 1)) goto copy_lhs;
+      if (integral && !is_unsigned && operand_equals(rhs, -1) && rhs->val.kind == VAL_INT) {
+        set_operation(inst, OP_NEG, 1, *lhs, *lhs);
+        return true;
+      }
+      break;
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+      if (integral && IS_VARIABLE((*lhs)) && IS_VARIABLE((*rhs)) && strcmp(lhs->var, rhs->var) == 0) {
+        Operand result = { .kind = O_VALUE, .val = { .kind = VAL_BOOL } };
+        result.val.b_val = inst->opcode == OP_CMP
+          || inst->opcode == OP_CMP_LT_EQ || inst->opcode == OP_CMP_GT_EQ;
+        set_operation(inst, OP_ASSIGN, 1, result, result);
+        return true;
+      }
+      break;
+    default: break;
+  }
+  return false;
+
+copy_lhs:
+  set_operation(inst, OP_ASSIGN, 1, *lhs, *lhs);
+  return true;
+}
+
+static bool reduce_multiplication(BasicBlock *block, Instruction *inst, bool is_unsigned) {
+  Operand x = inst->operands[0];
+  int64_t n = operand_integer(&inst->operands[1]);
+  if (n <= 1 || n > UINT32_MAX)
+    return false;
+
+  int k = log2_exact(n);
+  if (k > 0) {
+    set_operation(inst, OP_SHL, 2, x, integer_operand(is_unsigned, k));
+    return true;
+  }
+
+  /* x * {3,5,9} is a single lea */
+  if (n == 3 || n == 5 || n == 9)
+    return false;
+
+  /* x * (m * 2^k) for m in {3,5,9} is a lea followed by a shift */
+  static const int lea_factors[] = { 3, 5, 9 };
+  for (int i = 0; i < 3; i++) {
+    int m = lea_factors[i];
+    if (n % m == 0 && (k = log2_exact(n / m)) > 0) {
+      Operand t = emit_operation(block, inst, OP_MUL, x, integer_operand(is_unsigned, m));
+      set_operation(inst, OP_SHL, 2, t, integer_operand(is_unsigned, k));
+      return true;
+    }
+  }
+
+  /* x * (2^k - 1) */
+  if ((k = log2_exact(n + 1)) > 0) {
+    Operand t = emit_operation(block, inst, OP_SHL, x, integer_operand(is_unsigned, k));
+    set_operation(inst, OP_SUB, 2, t, x);
+    return true;
+  }
+
+  /* x * (2^a + 2^b) */
+  int b = log2_exact(n & -n);
+  int a = log2_exact(n - (n & -n));
+  if (a > 0) {
+    Operand hi = emit_operation(block, inst, OP_SHL, x, integer_operand(is_unsigned, a));
+    Operand lo = b ? emit_operation(block, inst, OP_SHL, x, integer_operand(is_unsigned, b)) : x;
+    set_operation(inst, OP_ADD, 2, hi, lo);
+    return true;
+  }
+
+  return false;
+}
+
+static void magic_signed(int32_t d, int32_t *magic, int *shift) {
+  const uint32_t two31 = 0x80000000u;
+  uint32_t ad = d < 0 ? 0u - (uint32_t)d : (uint32_t)d;
+  uint32_t t = two31 + ((uint32_t)d >> 31);
+  uint32_t anc = t - 1 - t % ad;
+  uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+  uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+  uint32_t delta;
+  int p = 31;
+
+  do {
+    p++;
+    q1 <<= 1; r1 <<= 1;
+    if (r1 >= anc) { q1++; r1 -= anc; }
+    q2 <<= 1; r2 <<= 1;
+    if (r2 >= ad) { q2++; r2 -= ad; }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  uint32_t m = q2 + 1;
+  *magic = (int32_t)(d < 0 ? 0u - m : m);
+  *shift = p - 32;
+}
+
+static void magic_unsigned(uint32_t d, uint32_t *magic, int *shift, bool *add) {
+  uint32_t nc = UINT32_MAX - (0u - d) % d;
+  uint32_t q1 = 0x80000000u / nc, r1 = 0x80000000u - q1 * nc;
+  uint32_t q2 = INT32_MAX / d, r2 = INT32_MAX - q2 * d;
+  uint32_t delta;
+  int p = 31;
+
+  *add = false;
+  do {
+    p++;
+    if (r1 >= nc - r1) { q1 = 2 * q1 + 1; r1 = 2 * r1 - nc; }
+    else { q1 = 2 * q1; r1 = 2 * r1; }
+
+    if (r2 + 1 >= d - r2) {
+      if (q2 >= INT32_MAX) *add = true;
+      q2 = 2 * q2 + 1; r2 = 2 * r2 + 1 - d;
+    } else {
+      if (q2 >= 0x80000000u) *add = true;
+      q2 = 2 * q2; r2 = 2 * r2 + 1;
+    }
+    delta = d - 1 - r2;
+  } while (p < 64 && (q1 < delta || (q1 == delta && r1 == 0)));
+
+  *magic = q2 + 1;
+  *shift = p - 32;
+}
+
+static bool reduce_division(BasicBlock *block, Instruction *inst, bool is_unsigned) {
+  Operand x = inst->operands[0];
+  int64_t n = operand_integer(&inst->operands[1]);
+  int k, shift;
+
+  if (is_unsigned) {
+    uint32_t d = (uint32_t)n;
+    if (d <= 1)
+      return false;
+
+    if ((k = log2_exact(d)) > 0) {
+      set_operation(inst, OP_SHR, 2, x, integer_operand(true, k));
+      return true;
+    }
+
+    uint32_t magic;
+    bool add;
+    magic_unsigned(d, &magic, &shift, &add);
+
+    Operand q = emit_operation(block, inst, OP_UMULHI, x, integer_operand(true, magic));
+    if (add) {
+      Operand t = emit_operation(block, inst, OP_SUB, x, q);
+      t = emit_operation(block, inst, OP_SHR, t, integer_operand(true, 1));
+      t = emit_operation(block, inst, OP_ADD, t, q);
+      set_operation(inst, OP_SHR, 2, t, integer_operand(true, shift - 1));
+    } else if (shift > 0) {
+      set_operation(inst, OP_SHR, 2, q, integer_operand(true, shift));
+    } else {
+      set_operation(inst, OP_ASSIGN, 1, q, q);
+    }
+    return true;
+  }
+
+  int32_t d = (int32_t)n;
+  if (d == 0 || d == 1 || d == -1 || d == INT32_MIN)
+    return false;
+
+  /* Signed division by 2^k rounds towards zero: bias negative dividends */
+  int32_t ad = d < 0 ? -d : d;
+  if ((k = log2_exact(ad)) > 0) {
+    Operand sign = emit_operation(block, inst, OP_SAR, x, integer_operand(false, 31));
+    Operand bias = emit_operation(block, inst, OP_SHR, k == 1 ? x : sign, integer_operand(false, 32 - k));
+    Operand biased = emit_operation(block, inst, OP_ADD, x, bias);
+    if (d > 0) {
+      set_operation(inst, OP_SAR, 2, biased, integer_operand(false, k));
+    } else {
+      Operand q = emit_operation(block, inst, OP_SAR, biased, integer_operand(false, k));
+      set_operation(inst, OP_NEG, 1, q, q);
+    }
+    return true;
+  }
+
+  int32_t magic;
+  magic_signed(d, &magic, &shift);
+
+  Operand q = emit_operation(block, inst, OP_MULHI, x, integer_operand(false, magic));
+  if (d > 0 && magic < 0)
+    q = emit_operation(block, inst, OP_ADD, q, x);
+  else if (d < 0 && magic > 0)
+    q = emit_operation(block, inst, OP_SUB, q, x);
+  if (shift > 0)
+    q = emit_operation(block, inst, OP_SAR, q, integer_operand(false, shift));
+
+  /* Round towards zero by adding one to negative quotients */
+  Operand sign = emit_operation(block, inst, OP_SHR, q, integer_operand(false, 31));
+  set_operation(inst, OP_ADD, 2, q, sign);
+  return true;
+}
+
+void simplify_instructions(BasicBlock *prog) {
+  for (BasicBlock *block = prog; block; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (!IS_BINARY_OP(inst->opcode) || inst->nopers != 2)
+        continue;
+
+      canonicalize_operands(inst);
+
+      if (apply_identities(inst)) {
+        LOG_INFO("simplified algebraic identity for '%s' at line %d, col %d",
+            inst->assignee, inst->span.line, inst->span.col);
+        continue;
+      }
+
+      /* Strength reduction only applies to 32-bit integers with a constant operand */
+      if (!IS_VARIABLE(inst->operands[0]) || !is_integer_operand(&inst->operands[1])
+          || !inst->type || (inst->type->kind != TY_INT && inst->type->kind != TY_UINT))
+        continue;
+
+      bool is_unsigned = inst->type->kind == TY_UINT;
+      bool reduced = false;
+      if (inst->opcode == OP_MUL)
+        reduced = reduce_multiplication(block, inst, is_unsigned);
+      else if (inst->opcode == OP_DIV)
+        reduced = reduce_division(block, inst, is_unsigned);
+
+      if (reduced) {
+        LOG_INFO("strength-reduced operation for '%s' at line %d, col %d",
+            inst->assignee, inst->span.line, inst->span.col);
+      }
+    }
+  }
+}
@@ -9,6 +9,7 @@
 #include "defs.h"
 #include "hashmap.h"
 #include "parse.h"
+#include "strpool.h"
 #include "symtab.h"
 #include "types.h"
 #include "util.h"
@@ -18,6 +19,9 @@ static Scope *scope     = NULL;
 static Token *prev_tok  = NULL;
 static Token *tok       = NULL;
 
+/* Return type of the function being parsed */
+static const Type *return_type = NULL;
+
 /* TODO: Get line context at error location */
 static void fail_at(Token *tok, const char *fmt, ...) {
   fprintf(stderr, "%s:%d:%d: ",
@@ -62,7 +66,7 @@ static bool match(const char *str) {
 
 static Token *expect(const char *str) {
   if (!match(str))
-    fail_at(tok, "expected '%s', got '%.*s' ", TOKSTR(tok));
+    fail_at(tok, "expected '%s', got '%.*s' ", str, TOKSTR(tok));
   return prev_tok;
 }
 
@@ -103,11 +107,55 @@ static Node *parse_block();
 static Node *parse_expression();
 static Node *parse_identifier();
 
+/* Implicit conversion of an expression to `type`. Only conversions to &
+ * from floating point change the representation of a value, the integer
+ * types are left as they are. Constants are converted in place. */
+static Node *convert(Node *node, const Type *type) {
+  if (node->type->kind == type->kind
+      || !(IS_FLOATING(node->type->kind) || IS_FLOATING(type->kind)))
+    return node;
+
+  if (node->kind == ND_VALUE_EXPR) {
+    if (!convert_value(&node->value, type))
+      LOG_FATAL("cannot convert value at line %d, col %d to '%s'",
+          node->span.line, node->span.col, type->name);
+    node->type = type;
+    return node;
+  }
+
+  if (node->type->kind == TY_VOID)
+    LOG_FATAL("void expression at line %d, col %d used as '%s'",
+        node->span.line, node->span.col, type->name);
+
+  Node *conv = node_new(ND_UNARY_EXPR);
+  conv->unary.un_op = UN_CONV;
+  conv->unary.expr = node;
+  conv->type = type;
+  conv->span = node->span;
+  return conv;
+}
+
+/* Type both operands of an arithmetic operation are converted to */
+static const Type *common_type(const Type *a, const Type *b) {
+  if (a->kind == TY_DOUBLE || b->kind == TY_DOUBLE)
+    return &PRIMITIVES[TY_DOUBLE];
+  if (a->kind == TY_FLOAT || b->kind == TY_FLOAT)
+    return &PRIMITIVES[TY_FLOAT];
+  return a;
+}
+
 static Node *parse_unary(Node **stack, char un_op) {
   Node *node = node_new(ND_UNARY_EXPR);
   node->unary.un_op = un_op;
   node->unary.expr = pop_node(stack);
   node->type = node->unary.expr->type;
+
+  if (un_op == UN_DEREF) {
+    node->type = pointee_type(node->unary.expr->type);
+    if (!node->type)
+      LOG_FATAL("cannot dereference '%s' at line %d, col %d",
+          node->unary.expr->type->name, node->span.line, node->span.col);
+  }
   return node;
 }
 
@@ -117,7 +165,14 @@ static Node *parse_binary(Node **stack, char bin_op) {
   node->binary.lhs = pop_node(stack);
   parse_term(stack);
   node->binary.rhs = pop_node(stack);
-  node->type = node->binary.lhs->type;
+
+  const Type *type = common_type(node->binary.lhs->type, node->binary.rhs->type);
+  node->binary.lhs = convert(node->binary.lhs, type);
+  node->binary.rhs = convert(node->binary.rhs, type);
+
+  /* Comparisons are bool, whatever the type of their operands */
+  bool comparison = bin_op >= BIN_CMP && bin_op <= BIN_CMP_GT_EQ;
+  node->type = comparison ? &PRIMITIVES[TY_BOOL] : type;
   return node;
 }
 
@@ -133,15 +188,21 @@ static Node *parse_call(Token *ident) {
   node->type = symbol->node->func.return_type;
   node->call.name = format("%.*s", TOKSTR(ident));
 
-  expect("(");
-
+  /* NOTE: the opening parenthesis was consumed by parse_identifier */
   Node args = { 0 };
   Node *cur = &args;
+  Node *param = symbol->node->func.params;
 
   for (;;) {
     if (match(")")) break;
 
-    cur = cur->next = parse_expression();
+    /* Arguments are converted to the type of their parameter */
+    Node *arg = parse_expression();
+    if (param) {
+      arg = convert(arg, param->var.type);
+      param = param->next;
+    }
+    cur = cur->next = arg;
 
     if (match(",")) { continue; }
     else { expect(")"); break; }
@@ -153,9 +214,23 @@ static Node *parse_call(Token *ident) {
 
 static Node *parse_number() {
   Node *node = node_new(ND_VALUE_EXPR);
-  node->type = &PRIMITIVES[TY_INT];
-  node->value.kind = VAL_INT;
-  node->value.i_val = stoi(tok->text, tok->len);
+
+  /* Numbers with a fraction or an exponent are doubles */
+  bool floating = false;
+  for (size_t i = 0; i < tok->len; i++) {
+    if (tok->text[i] == '.' || tok->text[i] == 'e' || tok->text[i] == 'E')
+      floating = true;
+  }
+
+  if (floating) {
+    node->type = &PRIMITIVES[TY_DOUBLE];
+    node->value.kind = VAL_DOUBLE;
+    node->value.d_val = stod(tok->text, tok->len);
+  } else {
+    node->type = &PRIMITIVES[TY_INT];
+    node->value.kind = VAL_INT;
+    node->value.i_val = stoi(tok->text, tok->len);
+  }
   advance();
   return node;
 }
@@ -177,6 +252,19 @@ static Node *parse_character() {
   return node;
 }
 
+/* Literals are interned as they are parsed, so that identical ones in any
+ * unit end up as the same string of the pool */
+static Node *parse_string() {
+  Node *node = node_new(ND_VALUE_EXPR);
+  node->type = &CHAR_POINTER;
+  node->value.kind = VAL_STRING;
+  int id = strpool_intern(&STRINGS, tok->text, tok->len);
+  node->value.s_val = STRINGS.strings[id].text;
+  node->value.s_len = tok->len;
+  advance();
+  return node;
+}
+
 static void parse_factor(Node **stack) {
   Node *node = NULL;
   if (tok->kind == TOK_IDENT) {
@@ -185,6 +273,8 @@ static void parse_factor(Node **stack) {
     node = parse_number();
   } else if (tok->kind == TOK_CHAR) {
     node = parse_character();
+  } else if (tok->kind == TOK_STRING) {
+    node = parse_string();
   } else if (match("true")) {
     node = parse_boolean(true);
   } else if (match("false")) {
@@ -209,14 +299,15 @@ static void parse_term(Node **stack) {
 }
 
 static void _parse_expression(Node **stack) {
-  int un_op = 0;
+  /* UN_NEG is 0, so no operator is -1 */
+  int un_op = -1;
   if      (match("-")) { un_op = UN_NEG; }
   else if (match("!")) { un_op = UN_NOT; }
   else if (match("*")) { un_op = UN_DEREF; }
 
   parse_term(stack);
 
-  if (un_op != 0) {
+  if (un_op != -1) {
     Node *node = parse_unary(stack, un_op);
     push_node(stack, node);
   }
@@ -249,6 +340,20 @@ static Node *parse_if_statement() {
 
   /* TODO: add typechecking to see if expression is a logical expression */
   node->cond.expr = parse_expression();
+
+  /* Floating point conditions are compared against zero */
+  if (IS_FLOATING(node->cond.expr->type->kind)) {
+    Node *cmp = node_new(ND_BINARY_EXPR);
+    cmp->binary.bin_op = BIN_CMP_NOT;
+    cmp->binary.lhs = node->cond.expr;
+    cmp->binary.rhs = node_new(ND_VALUE_EXPR);
+    cmp->binary.rhs->value.kind = VAL_INT;
+    cmp->binary.rhs->type = &PRIMITIVES[TY_INT];
+    cmp->binary.rhs = convert(cmp->binary.rhs, cmp->binary.lhs->type);
+    cmp->type = &PRIMITIVES[TY_BOOL];
+    cmp->span = node->cond.expr->span;
+    node->cond.expr = cmp;
+  }
   node->cond.body = parse_block();
 
   return node;
@@ -290,6 +395,7 @@ static Node *parse_varref(Token *ident) {
 
   node->type = symbol->node->var.type;
   node->ref = format("%.*s", TOKSTR(ident));
+  node->decl = symbol->node;
 
   return node;
 }
@@ -321,7 +427,7 @@ static Node *parse_vardecl() {
     node->var.type = parse_type();
 
     if (match("=")) {
-      node->var.value = parse_expression();
+      node->var.value = convert(parse_expression(), node->var.type);
     } else {
       LOG_WARN("uninitialized variable '%s' on line %d, col %d",
           node->var.name, node->span.line, node->span.col);
@@ -334,12 +440,17 @@ static Node *parse_vardecl() {
 static Node *parse_assignment(Token *ident) {
   assert(ident->kind == TOK_IDENT);
 
-  if (!find_symbol(scope, ident->text, ident->len))
+  Symbol *symbol = find_symbol(scope, ident->text, ident->len);
+  if (!symbol)
     fail_at(ident, "unknown variable '%.*s'", TOKSTR(ident));
+  else if (symbol->kind != SYM_VAR)
+    fail_at(ident, "symbol '%s' is not a variable", symbol->name);
 
   Node *node = node_new(ND_ASSIGN_STMT);
   node->assign.name = format("%.*s", TOKSTR(ident));
-  node->assign.value = parse_expression();
+  node->decl = symbol->node;
+  node->type = symbol->node->var.type;
+  node->assign.value = convert(parse_expression(), node->type);
 
   /* TODO: add typechecking to see if expression matches declared type for var */
 
@@ -348,7 +459,7 @@ static Node *parse_assignment(Token *ident) {
 
 static Node *parse_return() {
   Node *node = node_new(ND_RET_STMT);
-  node->ret.value = parse_expression();
+  node->ret.value = convert(parse_expression(), return_type);
   return node;
 }
 
@@ -469,6 +580,7 @@ static Node *parse_funcdecl() {
 
   /* Parse function return type (if no arrow, it's TY_VOID) */
   node->func.return_type = match("->") ? parse_type() : &PRIMITIVES[TY_VOID];
+  return_type = node->func.return_type;
 
   /* Parse function body */
   node->func.body = parse_block();
@@ -479,6 +591,64 @@ static Node *parse_funcdecl() {
   return node;
 }
 
+/* Locals share the namespace of globals in the IR, where passes & backends
+ * tell a global apart by its name. A local shadowing a global variable is
+ * renamed `<function>.<name>` from its declaration, & so are the references
+ * & assignments the parser bound to it. Globals declared after a function
+ * are only known here, once the whole module is parsed. */
+static void rename_bindings(Node *node, const char *func) {
+  for (; node; node = node->next) {
+    switch (node->kind) {
+      case ND_FUNC_DECL:
+        rename_bindings(node->func.params, node->func.name);
+        rename_bindings(node->func.body, node->func.name);
+        break;
+      case ND_VAR_DECL:
+        rename_bindings(node->var.value, func);
+        if (func) {
+          Symbol *global = find_symbol(&SYMTAB, node->var.name, strlen(node->var.name));
+          if (global && global->kind == SYM_VAR) {
+            char *name = format("%s.%s", func, node->var.name);
+            free(node->var.name);
+            node->var.name = name;
+          }
+        }
+        break;
+      case ND_REF_EXPR:
+        if (strcmp(node->ref, node->decl->var.name) != 0) {
+          free(node->ref);
+          node->ref = format("%s", node->decl->var.name);
+        }
+        break;
+      case ND_ASSIGN_STMT:
+        rename_bindings(node->assign.value, func);
+        if (strcmp(node->assign.name, node->decl->var.name) != 0) {
+          free(node->assign.name);
+          node->assign.name = format("%s", node->decl->var.name);
+        }
+        break;
+      case ND_RET_STMT:
+        rename_bindings(node->ret.value, func);
+        break;
+      case ND_COND_STMT:
+        rename_bindings(node->cond.expr, func);
+        rename_bindings(node->cond.body, func);
+        break;
+      case ND_CALL_EXPR:
+        rename_bindings(node->call.args, func);
+        break;
+      case ND_UNARY_EXPR:
+        rename_bindings(node->unary.expr, func);
+        break;
+      case ND_BINARY_EXPR:
+        rename_bindings(node->binary.lhs, func);
+        rename_bindings(node->binary.rhs, func);
+        break;
+      default: break;
+    }
+  }
+}
+
 Node *parse(File *file, Token *tokens) {
   /* Initialize parser state */
   currfile = file;
@@ -501,6 +671,7 @@ Node *parse(File *file, Token *tokens) {
     cur = cur->next = decl;
   }
 
+  rename_bindings(ast.next, NULL);
   return ast.next;
 }
 
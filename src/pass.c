@@ -0,0 +1,282 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ast.h"
+#include "callgraph.h"
+#include "ir.h"
+#include "optimize.h"
+#include "pass.h"
+#include "util.h"
+
+/* Pass Manager
+ *
+ * Every optimization is registered here under the name used by
+ * `-f <pass>` / `-f no-<pass>`. The pipeline decides the order the passes
+ * run in; a pass may appear more than once (e.g. to clean up after another
+ * pass), in which case the later runs can require a higher -O level. */
+
+static Pass PASSES[] = {
+  {
+    .name = "fold",
+    .description = "fold constant expressions in the AST",
+    .kind = PASS_AST,
+    .level = 1,
+    .run.ast = fold_constants,
+  },
+  {
+    .name = "cse",
+    .description = "eliminate common subexpressions while lowering",
+    .kind = PASS_LOWERING,
+    .level = 1,
+  },
+  {
+    .name = "globals",
+    .description = "propagate the values of globals that are never stored to",
+    .kind = PASS_IR,
+    .level = 1,
+    .run.ir = propagate_globals,
+  },
+  {
+    .name = "sccp",
+    .description = "sparse conditional constant propagation",
+    .kind = PASS_IR,
+    .level = 1,
+    .run.ir = propagate_constants,
+  },
+  {
+    .name = "simplify",
+    .description = "algebraic simplification & strength reduction",
+    .kind = PASS_IR,
+    .level = 1,
+    .run.ir = simplify_instructions,
+  },
+  {
+    .name = "ctfe",
+    .description = "evaluate calls with constant arguments at compile time",
+    .kind = PASS_IR,
+    .level = 1,
+    .run.ir = evaluate_calls,
+  },
+  {
+    .name = "inline",
+    .description = "inline small & single-use functions into their callers",
+    .kind = PASS_IR,
+    .level = 1,
+    .run.ir = inline_functions,
+  },
+  {
+    .name = "dfe",
+    .description = "remove functions that are no longer called",
+    .kind = PASS_IR,
+    .level = 1,
+    .run.ir = eliminate_dead_functions,
+  },
+  {
+    .name = "dce",
+    .description = "remove assignments whose value is never used",
+    .kind = PASS_IR,
+    .level = 1,
+    .run.ir = eliminate_dead_code,
+  },
+  {
+    .name = "select",
+    .description = "compile branches over single assignments to setcc/cmov",
+    .kind = PASS_MACHINE,
+    .level = 1,
+  },
+  {
+    .name = "peephole",
+    .description = "peephole optimization of the machine instructions",
+    .kind = PASS_MACHINE,
+    .level = 1,
+  },
+};
+
+#define NUM_PASSES (sizeof(PASSES) / sizeof(PASSES[0]))
+
+typedef struct {
+  const char *pass;
+  int level;
+  const char *after;  /* Only run when this pass is enabled as well */
+} PipelineStep;
+
+static const PipelineStep IR_PIPELINE[] = {
+  { "globals", 0, NULL },
+  { "sccp", 0, NULL },
+  { "ctfe", 0, NULL },
+  { "sccp", 0, "ctfe" },
+  { "simplify", 0, NULL },
+  { "inline", 0, NULL },
+  { "sccp", 0, "inline" },
+  { "dfe", 0, NULL },
+  { "sccp", 2, NULL },
+  { "dce", 0, NULL },
+};
+
+#define NUM_IR_STEPS (sizeof(IR_PIPELINE) / sizeof(IR_PIPELINE[0]))
+
+typedef struct {
+  const char *name;
+  double seconds;
+} Phase;
+
+#define MAX_PHASES 16
+static Phase phases[MAX_PHASES];
+static size_t nphases = 0;
+
+static int level = DEFAULT_OPT_LEVEL;
+static bool timing = false;
+
+static Pass *find_pass(const char *name) {
+  for (size_t i = 0; i < NUM_PASSES; i++) {
+    if (strcmp(PASSES[i].name, name) == 0)
+      return &PASSES[i];
+  }
+  return NULL;
+}
+
+void passes_init(int opt_level, bool timed) {
+  level = opt_level;
+  timing = timed;
+  for (size_t i = 0; i < NUM_PASSES; i++)
+    PASSES[i].enabled = opt_level >= PASSES[i].level;
+}
+
+/* Handles `<pass>` and `no-<pass>`. Returns false if no such pass exists. */
+bool passes_toggle(const char *arg) {
+  bool enable = true;
+  if (strncmp(arg, "no-", 3) == 0) {
+    enable = false;
+    arg += 3;
+  }
+
+  Pass *pass = find_pass(arg);
+  if (!pass)
+    return false;
+
+  pass->enabled = enable;
+  return true;
+}
+
+bool pass_enabled(const char *name) {
+  Pass *pass = find_pass(name);
+  return pass && pass->enabled;
+}
+
+int pass_opt_level() {
+  return level;
+}
+
+void passes_list() {
+  for (size_t i = 0; i < NUM_PASSES; i++) {
+    fprintf(stderr, "  %-12s -O%d  %s\n",
+        PASSES[i].name, PASSES[i].level, PASSES[i].description);
+  }
+}
+
+double timer_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void record_phase(const char *name, double start) {
+  if (!timing)
+    return;
+
+  double elapsed = timer_now() - start;
+  for (size_t i = 0; i < nphases; i++) {
+    if (strcmp(phases[i].name, name) == 0) {
+      phases[i].seconds += elapsed;
+      return;
+    }
+  }
+
+  if (nphases < MAX_PHASES)
+    phases[nphases++] = (Phase){ .name = name, .seconds = elapsed };
+}
+
+long count_instructions(BasicBlock *prog) {
+  long count = 0;
+  for (BasicBlock *block = prog; block; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode != OP_DEAD)
+        count++;
+    }
+  }
+  return count;
+}
+
+void run_ast_passes(Node *ast) {
+  for (size_t i = 0; i < NUM_PASSES; i++) {
+    Pass *pass = &PASSES[i];
+    if (pass->kind != PASS_AST || !pass->enabled)
+      continue;
+
+    double start = timing ? timer_now() : 0;
+    pass->run.ast(ast);
+    if (timing) {
+      pass->seconds += timer_now() - start;
+      pass->runs++;
+    }
+  }
+}
+
+void run_ir_passes(BasicBlock *prog) {
+  for (size_t i = 0; i < NUM_IR_STEPS; i++) {
+    Pass *pass = find_pass(IR_PIPELINE[i].pass);
+    if (!pass || !pass->enabled || level < IR_PIPELINE[i].level)
+      continue;
+    if (IR_PIPELINE[i].after && !pass_enabled(IR_PIPELINE[i].after))
+      continue;
+
+    if (!timing) {
+      pass->run.ir(prog);
+      continue;
+    }
+
+    long before = count_instructions(prog);
+    double start = timer_now();
+    pass->run.ir(prog);
+    pass->seconds += timer_now() - start;
+    pass->ir_delta += count_instructions(prog) - before;
+    pass->runs++;
+  }
+}
+
+void print_pass_timings() {
+  double total = 0;
+  for (size_t i = 0; i < NUM_PASSES; i++)
+    total += PASSES[i].seconds;
+  for (size_t i = 0; i < nphases; i++)
+    total += phases[i].seconds;
+
+  fprintf(stderr, "===== pass timings (-O%d) =====\n", level);
+  fprintf(stderr, "  %-12s %4s %12s %7s %10s\n", "name", "runs", "time (ms)", "%", "IR delta");
+
+  for (size_t i = 0; i < nphases; i++) {
+    fprintf(stderr, "  %-12s %4s %12.3f %6.1f%% %10s\n",
+        phases[i].name, "-", phases[i].seconds * 1e3,
+        total > 0 ? phases[i].seconds * 100 / total : 0, "-");
+  }
+
+  for (size_t i = 0; i < NUM_PASSES; i++) {
+    Pass *pass = &PASSES[i];
+    if (!pass->runs)
+      continue;
+
+    fprintf(stderr, "  %-12s %4d %12.3f %6.1f%% ",
+        pass->name, pass->runs, pass->seconds * 1e3,
+        total > 0 ? pass->seconds * 100 / total : 0);
+    if (pass->kind == PASS_IR)
+      fprintf(stderr, "%+10ld\n", pass->ir_delta);
+    else
+      fprintf(stderr, "%10s\n", "-");
+  }
+
+  fprintf(stderr, "  %-12s %4s %12.3f\n", "total", "", total * 1e3);
+}
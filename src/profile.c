@@ -0,0 +1,209 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "ir.h"
+#include "profile.h"
+#include "util.h"
+
+/* Frequency of blocks that never ran */
+#define MIN_FREQUENCY (1.0 / 1024)
+
+typedef struct {
+  int *items;
+  size_t length, capacity;
+} Shape;
+
+static void shape_push(Shape *shape, int item) {
+  if (shape->length == shape->capacity) {
+    shape->capacity = shape->capacity ? shape->capacity << 1 : 64;
+    int *tmp = realloc(shape->items, sizeof(int) * shape->capacity);
+    if (!tmp)
+      LOG_FATAL("realloc failed in shape_push");
+    shape->items = tmp;
+  }
+  shape->items[shape->length++] = item;
+}
+
+/* Hashes the control flow graph of a function: every block with the
+ * positions of its successors & its number of calls */
+static uint64_t cfg_hash(BasicBlock *entry, BasicBlock *end, int *nblocks, int *ncalls) {
+  int max_id = 0;
+  *nblocks = *ncalls = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next, (*nblocks)++) {
+    if (block->id > max_id)
+      max_id = block->id;
+  }
+
+  int *position = malloc(sizeof(int) * (max_id + 1));
+  if (!position)
+    LOG_FATAL("malloc failed in cfg_hash");
+  memset(position, -1, sizeof(int) * (max_id + 1));
+
+  int i = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next)
+    position[block->id] = i++;
+
+  Shape shape = { 0 };
+  shape_push(&shape, *nblocks);
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    shape_push(&shape, block->nsuccs);
+    for (int s = 0; s < block->nsuccs; s++) {
+      int id = block->succ[s]->id;
+      shape_push(&shape, id <= max_id ? position[id] : -1);
+    }
+
+    int calls = 0;
+    for (Instruction *inst = block->head; inst; inst = inst->next)
+      calls += inst->opcode == OP_CALL;
+    shape_push(&shape, calls);
+    *ncalls += calls;
+  }
+
+  uint64_t hash = fnv1a64_2((const char *)shape.items, sizeof(int) * shape.length);
+  free(shape.items);
+  free(position);
+  return hash;
+}
+
+static ProfiledFunction *add_function(Profile *profile, ProfiledFunction fn) {
+  ProfiledFunction *tmp = realloc(profile->functions, sizeof(ProfiledFunction) * (profile->nfunctions + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in add_function");
+  profile->functions = tmp;
+
+  tmp[profile->nfunctions++] = fn;
+  hashmap_insert(&profile->index, fn.name, (void *)(intptr_t)profile->nfunctions);
+  return &tmp[profile->nfunctions - 1];
+}
+
+void profile_instrument(BasicBlock *prog, Profile *profile) {
+  memset(profile, 0, sizeof(Profile));
+  hashmap_init(&profile->index);
+
+  for (BasicBlock *entry = prog; entry; ) {
+    if (!IS_FUNCTION_ENTRY(entry)) {
+      entry = entry->next;
+      continue;
+    }
+
+    BasicBlock *end = function_end(entry);
+    ProfiledFunction fn = { .name = format("%s", entry->head->operands[0].label) };
+    fn.hash = cfg_hash(entry, end, &fn.nblocks, &fn.ncalls);
+    fn.base = profile->ncounters;
+    add_function(profile, fn);
+
+    int counter = fn.base, call = fn.base + fn.nblocks;
+    for (BasicBlock *block = entry; block != end; block = block->next) {
+      block_add_counter(block, counter++);
+      for (Instruction *inst = block->head; inst; inst = inst->next) {
+        if (inst->opcode == OP_CALL)
+          inst->counter = call++;
+      }
+    }
+    profile->ncounters = call;
+    entry = end;
+  }
+}
+
+char *profile_header(Profile *profile) {
+  char *header = format("neoprof %d %zu %d\n", PROFILE_VERSION, profile->nfunctions, profile->ncounters);
+  for (size_t i = 0; i < profile->nfunctions; i++) {
+    ProfiledFunction *fn = &profile->functions[i];
+    char *line = format("%s%s %016" PRIx64 " %d %d\n", header, fn->name, fn->hash, fn->nblocks, fn->ncalls);
+    free(header);
+    header = line;
+  }
+  return header;
+}
+
+void profile_read(Profile *profile, const char *path) {
+  memset(profile, 0, sizeof(Profile));
+  hashmap_init(&profile->index);
+
+  size_t size;
+  char *data = readfile(path, &size);
+  char *p = data, *limit = data + size;
+
+  int version, n;
+  size_t nfunctions;
+  if (sscanf(p, "neoprof %d %zu %d%n", &version, &nfunctions, &profile->ncounters, &n) != 3 || version != PROFILE_VERSION)
+    LOG_FATAL("%s: not a version %d .neoprof file", path, PROFILE_VERSION);
+  p += n + 1;
+
+  for (size_t i = 0; i < nfunctions; i++) {
+    char name[256];
+    ProfiledFunction fn = { 0 };
+    if (p >= limit || sscanf(p, "%255s %" SCNx64 " %d %d%n", name, &fn.hash, &fn.nblocks, &fn.ncalls, &n) != 4)
+      LOG_FATAL("%s: malformed profile header", path);
+    p += n + 1;
+
+    fn.name = format("%s", name);
+    ProfiledFunction *prev = profile->nfunctions ? &profile->functions[profile->nfunctions - 1] : NULL;
+    fn.base = prev ? prev->base + prev->nblocks + prev->ncalls : 0;
+    add_function(profile, fn);
+  }
+
+  size_t bytes = sizeof(uint64_t) * profile->ncounters;
+  if (p > limit || (size_t)(limit - p) != bytes)
+    LOG_FATAL("%s: expected %d counters in the profile", path, profile->ncounters);
+
+  profile->counts = malloc(bytes ? bytes : 1);
+  if (!profile->counts)
+    LOG_FATAL("malloc failed in profile_read");
+  memcpy(profile->counts, p, bytes);
+  free(data);
+}
+
+void profile_annotate(BasicBlock *prog, Profile *profile) {
+  for (BasicBlock *entry = prog; entry; ) {
+    if (!IS_FUNCTION_ENTRY(entry)) {
+      entry = entry->next;
+      continue;
+    }
+
+    BasicBlock *end = function_end(entry);
+    const char *name = entry->head->operands[0].label;
+    int nblocks, ncalls;
+    uint64_t hash = cfg_hash(entry, end, &nblocks, &ncalls);
+
+    int index = (int)(intptr_t)hashmap_lookup(&profile->index, name) - 1;
+    ProfiledFunction *fn = index >= 0 ? &profile->functions[index] : NULL;
+    if (!fn) {
+      LOG_WARN("no profile for function '%s'", name);
+    } else if (fn->hash != hash || fn->nblocks != nblocks || fn->ncalls != ncalls) {
+      LOG_WARN("profile of function '%s' is stale, its control flow changed", name);
+    } else {
+      uint64_t *counts = profile->counts + fn->base;
+      uint64_t *calls = counts + nblocks;
+      for (BasicBlock *block = entry; block != end; block = block->next) {
+        block->count = (int64_t)*counts++;
+        for (Instruction *inst = block->head; inst; inst = inst->next) {
+          if (inst->opcode == OP_CALL)
+            inst->count = (int64_t)*calls++;
+        }
+      }
+    }
+    entry = end;
+  }
+}
+
+void profile_free(Profile *profile) {
+  for (size_t i = 0; i < profile->nfunctions; i++)
+    free(profile->functions[i].name);
+  free(profile->functions);
+  free(profile->counts);
+  hashmap_free(&profile->index);
+  memset(profile, 0, sizeof(Profile));
+}
+
+double block_frequency(BasicBlock *entry, BasicBlock *block) {
+  if (block->count < 0 || entry->count <= 0)
+    return 1;
+
+  double frequency = (double)block->count / (double)entry->count;
+  return frequency > MIN_FREQUENCY ? frequency : MIN_FREQUENCY;
+}
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strpool.h"
+#include "util.h"
+
+StringPool STRINGS = { 0 };
+
+void strpool_init(StringPool *pool) {
+  memset(pool, 0, sizeof(StringPool));
+  hashmap_init(&pool->index);
+  hashmap_init(&pool->labels);
+}
+
+void strpool_free(StringPool *pool) {
+  for (size_t i = 0; i < pool->nstrings; i++) {
+    free(pool->strings[i].text);
+    free(pool->strings[i].label);
+  }
+  free(pool->strings);
+  free(pool->data);
+  free(pool->order);
+  hashmap_free(&pool->index);
+  hashmap_free(&pool->labels);
+}
+
+int strpool_intern(StringPool *pool, const char *text, size_t len) {
+  void *exists = hashmap_lookup2(&pool->index, text, len);
+  if (exists)
+    return (int)(intptr_t)exists - 1;
+
+  if (pool->nstrings == pool->capacity) {
+    pool->capacity = pool->capacity ? pool->capacity * 2 : 16;
+    pool->strings = realloc(pool->strings, sizeof(PooledString) * pool->capacity);
+    if (!pool->strings)
+      LOG_FATAL("realloc failed in strpool_intern");
+  }
+
+  int id = (int)pool->nstrings++;
+  PooledString *s = &pool->strings[id];
+  s->text = malloc(len + 1);
+  if (!s->text)
+    LOG_FATAL("malloc failed in strpool_intern");
+  memcpy(s->text, text, len);
+  s->text[len] = 0;
+  s->len = len;
+  s->label = format("str.%d", id);
+  s->used = false;
+  s->root = id;
+  s->offset = 0;
+
+  hashmap_insert(&pool->index, s->text, (void *)(intptr_t)(id + 1));
+  hashmap_insert(&pool->labels, s->label, (void *)(intptr_t)(id + 1));
+  return id;
+}
+
+PooledString *strpool_find(StringPool *pool, const char *label) {
+  void *exists = hashmap_lookup(&pool->labels, label);
+  return exists ? &pool->strings[(intptr_t)exists - 1] : NULL;
+}
+
+bool strpool_use(StringPool *pool, const char *label) {
+  PooledString *s = strpool_find(pool, label);
+  if (!s)
+    return false;
+  s->used = true;
+  return true;
+}
+
+/* Strings compared from their last character backwards, so that a string
+ * comes right before the ones it is a suffix of */
+static const PooledString *sorted_strings;
+
+static int compare_reversed(const void *a, const void *b) {
+  const PooledString *x = &sorted_strings[*(const int *)a], *y = &sorted_strings[*(const int *)b];
+  for (size_t i = 1; i <= x->len && i <= y->len; i++) {
+    unsigned char cx = x->text[x->len - i], cy = y->text[y->len - i];
+    if (cx != cy)
+      return cx - cy;
+  }
+  return (x->len > y->len) - (x->len < y->len);
+}
+
+static bool is_suffix(const PooledString *s, const PooledString *of) {
+  return s->len <= of->len && memcmp(s->text, of->text + of->len - s->len, s->len) == 0;
+}
+
+/* Used strings by offset, & by index among equal offsets */
+static int compare_offsets(const void *a, const void *b) {
+  const PooledString *x = &sorted_strings[*(const int *)a], *y = &sorted_strings[*(const int *)b];
+  if (x->offset != y->offset)
+    return (x->offset > y->offset) - (x->offset < y->offset);
+  return *(const int *)a - *(const int *)b;
+}
+
+void strpool_layout(StringPool *pool) {
+  free(pool->data);
+  free(pool->order);
+
+  pool->order = malloc(sizeof(int) * (pool->nstrings ? pool->nstrings : 1));
+  if (!pool->order)
+    LOG_FATAL("malloc failed in strpool_layout");
+
+  pool->norder = 0;
+  for (size_t i = 0; i < pool->nstrings; i++) {
+    if (pool->strings[i].used)
+      pool->order[pool->norder++] = (int)i;
+  }
+
+  /* After sorting, a string that ends others also ends the one following
+   * it, which is stored in the longest of them */
+  sorted_strings = pool->strings;
+  qsort(pool->order, pool->norder, sizeof(int), compare_reversed);
+  for (size_t i = pool->norder; i-- > 0;) {
+    PooledString *s = &pool->strings[pool->order[i]];
+    if (i + 1 < pool->norder && is_suffix(s, &pool->strings[pool->order[i + 1]]))
+      s->root = pool->strings[pool->order[i + 1]].root;
+    else
+      s->root = pool->order[i];
+  }
+
+  /* Roots are placed in the order they were interned, each with its NUL */
+  pool->size = 0;
+  for (size_t i = 0; i < pool->nstrings; i++) {
+    PooledString *s = &pool->strings[i];
+    if (s->used && s->root == (int)i) {
+      s->offset = pool->size;
+      pool->size += s->len + 1;
+    }
+  }
+
+  pool->data = malloc(pool->size ? pool->size : 1);
+  if (!pool->data)
+    LOG_FATAL("malloc failed in strpool_layout");
+
+  for (size_t i = 0; i < pool->nstrings; i++) {
+    PooledString *s = &pool->strings[i];
+    if (!s->used)
+      continue;
+    if (s->root == (int)i) {
+      memcpy(pool->data + s->offset, s->text, s->len + 1);
+    } else {
+      PooledString *root = &pool->strings[s->root];
+      s->offset = root->offset + root->len - s->len;
+      LOG_INFO("merging string '%s' into the end of '%s'", s->text, root->text);
+    }
+  }
+
+  qsort(pool->order, pool->norder, sizeof(int), compare_offsets);
+}
@@ -1,56 +1,109 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "types.h"
+#include "util.h"
 
 const Type PRIMITIVES[] = {
   [TY_VOID] = {
     .kind = TY_VOID,
     .name = "void",
-    .align = 0,
+    .align = 1,
     .size = 0,
     .ptr = 0,
   },
   [TY_INT] = {
     .kind = TY_INT,
     .name = "int",
-    .align = 0,
+    .align = sizeof(int32_t),
     .size = sizeof(int32_t),
     .ptr = 0,
   },
   [TY_UINT] = {
     .kind = TY_UINT,
     .name = "uint",
-    .align = 0,
+    .align = sizeof(uint32_t),
     .size = sizeof(uint32_t),
     .ptr = 0,
   },
   [TY_FLOAT] = {
     .kind = TY_FLOAT,
     .name = "float",
-    .align = 0,
+    .align = sizeof(float),
     .size = sizeof(float),
     .ptr = 0,
   },
   [TY_DOUBLE] = {
     .kind = TY_DOUBLE,
     .name = "double",
-    .align = 0,
+    .align = sizeof(double),
     .size = sizeof(double),
     .ptr = 0,
   },
   [TY_CHAR] = {
     .kind = TY_CHAR,
     .name = "char",
-    .align = 0,
+    .align = sizeof(char),
     .size = sizeof(char),
     .ptr = 0,
   },
   [TY_BOOL] = {
     .kind = TY_BOOL,
     .name = "bool",
-    .align = 0,
+    .align = sizeof(bool),
     .size = sizeof(bool),
     .ptr = 0,
   },
 };
+
+const Type CHAR_POINTER = {
+  .kind = TY_CHAR,
+  .name = "*char",
+  .align = sizeof(void *),
+  .size = sizeof(void *),
+  .ptr = 1,
+};
+
+const Type *pointee_type(const Type *type) {
+  if (type->ptr != 1 || !IS_PRIMITIVE(type->kind))
+    return NULL;
+  return &PRIMITIVES[type->kind];
+}
+
+static int align_up(int n, int align) {
+  return (n + align - 1) / align * align;
+}
+
+/* Most aligned first, keeping the given order otherwise */
+static int compare_alignment(const void *a, const void *b) {
+  const LayoutItem *x = *(const LayoutItem **)a, *y = *(const LayoutItem **)b;
+  if (x->align != y->align)
+    return y->align - x->align;
+  return (x > y) - (x < y);
+}
+
+int layout_pack(LayoutItem *items, int n, bool reorder, int *align) {
+  LayoutItem **order = malloc(sizeof(LayoutItem *) * (n ? n : 1));
+  if (!order)
+    LOG_FATAL("malloc failed in layout_pack");
+
+  for (int i = 0; i < n; i++)
+    order[i] = &items[i];
+  if (reorder)
+    qsort(order, n, sizeof(LayoutItem *), compare_alignment);
+
+  int size = 0, max_align = 1;
+  for (int i = 0; i < n; i++) {
+    LayoutItem *item = order[i];
+    item->offset = align_up(size, item->align);
+    size = item->offset + item->size;
+    if (item->align > max_align)
+      max_align = item->align;
+  }
+
+  free(order);
+  if (align)
+    *align = max_align;
+  return align_up(size, max_align);
+}
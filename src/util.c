@@ -19,6 +19,14 @@ int stoi(const char *s, size_t len) {
   return n;
 }
 
+/* Tokens are not NUL-terminated, so the digits are copied for strtod */
+double stod(const char *s, size_t len) {
+  char *digits = format("%.*s", (int)len, s);
+  double d = strtod(digits, NULL);
+  free(digits);
+  return d;
+}
+
 uint64_t djb2(const char *s) {
   uint64_t hash = 5381;
   int c;
@@ -110,6 +118,7 @@ char *readfile(const char *filename, size_t *size) {
 
 int spawn_subprocess(char *prog, char *const args[]) {
   int status = 0;
+  fflush(stdout);
   pid_t pid = fork();
   switch (pid) {
     case -1:
@@ -123,3 +132,39 @@ int spawn_subprocess(char *prog, char *const args[]) {
   }
   return status;
 }
+
+/* Spawns `prog` with a pipe to its stdin, whose write end is stored in `fd` */
+pid_t spawn_pipe(char *prog, char *const args[], int *fd) {
+  int fds[2];
+  if (pipe(fds) != 0)
+    return -1;
+
+  fflush(stdout);
+  pid_t pid = fork();
+  switch (pid) {
+    case -1:
+      close(fds[0]);
+      close(fds[1]);
+      return pid;
+    case 0:
+      dup2(fds[0], STDIN_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      execvp(prog, args);
+      perror(prog);
+      exit(1);
+    default:
+      close(fds[0]);
+      *fd = fds[1];
+  }
+  return pid;
+}
+
+int wait_subprocess(pid_t pid) {
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+  return status;
+}
@@ -0,0 +1,1052 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "ir.h"
+#include "optimize.h"
+#include "strpool.h"
+#include "symtab.h"
+#include "util.h"
+#include "vm.h"
+
+/* Computed goto is a GNU extension */
+#if defined(__GNUC__) && !defined(NEO_VM_SWITCH)
+#define VM_COMPUTED_GOTO
+#endif
+
+#define VM_MAX_REGISTERS UINT16_MAX
+#define VM_STACK_SIZE    (1 << 20)   /* Registers of all frames */
+#define VM_MAX_FRAMES    (1 << 16)
+
+#define VM_OPCODE_NAME(op) #op,
+static const char *VM_OPCODE_NAMES[] = {
+  VM_OPCODES(VM_OPCODE_NAME)
+};
+#undef VM_OPCODE_NAME
+
+/* Translation */
+
+/* How values of a type are held & operated on */
+typedef enum {
+  VC_INT,      /* int & bool, sign-extended */
+  VC_UINT,     /* Zero-extended */
+  VC_CHAR,     /* Sign-extended from 8 bits, operated on as int */
+  VC_PTR,
+  VC_FLOAT,
+  VC_DOUBLE
+} ValueClass;
+
+typedef struct {
+  int reg;
+  const Type *type;    /* Of its first assignment, NULL until known */
+  int uses;
+} Slot;
+
+static VMProgram *vprog;
+
+/* Of the function being translated */
+static HashMap slots;           /* variable -> Slot */
+static int nregs;
+static int scratch;             /* First of three scratch registers */
+static int argbase;             /* Where the arguments of calls go */
+static int *block_starts;       /* By block id */
+static size_t *patches;         /* Jumps, holding the id of their block */
+static size_t npatches;
+
+static ValueClass value_class(const Type *type) {
+  if (type->ptr)
+    return VC_PTR;
+  switch (type->kind) {
+    case TY_UINT:   return VC_UINT;
+    case TY_CHAR:   return VC_CHAR;
+    case TY_FLOAT:  return VC_FLOAT;
+    case TY_DOUBLE: return VC_DOUBLE;
+    default:        return VC_INT;
+  }
+}
+
+static bool is_floating_class(ValueClass cls) {
+  return cls == VC_FLOAT || cls == VC_DOUBLE;
+}
+
+static size_t emit(VMOpcode op, int a, int b, int c) {
+  if (vprog->ncode == vprog->capacity) {
+    vprog->capacity = vprog->capacity ? vprog->capacity << 1 : 256;
+    VMInst *tmp = realloc(vprog->code, sizeof(VMInst) * vprog->capacity);
+    if (!tmp)
+      LOG_FATAL("realloc failed in emit");
+    vprog->code = tmp;
+  }
+
+  size_t at = vprog->ncode++;
+  VMInst *inst = &vprog->code[at];
+  memset(inst, 0, sizeof(VMInst));
+  inst->op = op;
+  inst->a = a;
+  inst->b = b;
+  inst->c = c;
+  return at;
+}
+
+static void emit_immediate(VMOpcode op, int a, int b, int64_t imm) {
+  size_t at = emit(op, a, b, 0);
+  vprog->code[at].i = imm;
+}
+
+static int global_index(const char *var) {
+  return (int)(intptr_t)hashmap_lookup(&vprog->global_index, var) - 1;
+}
+
+static Slot *slot_of(const char *var) {
+  Slot *slot = hashmap_lookup(&slots, var);
+  if (slot)
+    return slot;
+
+  slot = calloc(1, sizeof(Slot));
+  if (!slot)
+    LOG_FATAL("calloc failed in slot_of");
+  slot->reg = nregs++;
+  hashmap_insert(&slots, var, slot);
+  return slot;
+}
+
+static void free_slot(MapEntry *entry) {
+  free(entry->value);
+}
+
+static const Type *variable_type(const char *var) {
+  int index = global_index(var);
+  if (index >= 0) {
+    Symbol *symbol = find_symbol(&SYMTAB, (char *)var, strlen(var));
+    return symbol->node->var.type;
+  }
+  Slot *slot = hashmap_lookup(&slots, var);
+  return slot && slot->type ? slot->type : &PRIMITIVES[TY_INT];
+}
+
+static const Type *operand_type(Operand *operand) {
+  if (IS_VARIABLE((*operand)))
+    return variable_type(operand->var);
+  const Type *type = value_type(&operand->val);
+  return type ? type : &PRIMITIVES[TY_INT];
+}
+
+/* Type of the value an instruction assigns, as the register allocator types
+ * its intervals: copies take the type of their source */
+static const Type *assigned_type(Instruction *inst) {
+  if (IS_COMPARISON_OP(inst->opcode))
+    return &PRIMITIVES[TY_BOOL];
+  if (inst->opcode == OP_ASSIGN && inst->nopers == 1)
+    return operand_type(&inst->operands[0]);
+  if (inst->type && inst->type->kind != TY_VOID)
+    return inst->type;
+  return inst->nopers ? operand_type(&inst->operands[0]) : &PRIMITIVES[TY_INT];
+}
+
+/* Type an operation is carried out in */
+static const Type *operation_type(Instruction *inst) {
+  if (inst->type && inst->type->kind != TY_VOID)
+    return inst->type;
+  return operand_type(&inst->operands[0]);
+}
+
+/* Bits of a constant in the register of its type */
+static VMValue constant_value(const Value *val) {
+  VMValue v = { 0 };
+  switch (val->kind) {
+    case VAL_INT:    v.i = val->i_val; break;
+    case VAL_UINT:   v.i = val->u_val; break;
+    case VAL_CHAR:   v.i = (int8_t)val->c_val; break;
+    case VAL_BOOL:   v.i = val->b_val; break;
+    case VAL_FLOAT:  v.f = val->f_val; break;
+    case VAL_DOUBLE: v.d = val->d_val; break;
+    default: LOG_FATAL("value kind %d has no register value", val->kind);
+  }
+  return v;
+}
+
+/* Integer constants that fit an immediate */
+static bool integer_immediate(Operand *operand, int64_t *k) {
+  if (!IS_VALUE((*operand)) || operand->val.kind == VAL_FLOAT || operand->val.kind == VAL_DOUBLE
+      || operand->val.kind == VAL_STRING)
+    return false;
+  *k = constant_value(&operand->val).i;
+  return *k >= INT32_MIN && *k <= INT32_MAX;
+}
+
+/* Register holding an operand, loading constants & globals into `into` */
+static int read_operand(Operand *operand, int into) {
+  if (IS_VALUE((*operand))) {
+    emit_immediate(VM_LOADI, into, 0, constant_value(&operand->val).i);
+    return into;
+  }
+
+  assert(IS_VARIABLE((*operand)));
+  int index = global_index(operand->var);
+  if (index >= 0) {
+    emit_immediate(VM_GETG, into, 0, index);
+    return into;
+  }
+  return slot_of(operand->var)->reg;
+}
+
+/* Register an instruction assigns, a scratch one for globals which are
+ * stored by finish_destination */
+static int destination(Instruction *inst) {
+  return global_index(inst->assignee) >= 0 ? scratch + 2 : slot_of(inst->assignee)->reg;
+}
+
+static void finish_destination(Instruction *inst, int reg) {
+  int index = global_index(inst->assignee);
+  if (index >= 0)
+    emit_immediate(VM_SETG, reg, 0, index);
+}
+
+static void jump_to(VMOpcode op, int a, int b, BasicBlock *target) {
+  size_t at = emit(op, a, b, 0);
+  vprog->code[at].target = target->id;
+  patches[npatches++] = at;
+}
+
+static void compile_assign(Instruction *inst) {
+  int dest = destination(inst);
+  /* Uninitialized variables start out as zero */
+  if (inst->nopers == 0) {
+    emit_immediate(VM_LOADI, dest, 0, 0);
+  } else {
+    int src = read_operand(&inst->operands[0], dest);
+    if (src != dest)
+      emit(VM_MOV, dest, src, 0);
+  }
+  finish_destination(inst, dest);
+}
+
+/* By int, uint, pointer, float & double */
+static const VMOpcode COMPARISONS[][5] = {
+  [OP_CMP]       = { VM_EQ_I, VM_EQ_U, VM_EQ_P, VM_FEQ, VM_DEQ },
+  [OP_CMP_NOT]   = { VM_NE_I, VM_NE_U, VM_NE_P, VM_FNE, VM_DNE },
+  [OP_CMP_LT]    = { VM_LT_I, VM_LT_U, VM_LT_P, VM_FLT, VM_DLT },
+  [OP_CMP_GT]    = { VM_GT_I, VM_GT_U, VM_GT_P, VM_FGT, VM_DGT },
+  [OP_CMP_LT_EQ] = { VM_LE_I, VM_LE_U, VM_LE_P, VM_FLE, VM_DLE },
+  [OP_CMP_GT_EQ] = { VM_GE_I, VM_GE_U, VM_GE_P, VM_FGE, VM_DGE },
+};
+
+/* Column of COMPARISONS & BRANCHES comparing values of a class, chars &
+ * bools comparing as int */
+static int comparison_column(ValueClass cls) {
+  switch (cls) {
+    case VC_UINT:   return 1;
+    case VC_PTR:    return 2;
+    case VC_FLOAT:  return 3;
+    case VC_DOUBLE: return 4;
+    default:        return 0;
+  }
+}
+
+/* By register, unsigned register, immediate & unsigned immediate */
+static const VMOpcode INTEGER_OPS[][4] = {
+  [OP_ADD]    = { VM_ADD_I, VM_ADD_U, VM_ADDI_I, VM_ADDI_U },
+  [OP_SUB]    = { VM_SUB_I, VM_SUB_U, VM_SUBI_I, VM_SUBI_U },
+  [OP_MUL]    = { VM_MUL_I, VM_MUL_U, VM_MULI_I, VM_MULI_U },
+  [OP_DIV]    = { VM_DIV_I, VM_DIV_U, 0, 0 },
+  [OP_SHL]    = { VM_SHL_I, VM_SHL_U, VM_SHLI_I, VM_SHLI_U },
+  [OP_SHR]    = { VM_SHR_I, VM_SHR_U, VM_SHRI_I, VM_SHRI_U },
+  [OP_SAR]    = { VM_SAR_I, VM_SAR_U, VM_SARI_I, VM_SARI_U },
+  [OP_MULHI]  = { VM_MULHI_I, VM_MULHI_U, 0, 0 },
+  [OP_UMULHI] = { VM_UMULHI_I, VM_UMULHI_U, 0, 0 },
+};
+
+/* By float & double */
+static const VMOpcode FLOATING_OPS[][2] = {
+  [OP_ADD] = { VM_FADD, VM_DADD },
+  [OP_SUB] = { VM_FSUB, VM_DSUB },
+  [OP_MUL] = { VM_FMUL, VM_DMUL },
+  [OP_DIV] = { VM_FDIV, VM_DDIV },
+};
+
+static void compile_comparison(Instruction *inst) {
+  int column = comparison_column(value_class(operation_type(inst)));
+  int dest = destination(inst);
+  int lhs = read_operand(&inst->operands[0], scratch);
+  int rhs = read_operand(&inst->operands[1], scratch + 1);
+  emit(COMPARISONS[inst->opcode][column], dest, lhs, rhs);
+  finish_destination(inst, dest);
+}
+
+static void compile_binary(Instruction *inst) {
+  ValueClass cls = value_class(operation_type(inst));
+  Operand *lhs = &inst->operands[0], *rhs = &inst->operands[1];
+  int dest = destination(inst);
+
+  if (is_floating_class(cls)) {
+    VMOpcode op = FLOATING_OPS[inst->opcode][cls == VC_DOUBLE];
+    emit(op, dest, read_operand(lhs, scratch), read_operand(rhs, scratch + 1));
+    finish_destination(inst, dest);
+    return;
+  }
+
+  /* Pointers are offset by whole 64-bit integers */
+  if (cls == VC_PTR && (inst->opcode == OP_ADD || inst->opcode == OP_SUB)) {
+    VMOpcode op = inst->opcode == OP_ADD ? VM_ADD_P : VM_SUB_P;
+    emit(op, dest, read_operand(lhs, scratch), read_operand(rhs, scratch + 1));
+    finish_destination(inst, dest);
+    return;
+  }
+
+  /* A constant on the left of a commutative operation goes right */
+  int64_t k;
+  if ((inst->opcode == OP_ADD || inst->opcode == OP_MUL)
+      && integer_immediate(lhs, &k) && !IS_VALUE((*rhs))) {
+    Operand *tmp = lhs;
+    lhs = rhs;
+    rhs = tmp;
+  }
+
+  bool is_unsigned = cls == VC_UINT;
+  VMOpcode immediate = INTEGER_OPS[inst->opcode][2 + is_unsigned];
+  if (immediate && integer_immediate(rhs, &k))
+    emit_immediate(immediate, dest, read_operand(lhs, scratch), k);
+  else
+    emit(INTEGER_OPS[inst->opcode][is_unsigned], dest, read_operand(lhs, scratch), read_operand(rhs, scratch + 1));
+
+  /* Chars wrap to 8 bits */
+  if (cls == VC_CHAR)
+    emit(VM_SEXT8, dest, dest, 0);
+  finish_destination(inst, dest);
+}
+
+/* Conversions between integer types extend the value as its new type;
+ * conversions from floating point truncate, values out of range giving the
+ * result of cvttsd2si */
+static void compile_conversion(Instruction *inst) {
+  Operand *src = &inst->operands[0];
+  ValueClass from = value_class(operand_type(src)), to = value_class(operation_type(inst));
+  int dest = destination(inst);
+  int reg = read_operand(src, dest);
+  bool is_float = from == VC_FLOAT;
+
+  VMOpcode op = VM_MOV;
+  if (is_floating_class(from) && is_floating_class(to)) {
+    op = from == to ? VM_MOV : is_float ? VM_FTOD : VM_DTOF;
+  } else if (is_floating_class(to)) {
+    op = to == VC_FLOAT ? VM_ITOF : VM_ITOD;
+  } else if (is_floating_class(from)) {
+    if (operation_type(inst)->kind == TY_BOOL)
+      op = is_float ? VM_FTOB : VM_DTOB;
+    else if (to == VC_UINT)
+      op = is_float ? VM_FTOU : VM_DTOU;
+    else
+      op = is_float ? VM_FTOI : VM_DTOI;
+  } else if (to == VC_UINT) {
+    op = VM_ZEXT32;
+  } else if (to == VC_INT && operation_type(inst)->kind != TY_BOOL) {
+    op = VM_SEXT32;
+  }
+
+  if (op != VM_MOV || reg != dest)
+    emit(op, dest, reg, 0);
+  if (to == VC_CHAR)
+    emit(VM_SEXT8, dest, dest, 0);
+  finish_destination(inst, dest);
+}
+
+static void compile_unary(Instruction *inst) {
+  ValueClass cls = value_class(operation_type(inst));
+  int dest = destination(inst);
+  int src = read_operand(&inst->operands[0], scratch);
+
+  switch (inst->opcode) {
+    case OP_NEG:
+      if (is_floating_class(cls)) {
+        emit(cls == VC_FLOAT ? VM_FNEG : VM_DNEG, dest, src, 0);
+      } else {
+        emit(cls == VC_UINT ? VM_NEG_U : VM_NEG_I, dest, src, 0);
+        if (cls == VC_CHAR)
+          emit(VM_SEXT8, dest, dest, 0);
+      }
+      break;
+    case OP_NOT: {
+      ValueClass from = value_class(operand_type(&inst->operands[0]));
+      if (is_floating_class(from)) {
+        emit(from == VC_FLOAT ? VM_FTOB : VM_DTOB, dest, src, 0);
+        src = dest;
+      }
+      emit(VM_NOT, dest, src, 0);
+      break;
+    }
+    case OP_DEREF:
+      emit(VM_LOADB, dest, src, 0);
+      break;
+    default: LOG_FATAL("shouldn't have gotten here...");
+  }
+  finish_destination(inst, dest);
+}
+
+static void compile_address(Instruction *inst) {
+  PooledString *s = strpool_find(&STRINGS, inst->operands[0].label);
+  if (!s)
+    LOG_FATAL("no string literal labeled '%s'", inst->operands[0].label);
+
+  int dest = destination(inst);
+  emit_immediate(VM_LOADI, dest, 0, (int64_t)(intptr_t)(STRINGS.data + s->offset));
+  finish_destination(inst, dest);
+}
+
+/* Arguments are moved into the registers the frame of the callee starts at */
+static void compile_call(Instruction *inst) {
+  int nargs = inst->operands[1].val.i_val;
+  int index = (int)(intptr_t)hashmap_lookup(&vprog->function_index, inst->operands[0].label) - 1;
+  if (index < 0)
+    LOG_FATAL("call to undefined function '%s'", inst->operands[0].label);
+
+  Instruction *arg = inst;
+  for (int i = 0; i < nargs; i++)
+    arg = arg->prev;
+  for (int i = 0; i < nargs; i++, arg = arg->next) {
+    assert(arg->opcode == OP_ARG);
+    int src = read_operand(&arg->operands[0], argbase + i);
+    if (src != argbase + i)
+      emit(VM_MOV, argbase + i, src, 0);
+  }
+
+  int dest = inst->assignee ? destination(inst) : scratch + 2;
+  emit(VM_CALL, dest, argbase, index);
+  if (inst->assignee)
+    finish_destination(inst, dest);
+}
+
+static void compile_instruction(Instruction *inst) {
+  switch (inst->opcode) {
+    case OP_DEF:
+    case OP_DEAD:
+    case OP_ARG:
+    case OP_JMP:
+    case OP_BR:
+      break;
+    case OP_PARAM: {
+      int dest = destination(inst);
+      if (dest != inst->operands[0].val.i_val)
+        emit(VM_MOV, dest, inst->operands[0].val.i_val, 0);
+      finish_destination(inst, dest);
+      break;
+    }
+    case OP_ASSIGN:
+      compile_assign(inst);
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_SAR:
+    case OP_MULHI:
+    case OP_UMULHI:
+      compile_binary(inst);
+      break;
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+      compile_comparison(inst);
+      break;
+    case OP_CONV:
+      compile_conversion(inst);
+      break;
+    case OP_NEG:
+    case OP_NOT:
+    case OP_DEREF:
+      compile_unary(inst);
+      break;
+    case OP_ADDR:
+      compile_address(inst);
+      break;
+    case OP_CALL:
+      compile_call(inst);
+      break;
+    case OP_RET:
+      if (inst->nopers)
+        emit(VM_RET, read_operand(&inst->operands[0], scratch), 0, 0);
+      else
+        emit(VM_RETV, 0, 0, 0);
+      break;
+    default:
+      LOG_FATAL("unsupported opcode %s in the interpreter", OPCODES[inst->opcode]);
+  }
+}
+
+/* A comparison of integers read only by the branch right after it is
+ * compiled into the branch as a compare & branch */
+static bool fuses_with_branch(Instruction *inst) {
+  Instruction *br = inst->next;
+  if (!IS_COMPARISON_OP(inst->opcode) || !inst->assignee || !br || br->opcode != OP_BR
+      || !IS_VARIABLE(br->operands[0]) || strcmp(br->operands[0].var, inst->assignee) != 0)
+    return false;
+
+  Slot *slot = hashmap_lookup(&slots, inst->assignee);
+  return slot && slot->uses == 1 && !is_floating_class(value_class(operation_type(inst)));
+}
+
+/* By int, uint & pointer, comparing with a register & with an immediate */
+static const VMOpcode BRANCHES[][3][2] = {
+  [OP_CMP]       = { { VM_JEQ_I, VM_JEQI_I }, { VM_JEQ_U, VM_JEQI_U }, { VM_JEQ_P, VM_JEQI_P } },
+  [OP_CMP_NOT]   = { { VM_JNE_I, VM_JNEI_I }, { VM_JNE_U, VM_JNEI_U }, { VM_JNE_P, VM_JNEI_P } },
+  [OP_CMP_LT]    = { { VM_JLT_I, VM_JLTI_I }, { VM_JLT_U, VM_JLTI_U }, { VM_JLT_P, VM_JLTI_P } },
+  [OP_CMP_GT]    = { { VM_JGT_I, VM_JGTI_I }, { VM_JGT_U, VM_JGTI_U }, { VM_JGT_P, VM_JGTI_P } },
+  [OP_CMP_LT_EQ] = { { VM_JLE_I, VM_JLEI_I }, { VM_JLE_U, VM_JLEI_U }, { VM_JLE_P, VM_JLEI_P } },
+  [OP_CMP_GT_EQ] = { { VM_JGE_I, VM_JGEI_I }, { VM_JGE_U, VM_JGEI_U }, { VM_JGE_P, VM_JGEI_P } },
+};
+
+static Opcode negate_comparison(Opcode opcode) {
+  switch (opcode) {
+    case OP_CMP:       return OP_CMP_NOT;
+    case OP_CMP_NOT:   return OP_CMP;
+    case OP_CMP_LT:    return OP_CMP_GT_EQ;
+    case OP_CMP_GT:    return OP_CMP_LT_EQ;
+    case OP_CMP_LT_EQ: return OP_CMP_GT;
+    default:           return OP_CMP_LT;
+  }
+}
+
+/* Comparison holding with its operands swapped */
+static Opcode swap_comparison(Opcode opcode) {
+  switch (opcode) {
+    case OP_CMP_LT:    return OP_CMP_GT;
+    case OP_CMP_GT:    return OP_CMP_LT;
+    case OP_CMP_LT_EQ: return OP_CMP_GT_EQ;
+    case OP_CMP_GT_EQ: return OP_CMP_LT_EQ;
+    default:           return opcode;
+  }
+}
+
+static void compare_and_branch(Instruction *cmp, Opcode opcode, BasicBlock *target) {
+  Operand *lhs = &cmp->operands[0], *rhs = &cmp->operands[1];
+  int column = comparison_column(value_class(operation_type(cmp)));
+  int64_t k;
+  if (integer_immediate(lhs, &k) && !IS_VALUE((*rhs))) {
+    Operand *tmp = lhs;
+    lhs = rhs;
+    rhs = tmp;
+    opcode = swap_comparison(opcode);
+  }
+
+  if (integer_immediate(rhs, &k)) {
+    jump_to(BRANCHES[opcode][column][1], read_operand(lhs, scratch), 0, target);
+    vprog->code[vprog->ncode - 1].k = (int32_t)k;
+  } else {
+    jump_to(BRANCHES[opcode][column][0], read_operand(lhs, scratch), read_operand(rhs, scratch + 1), target);
+  }
+}
+
+static void compile_branch(BasicBlock *block, Instruction *br, BasicBlock *next) {
+  BasicBlock *taken = block->succ[0], *other = block->succ[1];
+  Operand *cond = &br->operands[0];
+
+  if (IS_VALUE((*cond)) || taken == other) {
+    BasicBlock *target = taken == other || value_is_truthy(&cond->val) ? taken : other;
+    if (target != next)
+      jump_to(VM_JMP, 0, 0, target);
+    return;
+  }
+
+  if (br->prev && fuses_with_branch(br->prev)) {
+    Opcode opcode = br->prev->opcode;
+    if (taken == next) {
+      compare_and_branch(br->prev, negate_comparison(opcode), other);
+    } else {
+      compare_and_branch(br->prev, opcode, taken);
+      if (other != next)
+        jump_to(VM_JMP, 0, 0, other);
+    }
+    return;
+  }
+
+  int reg = read_operand(cond, scratch);
+  ValueClass cls = value_class(operand_type(cond));
+  if (is_floating_class(cls)) {
+    emit(cls == VC_FLOAT ? VM_FTOB : VM_DTOB, scratch, reg, 0);
+    reg = scratch;
+  }
+
+  if (taken == next) {
+    jump_to(VM_JZ, reg, 0, other);
+  } else {
+    jump_to(VM_JNZ, reg, 0, taken);
+    if (other != next)
+      jump_to(VM_JMP, 0, 0, other);
+  }
+}
+
+static void compile_block(BasicBlock *block, BasicBlock *next, BasicBlock *end) {
+  block_starts[block->id] = (int)vprog->ncode;
+
+  for (Instruction *inst = block->head; inst; inst = inst->next) {
+    if (!fuses_with_branch(inst))
+      compile_instruction(inst);
+  }
+
+  Instruction *tail = block->tail;
+  if (tail && tail->opcode == OP_BR)
+    compile_branch(block, tail, next);
+  else if (tail && tail->opcode == OP_RET)
+    return;
+  else if (block->nsuccs == 1 && block->succ[0] != end) {
+    if (block->succ[0] != next)
+      jump_to(VM_JMP, 0, 0, block->succ[0]);
+  } else {
+    /* Falling off the end of a function returns */
+    emit(VM_RETV, 0, 0, 0);
+  }
+}
+
+/* Parameters take the first registers, where the caller put the arguments,
+ * followed by the other variables in the order they appear, three scratch
+ * registers, & the arguments of calls */
+static void allocate_registers(BasicBlock *entry, BasicBlock *end) {
+  const char *name = entry->head->operands[0].label;
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)name, strlen(name));
+  int nparams = 0;
+  if (symbol && symbol->kind == SYM_FUNC) {
+    for (Node *param = symbol->node->func.params; param; param = param->next)
+      nparams++;
+  }
+
+  /* Parameters stay in the registers they are passed in */
+  nregs = nparams;
+  for (Instruction *inst = entry->head; inst; inst = inst->next) {
+    if (inst->opcode != OP_PARAM || global_index(inst->assignee) >= 0
+        || hashmap_lookup(&slots, inst->assignee))
+      continue;
+
+    Slot *slot = calloc(1, sizeof(Slot));
+    if (!slot)
+      LOG_FATAL("calloc failed in allocate_registers");
+    slot->reg = inst->operands[0].val.i_val;
+    hashmap_insert(&slots, inst->assignee, slot);
+  }
+
+  int max_args = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_DEAD)
+        continue;
+      if (inst->opcode == OP_CALL && inst->operands[1].val.i_val > max_args)
+        max_args = inst->operands[1].val.i_val;
+
+      for (int i = 0; i < inst->nopers; i++) {
+        if (IS_VARIABLE(inst->operands[i]) && global_index(inst->operands[i].var) < 0)
+          slot_of(inst->operands[i].var)->uses++;
+      }
+      if (inst->assignee && global_index(inst->assignee) < 0) {
+        Slot *slot = slot_of(inst->assignee);
+        if (!slot->type)
+          slot->type = assigned_type(inst);
+      }
+    }
+  }
+
+  scratch = nregs;
+  argbase = scratch + 3;
+  nregs = argbase + max_args;
+  if (nregs > VM_MAX_REGISTERS)
+    LOG_FATAL("function '%s' needs more than %d registers", name, VM_MAX_REGISTERS);
+}
+
+static void compile_function(BasicBlock *entry, BasicBlock *end, VMFunction *function) {
+  hashmap_init(&slots);
+  allocate_registers(entry, end);
+  function->entry = vprog->ncode;
+
+  int max_id = 0, nblocks = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next, nblocks++) {
+    if (block->id > max_id)
+      max_id = block->id;
+  }
+
+  /* At most two jumps end a block */
+  block_starts = malloc(sizeof(int) * (max_id + 1));
+  patches = malloc(sizeof(size_t) * (2 * nblocks + 1));
+  if (!block_starts || !patches)
+    LOG_FATAL("malloc failed in compile_function");
+  npatches = 0;
+
+  for (BasicBlock *block = entry; block != end; block = block->next)
+    compile_block(block, block->next, end);
+
+  for (size_t i = 0; i < npatches; i++) {
+    VMInst *jump = &vprog->code[patches[i]];
+    jump->target = block_starts[jump->target];
+  }
+
+  function->nregs = nregs;
+  free(block_starts);
+  free(patches);
+  block_starts = NULL;
+  patches = NULL;
+  hashmap_foreach(&slots, free_slot);
+  hashmap_free(&slots);
+}
+
+/* Globals the program refers to, with their initial values */
+static void alloc_globals(BasicBlock *prog) {
+  HashMap used;
+  hashmap_init(&used);
+  scan_globals(prog, &used, NULL);
+
+  vprog->globals = calloc(used.size ? used.size : 1, sizeof(VMValue));
+  if (!vprog->globals)
+    LOG_FATAL("calloc failed in alloc_globals");
+
+  for (size_t i = 0; i < SYMTAB.symbols.capacity; i++) {
+    MapEntry entry = SYMTAB.symbols.entries[i];
+    if (!entry.key)
+      continue;
+
+    Symbol *symbol = entry.value;
+    if (!symbol->name || symbol->kind != SYM_VAR || !hashmap_lookup(&used, symbol->name))
+      continue;
+
+    Value value;
+    if (!global_value(symbol->node, &value))
+      LOG_FATAL("initializer of global '%s' is not a constant", symbol->name);
+    if (value.kind == VAL_STRING) {
+      PooledString *s = strpool_find(&STRINGS, global_string(&value));
+      vprog->globals[vprog->nglobals++].i = (int64_t)(intptr_t)(STRINGS.data + s->offset);
+    } else {
+      vprog->globals[vprog->nglobals++] = constant_value(&value);
+    }
+    hashmap_insert(&vprog->global_index, symbol->name, (void *)(intptr_t)vprog->nglobals);
+  }
+
+  hashmap_free(&used);
+}
+
+void vm_compile(BasicBlock *prog, VMProgram *vp) {
+  memset(vp, 0, sizeof(VMProgram));
+  hashmap_init(&vp->function_index);
+  hashmap_init(&vp->global_index);
+  vprog = vp;
+
+  /* Strings are read from the pool laid out in memory */
+  for (BasicBlock *block = prog; block; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_ADDR && IS_LABEL(inst->operands[0]))
+        strpool_use(&STRINGS, inst->operands[0].label);
+    }
+  }
+  use_global_strings(prog);
+  strpool_layout(&STRINGS);
+
+  alloc_globals(prog);
+
+  /* Functions are numbered first so calls can refer to later ones */
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (IS_FUNCTION_ENTRY(block))
+      vp->nfunctions++;
+  }
+  vp->functions = calloc(vp->nfunctions ? vp->nfunctions : 1, sizeof(VMFunction));
+  if (!vp->functions)
+    LOG_FATAL("calloc failed in vm_compile");
+
+  size_t n = 0;
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (IS_FUNCTION_ENTRY(block)) {
+      vp->functions[n].name = block->head->operands[0].label;
+      hashmap_insert(&vp->function_index, vp->functions[n].name, (void *)(intptr_t)(n + 1));
+      n++;
+    }
+  }
+
+  /* The code outside of functions only delimits them */
+  n = 0;
+  for (BasicBlock *block = prog; block; ) {
+    if (IS_FUNCTION_ENTRY(block)) {
+      BasicBlock *end = function_end(block);
+      compile_function(block, end, &vp->functions[n++]);
+      block = end;
+    } else {
+      block = block->next;
+    }
+  }
+
+  vprog = NULL;
+}
+
+void vm_free(VMProgram *vp) {
+  free(vp->code);
+  free(vp->functions);
+  free(vp->globals);
+  hashmap_free(&vp->function_index);
+  hashmap_free(&vp->global_index);
+}
+
+void vm_dump(VMProgram *vp) {
+  for (size_t f = 0; f < vp->nfunctions; f++) {
+    VMFunction *function = &vp->functions[f];
+    size_t end = f + 1 < vp->nfunctions ? vp->functions[f + 1].entry : vp->ncode;
+    printf("%s: (%d registers)\n", function->name, function->nregs);
+
+    for (size_t i = function->entry; i < end; i++) {
+      VMInst *inst = &vp->code[i];
+      printf("%6zu  %-10s %5d %5d %5d", i, VM_OPCODE_NAMES[inst->op], inst->a, inst->b, inst->c);
+      if (inst->op >= VM_JMP && inst->op <= VM_JGEI_P)
+        printf("  -> %d", inst->target);
+      if (inst->op >= VM_JEQI_I && inst->op <= VM_JGEI_P)
+        printf("  k=%d", inst->k);
+      else if (inst->op == VM_LOADI || inst->op == VM_GETG || inst->op == VM_SETG
+          || (inst->op >= VM_ADDI_I && inst->op <= VM_SARI_U))
+        printf("  %lld", (long long)inst->i);
+      printf("\n");
+    }
+  }
+}
+
+/* Execution */
+
+typedef struct {
+  const VMInst *ret;    /* Instruction after the call */
+  VMValue *regs;        /* Frame of the caller */
+} VMFrame;
+
+/* Same results as the truncating conversions of the native code */
+static int32_t float_to_int(double d) {
+  return d > -2147483649.0 && d < 2147483648.0 ? (int32_t)d : INT32_MIN;
+}
+
+static uint32_t float_to_uint(double d) {
+  return d > -9223372036854775809.0 && d < 9223372036854775808.0 ? (uint32_t)(int64_t)d : 0;
+}
+
+int vm_run(VMProgram *vp, const char *entry) {
+  int index = (int)(intptr_t)hashmap_lookup(&vp->function_index, entry) - 1;
+  if (index < 0)
+    LOG_FATAL("entry point '%s' is not defined", entry);
+
+  VMValue *stack = calloc(VM_STACK_SIZE, sizeof(VMValue));
+  VMFrame *frames = malloc(sizeof(VMFrame) * VM_MAX_FRAMES);
+  if (!stack || !frames)
+    LOG_FATAL("allocation failed in vm_run");
+
+  const VMInst *code = vp->code;
+  const VMFunction *functions = vp->functions;
+  VMValue *globals = vp->globals;
+  VMValue *R = stack, *stack_end = stack + VM_STACK_SIZE;
+  const VMInst *pc = code + functions[index].entry;
+  size_t depth = 0;
+  int status = 0;
+
+  if (functions[index].nregs > VM_STACK_SIZE)
+    LOG_FATAL("stack overflow in the interpreter");
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_LABEL(op) [VM_##op] = &&L_##op,
+  static const void *labels[NUM_VM_OPCODES] = {
+    VM_OPCODES(VM_LABEL)
+  };
+#undef VM_LABEL
+#define CASE(op)   L_##op:
+#define DISPATCH() goto *labels[pc->op]
+  DISPATCH();
+#else
+#define CASE(op)   case VM_##op:
+#define DISPATCH() continue
+  for (;;) switch (pc->op) {
+#endif
+
+/* Not wrapped in do-while, where continue would not reach the dispatch */
+#define NEXT() { pc++; DISPATCH(); }
+
+/* Integer operations on 32 bits, the result extended as type T */
+#define INT_OP(op, T, Y, expr) \
+  CASE(op) { \
+    uint32_t x = (uint32_t)R[pc->b].i, y = (uint32_t)(Y); \
+    (void)y; \
+    R[pc->a].i = (T)(expr); \
+    NEXT(); \
+  }
+#define INT_BINARY(op, expr) \
+  INT_OP(op##_I, int32_t, R[pc->c].i, expr) \
+  INT_OP(op##_U, uint32_t, R[pc->c].i, expr)
+#define INT_IMMEDIATE(op, expr) \
+  INT_OP(op##_I, int32_t, pc->i, expr) \
+  INT_OP(op##_U, uint32_t, pc->i, expr)
+#define FLOAT_OP(op, field, expr) \
+  CASE(op) { R[pc->a].field = (expr); NEXT(); }
+#define COMPARE(op, field, cmp) \
+  CASE(op) { R[pc->a].i = R[pc->b].field cmp R[pc->c].field; NEXT(); }
+#define INT_COMPARE(op, T, cmp) \
+  CASE(op) { R[pc->a].i = (T)R[pc->b].i cmp (T)R[pc->c].i; NEXT(); }
+#define INT_COMPARISON(op, cmp) \
+  INT_COMPARE(op##_I, int32_t, cmp) \
+  INT_COMPARE(op##_U, uint32_t, cmp) \
+  INT_COMPARE(op##_P, int64_t, cmp)
+#define BRANCH(op, T, cmp, Y) \
+  CASE(op) { \
+    if ((T)R[pc->a].i cmp (T)(Y)) pc = code + pc->target; \
+    else pc++; \
+    DISPATCH(); \
+  }
+#define INT_BRANCH(op, cmp) \
+  BRANCH(op##_I, int32_t, cmp, R[pc->b].i) \
+  BRANCH(op##_U, uint32_t, cmp, R[pc->b].i) \
+  BRANCH(op##_P, int64_t, cmp, R[pc->b].i) \
+  BRANCH(op##I_I, int32_t, cmp, pc->k) \
+  BRANCH(op##I_U, uint32_t, cmp, pc->k) \
+  BRANCH(op##I_P, int64_t, cmp, pc->k)
+
+  CASE(MOV)    { R[pc->a] = R[pc->b]; NEXT(); }
+  CASE(LOADI)  { R[pc->a].i = pc->i; NEXT(); }
+  CASE(GETG)   { R[pc->a] = globals[pc->i]; NEXT(); }
+  CASE(SETG)   { globals[pc->i] = R[pc->a]; NEXT(); }
+
+  INT_BINARY(ADD, x + y)
+  INT_BINARY(SUB, x - y)
+  INT_BINARY(MUL, x * y)
+  CASE(ADD_P)  { R[pc->a].i = R[pc->b].i + R[pc->c].i; NEXT(); }
+  CASE(SUB_P)  { R[pc->a].i = R[pc->b].i - R[pc->c].i; NEXT(); }
+  CASE(DIV_I) {
+    int32_t x = (int32_t)R[pc->b].i, y = (int32_t)R[pc->c].i;
+    if (y == 0 || (x == INT32_MIN && y == -1))
+      LOG_FATAL("integer division error in the interpreter");
+    R[pc->a].i = x / y;
+    NEXT();
+  }
+  CASE(DIV_U) {
+    uint32_t x = (uint32_t)R[pc->b].i, y = (uint32_t)R[pc->c].i;
+    if (y == 0)
+      LOG_FATAL("integer division error in the interpreter");
+    R[pc->a].i = x / y;
+    NEXT();
+  }
+  INT_BINARY(SHL, x << (y & 31))
+  INT_BINARY(SHR, x >> (y & 31))
+  INT_BINARY(SAR, (int32_t)x >> (y & 31))
+  INT_BINARY(MULHI, ((int64_t)(int32_t)x * (int32_t)y) >> 32)
+  INT_BINARY(UMULHI, ((uint64_t)x * y) >> 32)
+
+  INT_IMMEDIATE(ADDI, x + y)
+  INT_IMMEDIATE(SUBI, x - y)
+  INT_IMMEDIATE(MULI, x * y)
+  INT_IMMEDIATE(SHLI, x << (y & 31))
+  INT_IMMEDIATE(SHRI, x >> (y & 31))
+  INT_IMMEDIATE(SARI, (int32_t)x >> (y & 31))
+
+  INT_OP(NEG_I, int32_t, 0, 0u - x)
+  INT_OP(NEG_U, uint32_t, 0, 0u - x)
+  CASE(NOT)    { R[pc->a].i = !R[pc->b].i; NEXT(); }
+
+  FLOAT_OP(FADD, f, R[pc->b].f + R[pc->c].f)
+  FLOAT_OP(FSUB, f, R[pc->b].f - R[pc->c].f)
+  FLOAT_OP(FMUL, f, R[pc->b].f * R[pc->c].f)
+  FLOAT_OP(FDIV, f, R[pc->b].f / R[pc->c].f)
+  FLOAT_OP(FNEG, f, -R[pc->b].f)
+  FLOAT_OP(DADD, d, R[pc->b].d + R[pc->c].d)
+  FLOAT_OP(DSUB, d, R[pc->b].d - R[pc->c].d)
+  FLOAT_OP(DMUL, d, R[pc->b].d * R[pc->c].d)
+  FLOAT_OP(DDIV, d, R[pc->b].d / R[pc->c].d)
+  FLOAT_OP(DNEG, d, -R[pc->b].d)
+
+  INT_COMPARISON(EQ, ==)
+  INT_COMPARISON(NE, !=)
+  INT_COMPARISON(LT, <)
+  INT_COMPARISON(GT, >)
+  INT_COMPARISON(LE, <=)
+  INT_COMPARISON(GE, >=)
+  COMPARE(FEQ, f, ==)
+  COMPARE(FNE, f, !=)
+  COMPARE(FLT, f, <)
+  COMPARE(FGT, f, >)
+  COMPARE(FLE, f, <=)
+  COMPARE(FGE, f, >=)
+  COMPARE(DEQ, d, ==)
+  COMPARE(DNE, d, !=)
+  COMPARE(DLT, d, <)
+  COMPARE(DGT, d, >)
+  COMPARE(DLE, d, <=)
+  COMPARE(DGE, d, >=)
+
+  CASE(SEXT8)  { R[pc->a].i = (int8_t)R[pc->b].i; NEXT(); }
+  CASE(SEXT32) { R[pc->a].i = (int32_t)R[pc->b].i; NEXT(); }
+  CASE(ZEXT32) { R[pc->a].i = (uint32_t)R[pc->b].i; NEXT(); }
+  FLOAT_OP(ITOF, f, (float)R[pc->b].i)
+  FLOAT_OP(ITOD, d, (double)R[pc->b].i)
+  FLOAT_OP(FTOI, i, float_to_int(R[pc->b].f))
+  FLOAT_OP(DTOI, i, float_to_int(R[pc->b].d))
+  FLOAT_OP(FTOU, i, float_to_uint(R[pc->b].f))
+  FLOAT_OP(DTOU, i, float_to_uint(R[pc->b].d))
+  FLOAT_OP(FTOB, i, R[pc->b].f != 0)
+  FLOAT_OP(DTOB, i, R[pc->b].d != 0)
+  FLOAT_OP(FTOD, d, R[pc->b].f)
+  FLOAT_OP(DTOF, f, (float)R[pc->b].d)
+  CASE(LOADB)  { R[pc->a].i = *(const int8_t *)(intptr_t)R[pc->b].i; NEXT(); }
+
+  CASE(JMP)    { pc = code + pc->target; DISPATCH(); }
+  BRANCH(JNZ, int64_t, !=, 0)
+  BRANCH(JZ, int64_t, ==, 0)
+  INT_BRANCH(JEQ, ==)
+  INT_BRANCH(JNE, !=)
+  INT_BRANCH(JLT, <)
+  INT_BRANCH(JGT, >)
+  INT_BRANCH(JLE, <=)
+  INT_BRANCH(JGE, >=)
+
+  CASE(CALL) {
+    const VMFunction *callee = &functions[pc->c];
+    VMValue *regs = R + pc->b;
+    if (depth == VM_MAX_FRAMES || regs + callee->nregs > stack_end)
+      LOG_FATAL("stack overflow in the interpreter");
+    frames[depth++] = (VMFrame){ pc + 1, R };
+    R = regs;
+    pc = code + callee->entry;
+    DISPATCH();
+  }
+  CASE(RET) {
+    VMValue value = R[pc->a];
+    if (!depth) {
+      status = (int)value.i;
+      goto done;
+    }
+    VMFrame *frame = &frames[--depth];
+    R = frame->regs;
+    pc = frame->ret;
+    /* Into the destination of the call */
+    R[pc[-1].a] = value;
+    DISPATCH();
+  }
+  CASE(RETV) {
+    if (!depth)
+      goto done;
+    VMFrame *frame = &frames[--depth];
+    R = frame->regs;
+    pc = frame->ret;
+    DISPATCH();
+  }
+
+#ifndef VM_COMPUTED_GOTO
+  }
+#endif
+
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+#undef INT_OP
+#undef INT_BINARY
+#undef INT_IMMEDIATE
+#undef FLOAT_OP
+#undef COMPARE
+#undef INT_COMPARE
+#undef INT_COMPARISON
+#undef BRANCH
+#undef INT_BRANCH
+
+done:
+  free(stack);
+  free(frames);
+  return status;
+}
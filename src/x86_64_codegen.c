@@ -0,0 +1,2121 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "codegen.h"
+#include "ir.h"
+#include "optimize.h"
+#include "strpool.h"
+#include "symtab.h"
+#include "syscalls.h"
+#include "util.h"
+#include "x86_64.h"
+
+/* x86_64 (Linux) Instruction Selection */
+
+const char *MOPCODES[NUM_MOPCODES] = {
+  [MI_LABEL]     = "label",
+  [MI_MOV]       = "mov",
+  [MI_MOVSXD]    = "movsxd",
+  [MI_LEA]       = "lea",
+  [MI_ADD]       = "add",
+  [MI_SUB]       = "sub",
+  [MI_XOR]       = "xor",
+  [MI_INC]       = "inc",
+  [MI_DEC]       = "dec",
+  [MI_IMUL]      = "imul",
+  [MI_IDIV]      = "idiv",
+  [MI_DIV]       = "div",
+  [MI_CDQ]       = "cdq",
+  [MI_SHL]       = "shl",
+  [MI_SHR]       = "shr",
+  [MI_SAR]       = "sar",
+  [MI_PUSH]      = "push",
+  [MI_POP]       = "pop",
+  [MI_SYSCALL]   = "syscall",
+  [MI_RDTSC]     = "rdtsc",
+  [MI_RDTSCP]    = "rdtscp",
+  [MI_CMP]       = "cmp",
+  [MI_TEST]      = "test",
+  [MI_MOVZX]     = "movzx",
+  [MI_MOVSX]     = "movsx",
+  [MI_SETCC]     = "set",
+  [MI_CMOV]      = "cmov",
+  [MI_JMP]       = "jmp",
+  [MI_JCC]       = "j",
+  [MI_NEG]       = "neg",
+  [MI_MOVSS]     = "movss",
+  [MI_MOVSD]     = "movsd",
+  [MI_ADDSS]     = "addss",
+  [MI_ADDSD]     = "addsd",
+  [MI_SUBSS]     = "subss",
+  [MI_SUBSD]     = "subsd",
+  [MI_MULSS]     = "mulss",
+  [MI_MULSD]     = "mulsd",
+  [MI_DIVSS]     = "divss",
+  [MI_DIVSD]     = "divsd",
+  [MI_UCOMISS]   = "ucomiss",
+  [MI_UCOMISD]   = "ucomisd",
+  [MI_CVTSI2SS]  = "cvtsi2ss",
+  [MI_CVTSI2SD]  = "cvtsi2sd",
+  [MI_CVTTSS2SI] = "cvttss2si",
+  [MI_CVTTSD2SI] = "cvttsd2si",
+  [MI_CVTSS2SD]  = "cvtss2sd",
+  [MI_CVTSD2SS]  = "cvtsd2ss",
+  [MI_XORPS]     = "xorps",
+  [MI_CALL]      = "call",
+  [MI_RET]       = "ret",
+};
+
+const char *CONDITIONS[NUM_CONDITIONS] = {
+  [CC_B]  = "b",
+  [CC_AE] = "ae",
+  [CC_E]  = "e",
+  [CC_NE] = "ne",
+  [CC_BE] = "be",
+  [CC_A]  = "a",
+  [CC_P]  = "p",
+  [CC_NP] = "np",
+  [CC_L]  = "l",
+  [CC_GE] = "ge",
+  [CC_LE] = "le",
+  [CC_G]  = "g",
+};
+
+/* Locations of the variables of the function being compiled */
+static Allocation allocation;
+
+/* Program being generated */
+static MProgram *mprog;
+static CodegenOptions options;
+
+/* Constants in .rodata by size & bit pattern -> index + 1 */
+static HashMap constants;
+
+/* Frame of the function being compiled. The callee-saved registers it uses
+ * are pushed right below the saved rbp, or the return address without a
+ * frame pointer, & the spill slots follow. Leaf functions keep their slots
+ * in the red zone below rsp when they fit. */
+static RegisterID saved_registers[NUM_REGISTERS];
+static int nsaved;
+static int frame_size;            /* Bytes rsp is lowered by after the pushes */
+static int stack_adjust;          /* Bytes pushed since, for outgoing arguments */
+static int division_slot = -1;       /* Slots saving rax & rdx around a division, or -1 */
+static int *slot_offsets;         /* Bytes from the top of the slot area to each slot */
+static int slot_area;             /* Bytes taken by the spill slots */
+static BasicBlock *current_end;   /* First block after the function */
+static bool in_function;          /* Compiling a function, not _start */
+
+/* Label names by block id, & whether a jump targets the block */
+static char **block_labels;
+static bool *jump_targets;
+static size_t nblock_labels;
+
+/* Code that never ran in the profile, placed after every function so that
+ * the code that did is packed together */
+static MInst *cold;
+static size_t ncold, cold_capacity;
+
+/* Counters of instrumented builds, one quadword each */
+#define PROFILE_COUNTERS "__neo_prof_counters"
+
+/* -fprofile-cycles keeps a record of quadwords per function */
+#define CYCLES         "__neo_cycles"
+#define CYCLES_CALLEES "__neo_cycles_callees"  /* Spent in the callees of the running function */
+#define CYCLES_LINE    "__neo_cycles_line"     /* Line of the report being formatted */
+#define CYCLES_RECORD  32
+#define CYCLES_CALLS   0
+#define CYCLES_TOTAL   8
+#define CYCLES_SELF    16
+#define CYCLES_DEPTH   24  /* Activations on the stack, so recursion is timed once */
+#define CYCLES_FIELD   20  /* Width of the numbers in the report */
+
+static int cycles_slot = -1;   /* Slots of the entry time & of the caller's callee cycles, or -1 */
+static int function_index;     /* Of the function being compiled, in program order */
+
+static MOperand mreg(RegisterID rid) {
+  return (MOperand){ .kind = MO_REG, .reg = rid, .index = NO_REG };
+}
+
+static MOperand mimm(int64_t imm) {
+  return (MOperand){ .kind = MO_IMM, .imm = imm, .reg = NO_REG, .index = NO_REG };
+}
+
+static MOperand mmem(int base, int32_t disp) {
+  return (MOperand){ .kind = MO_MEM, .reg = base, .index = NO_REG, .disp = disp };
+}
+
+static MOperand msym(const char *sym) {
+  return (MOperand){ .kind = MO_SYM, .sym = sym, .reg = NO_REG, .index = NO_REG };
+}
+
+/* [sym + disp], relative to rip */
+static MOperand mstatic(const char *sym, int32_t disp) {
+  MOperand mem = mmem(NO_REG, disp);
+  mem.sym = sym;
+  return mem;
+}
+
+static MOperand mindexed(int base, int index, int32_t disp) {
+  MOperand mem = mmem(base, disp);
+  mem.index = index;
+  mem.scale = 1;
+  return mem;
+}
+
+static MInst *emit(MOpcode op, int size, int nopers, ...) {
+  if (mprog->ninsts == mprog->capacity) {
+    mprog->capacity = mprog->capacity ? mprog->capacity << 1 : 256;
+    MInst *tmp = realloc(mprog->insts, sizeof(MInst) * mprog->capacity);
+    if (!tmp)
+      LOG_FATAL("realloc failed in emit");
+    mprog->insts = tmp;
+  }
+
+  MInst *inst = &mprog->insts[mprog->ninsts++];
+  memset(inst, 0, sizeof(MInst));
+  inst->op = op;
+  inst->size = size;
+  inst->nopers = nopers;
+
+  va_list args;
+  va_start(args, nopers);
+  for (int i = 0; i < nopers; i++)
+    inst->operands[i] = va_arg(args, MOperand);
+  va_end(args);
+  return inst;
+}
+
+#define emit0(op, size)          emit(op, size, 0)
+#define emit1(op, size, a)       emit(op, size, 1, a)
+#define emit2(op, size, a, b)    emit(op, size, 2, a, b)
+#define emit3(op, size, a, b, c) emit(op, size, 3, a, b, c)
+
+static void emit_label(const char *name, bool global) {
+  MInst *inst = emit1(MI_LABEL, 8, msym(name));
+  inst->global = global;
+}
+
+/* Name of the label of a block, created the first time it is needed */
+static const char *block_label(BasicBlock *block) {
+  size_t id = block->id;
+  if (id >= nblock_labels) {
+    size_t n = nblock_labels ? nblock_labels : 64;
+    while (n <= id)
+      n <<= 1;
+
+    char **tmp = realloc(block_labels, sizeof(char *) * n);
+    bool *targets = realloc(jump_targets, sizeof(bool) * n);
+    if (!tmp || !targets)
+      LOG_FATAL("realloc failed in block_label");
+    memset(tmp + nblock_labels, 0, sizeof(char *) * (n - nblock_labels));
+    memset(targets + nblock_labels, 0, sizeof(bool) * (n - nblock_labels));
+    block_labels = tmp;
+    jump_targets = targets;
+    nblock_labels = n;
+  }
+
+  if (!block_labels[id]) {
+    char **tmp = realloc(mprog->labels, sizeof(char *) * (mprog->nlabels + 1));
+    if (!tmp)
+      LOG_FATAL("realloc failed in block_label");
+
+    block_labels[id] = format(LOCAL_LABEL_PREFIX "%zu", id);
+    tmp[mprog->nlabels++] = block_labels[id];
+    mprog->labels = tmp;
+  }
+  return block_labels[id];
+}
+
+/* Moves the instructions emitted since `start` to the cold code */
+static void move_to_cold(size_t start) {
+  size_t n = mprog->ninsts - start;
+  if (ncold + n > cold_capacity) {
+    while (ncold + n > cold_capacity)
+      cold_capacity = cold_capacity ? cold_capacity << 1 : 256;
+    MInst *tmp = realloc(cold, sizeof(MInst) * cold_capacity);
+    if (!tmp)
+      LOG_FATAL("realloc failed in move_to_cold");
+    cold = tmp;
+  }
+
+  memcpy(cold + ncold, mprog->insts + start, sizeof(MInst) * n);
+  ncold += n;
+  mprog->ninsts = start;
+}
+
+/* Increments a profile counter, which leaves every register but the flags
+ * alone */
+static void emit_counter(int counter) {
+  if (!options.profile || counter < 0)
+    return;
+
+  emit1(MI_INC, 8, mstatic(PROFILE_COUNTERS, counter * 8));
+}
+
+/* Conditional jump to a label that does not name a block */
+static void emit_jcc_label(CondCode cc, const char *label) {
+  MInst *inst = emit1(MI_JCC, 8, msym(label));
+  inst->cc = cc;
+}
+
+static void emit_jcc(CondCode cc, BasicBlock *target) {
+  MInst *inst = emit1(MI_JCC, 8, msym(block_label(target)));
+  inst->cc = cc;
+  jump_targets[target->id] = true;
+}
+
+/* Jumps to a block, unless it is laid out right after the current one */
+static void jump_to(BasicBlock *target, BasicBlock *next) {
+  if (target != next) {
+    emit1(MI_JMP, 8, msym(block_label(target)));
+    jump_targets[target->id] = true;
+  }
+}
+
+/* Removes the labels of blocks that are only fallen into, so they do not
+ * split peephole windows */
+static void drop_unused_labels() {
+  size_t prefix = strlen(LOCAL_LABEL_PREFIX), out = 0;
+  for (size_t i = 0; i < mprog->ninsts; i++) {
+    MInst *inst = &mprog->insts[i];
+    if (inst->op == MI_LABEL && strncmp(inst->operands[0].sym, LOCAL_LABEL_PREFIX, prefix) == 0
+        && !jump_targets[strtol(inst->operands[0].sym + prefix, NULL, 10)])
+      continue;
+    mprog->insts[out++] = *inst;
+  }
+  mprog->ninsts = out;
+}
+
+/* Register holding a variable, or -1 when the variable lives in memory */
+static int register_of(int vreg) {
+  RegisterData *data = allocation_lookup(&allocation, vreg);
+  return data->global || data->slot >= 0 ? -1 : data->rid;
+}
+
+/* Coalesced variables share their location */
+static bool same_location(int a, int b) {
+  RegisterData *x = allocation_lookup(&allocation, a);
+  RegisterData *y = allocation_lookup(&allocation, b);
+  if (x == y)
+    return true;
+  if (x->global || y->global)
+    return false;
+  return x->slot >= 0 ? x->slot == y->slot : (y->slot < 0 && x->rid == y->rid);
+}
+
+static bool operand_in_register(Operand *operand, RegisterID rid) {
+  return IS_VARIABLE((*operand)) && register_of(operand->vreg) == (int)rid;
+}
+
+static bool operand_in_memory(Operand *operand) {
+  return IS_VARIABLE((*operand)) && register_of(operand->vreg) < 0;
+}
+
+/* Values that can be encoded as a sign-extended 32-bit immediate */
+static bool fits_imm32(Operand *operand) {
+  return !(IS_VALUE((*operand)) && operand->val.kind == VAL_UINT && operand->val.u_val > INT32_MAX);
+}
+
+static int64_t immediate(Value v) {
+  switch (v.kind) {
+    case VAL_INT:  return v.i_val;
+    case VAL_UINT: return v.u_val;
+    case VAL_CHAR: return v.c_val;
+    case VAL_BOOL: return v.b_val;
+    default: LOG_FATAL("value kind %d can't be used as an immediate", v.kind);
+  }
+}
+
+#define RED_ZONE_SIZE 128
+
+static MOperand frame_slot(int slot) {
+  if (!options.omit_frame_pointer)
+    return mmem(RBP, -(nsaved * SLOT_SIZE + slot_offsets[slot]));
+  return mmem(RSP, frame_size + stack_adjust - slot_offsets[slot]);
+}
+
+/* Argument passed on the stack, above the return address */
+static MOperand incoming_argument(int index) {
+  if (!options.omit_frame_pointer)
+    return mmem(RBP, 2 * SLOT_SIZE + index * SLOT_SIZE);
+  int above = frame_size + stack_adjust + nsaved * SLOT_SIZE + SLOT_SIZE;
+  return mmem(RSP, above + index * SLOT_SIZE);
+}
+
+/* Location of a variable */
+static MOperand location(int vreg) {
+  RegisterData *data = allocation_lookup(&allocation, vreg);
+  if (data->global) {
+    MOperand mem = mmem(NO_REG, 0);
+    mem.sym = data->var;
+    return mem;
+  }
+  if (data->slot >= 0)
+    return frame_slot(data->slot);
+  return mreg(data->rid);
+}
+
+static MOperand moperand(Operand *operand) {
+  switch (operand->kind) {
+    case O_VALUE:    return mimm(immediate(operand->val));
+    case O_VARIABLE: return location(operand->vreg);
+    default: LOG_FATAL("shouldn't have gotten here...");
+  }
+}
+
+/* Globals take the natural size of their type, while integers are read &
+ * written as whole registers everywhere else. Type of a global integer
+ * narrower than a register, NULL for any other variable. */
+static const Type *narrow_global(int vreg) {
+  RegisterData *data = allocation_lookup(&allocation, vreg);
+  if (!data->global || data->type->ptr || IS_FLOATING(data->type->kind))
+    return NULL;
+  return data->type->size < SLOT_SIZE ? data->type : NULL;
+}
+
+/* Loads an integer narrower than a register from memory, extended the way
+ * values of its type are held in registers */
+static void load_narrow(RegisterID rid, MOperand src, const Type *type) {
+  switch (type->kind) {
+    case TY_INT:  emit2(MI_MOVSXD, 8, mreg(rid), src); break;
+    case TY_CHAR: emit2(MI_MOVSX, 4, mreg(rid), src); break;
+    case TY_BOOL: emit2(MI_MOVZX, 4, mreg(rid), src); break;
+    default:      emit2(MI_MOV, 4, mreg(rid), src); break;
+  }
+}
+
+/* Moves a variable out of memory into a register */
+static void load_variable(RegisterID rid, int vreg) {
+  const Type *narrow = narrow_global(vreg);
+  if (narrow)
+    load_narrow(rid, location(vreg), narrow);
+  else
+    emit2(MI_MOV, 8, mreg(rid), location(vreg));
+}
+
+/* Stores a register or an immediate into the memory of a variable */
+static void store_variable(int vreg, MOperand src) {
+  const Type *narrow = narrow_global(vreg);
+  emit2(MI_MOV, narrow ? narrow->size : 8, location(vreg), src);
+}
+
+/* Moves an operand into a register, unless it already lives there */
+static void load_operand(RegisterID rid, Operand *operand) {
+  if (operand_in_register(operand, rid))
+    return;
+  if (IS_VARIABLE((*operand)) && narrow_global(operand->vreg))
+    load_variable(rid, operand->vreg);
+  else
+    emit2(MI_MOV, 8, mreg(rid), moperand(operand));
+}
+
+/* An integer operand of an instruction, narrow globals being loaded into
+ * `scratch` as they cannot be read in place */
+static MOperand int_operand(Operand *operand, RegisterID scratch) {
+  if (IS_VARIABLE((*operand)) && narrow_global(operand->vreg)) {
+    load_variable(scratch, operand->vreg);
+    return mreg(scratch);
+  }
+  return moperand(operand);
+}
+
+/* Register the result of an instruction is computed in. Results that live
+ * in memory are computed in the scratch register and stored afterwards. */
+static RegisterID destination(Instruction *inst) {
+  int rid = register_of(inst->vreg);
+  return rid >= 0 ? rid : SCRATCH;
+}
+
+static void store_destination(Instruction *inst, RegisterID rid) {
+  if (register_of(inst->vreg) >= 0)
+    return;
+  store_variable(inst->vreg, mreg(rid));
+}
+
+/* Floating Point
+ *
+ * float & double values live in the low lane of XMM registers & are
+ * computed with scalar SSE2 instructions, which take their second operand
+ * from a register or memory. Constants are loaded from .rodata, relative to
+ * rip, except for zero which is xor'd. */
+
+/* Scalar SSE instructions, in single & double precision */
+static const MOpcode SSE_OPS[][2] = {
+  [OP_ADD]    = { MI_ADDSS, MI_ADDSD },
+  [OP_SUB]    = { MI_SUBSS, MI_SUBSD },
+  [OP_MUL]    = { MI_MULSS, MI_MULSD },
+  [OP_DIV]    = { MI_DIVSS, MI_DIVSD },
+  [OP_CMP]    = { MI_UCOMISS, MI_UCOMISD },
+  [OP_ASSIGN] = { MI_MOVSS, MI_MOVSD },
+};
+
+#define SSE_OP(op, size) SSE_OPS[op][(size) == 8]
+
+static bool is_floating(const Type *type) {
+  return type && IS_FLOATING(type->kind);
+}
+
+/* Width of a float or double in bytes */
+static int fp_size(const Type *type) {
+  return type->kind == TY_FLOAT ? 4 : 8;
+}
+
+static const Type *variable_type(int vreg) {
+  return allocation_lookup(&allocation, vreg)->type;
+}
+
+static const Type *operand_type(Operand *operand) {
+  return IS_VALUE((*operand)) ? value_type(&operand->val) : variable_type(operand->vreg);
+}
+
+/* A constant in .rodata, shared by every use of the same bit pattern */
+static MOperand mconst(uint64_t bits, size_t size) {
+  char *key = format("%zu:%llx", size, (unsigned long long)bits);
+  intptr_t index = (intptr_t)hashmap_lookup(&constants, key);
+  if (!index) {
+    MConst *tmp = realloc(mprog->consts, sizeof(MConst) * (mprog->nconsts + 1));
+    if (!tmp)
+      LOG_FATAL("realloc failed in mconst");
+
+    tmp[mprog->nconsts] = (MConst){ format("const.%zu", mprog->nconsts), bits, size };
+    mprog->consts = tmp;
+    index = ++mprog->nconsts;
+    hashmap_insert(&constants, key, (void *)index);
+  }
+  free(key);
+
+  MOperand mem = mmem(NO_REG, 0);
+  mem.sym = mprog->consts[index - 1].name;
+  return mem;
+}
+
+/* Bit pattern of a constant as a float or a double */
+static uint64_t fp_bits(Value v, int size) {
+  if (!convert_value(&v, &PRIMITIVES[size == 4 ? TY_FLOAT : TY_DOUBLE]))
+    LOG_FATAL("value kind %d can't be used as a floating point number", v.kind);
+
+  uint64_t bits = 0;
+  if (size == 4)
+    memcpy(&bits, &v.f_val, sizeof(float));
+  else
+    memcpy(&bits, &v.d_val, sizeof(double));
+  return bits;
+}
+
+static MOperand fp_operand(Operand *operand, int size) {
+  if (IS_VALUE((*operand)))
+    return mconst(fp_bits(operand->val, size), size);
+  return location(operand->vreg);
+}
+
+static void load_fp(RegisterID rid, Operand *operand, int size) {
+  if (operand_in_register(operand, rid))
+    return;
+
+  if (IS_VALUE((*operand)) && fp_bits(operand->val, size) == 0)
+    emit2(MI_XORPS, 16, mreg(rid), mreg(rid));
+  else
+    emit2(SSE_OP(OP_ASSIGN, size), size, mreg(rid), fp_operand(operand, size));
+}
+
+static RegisterID fp_destination(Instruction *inst) {
+  int rid = register_of(inst->vreg);
+  return rid >= 0 ? rid : SCRATCH_XMM;
+}
+
+static void store_fp(Instruction *inst, RegisterID rid) {
+  if (register_of(inst->vreg) >= 0)
+    return;
+  int size = fp_size(variable_type(inst->vreg));
+  emit2(SSE_OP(OP_ASSIGN, size), size, location(inst->vreg), mreg(rid));
+}
+
+static void compile_fp_assign(Instruction *inst) {
+  Operand *src = &inst->operands[0];
+  if (IS_VARIABLE((*src)) && same_location(src->vreg, inst->vreg))
+    return;
+
+  RegisterID dest = fp_destination(inst);
+  int size = fp_size(variable_type(inst->vreg));
+  if (dest == SCRATCH_XMM && IS_VARIABLE((*src)) && register_of(src->vreg) >= 0) {
+    store_fp(inst, register_of(src->vreg));
+    return;
+  }
+
+  load_fp(dest, src, size);
+  store_fp(inst, dest);
+}
+
+static void compile_fp_binop(Instruction *inst) {
+  int size = fp_size(variable_type(inst->vreg));
+  MOpcode op = SSE_OP(inst->opcode, size);
+  Operand *lhs = &inst->operands[0], *rhs = &inst->operands[1];
+  RegisterID dest = fp_destination(inst);
+
+  /* Loading the lhs would clobber the rhs */
+  if (operand_in_register(rhs, dest) && !operand_in_register(lhs, dest)) {
+    if (inst->opcode == OP_ADD || inst->opcode == OP_MUL) {
+      Operand *tmp = lhs;
+      lhs = rhs;
+      rhs = tmp;
+    } else {
+      load_fp(SCRATCH_XMM, lhs, size);
+      emit2(op, size, mreg(SCRATCH_XMM), fp_operand(rhs, size));
+      emit2(SSE_OP(OP_ASSIGN, size), size, mreg(dest), mreg(SCRATCH_XMM));
+      return;
+    }
+  }
+
+  load_fp(dest, lhs, size);
+  emit2(op, size, mreg(dest), fp_operand(rhs, size));
+  store_fp(inst, dest);
+}
+
+/* Unordered operands (NaN) set ZF as equal ones do, & PF on top, so
+ * equality also needs the parity flag. Both conditions are set into scratch
+ * registers & added up, giving 2 when equal & ordered, & 0 when not equal
+ * & ordered. The registers are cleared first since xor clobbers the flags. */
+static CondCode emit_fp_equality(Operand *lhs, MOperand rhs, int size, bool equal) {
+  emit2(MI_XOR, 4, mreg(SCRATCH), mreg(SCRATCH));
+  emit2(MI_XOR, 4, mreg(SCRATCH2), mreg(SCRATCH2));
+
+  MOperand a = fp_operand(lhs, size);
+  if (a.kind != MO_REG) {
+    load_fp(SCRATCH_XMM2, lhs, size);
+    a = mreg(SCRATCH_XMM2);
+  }
+  emit2(SSE_OP(OP_CMP, size), size, a, rhs);
+
+  MInst *set = emit1(MI_SETCC, 1, mreg(SCRATCH));
+  set->cc = equal ? CC_E : CC_NE;
+  set = emit1(MI_SETCC, 1, mreg(SCRATCH2));
+  set->cc = equal ? CC_NP : CC_P;
+  emit2(MI_ADD, 4, mreg(SCRATCH), mreg(SCRATCH2));
+
+  if (equal) {
+    emit2(MI_CMP, 4, mreg(SCRATCH), mimm(2));
+    return CC_E;
+  }
+  emit2(MI_TEST, 4, mreg(SCRATCH), mreg(SCRATCH));
+  return CC_NE;
+}
+
+static void compile_assign(Instruction *inst) {
+  /* Uninitialized variables only need a location */
+  if (inst->nopers == 0)
+    return;
+
+  if (is_floating(variable_type(inst->vreg))) {
+    compile_fp_assign(inst);
+    return;
+  }
+
+  assert(inst->nopers == 1);
+  assert(inst->operands[0].kind != O_UNKNOWN);
+  assert(inst->operands[0].kind != O_LABEL);
+
+  Operand *src = &inst->operands[0];
+  int dest_register = register_of(inst->vreg);
+  if (dest_register >= 0) {
+    load_operand(dest_register, src);
+    return;
+  }
+
+  if (IS_VARIABLE((*src)) && same_location(src->vreg, inst->vreg))
+    return;
+
+  /* There are no memory to memory moves */
+  if (operand_in_memory(src) || !fits_imm32(src)) {
+    load_operand(SCRATCH, src);
+    store_destination(inst, SCRATCH);
+    return;
+  }
+
+  store_variable(inst->vreg, moperand(src));
+}
+
+/* idiv/div take their dividend in edx:eax, both are saved to the frame
+ * around the division unless they receive the result. Pushing them would
+ * clobber the red zone & move the slots addressed from rsp. */
+static void compile_division(Instruction *inst) {
+  bool is_unsigned = inst->type && inst->type->kind == TY_UINT;
+  RegisterID dest = destination(inst);
+
+  load_operand(SCRATCH2, &inst->operands[1]);
+  assert(division_slot >= 0);
+  if (dest != RAX)
+    emit2(MI_MOV, 8, frame_slot(division_slot), mreg(RAX));
+  if (dest != RDX)
+    emit2(MI_MOV, 8, frame_slot(division_slot + 1), mreg(RDX));
+
+  load_operand(RAX, &inst->operands[0]);
+  if (is_unsigned) {
+    emit2(MI_XOR, 4, mreg(RDX), mreg(RDX));
+    emit1(MI_DIV, 4, mreg(SCRATCH2));
+    emit2(MI_MOV, 4, mreg(SCRATCH), mreg(RAX));
+  } else {
+    emit0(MI_CDQ, 4);
+    emit1(MI_IDIV, 4, mreg(SCRATCH2));
+    emit2(MI_MOVSXD, 8, mreg(SCRATCH), mreg(RAX));
+  }
+
+  if (dest != RDX)
+    emit2(MI_MOV, 8, mreg(RDX), frame_slot(division_slot + 1));
+  if (dest != RAX)
+    emit2(MI_MOV, 8, mreg(RAX), frame_slot(division_slot));
+
+  if (dest != SCRATCH)
+    emit2(MI_MOV, 8, mreg(dest), mreg(SCRATCH));
+  store_destination(inst, dest);
+}
+
+static void compile_binop(Instruction *inst) {
+  assert(inst->nopers == 2);
+  assert(inst->operands[0].kind != O_UNKNOWN);
+  assert(inst->operands[0].kind != O_LABEL);
+  assert(inst->operands[1].kind != O_UNKNOWN);
+  assert(inst->operands[1].kind != O_LABEL);
+
+  if (is_floating(variable_type(inst->vreg))) {
+    compile_fp_binop(inst);
+    return;
+  }
+
+  if (inst->opcode == OP_DIV) {
+    compile_division(inst);
+    return;
+  }
+
+  static const MOpcode BINARY_OPS[] = {
+    [OP_ADD] = MI_ADD,
+    [OP_SUB] = MI_SUB,
+    [OP_MUL] = MI_IMUL,
+  };
+
+  MOpcode binop = BINARY_OPS[inst->opcode];
+  Operand *lhs = &inst->operands[0], *rhs = &inst->operands[1];
+  RegisterID dest = destination(inst);
+
+  /* Multiplication by 3, 5 or 9 is a single lea */
+  if (inst->opcode == OP_MUL && IS_VARIABLE((*lhs)) && IS_VALUE((*rhs))
+      && rhs->val.kind <= VAL_UINT) {
+    int32_t n = rhs->val.i_val;
+    if (n == 3 || n == 5 || n == 9) {
+      int src_register = register_of(lhs->vreg);
+      if (src_register < 0) {
+        load_operand(dest, lhs);
+        src_register = dest;
+      }
+
+      MOperand address = mmem(src_register, 0);
+      address.index = src_register;
+      address.scale = n - 1;
+      emit2(MI_LEA, 8, mreg(dest), address);
+      store_destination(inst, dest);
+      return;
+    }
+  }
+
+  /* Loading the lhs would clobber the rhs */
+  if (operand_in_register(rhs, dest) && !operand_in_register(lhs, dest)) {
+    if (inst->opcode != OP_SUB) {
+      Operand *tmp = lhs;
+      lhs = rhs;
+      rhs = tmp;
+    } else {
+      load_operand(SCRATCH, lhs);
+      emit2(binop, 8, mreg(SCRATCH), moperand(rhs));
+      emit2(MI_MOV, 8, mreg(dest), mreg(SCRATCH));
+      return;
+    }
+  }
+
+  if (!fits_imm32(rhs)) {
+    load_operand(SCRATCH2, rhs);
+    load_operand(dest, lhs);
+    emit2(binop, 8, mreg(dest), mreg(SCRATCH2));
+    store_destination(inst, dest);
+    return;
+  }
+
+  load_operand(dest, lhs);
+  emit2(binop, 8, mreg(dest), int_operand(rhs, SCRATCH2));
+  store_destination(inst, dest);
+}
+
+static void compile_shift(Instruction *inst) {
+  assert(inst->nopers == 2);
+  assert(IS_VALUE(inst->operands[1]));
+
+  static const MOpcode SHIFT_OPS[] = {
+    [OP_SHL] = MI_SHL,
+    [OP_SHR] = MI_SHR,
+    [OP_SAR] = MI_SAR,
+  };
+
+  RegisterID dest = destination(inst);
+  load_operand(dest, &inst->operands[0]);
+  emit2(SHIFT_OPS[inst->opcode], 4, mreg(dest), mimm(inst->operands[1].val.i_val & 31));
+  store_destination(inst, dest);
+}
+
+/* High half of a 32x32-bit multiplication by a (magic) constant, done as a
+ * single 64-bit multiply of the sign- or zero-extended operand */
+static void compile_mulhi(Instruction *inst) {
+  assert(inst->nopers == 2);
+  assert(IS_VALUE(inst->operands[1]));
+
+  RegisterID dest = destination(inst);
+  MOperand r = mreg(dest);
+  Operand *x = &inst->operands[0];
+
+  /* A constant dividend is extended here rather than by the load */
+  if (inst->opcode == OP_MULHI) {
+    if (IS_VALUE((*x)))
+      emit2(MI_MOV, 8, r, mimm((int32_t)immediate(x->val)));
+    else
+      emit2(MI_MOVSXD, 8, r, moperand(x));
+    emit3(MI_IMUL, 8, r, r, mimm(inst->operands[1].val.i_val));
+    emit2(MI_SAR, 8, r, mimm(32));
+  } else {
+    uint32_t magic = inst->operands[1].val.u_val;
+    emit2(MI_MOV, 4, r, IS_VALUE((*x)) ? mimm((uint32_t)immediate(x->val)) : moperand(x));
+    if (magic <= INT32_MAX) {
+      emit3(MI_IMUL, 8, r, r, mimm(magic));
+    } else {
+      /* The magic number does not fit in a sign-extended imm32 */
+      emit2(MI_MOV, 4, mreg(SCRATCH2), mimm(magic));
+      emit2(MI_IMUL, 8, r, mreg(SCRATCH2));
+    }
+    emit2(MI_SHR, 8, r, mimm(32));
+  }
+
+  store_destination(inst, dest);
+}
+
+/* Integers are converted from their 32-bit register, except uint which
+ * needs the zero-extended 64-bit one to stay positive; conversions back
+ * truncate towards zero, into a 64-bit register for uint. Conversions
+ * between integer types leave the value as it is. */
+static void compile_conversion(Instruction *inst) {
+  assert(inst->nopers == 1);
+
+  Operand *src = &inst->operands[0];
+  const Type *from = operand_type(src), *to = variable_type(inst->vreg);
+
+  if (!is_floating(from) && !is_floating(to)) {
+    compile_assign(inst);
+    return;
+  }
+
+  if (!is_floating(from)) {
+    int size = from->kind == TY_UINT ? 8 : 4;
+    MOperand value = int_operand(src, SCRATCH);
+    if (value.kind == MO_IMM || size == 8) {
+      emit2(MI_MOV, 4, mreg(SCRATCH), value);
+      value = mreg(SCRATCH);
+    }
+
+    RegisterID dest = fp_destination(inst);
+    emit2(to->kind == TY_FLOAT ? MI_CVTSI2SS : MI_CVTSI2SD, size, mreg(dest), value);
+    store_fp(inst, dest);
+    return;
+  }
+
+  int from_size = fp_size(from);
+  if (is_floating(to)) {
+    RegisterID dest = fp_destination(inst);
+    if (fp_size(to) == from_size)
+      load_fp(dest, src, from_size);
+    else
+      emit2(from_size == 4 ? MI_CVTSS2SD : MI_CVTSD2SS, from_size, mreg(dest), fp_operand(src, from_size));
+    store_fp(inst, dest);
+    return;
+  }
+
+  RegisterID dest = destination(inst);
+  if (to->kind == TY_BOOL) {
+    /* Compared against zero, unordered values being true */
+    emit2(MI_XORPS, 16, mreg(SCRATCH_XMM), mreg(SCRATCH_XMM));
+    emit_fp_equality(src, mreg(SCRATCH_XMM), from_size, false);
+    emit2(MI_MOV, 4, mreg(dest), mreg(SCRATCH));
+  } else {
+    emit2(from_size == 4 ? MI_CVTTSS2SI : MI_CVTTSD2SI, to->kind == TY_UINT ? 8 : 4,
+        mreg(dest), fp_operand(src, from_size));
+  }
+  store_destination(inst, dest);
+}
+
+/* Floating point values are negated by flipping their sign bit, with a
+ * 16-byte mask as xorps only takes packed operands */
+static void compile_negation(Instruction *inst) {
+  assert(inst->nopers == 1);
+
+  Operand *src = &inst->operands[0];
+  const Type *type = variable_type(inst->vreg);
+
+  if (is_floating(type)) {
+    int size = fp_size(type);
+    RegisterID dest = fp_destination(inst);
+    load_fp(dest, src, size);
+    emit2(MI_XORPS, 16, mreg(dest), mconst(size == 4 ? 1ULL << 31 : 1ULL << 63, 16));
+    store_fp(inst, dest);
+    return;
+  }
+
+  RegisterID dest = destination(inst);
+  load_operand(dest, src);
+  emit1(MI_NEG, 8, mreg(dest));
+  store_destination(inst, dest);
+}
+
+/* String literals are addressed relative to rip in .rodata.str, & only
+ * those whose address is taken are emitted */
+static void compile_address(Instruction *inst) {
+  assert(inst->nopers == 1 && IS_LABEL(inst->operands[0]));
+
+  const char *label = inst->operands[0].label;
+  if (!strpool_use(&STRINGS, label))
+    LOG_FATAL("no string literal labeled '%s'", label);
+
+  MOperand mem = mmem(NO_REG, 0);
+  mem.sym = label;
+  RegisterID dest = destination(inst);
+  emit2(MI_LEA, 8, mreg(dest), mem);
+  store_destination(inst, dest);
+}
+
+/* Characters are loaded zero-extended, through the scratch register when
+ * the pointer is not in one */
+static void compile_dereference(Instruction *inst) {
+  assert(inst->nopers == 1);
+
+  Operand *src = &inst->operands[0];
+  int base = IS_VARIABLE((*src)) ? register_of(src->vreg) : -1;
+  if (base < 0) {
+    load_operand(SCRATCH, src);
+    base = SCRATCH;
+  }
+
+  RegisterID dest = destination(inst);
+  emit2(MI_MOVZX, 4, mreg(dest), mmem(base, 0));
+  store_destination(inst, dest);
+}
+
+static CondCode condition_of(Opcode opcode, bool is_unsigned) {
+  switch (opcode) {
+    case OP_CMP:       return CC_E;
+    case OP_CMP_NOT:   return CC_NE;
+    case OP_CMP_LT:    return is_unsigned ? CC_B : CC_L;
+    case OP_CMP_GT:    return is_unsigned ? CC_A : CC_G;
+    case OP_CMP_LT_EQ: return is_unsigned ? CC_BE : CC_LE;
+    case OP_CMP_GT_EQ: return is_unsigned ? CC_AE : CC_GE;
+    default: LOG_FATAL("opcode %s is not a comparison", OPCODES[opcode]);
+  }
+}
+
+/* Condition holding once the operands of a comparison are swapped */
+static CondCode swap_condition(CondCode cc) {
+  switch (cc) {
+    case CC_L:  return CC_G;
+    case CC_G:  return CC_L;
+    case CC_LE: return CC_GE;
+    case CC_GE: return CC_LE;
+    case CC_B:  return CC_A;
+    case CC_A:  return CC_B;
+    case CC_BE: return CC_AE;
+    case CC_AE: return CC_BE;
+    default:    return cc;
+  }
+}
+
+/* ucomiss/ucomisd set the flags as an unsigned comparison does. < & <= are
+ * swapped into > & >=, so that unordered operands (NaN), which set CF,
+ * make every ordering false. */
+static CondCode emit_fp_compare(Instruction *inst) {
+  Operand *lhs = &inst->operands[0], *rhs = &inst->operands[1];
+  int size = fp_size(operand_type(lhs));
+  CondCode cc = condition_of(inst->opcode, true);
+
+  if (cc == CC_E || cc == CC_NE)
+    return emit_fp_equality(lhs, fp_operand(rhs, size), size, cc == CC_E);
+
+  if (cc == CC_B || cc == CC_BE) {
+    Operand *tmp = lhs;
+    lhs = rhs;
+    rhs = tmp;
+    cc = swap_condition(cc);
+  }
+
+  MOperand a = fp_operand(lhs, size);
+  if (a.kind != MO_REG) {
+    load_fp(SCRATCH_XMM, lhs, size);
+    a = mreg(SCRATCH_XMM);
+  }
+
+  emit2(SSE_OP(OP_CMP, size), size, a, fp_operand(rhs, size));
+  return cc;
+}
+
+/* Emits the cmp of a comparison & returns the condition code that holds
+ * when the comparison is true. Integers are 32-bit & only the lower half of
+ * their registers is kept meaningful (32-bit shifts zero-extend), so the
+ * comparison is a 32-bit one. */
+static CondCode emit_compare(Instruction *inst) {
+  assert(inst->nopers == 2);
+
+  if (is_floating(operand_type(&inst->operands[0])))
+    return emit_fp_compare(inst);
+
+  bool is_unsigned = inst->type && inst->type->kind == TY_UINT;
+  CondCode cc = condition_of(inst->opcode, is_unsigned);
+  Operand *lhs = &inst->operands[0], *rhs = &inst->operands[1];
+
+  /* cmp only takes an immediate on the right */
+  if (IS_VALUE((*lhs)) && !IS_VALUE((*rhs))) {
+    Operand *tmp = lhs;
+    lhs = rhs;
+    rhs = tmp;
+    cc = swap_condition(cc);
+  }
+
+  MOperand a;
+  if (IS_VALUE((*lhs))) {
+    load_operand(SCRATCH, lhs);
+    a = mreg(SCRATCH);
+  } else {
+    a = int_operand(lhs, SCRATCH);
+  }
+
+  MOperand b;
+  if ((a.kind == MO_MEM && operand_in_memory(rhs)) || !fits_imm32(rhs)) {
+    load_operand(SCRATCH2, rhs);
+    b = mreg(SCRATCH2);
+  } else {
+    b = int_operand(rhs, SCRATCH2);
+  }
+
+  emit2(MI_CMP, 4, a, b);
+  return cc;
+}
+
+/* Comparisons used as values are materialized as 0 or 1 */
+static void compile_compare(Instruction *inst) {
+  CondCode cc = emit_compare(inst);
+  RegisterID dest = destination(inst);
+
+  MInst *set = emit1(MI_SETCC, 1, mreg(dest));
+  set->cc = cc;
+  emit2(MI_MOVZX, 4, mreg(dest), mreg(dest));
+  store_destination(inst, dest);
+}
+
+/* A comparison read only by the branch right after it is compiled into the
+ * branch as cmp + jcc, & its result never materialized */
+static bool fuses_with_branch(Instruction *inst) {
+  Instruction *br = inst->next;
+  return IS_COMPARISON_OP(inst->opcode) && inst->assignee && br && br->opcode == OP_BR
+    && IS_VARIABLE(br->operands[0]) && br->operands[0].vreg == inst->vreg
+    && allocation_lookup(&allocation, inst->vreg)->uses == 2;
+}
+
+/* Emits the test of a branch condition & returns the condition code under
+ * which the branch is taken */
+static CondCode emit_condition(Instruction *br) {
+  if (br->prev && fuses_with_branch(br->prev))
+    return emit_compare(br->prev);
+
+  MOperand cond = int_operand(&br->operands[0], SCRATCH);
+  if (cond.kind == MO_REG)
+    emit2(MI_TEST, 4, cond, cond);
+  else
+    emit2(MI_CMP, 4, cond, mimm(0));
+  return CC_NE;
+}
+
+static void compile_branch(BasicBlock *block, Instruction *br, BasicBlock *next) {
+  assert(block->nsuccs == 2);
+  BasicBlock *taken = block->succ[0], *other = block->succ[1];
+
+  if (IS_VALUE(br->operands[0])) {
+    jump_to(value_is_truthy(&br->operands[0].val) ? taken : other, next);
+    return;
+  }
+
+  CondCode cc = emit_condition(br);
+  if (taken == next) {
+    emit_jcc(CC_NEGATE(cc), other);
+  } else {
+    emit_jcc(cc, taken);
+    jump_to(other, next);
+  }
+}
+
+/* Branch whose arms only assign the same variable, or where one arm does &
+ * the other is the join block. The assignment is made conditional instead. */
+typedef struct {
+  BasicBlock *join;
+  Instruction *assign[2];   /* When the condition holds & when it does not, NULL
+                             * when the variable keeps its value */
+} Select;
+
+/* The single assignment of a block entered from `from` only */
+static Instruction *single_assignment(BasicBlock *block, BasicBlock *from) {
+  if (block->npreds != 1 || block->pred[0] != from || block->nsuccs != 1)
+    return NULL;
+
+  Instruction *assign = NULL;
+  for (Instruction *inst = block->head; inst; inst = inst->next) {
+    if (inst->opcode == OP_DEAD || inst->opcode == OP_JMP)
+      continue;
+    if (assign || inst->opcode != OP_ASSIGN || inst->nopers != 1)
+      return NULL;
+    assign = inst;
+  }
+  return assign;
+}
+
+static bool match_select(BasicBlock *block, Select *sel) {
+  Instruction *br = block->tail;
+  if (!options.select || !br || br->opcode != OP_BR || block->nsuccs != 2 || IS_VALUE(br->operands[0]))
+    return false;
+
+  BasicBlock *then = block->succ[0], *other = block->succ[1];
+  Instruction *a = single_assignment(then, block);
+  Instruction *b = single_assignment(other, block);
+
+  if (a && b && then->succ[0] == other->succ[0] && a->vreg == b->vreg) {
+    sel->join = then->succ[0];
+  } else if (a && then->succ[0] == other) {
+    sel->join = other;
+    b = NULL;
+  } else if (b && other->succ[0] == then) {
+    sel->join = then;
+    a = NULL;
+  } else {
+    return false;
+  }
+
+  /* cmov only moves general purpose registers */
+  if (is_floating(variable_type(a ? a->vreg : b->vreg)))
+    return false;
+
+  sel->assign[0] = a;
+  sel->assign[1] = b;
+  return true;
+}
+
+/* Value assigned by an arm, NULL when the arm leaves the variable as is */
+static Operand *select_value(Instruction *assign, int vreg) {
+  if (!assign)
+    return NULL;
+
+  Operand *value = &assign->operands[0];
+  if (IS_VARIABLE((*value)) && same_location(value->vreg, vreg))
+    return NULL;
+  return value;
+}
+
+/* cmov (or setcc for 0 & 1) into the register of the variable, the value of
+ * the other arm being moved there first since mov leaves the flags alone */
+static void compile_select(Instruction *br, Select *sel) {
+  Instruction *assign = sel->assign[0] ? sel->assign[0] : sel->assign[1];
+  int vreg = assign->vreg;
+
+  CondCode cc = emit_condition(br);
+  Operand *when = select_value(sel->assign[0], vreg);
+  Operand *otherwise = select_value(sel->assign[1], vreg);
+  if (!when) {
+    when = otherwise;
+    otherwise = NULL;
+    cc = CC_NEGATE(cc);
+  }
+  if (!when)
+    return;
+
+  int rid = register_of(vreg);
+  RegisterID dest = rid >= 0 ? rid : SCRATCH;
+
+  if (otherwise && IS_VALUE((*when)) && IS_VALUE((*otherwise))) {
+    int64_t t = immediate(when->val), f = immediate(otherwise->val);
+    if ((t == 1 && f == 0) || (t == 0 && f == 1)) {
+      MInst *set = emit1(MI_SETCC, 1, mreg(dest));
+      set->cc = t ? cc : CC_NEGATE(cc);
+      emit2(MI_MOVZX, 4, mreg(dest), mreg(dest));
+      if (rid < 0)
+        store_variable(vreg, mreg(dest));
+      return;
+    }
+  }
+
+  if (otherwise)
+    load_operand(dest, otherwise);
+  else if (rid < 0)
+    load_variable(dest, vreg);
+
+  MOperand src = int_operand(when, SCRATCH2);
+  if (src.kind == MO_IMM) {
+    emit2(MI_MOV, 8, mreg(SCRATCH2), src);
+    src = mreg(SCRATCH2);
+  }
+
+  MInst *cmov = emit2(MI_CMOV, 8, mreg(dest), src);
+  cmov->cc = cc;
+  if (rid < 0)
+    store_variable(vreg, mreg(dest));
+}
+
+/* Calling Convention
+ *
+ * Arguments are moved into their registers, & parameters out of them, as a
+ * single parallel copy: a copy may overwrite the source of another, so they
+ * are ordered for every register to be read before it is written, & cycles
+ * are broken through a scratch register. Stack arguments are pushed right
+ * to left & found at [rbp+16] onwards by the callee. */
+
+typedef struct {
+  MOperand dst, src;
+  int size;  /* Of floating point values, or 0 for integers */
+  const Type *narrow;  /* Of a narrow global source, loaded by extension */
+} Copy;
+
+static bool fits_int32(int64_t v) {
+  return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+/* Source of a copy of an operand; a floating point zero is an immediate */
+static MOperand copy_source(Operand *operand, int size) {
+  if (!size)
+    return moperand(operand);
+  if (IS_VALUE((*operand)) && fp_bits(operand->val, size) == 0)
+    return mimm(0);
+  return fp_operand(operand, size);
+}
+
+static void emit_copy(MOperand dst, MOperand src, int size) {
+  if (!size) {
+    if (dst.kind == MO_MEM && (src.kind == MO_MEM || (src.kind == MO_IMM && !fits_int32(src.imm)))) {
+      emit2(MI_MOV, 8, mreg(SCRATCH), src);
+      src = mreg(SCRATCH);
+    }
+    emit2(MI_MOV, 8, dst, src);
+    return;
+  }
+
+  if (src.kind == MO_IMM) {
+    if (dst.kind == MO_REG)
+      emit2(MI_XORPS, 16, dst, dst);
+    else
+      emit2(MI_MOV, size, dst, src);
+    return;
+  }
+
+  MOpcode mov = SSE_OP(OP_ASSIGN, size);
+  if (dst.kind == MO_MEM && src.kind == MO_MEM) {
+    emit2(mov, size, mreg(SCRATCH_XMM), src);
+    src = mreg(SCRATCH_XMM);
+  }
+  emit2(mov, size, dst, src);
+}
+
+/* Whether another copy still has to read the destination of copies[i] */
+static bool copy_blocked(Copy *copies, int n, int i) {
+  if (copies[i].dst.kind != MO_REG)
+    return false;
+
+  for (int j = 0; j < n; j++) {
+    if (j != i && copies[j].src.kind == MO_REG && copies[j].src.reg == copies[i].dst.reg)
+      return true;
+  }
+  return false;
+}
+
+static void emit_parallel_copy(Copy *copies, int n) {
+  int pending = 0;
+  for (int i = 0; i < n; i++) {
+    MOperand *dst = &copies[i].dst, *src = &copies[i].src;
+    if (!(dst->kind == MO_REG && src->kind == MO_REG && dst->reg == src->reg))
+      copies[pending++] = copies[i];
+  }
+
+  while (pending > 0) {
+    bool progress = false;
+    for (int i = 0; i < pending; i++) {
+      if (copy_blocked(copies, pending, i))
+        continue;
+
+      if (copies[i].narrow)
+        load_narrow(copies[i].dst.reg, copies[i].src, copies[i].narrow);
+      else
+        emit_copy(copies[i].dst, copies[i].src, copies[i].size);
+      copies[i--] = copies[--pending];
+      progress = true;
+    }
+    if (progress)
+      continue;
+
+    /* Only cycles of registers are left: one of them is moved aside, as the
+     * scratch registers of emit_copy are not part of any cycle */
+    int reg = copies[0].dst.reg;
+    bool xmm = REGCLASS(reg) == RC_XMM;
+    RegisterID aside = xmm ? SCRATCH_XMM2 : SCRATCH2;
+    emit_copy(mreg(aside), mreg(reg), xmm ? 8 : 0);
+    for (int j = 0; j < pending; j++) {
+      if (copies[j].src.kind == MO_REG && copies[j].src.reg == reg)
+        copies[j].src = mreg(aside);
+    }
+  }
+}
+
+/* Size of a floating point operand, 0 for integers */
+static int copy_size(const Type *type) {
+  return is_floating(type) ? fp_size(type) : 0;
+}
+
+/* Parameters are all bound at once, before the body of the function */
+static void bind_parameters(BasicBlock *entry) {
+  const char *func = entry->head->operands[0].label;
+  Copy *copies = NULL;
+  int n = 0;
+
+  for (Instruction *inst = entry->head; inst; inst = inst->next) {
+    if (inst->opcode != OP_PARAM)
+      continue;
+
+    Copy *tmp = realloc(copies, sizeof(Copy) * (n + 1));
+    if (!tmp)
+      LOG_FATAL("realloc failed in bind_parameters");
+    copies = tmp;
+
+    int stack;
+    int rid = parameter_register(func, inst->operands[0].val.i_val, &stack);
+    copies[n].dst = location(inst->vreg);
+    copies[n].src = rid >= 0 ? mreg(rid) : incoming_argument(stack);
+    copies[n].size = copy_size(variable_type(inst->vreg));
+    copies[n].narrow = NULL;
+    n++;
+  }
+
+  emit_parallel_copy(copies, n);
+  free(copies);
+}
+
+static void compile_call(Instruction *inst) {
+  int nargs = inst->operands[1].val.i_val;
+  Instruction *arg = inst;
+  for (int i = 0; i < nargs; i++)
+    arg = arg->prev;
+
+  /* Sources are only addressed once emitted, as rsp moves with each push */
+  Copy *copies = calloc(nargs ? nargs : 1, sizeof(Copy));
+  Operand **sources = calloc(nargs ? nargs : 1, sizeof(Operand *));
+  Operand **stack = calloc(nargs ? nargs : 1, sizeof(Operand *));
+  if (!copies || !sources || !stack)
+    LOG_FATAL("calloc failed in compile_call");
+
+  int ncopies = 0, nstack = 0, counts[NUM_REGCLASSES] = { 0 };
+  for (int i = 0; i < nargs; i++, arg = arg->next) {
+    assert(arg->opcode == OP_ARG);
+    Operand *value = &arg->operands[0];
+    int size = copy_size(operand_type(value));
+    RegClass cls = size ? RC_XMM : RC_GPR;
+    int rid = argument_register(cls, counts[cls]++);
+
+    if (rid >= 0) {
+      copies[ncopies] = (Copy){ .dst = mreg(rid), .size = size };
+      sources[ncopies++] = value;
+    } else {
+      stack[nstack++] = value;
+    }
+  }
+
+  /* rsp is 16-byte aligned in the body of a function */
+  int pushed = nstack + nstack % 2;
+  if (nstack % 2) {
+    emit2(MI_SUB, 8, mreg(RSP), mimm(SLOT_SIZE));
+    stack_adjust += SLOT_SIZE;
+  }
+  for (int i = nstack - 1; i >= 0; i--) {
+    int size = copy_size(operand_type(stack[i]));
+    MOperand src = copy_source(stack[i], size);
+    if (size) {
+      if (src.kind == MO_MEM) {
+        emit2(SSE_OP(OP_ASSIGN, size), size, mreg(SCRATCH_XMM), src);
+        src = mreg(SCRATCH_XMM);
+      }
+      emit2(MI_SUB, 8, mreg(RSP), mimm(SLOT_SIZE));
+      emit_copy(mmem(RSP, 0), src, size);
+    } else {
+      src = int_operand(stack[i], SCRATCH);
+      if (src.kind != MO_REG) {
+        emit2(MI_MOV, 8, mreg(SCRATCH), src);
+        src = mreg(SCRATCH);
+      }
+      emit1(MI_PUSH, 8, src);
+    }
+    stack_adjust += SLOT_SIZE;
+  }
+
+  for (int i = 0; i < ncopies; i++) {
+    copies[i].src = copy_source(sources[i], copies[i].size);
+    if (!copies[i].size && IS_VARIABLE((*sources[i])))
+      copies[i].narrow = narrow_global(sources[i]->vreg);
+  }
+  emit_parallel_copy(copies, ncopies);
+  emit_counter(inst->counter);
+  emit1(MI_CALL, 8, msym(inst->operands[0].label));
+  if (pushed)
+    emit2(MI_ADD, 8, mreg(RSP), mimm(pushed * SLOT_SIZE));
+  stack_adjust = 0;
+
+  if (inst->assignee) {
+    int size = copy_size(variable_type(inst->vreg));
+    RegisterID rid = RETURN_REGISTER(size ? RC_XMM : RC_GPR);
+    if (register_of(inst->vreg) == (int)rid)
+      ;
+    else if (narrow_global(inst->vreg))
+      store_variable(inst->vreg, mreg(rid));
+    else
+      emit_copy(location(inst->vreg), mreg(rid), size);
+  }
+
+  free(copies);
+  free(sources);
+  free(stack);
+}
+
+/* Reads the time stamp counter into rax, clobbering rdx */
+static void emit_read_tsc(MOpcode op) {
+  emit0(op, 8);
+  emit2(MI_SHL, 8, mreg(RDX), mimm(32));
+  emit2(MI_ADD, 8, mreg(RAX), mreg(RDX));
+}
+
+/* Starts timing the function once its frame is set up. Its callees start
+ * from zero, & rdx, which may hold an argument, is kept in the scratch
+ * register meanwhile. */
+static void emit_cycles_entry() {
+  int record = function_index * CYCLES_RECORD;
+  emit2(MI_MOV, 8, mreg(SCRATCH), mreg(RDX));
+  emit1(MI_INC, 8, mstatic(CYCLES, record + CYCLES_CALLS));
+  emit1(MI_INC, 8, mstatic(CYCLES, record + CYCLES_DEPTH));
+  emit2(MI_MOV, 8, mreg(RAX), mstatic(CYCLES_CALLEES, 0));
+  emit2(MI_MOV, 8, frame_slot(cycles_slot + 1), mreg(RAX));
+  emit2(MI_MOV, 8, mstatic(CYCLES_CALLEES, 0), mimm(0));
+  emit_read_tsc(MI_RDTSC);
+  emit2(MI_MOV, 8, frame_slot(cycles_slot), mreg(RAX));
+  emit2(MI_MOV, 8, mreg(RDX), mreg(SCRATCH));
+}
+
+/* Stops timing the function before its epilogue: its self cycles leave out
+ * those of its callees, & all of them count as callee cycles of its caller.
+ * The result in rax is kept in the scratch register meanwhile, while rcx &
+ * rdx are free on return. */
+static void emit_cycles_exit() {
+  int record = function_index * CYCLES_RECORD;
+  emit2(MI_MOV, 8, mreg(SCRATCH), mreg(RAX));
+  emit_read_tsc(MI_RDTSCP);
+  emit2(MI_SUB, 8, mreg(RAX), frame_slot(cycles_slot));
+  emit2(MI_MOV, 8, mreg(RDX), mreg(RAX));
+  emit2(MI_SUB, 8, mreg(RDX), mstatic(CYCLES_CALLEES, 0));
+  emit2(MI_ADD, 8, mstatic(CYCLES, record + CYCLES_SELF), mreg(RDX));
+  emit2(MI_MOV, 8, mreg(RDX), frame_slot(cycles_slot + 1));
+  emit2(MI_ADD, 8, mreg(RDX), mreg(RAX));
+  emit2(MI_MOV, 8, mstatic(CYCLES_CALLEES, 0), mreg(RDX));
+
+  /* Only the outermost activation adds to the total */
+  emit2(MI_XOR, 4, mreg(RCX), mreg(RCX));
+  emit1(MI_DEC, 8, mstatic(CYCLES, record + CYCLES_DEPTH));
+  emit2(MI_CMOV, 8, mreg(RCX), mreg(RAX))->cc = CC_E;
+  emit2(MI_ADD, 8, mstatic(CYCLES, record + CYCLES_TOTAL), mreg(RCX));
+  emit2(MI_MOV, 8, mreg(RAX), mreg(SCRATCH));
+}
+
+static void emit_epilogue() {
+  if (cycles_slot >= 0)
+    emit_cycles_exit();
+  if (frame_size)
+    emit2(MI_ADD, 8, mreg(RSP), mimm(frame_size));
+  for (int i = nsaved - 1; i >= 0; i--)
+    emit1(MI_POP, 8, mreg(saved_registers[i]));
+  if (!options.omit_frame_pointer)
+    emit1(MI_POP, 8, mreg(RBP));
+  emit0(MI_RET, 8);
+}
+
+static void compile_return(Instruction *inst) {
+  if (inst->nopers) {
+    Operand *value = &inst->operands[0];
+    int size = copy_size(operand_type(value));
+    RegisterID rid = RETURN_REGISTER(size ? RC_XMM : RC_GPR);
+    if (!(IS_VARIABLE((*value)) && register_of(value->vreg) == (int)rid))
+      emit_copy(mreg(rid), copy_source(value, size), size);
+  }
+  emit_epilogue();
+}
+
+static void compile_instruction(Instruction *inst) {
+  switch (inst->opcode) {
+    case OP_DEF:
+    case OP_PARAM:
+      /* Bound by the prologue */
+    case OP_ARG:
+      /* Passed by the call that follows */
+      break;
+    case OP_CALL:
+      compile_call(inst);
+      break;
+    case OP_ASSIGN:
+      compile_assign(inst);
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+      compile_binop(inst);
+      break;
+    case OP_SHL:
+    case OP_SHR:
+    case OP_SAR:
+      compile_shift(inst);
+      break;
+    case OP_MULHI:
+    case OP_UMULHI:
+      compile_mulhi(inst);
+      break;
+    case OP_NEG:
+      compile_negation(inst);
+      break;
+    case OP_CONV:
+      compile_conversion(inst);
+      break;
+    case OP_ADDR:
+      compile_address(inst);
+      break;
+    case OP_DEREF:
+      compile_dereference(inst);
+      break;
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+      compile_compare(inst);
+      break;
+    case OP_RET:
+      compile_return(inst);
+      break;
+    case OP_DEAD:
+      /* Dropped arguments & calls assign nothing, & temporaries or the
+       * copies of inlined variables ($-prefixed) aren't the user's */
+      if (inst->assignee && inst->assignee[0] != '$')
+        LOG_WARN("ignoring dead variable '%s' at line %d, col %d",
+            inst->assignee, inst->span.line, inst->span.col);
+      break;
+    default:
+      LOG_FATAL("compilation not supported for opcode: %s", OPCODES[inst->opcode]);
+  }
+}
+
+/* Compiles a block laid out right before `next` */
+static void compile_block(BasicBlock *block, BasicBlock *next) {
+  if (block->npreds && !IS_FUNCTION_ENTRY(block))
+    emit_label(block_label(block), false);
+  for (int i = 0; i < block->ncounters; i++)
+    emit_counter(block->counters[i]);
+
+  for (Instruction *inst = block->head; inst; inst = inst->next) {
+    if (inst->opcode == OP_JMP || inst->opcode == OP_BR || fuses_with_branch(inst))
+      continue;
+    compile_instruction(inst);
+  }
+
+  Instruction *tail = block->tail;
+  Select sel;
+  if (tail && tail->opcode == OP_BR) {
+    if (match_select(block, &sel)) {
+      compile_select(tail, &sel);
+      jump_to(sel.join, next);
+    } else {
+      compile_branch(block, tail, next);
+    }
+  } else if (tail && tail->opcode == OP_RET) {
+    /* The return emitted the epilogue */
+  } else if (block->nsuccs == 1 && block->succ[0] != current_end) {
+    jump_to(block->succ[0], next);
+  } else if (in_function) {
+    /* Falling off the end of a function returns */
+    emit_epilogue();
+  }
+}
+
+/* Successor a block should fall through into: the arm of a branch taken
+ * more often in the profile. Without profile data both arms are as likely,
+ * except that an arm returning right away is taken less often (Ball &
+ * Larus) */
+static BasicBlock *fallthrough_successor(BasicBlock *block) {
+  Select sel;
+  if (match_select(block, &sel))
+    return sel.join;
+
+  if (block->nsuccs == 2) {
+    BasicBlock *then = block->succ[0], *other = block->succ[1];
+    if (then->count >= 0 && other->count >= 0 && then->count != other->count)
+      return then->count > other->count ? then : other;
+
+    bool then_returns = then->tail && then->tail->opcode == OP_RET;
+    bool other_returns = other->tail && other->tail->opcode == OP_RET;
+    return then_returns && !other_returns ? other : then;
+  }
+  return block->nsuccs == 1 ? block->succ[0] : NULL;
+}
+
+/* Orders the blocks of a function so that control falls through into the
+ * next block as often as possible. A block follows its predecessor once all
+ * of its predecessors are placed, so a join comes after the last of its
+ * arms, save for arms that never ran in the profile; otherwise blocks keep
+ * their order. Arms folded into a select are left out. Returns the number
+ * of blocks in `order`. */
+static size_t layout_blocks(BasicBlock *entry, BasicBlock *end, BasicBlock ***order) {
+  size_t n = 0;
+  int max_id = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next, n++) {
+    if (block->id > max_id)
+      max_id = block->id;
+  }
+
+  BasicBlock **blocks = calloc(n, sizeof(BasicBlock *));
+  BasicBlock **out = calloc(n, sizeof(BasicBlock *));
+  int *position = malloc(sizeof(int) * (max_id + 1));
+  bool *placed = calloc(n, sizeof(bool));
+  if (!blocks || !out || !position || !placed)
+    LOG_FATAL("allocation failed in layout_blocks");
+
+  memset(position, -1, sizeof(int) * (max_id + 1));
+  size_t i = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next, i++) {
+    blocks[i] = block;
+    position[block->id] = i;
+  }
+
+  for (i = 0; i < n; i++) {
+    Select sel;
+    if (!match_select(blocks[i], &sel))
+      continue;
+    for (int k = 0; k < 2; k++) {
+      if (sel.assign[k])
+        placed[position[blocks[i]->succ[k]->id]] = true;
+    }
+  }
+
+  size_t count = 0;
+  for (i = 0; i < n; i++) {
+    BasicBlock *block = blocks[i];
+    while (block && !placed[position[block->id]]) {
+      placed[position[block->id]] = true;
+      out[count++] = block;
+
+      BasicBlock *succ = fallthrough_successor(block);
+      if (!succ || succ->id > max_id || position[succ->id] < 0 || blocks[position[succ->id]] != succ)
+        break;
+
+      bool ready = true;
+      for (int p = 0; p < succ->npreds; p++) {
+        if (succ->pred[p]->count == 0 && succ->count != 0)
+          continue;
+        int at = succ->pred[p]->id <= max_id ? position[succ->pred[p]->id] : -1;
+        if (at >= 0 && blocks[at] == succ->pred[p] && !placed[at])
+          ready = false;
+      }
+      block = ready ? succ : NULL;
+    }
+  }
+
+  free(blocks);
+  free(position);
+  free(placed);
+  *order = out;
+  return count;
+}
+
+/* Callee-saved registers the allocator handed out */
+static void find_saved_registers() {
+  bool used[NUM_REGISTERS] = { false };
+  for (size_t i = 0; i < allocation.nintervals; i++) {
+    RegisterData *data = allocation.intervals[i];
+    if (!data->global && data->slot < 0 && data->rid >= 0)
+      used[data->rid] = true;
+  }
+
+  nsaved = 0;
+  for (int rid = 0; rid < NUM_REGISTERS; rid++) {
+    int priority = register_priority(rid);
+    if (used[rid] && priority >= 0 && (CALLEE_SAVED & (1u << priority)))
+      saved_registers[nsaved++] = rid;
+  }
+}
+
+/* Whether the function calls another one, & whether it has an integer
+ * division needing the slots to save rax & rdx */
+static void scan_function(BasicBlock *entry, BasicBlock *end, bool *leaf, bool *divides) {
+  *leaf = true;
+  *divides = false;
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_CALL)
+        *leaf = false;
+      else if (inst->opcode == OP_DIV && !is_floating(variable_type(inst->vreg)))
+        *divides = true;
+    }
+  }
+}
+
+/* Spill slots are sized by what they hold & packed by alignment: integers
+ * are kept in whole registers so they take a quadword, floats only 4 bytes.
+ * The area starts 8-byte aligned below the saved registers. */
+static void layout_slots(int nslots) {
+  LayoutItem *items = calloc(nslots ? nslots : 1, sizeof(LayoutItem));
+  slot_offsets = calloc(nslots ? nslots : 1, sizeof(int));
+  if (!items || !slot_offsets)
+    LOG_FATAL("calloc failed in layout_slots");
+
+  for (size_t i = 0; i < allocation.nintervals; i++) {
+    RegisterData *data = allocation.intervals[i];
+    if (data->global || data->slot < 0)
+      continue;
+
+    int size = data->cls == RC_XMM ? fp_size(data->type) : SLOT_SIZE;
+    if (size > items[data->slot].size)
+      items[data->slot].size = items[data->slot].align = size;
+  }
+
+  /* Slots for the division only */
+  for (int i = 0; i < nslots; i++) {
+    if (!items[i].size)
+      items[i].size = items[i].align = SLOT_SIZE;
+  }
+
+  slot_area = layout_pack(items, nslots, true, NULL);
+  for (int i = 0; i < nslots; i++)
+    slot_offsets[i] = slot_area - items[i].offset;
+  free(items);
+}
+
+/* Name of the cold part of a function, owned by the program */
+static const char *cold_label(const char *func) {
+  char **tmp = realloc(mprog->labels, sizeof(char *) * (mprog->nlabels + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in cold_label");
+  mprog->labels = tmp;
+  return tmp[mprog->nlabels++] = format("%s.cold", func);
+}
+
+static void compile_function(BasicBlock *entry, BasicBlock *end, RegAllocKind regalloc) {
+  size_t start = mprog->ninsts;
+  allocate_registers(&allocation, regalloc, entry, end);
+  find_saved_registers();
+  current_end = end;
+  in_function = true;
+
+  bool leaf, divides;
+  scan_function(entry, end, &leaf, &divides);
+  int nslots = allocation.nslots;
+  division_slot = divides ? nslots : -1;
+  nslots += divides ? 2 : 0;
+  cycles_slot = options.profile_cycles ? nslots : -1;
+  layout_slots(nslots + (options.profile_cycles ? 2 : 0));
+
+  emit_label(entry->head->operands[0].label, false);
+  if (!options.omit_frame_pointer) {
+    emit1(MI_PUSH, 8, mreg(RBP));
+    emit2(MI_MOV, 8, mreg(RBP), mreg(RSP));
+  }
+  for (int i = 0; i < nsaved; i++)
+    emit1(MI_PUSH, 8, mreg(saved_registers[i]));
+
+  /* Spill slots, keeping the stack 16-byte aligned for calls. Nothing
+   * interrupts a leaf function to write below rsp, so its slots need no
+   * room when they fit in the red zone. */
+  int pushed = (options.omit_frame_pointer ? 1 : 2) * SLOT_SIZE + nsaved * SLOT_SIZE;
+  if (leaf && slot_area <= RED_ZONE_SIZE)
+    frame_size = 0;
+  else
+    frame_size = ((pushed + slot_area + 15) & ~15) - pushed;
+  if (frame_size)
+    emit2(MI_SUB, 8, mreg(RSP), mimm(frame_size));
+  if (cycles_slot >= 0)
+    emit_cycles_entry();
+
+  bind_parameters(entry);
+
+  BasicBlock **order;
+  size_t nblocks = layout_blocks(entry, end, &order);
+
+  /* Blocks that never ran in the profile are split off, unless the whole
+   * function never did & goes with them */
+  size_t nhot = 0;
+  BasicBlock **blocks = calloc(nblocks ? nblocks : 1, sizeof(BasicBlock *));
+  if (!blocks)
+    LOG_FATAL("calloc failed in compile_function");
+  for (size_t i = 0; i < nblocks; i++) {
+    if (order[i]->count != 0 || entry->count == 0)
+      blocks[nhot++] = order[i];
+  }
+  size_t ncold_blocks = 0;
+  for (size_t i = 0; i < nblocks; i++) {
+    if (order[i]->count == 0 && entry->count != 0)
+      blocks[nhot + ncold_blocks++] = order[i];
+  }
+
+  for (size_t i = 0; i < nhot; i++)
+    compile_block(blocks[i], i + 1 < nhot ? blocks[i + 1] : end);
+
+  if (ncold_blocks) {
+    size_t split = mprog->ninsts;
+    emit_label(cold_label(entry->head->operands[0].label), false);
+    for (size_t i = nhot; i < nblocks; i++)
+      compile_block(blocks[i], i + 1 < nblocks ? blocks[i + 1] : NULL);
+    move_to_cold(split);
+  }
+  if (entry->count == 0)
+    move_to_cold(start);
+
+  free(blocks);
+  free(order);
+  free_allocation(&allocation);
+  current_end = NULL;
+  in_function = false;
+  free(slot_offsets);
+  slot_offsets = NULL;
+  nsaved = frame_size = slot_area = 0;
+  division_slot = cycles_slot = -1;
+  function_index++;
+}
+
+/* By decreasing alignment, then by name for a stable output */
+static int compare_data(const void *a, const void *b) {
+  const MData *x = a, *y = b;
+  if (x->align != y->align)
+    return (int)y->align - (int)x->align;
+  return strcmp(x->name, y->name);
+}
+
+static void add_data(MData **list, size_t *n, MData data) {
+  MData *tmp = realloc(*list, sizeof(MData) * (*n + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in add_data");
+  tmp[(*n)++] = data;
+  *list = tmp;
+}
+
+/* Globals the program still refers to go to .rodata when it never stores
+ * to them, to .data when their initial value is not zero, & to .bss
+ * otherwise */
+static void alloc_global_symbols(BasicBlock *prog) {
+  HashMap used, stored;
+  hashmap_init(&used);
+  hashmap_init(&stored);
+  scan_globals(prog, &used, &stored);
+
+  for (size_t i = 0; i < SYMTAB.symbols.capacity; i++) {
+    MapEntry entry = SYMTAB.symbols.entries[i];
+    if (!entry.key)
+      continue;
+
+    Symbol *symbol = (Symbol *)entry.value;
+    if (!symbol->name || symbol->kind != SYM_VAR || !hashmap_lookup(&used, symbol->name))
+      continue;
+
+    /* Natural size & alignment, narrow integers are extended when loaded */
+    const Type *type = symbol->node->var.type;
+    int size = type->size;
+
+    Value value;
+    if (!global_value(symbol->node, &value))
+      LOG_FATAL("initializer of global '%s' is not a constant", symbol->name);
+    MData data = { symbol->name, size, type->align, 0 };
+    if (value.kind == VAL_STRING) {
+      /* The address of the literal is filled in by the linker */
+      data.label = global_string(&value);
+      add_data(&mprog->data, &mprog->ndata, data);
+      continue;
+    }
+
+    uint64_t bits = is_floating(type) ? fp_bits(value, size) : (uint64_t)immediate(value);
+    data.bits = bits;
+    if (!hashmap_lookup(&stored, symbol->name)) {
+      MConst *tmp = realloc(mprog->consts, sizeof(MConst) * (mprog->nconsts + 1));
+      if (!tmp)
+        LOG_FATAL("realloc failed in alloc_global_symbols");
+      tmp[mprog->nconsts++] = (MConst){ format("%s", symbol->name), bits, size };
+      mprog->consts = tmp;
+    } else if (bits) {
+      add_data(&mprog->data, &mprog->ndata, data);
+    } else {
+      add_data(&mprog->bss, &mprog->nbss, data);
+    }
+  }
+
+  if (options.profile) {
+    size_t size = SLOT_SIZE * (options.profile->ncounters ? options.profile->ncounters : 1);
+    add_data(&mprog->bss, &mprog->nbss, (MData){ PROFILE_COUNTERS, size, SLOT_SIZE, 0 });
+  }
+  if (options.profile_cycles) {
+    size_t nfunctions = 0;
+    for (BasicBlock *block = prog; block; block = block->next)
+      nfunctions += IS_FUNCTION_ENTRY(block);
+    add_data(&mprog->bss, &mprog->nbss, (MData){ CYCLES, CYCLES_RECORD * nfunctions, SLOT_SIZE, 0 });
+    add_data(&mprog->bss, &mprog->nbss, (MData){ CYCLES_CALLEES, SLOT_SIZE, SLOT_SIZE, 0 });
+    add_data(&mprog->bss, &mprog->nbss, (MData){ CYCLES_LINE, (3 * CYCLES_FIELD + 1 + 7) & ~7, SLOT_SIZE, 0 });
+  }
+
+  /* Most aligned first, the symbols follow each other without padding */
+  qsort(mprog->bss, mprog->nbss, sizeof(MData), compare_data);
+  qsort(mprog->data, mprog->ndata, sizeof(MData), compare_data);
+
+  hashmap_free(&used);
+  hashmap_free(&stored);
+}
+
+/* Address of a string constant, kept in the string pool */
+static MOperand string_address(const char *text) {
+  int id = strpool_intern(&STRINGS, text, strlen(text));
+  const char *label = STRINGS.strings[id].label;
+  strpool_use(&STRINGS, label);
+  return mstatic(label, 0);
+}
+
+static void emit_syscall(int number) {
+  emit2(MI_MOV, 8, mreg(RAX), mimm(number));
+  emit0(MI_SYSCALL, 8);
+}
+
+/* write(fd, buffer, len), the buffer being a register or its address */
+static void emit_write(MOperand fd, MOperand buffer, int64_t len) {
+  emit2(MI_MOV, 8, mreg(RDI), fd);
+  emit2(buffer.kind == MO_MEM ? MI_LEA : MI_MOV, 8, mreg(RSI), buffer);
+  emit2(MI_MOV, 8, mreg(RDX), mimm(len));
+  emit_syscall(SYS_write);
+}
+
+/* Writes the profile of an instrumented build; one that cannot be opened is
+ * skipped, as writing to the failed descriptor fails too */
+static void emit_profile_write() {
+  char *header = profile_header(options.profile);
+
+  emit2(MI_LEA, 8, mreg(RDI), string_address(options.profile_path));
+  emit2(MI_MOV, 8, mreg(RSI), mimm(O_WRONLY | O_CREAT | O_TRUNC));
+  emit2(MI_MOV, 8, mreg(RDX), mimm(0644));
+  emit_syscall(SYS_open);
+  emit2(MI_MOV, 8, mreg(R12), mreg(RAX));
+
+  emit_write(mreg(R12), string_address(header), strlen(header));
+  emit_write(mreg(R12), mstatic(PROFILE_COUNTERS, 0), SLOT_SIZE * options.profile->ncounters);
+  emit2(MI_MOV, 8, mreg(RDI), mreg(R12));
+  emit_syscall(SYS_close);
+  free(header);
+}
+
+/* Formats the number in rax right-aligned in the report line, ending at
+ * byte `end` */
+static void emit_decimal(int end, const char *loop) {
+  emit2(MI_LEA, 8, mreg(RDI), mstatic(CYCLES_LINE, end));
+  emit2(MI_MOV, 4, mreg(RCX), mimm(10));
+  emit_label(loop, false);
+  emit2(MI_XOR, 4, mreg(RDX), mreg(RDX));
+  emit1(MI_DIV, 8, mreg(RCX));
+  emit2(MI_ADD, 8, mreg(RDX), mimm('0'));
+  emit1(MI_DEC, 8, mreg(RDI));
+  emit2(MI_MOV, 1, mmem(RDI, 0), mreg(RDX));
+  emit2(MI_TEST, 8, mreg(RAX), mreg(RAX));
+  emit_jcc_label(CC_NE, loop);
+}
+
+/* Writes the flat profile of -fprofile-cycles to stderr: a line for every
+ * function that was called, by decreasing self cycles. The records are
+ * selected one at a time, the depth of those already written set to 1. */
+static void emit_cycles_report(BasicBlock *prog) {
+  static const char *DIGITS[] = { "__neo_cycles.calls", "__neo_cycles.total", "__neo_cycles.self" };
+  static const int FIELDS[] = { CYCLES_CALLS, CYCLES_TOTAL, CYCLES_SELF };
+
+  /* Names are padded to a common width, & stored one after the other */
+  size_t width = strlen("function"), nfunctions = 0;
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (IS_FUNCTION_ENTRY(block)) {
+      size_t len = strlen(block->head->operands[0].label);
+      width = len > width ? len : width;
+      nfunctions++;
+    }
+  }
+  width += 2;
+
+  char *names = malloc(width * nfunctions + 1);
+  if (!names)
+    LOG_FATAL("malloc failed in emit_cycles_report");
+  memset(names, ' ', width * nfunctions);
+  names[width * nfunctions] = 0;
+  size_t i = 0;
+  for (BasicBlock *block = prog; block; block = block->next) {
+    if (IS_FUNCTION_ENTRY(block)) {
+      const char *name = block->head->operands[0].label;
+      memcpy(names + width * i++, name, strlen(name));
+    }
+  }
+
+  char *header = format("%-*s%*s%*s%*s\n", (int)width, "function", CYCLES_FIELD, "calls",
+      CYCLES_FIELD, "total cycles", CYCLES_FIELD, "self cycles");
+  emit_write(mimm(STDERR_FILENO), string_address(header), strlen(header));
+
+  /* r14: the records, r13: the record looked at, r12: the one to write */
+  emit2(MI_LEA, 8, mreg(R14), mstatic(CYCLES, 0));
+  emit_label("__neo_cycles.next", false);
+  emit2(MI_MOV, 8, mreg(R12), mimm(-1));
+  emit2(MI_XOR, 4, mreg(R13), mreg(R13));
+  emit_label("__neo_cycles.scan", false);
+  emit2(MI_CMP, 8, mreg(R13), mimm(CYCLES_RECORD * nfunctions));
+  emit_jcc_label(CC_E, "__neo_cycles.found");
+  emit2(MI_CMP, 8, mindexed(R14, R13, CYCLES_DEPTH), mimm(0));
+  emit_jcc_label(CC_NE, "__neo_cycles.skip");
+  emit2(MI_CMP, 8, mindexed(R14, R13, CYCLES_CALLS), mimm(0));
+  emit_jcc_label(CC_E, "__neo_cycles.skip");
+  emit2(MI_CMP, 8, mreg(R12), mimm(0));
+  emit_jcc_label(CC_L, "__neo_cycles.take");
+  emit2(MI_MOV, 8, mreg(RAX), mindexed(R14, R13, CYCLES_SELF));
+  emit2(MI_CMP, 8, mreg(RAX), mindexed(R14, R12, CYCLES_SELF));
+  emit_jcc_label(CC_BE, "__neo_cycles.skip");
+  emit_label("__neo_cycles.take", false);
+  emit2(MI_MOV, 8, mreg(R12), mreg(R13));
+  emit_label("__neo_cycles.skip", false);
+  emit2(MI_ADD, 8, mreg(R13), mimm(CYCLES_RECORD));
+  emit1(MI_JMP, 8, msym("__neo_cycles.scan"));
+
+  emit_label("__neo_cycles.found", false);
+  emit2(MI_CMP, 8, mreg(R12), mimm(0));
+  emit_jcc_label(CC_L, "__neo_cycles.done");
+  emit2(MI_MOV, 8, mindexed(R14, R12, CYCLES_DEPTH), mimm(1));
+
+  /* The name, at index r12 / CYCLES_RECORD */
+  emit2(MI_MOV, 8, mreg(RAX), mreg(R12));
+  emit2(MI_SHR, 8, mreg(RAX), mimm(5));
+  emit3(MI_IMUL, 8, mreg(RAX), mreg(RAX), mimm(width));
+  emit2(MI_LEA, 8, mreg(RSI), string_address(names));
+  emit2(MI_ADD, 8, mreg(RSI), mreg(RAX));
+  emit_write(mimm(STDERR_FILENO), mreg(RSI), width);
+
+  /* The numbers, over a line of spaces */
+  int len = 3 * CYCLES_FIELD + 1;
+  emit2(MI_MOV, 8, mreg(RAX), mimm(0x2020202020202020));
+  for (int offset = 0; offset < len; offset += SLOT_SIZE)
+    emit2(MI_MOV, 8, mstatic(CYCLES_LINE, offset), mreg(RAX));
+  emit2(MI_MOV, 4, mreg(RDX), mimm('\n'));
+  emit2(MI_MOV, 1, mstatic(CYCLES_LINE, len - 1), mreg(RDX));
+  for (int k = 0; k < 3; k++) {
+    emit2(MI_MOV, 8, mreg(RAX), mindexed(R14, R12, FIELDS[k]));
+    emit_decimal(CYCLES_FIELD * (k + 1), DIGITS[k]);
+  }
+  emit_write(mimm(STDERR_FILENO), mstatic(CYCLES_LINE, 0), len);
+  emit1(MI_JMP, 8, msym("__neo_cycles.next"));
+  emit_label("__neo_cycles.done", false);
+
+  free(header);
+  free(names);
+}
+
+/* Exits with the result of main in eax, or 0 when main returns nothing,
+ * through raw syscalls as there is no libc. Instrumented builds first write
+ * out what they measured, keeping the result in rbx. */
+static void emit_exit(BasicBlock *prog) {
+  bool report = options.profile || options.profile_cycles;
+  if (report)
+    emit2(MI_MOV, 4, mreg(RBX), mreg(RAX));
+  if (options.profile)
+    emit_profile_write();
+  if (options.profile_cycles)
+    emit_cycles_report(prog);
+  if (report)
+    emit2(MI_MOV, 4, mreg(RAX), mreg(RBX));
+
+  Symbol *entry = find_symbol(&SYMTAB, "main", 4);
+  if (entry->node->func.return_type->kind == TY_VOID)
+    emit2(MI_XOR, 4, mreg(RDI), mreg(RDI));
+  else
+    emit2(MI_MOV, 4, mreg(RDI), mreg(RAX));
+  emit_syscall(SYS_exit);
+}
+
+MProgram x86_64_generate(BasicBlock *prog, CodegenOptions opts) {
+  MProgram mp = { .frame_pointer = !opts.omit_frame_pointer };
+  mprog = &mp;
+  options = opts;
+  function_index = 0;
+  hashmap_init(&constants);
+
+  /* Allocate space for global variables */
+  alloc_global_symbols(prog);
+
+  /* Entry point of program: the code outside of functions runs first, then
+   * main is called & its result is the exit status. rsp is 16-byte aligned
+   * on entry, so main finds it as after any call. */
+  emit_label("_start", true);
+  for (BasicBlock *block = prog; block; ) {
+    if (IS_FUNCTION_ENTRY(block)) {
+      block = function_end(block);
+    } else {
+      compile_block(block, block->next);
+      block = block->next;
+    }
+  }
+
+  emit1(MI_CALL, 8, msym("main"));
+  emit_exit(prog);
+
+  for (BasicBlock *block = prog; block; ) {
+    if (IS_FUNCTION_ENTRY(block)) {
+      BasicBlock *end = function_end(block);
+      compile_function(block, end, opts.regalloc);
+      block = end;
+    } else {
+      block = block->next;
+    }
+  }
+
+  /* Cold code goes after all the functions */
+  for (size_t i = 0; i < ncold; i++)
+    *emit0(cold[i].op, cold[i].size) = cold[i];
+  free(cold);
+  cold = NULL;
+  ncold = cold_capacity = 0;
+
+  strpool_layout(&STRINGS);
+  mp.strings = &STRINGS;
+
+  drop_unused_labels();
+  free(block_labels);
+  free(jump_targets);
+  block_labels = NULL;
+  jump_targets = NULL;
+  nblock_labels = 0;
+  hashmap_free(&constants);
+
+  mprog = NULL;
+  return mp;
+}
+
+void mprogram_free(MProgram *mp) {
+  for (size_t i = 0; i < mp->nlabels; i++)
+    free(mp->labels[i]);
+  free(mp->labels);
+  free(mp->insts);
+  free(mp->bss);
+  free(mp->data);
+  for (size_t i = 0; i < mp->nconsts; i++)
+    free(mp->consts[i].name);
+  free(mp->consts);
+  memset(mp, 0, sizeof(MProgram));
+}
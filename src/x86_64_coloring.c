@@ -0,0 +1,450 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "x86_64.h"
+
+/* Graph Coloring Register Allocation (Chaitin-Briggs)
+ *
+ * Two variables interfere when one is defined while the other is live. The
+ * copies emitted for every OP_ASSIGN are coalesced whenever the Briggs or the
+ * George test proves that merging both ends cannot make the graph harder to
+ * color. Nodes of degree < K are simplified away; when none is left, the
+ * cheapest node is pushed anyway and only spilled if no color remains for it
+ * once its neighbors are colored. Spilled variables share a stack slot when
+ * they do not interfere.
+ *
+ * Variables of different register classes never compete for a register, so
+ * they never interfere either, and each class is colored with its own K.
+ * Variables live across a call exclude the caller-saved registers, which
+ * lowers their K, and variables with a hint take it whenever it is free. */
+
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+#define BITSET_TEST(set, i) ((set)[(i) / 64] & (1ULL << ((i) % 64)))
+#define BITSET_SET(set, i) ((set)[(i) / 64] |= (1ULL << ((i) % 64)))
+#define BITSET_CLEAR(set, i) ((set)[(i) / 64] &= ~(1ULL << ((i) % 64)))
+
+typedef struct {
+  int dst, src;
+} Move;
+
+typedef struct {
+  int n;                 /* Number of local variables */
+  size_t words;          /* Words in a bitset over the variables */
+  RegisterData **nodes;
+  int *index;            /* vreg -> node, or -1 for globals */
+
+  uint64_t *adj;         /* Interference matrix, one bitset per node */
+  int *alias;            /* Node a coalesced node was merged into */
+  int *degree;
+  double *cost;          /* Weighted occurrences of the node and everything merged into it */
+  uint32_t *excluded;    /* Bits of ALLOCATABLE the node may not take */
+  int *hint;
+
+  int nmoves;
+  Move *moves;
+} Graph;
+
+static uint32_t allowed(Graph *g, int node) {
+  return CLASS_REGISTERS[g->nodes[node]->cls] & ~g->excluded[node];
+}
+
+/* K, the number of registers a node may take */
+static int colors(Graph *g, int node) {
+  return __builtin_popcount(allowed(g, node));
+}
+
+static uint64_t *row(Graph *g, int node) {
+  return g->adj + (size_t)node * g->words;
+}
+
+static int node_of(Graph *g, int vreg) {
+  return g->index[vreg];
+}
+
+static int find_alias(Graph *g, int node) {
+  while (g->alias[node] != node)
+    node = g->alias[node] = g->alias[g->alias[node]];
+  return node;
+}
+
+static void add_edge(Graph *g, int a, int b) {
+  if (a == b || BITSET_TEST(row(g, a), b) || g->nodes[a]->cls != g->nodes[b]->cls)
+    return;
+
+  BITSET_SET(row(g, a), b);
+  BITSET_SET(row(g, b), a);
+  g->degree[a]++;
+  g->degree[b]++;
+}
+
+static void add_move(Graph *g, int dst, int src) {
+  Move *tmp = realloc(g->moves, sizeof(Move) * (g->nmoves + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in add_move");
+
+  tmp[g->nmoves++] = (Move){ dst, src };
+  g->moves = tmp;
+}
+
+static void build_nodes(Graph *g, Allocation *alloc) {
+  g->nodes = calloc(alloc->nintervals + 1, sizeof(RegisterData *));
+  g->index = calloc(alloc->nintervals + 1, sizeof(int));
+  if (!g->nodes || !g->index)
+    LOG_FATAL("calloc failed in build_nodes");
+
+  for (size_t i = 0; i < alloc->nintervals; i++) {
+    RegisterData *data = alloc->intervals[i];
+    g->index[i] = -1;
+    if (data->global)
+      continue;
+
+    g->index[i] = g->n;
+    g->nodes[g->n++] = data;
+  }
+
+  g->words = BITSET_WORDS(g->n ? g->n : 1);
+  g->adj = calloc((size_t)g->n * g->words + 1, sizeof(uint64_t));
+  g->alias = calloc(g->n + 1, sizeof(int));
+  g->degree = calloc(g->n + 1, sizeof(int));
+  g->cost = calloc(g->n + 1, sizeof(double));
+  g->excluded = calloc(g->n + 1, sizeof(uint32_t));
+  g->hint = calloc(g->n + 1, sizeof(int));
+  if (!g->adj || !g->alias || !g->degree || !g->cost || !g->excluded || !g->hint)
+    LOG_FATAL("calloc failed in build_nodes");
+
+  for (int i = 0; i < g->n; i++) {
+    g->alias[i] = i;
+    g->cost[i] = g->nodes[i]->cost;
+    g->excluded[i] = g->nodes[i]->crosses_call ? ~CALLEE_SAVED : 0;
+    g->hint[i] = g->nodes[i]->hint;
+  }
+}
+
+/* The source of a copy between two locals, or -1 */
+static int move_source(Graph *g, Instruction *inst) {
+  if (inst->opcode != OP_ASSIGN || inst->nopers != 1 || !IS_VARIABLE(inst->operands[0]))
+    return -1;
+
+  int src = node_of(g, inst->operands[0].vreg), dst = node_of(g, inst->vreg);
+  return src >= 0 && dst >= 0 && g->nodes[src]->cls == g->nodes[dst]->cls ? src : -1;
+}
+
+/* Backward liveness over the blocks of the function, then one more walk over
+ * every block to connect each definition to what is live across it */
+static void build_interference(Graph *g, BasicBlock *entry, BasicBlock *end) {
+  int nblocks = 0, max_id = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    nblocks++;
+    if (block->id > max_id)
+      max_id = block->id;
+  }
+
+  BasicBlock **blocks = calloc(nblocks, sizeof(BasicBlock *));
+  int *position = malloc(sizeof(int) * (max_id + 1));
+  uint64_t *sets = calloc((size_t)nblocks * g->words * 4, sizeof(uint64_t));
+  uint64_t *live = calloc(g->words, sizeof(uint64_t));
+  if (!blocks || !position || !sets || !live)
+    LOG_FATAL("allocation failed in build_interference");
+
+  for (int i = 0; i <= max_id; i++)
+    position[i] = -1;
+
+  int b = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next, b++) {
+    blocks[b] = block;
+    position[block->id] = b;
+  }
+
+#define USE(b)      (sets + ((size_t)(b) * 4 + 0) * g->words)
+#define DEF(b)      (sets + ((size_t)(b) * 4 + 1) * g->words)
+#define LIVE_IN(b)  (sets + ((size_t)(b) * 4 + 2) * g->words)
+#define LIVE_OUT(b) (sets + ((size_t)(b) * 4 + 3) * g->words)
+
+  /* Upward-exposed uses and definitions of every block */
+  for (b = 0; b < nblocks; b++) {
+    for (Instruction *inst = blocks[b]->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_DEAD)
+        continue;
+
+      for (int i = 0; i < inst->nopers; i++) {
+        if (!IS_VARIABLE(inst->operands[i]))
+          continue;
+        int v = node_of(g, inst->operands[i].vreg);
+        if (v >= 0 && !BITSET_TEST(DEF(b), v))
+          BITSET_SET(USE(b), v);
+      }
+
+      int d = inst->assignee ? node_of(g, inst->vreg) : -1;
+      if (d >= 0)
+        BITSET_SET(DEF(b), d);
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (b = nblocks - 1; b >= 0; b--) {
+      BasicBlock *block = blocks[b];
+      for (int s = 0; s < block->nsuccs; s++) {
+        int id = block->succ[s]->id;
+        int succ = id <= max_id ? position[id] : -1;
+        if (succ < 0 || blocks[succ] != block->succ[s])
+          continue;
+        for (size_t w = 0; w < g->words; w++)
+          LIVE_OUT(b)[w] |= LIVE_IN(succ)[w];
+      }
+
+      for (size_t w = 0; w < g->words; w++) {
+        uint64_t in = USE(b)[w] | (LIVE_OUT(b)[w] & ~DEF(b)[w]);
+        if (in != LIVE_IN(b)[w]) {
+          LIVE_IN(b)[w] = in;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  for (b = 0; b < nblocks; b++) {
+    memcpy(live, LIVE_OUT(b), sizeof(uint64_t) * g->words);
+
+    for (Instruction *inst = blocks[b]->tail; inst; inst = inst->prev) {
+      if (inst->opcode == OP_DEAD)
+        continue;
+
+      int d = inst->assignee ? node_of(g, inst->vreg) : -1;
+      if (d >= 0) {
+        /* A copy does not make its two ends interfere: they hold the same
+         * value, so they may well share a register */
+        int src = move_source(g, inst);
+        if (src >= 0)
+          add_move(g, d, src);
+
+        for (size_t w = 0; w < g->words; w++) {
+          for (uint64_t bits = live[w]; bits; bits &= bits - 1) {
+            int v = w * 64 + __builtin_ctzll(bits);
+            if (v != src)
+              add_edge(g, d, v);
+          }
+        }
+        BITSET_CLEAR(live, d);
+      }
+
+      for (int i = 0; i < inst->nopers; i++) {
+        if (!IS_VARIABLE(inst->operands[i]))
+          continue;
+        int v = node_of(g, inst->operands[i].vreg);
+        if (v >= 0)
+          BITSET_SET(live, v);
+      }
+    }
+  }
+
+#undef USE
+#undef DEF
+#undef LIVE_IN
+#undef LIVE_OUT
+
+  free(blocks);
+  free(position);
+  free(sets);
+  free(live);
+}
+
+/* Briggs: the merged node has fewer than K neighbors of significant degree,
+ * K being what is left once the registers either end excludes are */
+static bool briggs_test(Graph *g, int a, int b) {
+  int significant = 0;
+  for (int t = 0; t < g->n; t++) {
+    bool ta = BITSET_TEST(row(g, a), t) != 0, tb = BITSET_TEST(row(g, b), t) != 0;
+    if (!ta && !tb)
+      continue;
+
+    /* A neighbor of both ends loses one edge in the merge */
+    int degree = g->degree[t] - (ta && tb);
+    if (degree >= colors(g, t))
+      significant++;
+  }
+  uint32_t merged = allowed(g, a) & ~g->excluded[b];
+  return significant < __builtin_popcount(merged);
+}
+
+/* George: every neighbor of `b` already interferes with `a` or is trivially
+ * colorable, & `b` excludes no more registers than `a` */
+static bool george_test(Graph *g, int a, int b) {
+  if (g->excluded[b] & ~g->excluded[a])
+    return false;
+
+  for (int t = 0; t < g->n; t++) {
+    if (BITSET_TEST(row(g, b), t) && !BITSET_TEST(row(g, a), t) && g->degree[t] >= colors(g, t))
+      return false;
+  }
+  return true;
+}
+
+static void merge_nodes(Graph *g, int a, int b) {
+  for (int t = 0; t < g->n; t++) {
+    if (!BITSET_TEST(row(g, b), t))
+      continue;
+
+    BITSET_CLEAR(row(g, t), b);
+    g->degree[t]--;
+    add_edge(g, a, t);
+  }
+
+  memset(row(g, b), 0, sizeof(uint64_t) * g->words);
+  g->degree[b] = 0;
+  g->alias[b] = a;
+  g->cost[a] += g->cost[b];
+  g->excluded[a] |= g->excluded[b];
+  if (g->hint[a] < 0)
+    g->hint[a] = g->hint[b];
+#ifdef DEBUG
+  printf("-> coalesced variable '%s' into '%s'\n", g->nodes[b]->var, g->nodes[a]->var);
+#endif
+}
+
+static void coalesce(Graph *g) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < g->nmoves; i++) {
+      int a = find_alias(g, g->moves[i].dst), b = find_alias(g, g->moves[i].src);
+      if (a == b || BITSET_TEST(row(g, a), b))
+        continue;
+
+      if (briggs_test(g, a, b) || george_test(g, a, b)) {
+        merge_nodes(g, a, b);
+        changed = true;
+      }
+    }
+  }
+}
+
+void color_graph(Allocation *alloc, BasicBlock *entry, BasicBlock *end) {
+  Graph g = { 0 };
+  build_nodes(&g, alloc);
+  build_interference(&g, entry, end);
+  coalesce(&g);
+
+  int *stack = calloc(g.n + 1, sizeof(int));
+  int *degree = calloc(g.n + 1, sizeof(int));
+  int *color = calloc(g.n + 1, sizeof(int));
+  bool *removed = calloc(g.n + 1, sizeof(bool));
+  if (!stack || !degree || !color || !removed)
+    LOG_FATAL("calloc failed in color_graph");
+
+  int nstack = 0, remaining = 0;
+  for (int i = 0; i < g.n; i++) {
+    degree[i] = g.degree[i];
+    removed[i] = g.alias[i] != i;
+    remaining += !removed[i];
+  }
+
+  /* Simplify, falling back to an optimistic push of the node whose spill
+   * would cost the least per edge it removes */
+  while (remaining > 0) {
+    int pick = -1;
+    double best = 0;
+    for (int i = 0; i < g.n; i++) {
+      if (removed[i])
+        continue;
+      if (degree[i] < colors(&g, i)) {
+        pick = i;
+        break;
+      }
+
+      double cost = g.cost[i] / (double)degree[i];
+      if (pick < 0 || cost < best) {
+        pick = i;
+        best = cost;
+      }
+    }
+
+    removed[pick] = true;
+    stack[nstack++] = pick;
+    remaining--;
+    for (int t = 0; t < g.n; t++) {
+      if (BITSET_TEST(row(&g, pick), t))
+        degree[t]--;
+    }
+  }
+
+  /* Select: the hint of the node if it is free, or else the colors it may
+   * take in the priority order of ALLOCATABLE */
+  for (int i = 0; i < g.n; i++)
+    color[i] = -1;
+
+  int *slot = degree;
+  while (nstack > 0) {
+    int node = stack[--nstack];
+    uint32_t available = allowed(&g, node);
+    for (int t = 0; t < g.n; t++) {
+      if (BITSET_TEST(row(&g, node), t) && color[t] >= 0)
+        available &= ~(1u << register_priority(color[t]));
+    }
+
+    int hint = g.hint[node];
+    if (hint >= 0 && (available & (1u << register_priority(hint))))
+      color[node] = hint;
+    else if (available)
+      color[node] = ALLOCATABLE[__builtin_ctz(available)];
+  }
+
+  /* Actual spills get the lowest slot none of their spilled neighbors has.
+   * Classes do not interfere, so each one gets slots of its own. */
+  for (int i = 0; i < g.n; i++)
+    slot[i] = -1;
+
+  for (RegClass cls = 0; cls < NUM_REGCLASSES; cls++) {
+    int base = alloc->nslots;
+    for (int i = 0; i < g.n; i++) {
+      if (g.alias[i] != i || color[i] >= 0 || g.nodes[i]->cls != cls)
+        continue;
+
+      bool *taken = removed;
+      memset(taken, 0, sizeof(bool) * (g.n + 1));
+      for (int t = 0; t < g.n; t++) {
+        if (BITSET_TEST(row(&g, i), t) && slot[t] >= 0)
+          taken[slot[t] - base] = true;
+      }
+
+      int s = 0;
+      while (taken[s])
+        s++;
+
+      slot[i] = base + s;
+      if (base + s + 1 > alloc->nslots)
+        alloc->nslots = base + s + 1;
+    }
+  }
+
+  for (int i = 0; i < g.n; i++) {
+    RegisterData *data = g.nodes[i];
+    int node = find_alias(&g, i);
+    data->rid = color[node];
+    data->slot = slot[node];
+#ifdef DEBUG
+    if (data->slot >= 0)
+      printf("-> spilled variable '%s' to slot %d\n", data->var, data->slot);
+    else
+      printf("-> assigned register '%s' to variable '%s'\n", regname(data->rid), data->var);
+#endif
+  }
+
+  free(stack);
+  free(degree);
+  free(color);
+  free(removed);
+  free(g.nodes);
+  free(g.adj);
+  free(g.alias);
+  free(g.degree);
+  free(g.cost);
+  free(g.excluded);
+  free(g.hint);
+  free(g.moves);
+  free(g.index);
+}
@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "object.h"
+#include "util.h"
+#include "x86_64.h"
+
+/* x86_64 Instruction Encoder
+ *
+ * Encodes the machine instructions of a program into the sections of an
+ * object file. Static variables are addressed relative to rip, so every
+ * reference to them is a PC-relative relocation resolved by the linker.
+ *
+ * Jumps are relaxed: they start out in their 2-byte short form and the text
+ * is encoded again, with the jumps whose target is out of reach of a rel8
+ * grown to their rel32 form, until no jump grows anymore. */
+
+/* Numbers of the registers in ModRM, SIB & opcodes (+ REX extension bit) */
+static const uint8_t HW[NUM_REGISTERS] = {
+  [RAX] = 0, [RCX] = 1, [RDX] = 2, [RBX] = 3,
+  [RSP] = 4, [RBP] = 5, [RSI] = 6, [RDI] = 7,
+  [R8] = 8, [R9] = 9, [R10] = 10, [R11] = 11,
+  [R12] = 12, [R13] = 13, [R14] = 14, [R15] = 15,
+  [XMM0] = 0, [XMM1] = 1, [XMM2] = 2, [XMM3] = 3,
+  [XMM4] = 4, [XMM5] = 5, [XMM6] = 6, [XMM7] = 7,
+  [XMM8] = 8, [XMM9] = 9, [XMM10] = 10, [XMM11] = 11,
+  [XMM12] = 12, [XMM13] = 13, [XMM14] = 14, [XMM15] = 15,
+};
+
+#define REX   0x40
+#define REX_W 0x08
+#define REX_R 0x04
+#define REX_X 0x02
+#define REX_B 0x01
+
+typedef struct {
+  ObjectFile *obj;
+  Section *text;
+
+  MInst *insts;
+  HashMap labels;        /* name -> index of the label instruction + 1 */
+  size_t *offsets;       /* Offset of every instruction in the last pass */
+  bool *near;            /* Jumps needing a rel32 */
+} Encoder;
+
+static bool fits_int8(int64_t v) {
+  return v >= INT8_MIN && v <= INT8_MAX;
+}
+
+static bool fits_int32(int64_t v) {
+  return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+static void emit_u8(Encoder *e, uint8_t b) {
+  section_emit(e->text, &b, 1);
+}
+
+static void emit_le(Encoder *e, uint64_t v, int size) {
+  uint8_t bytes[8];
+  for (int i = 0; i < size; i++)
+    bytes[i] = (uint8_t)(v >> (8 * i));
+  section_emit(e->text, bytes, size);
+}
+
+static void emit_rex(Encoder *e, int size, int reg, bool byte_reg, MOperand *rm) {
+  uint8_t rex = 0;
+  if (size == 8)
+    rex |= REX_W;
+  if (reg >= 0 && HW[reg] >= 8)
+    rex |= REX_R;
+  if (rm && rm->kind == MO_MEM && rm->index != NO_REG && HW[rm->index] >= 8)
+    rex |= REX_X;
+  if (rm && rm->reg != NO_REG && HW[rm->reg] >= 8)
+    rex |= REX_B;
+
+  /* Without a REX prefix, byte registers 4-7 are ah, ch, dh & bh */
+  if (size == 1 && rm && rm->kind == MO_REG && (HW[rm->reg] & 7) >= 4)
+    byte_reg = true;
+  if (rex || byte_reg)
+    emit_u8(e, REX | rex);
+}
+
+/* Emits an instruction taking a ModRM byte: prefix, opcode, ModRM, SIB,
+ * displacement & immediate. `reg` is a register, or an opcode extension
+ * when `is_ext` is set. */
+static void encode_rm(Encoder *e, int size, const uint8_t *opcode, int oplen,
+    int reg, bool is_ext, MOperand *rm, int immsize, int64_t imm) {
+  /* Only one-byte opcodes, e.g. mov [m], r8, take a byte register in reg */
+  bool byte_reg = size == 1 && !is_ext && oplen == 1 && HW[reg] >= 4 && HW[reg] < 8;
+  emit_rex(e, size, is_ext ? -1 : reg, byte_reg, rm);
+  section_emit(e->text, opcode, oplen);
+
+  uint8_t reg_field = (is_ext ? reg : HW[reg]) & 7;
+
+  if (rm->kind == MO_REG) {
+    emit_u8(e, 0xC0 | reg_field << 3 | (HW[rm->reg] & 7));
+    emit_le(e, imm, immsize);
+    return;
+  }
+
+  if (rm->kind != MO_MEM)
+    LOG_FATAL("invalid r/m operand for %02x", opcode[0]);
+
+  /* [rip + disp32], relocated against the symbol */
+  if (rm->sym) {
+    emit_u8(e, 0x00 | reg_field << 3 | 5);
+    size_t offset = e->text->size;
+    emit_le(e, 0, 4);
+    emit_le(e, imm, immsize);
+
+    int symbol = object_symbol(e->obj, rm->sym);
+    int64_t addend = rm->disp - (int64_t)(e->text->size - offset);
+    object_relocate(e->obj, SEC_TEXT, offset, symbol, RELOC_PC32, addend);
+    return;
+  }
+
+  uint8_t base = HW[rm->reg] & 7;
+  uint8_t mod;
+  if (rm->disp == 0 && base != 5)   /* [rbp] & [r13] always have a displacement */
+    mod = 0x00;
+  else if (fits_int8(rm->disp))
+    mod = 0x40;
+  else
+    mod = 0x80;
+
+  if (rm->index != NO_REG || base == 4) {
+    /* rsp & r12 as a base need a SIB byte, index 4 means none */
+    static const uint8_t SCALES[] = { [1] = 0, [2] = 1, [4] = 2, [8] = 3 };
+    uint8_t index = rm->index != NO_REG ? HW[rm->index] & 7 : 4;
+    uint8_t scale = rm->index != NO_REG ? SCALES[rm->scale] : 0;
+    emit_u8(e, mod | reg_field << 3 | 4);
+    emit_u8(e, scale << 6 | index << 3 | base);
+  } else {
+    emit_u8(e, mod | reg_field << 3 | base);
+  }
+
+  if (mod == 0x40)
+    emit_le(e, rm->disp, 1);
+  else if (mod == 0x80)
+    emit_le(e, rm->disp, 4);
+  emit_le(e, imm, immsize);
+}
+
+/* Opcode + register number, as in push/pop & mov r, imm */
+static void encode_plus_reg(Encoder *e, int size, uint8_t opcode, int reg) {
+  uint8_t rex = (size == 8 ? REX_W : 0) | (HW[reg] >= 8 ? REX_B : 0);
+  if (rex)
+    emit_u8(e, REX | rex);
+  emit_u8(e, opcode + (HW[reg] & 7));
+}
+
+static void encode_mov(Encoder *e, MInst *inst) {
+  MOperand *dst = &inst->operands[0], *src = &inst->operands[1];
+  int size = inst->size;
+
+  if (src->kind == MO_REG) {
+    encode_rm(e, size, (uint8_t[]){ size == 1 ? 0x88 : 0x89 }, 1, src->reg, false, dst, 0, 0);
+  } else if (src->kind == MO_MEM) {
+    encode_rm(e, size, (uint8_t[]){ 0x8B }, 1, dst->reg, false, src, 0, 0);
+  } else if (dst->kind == MO_REG) {
+    /* Writing a 32-bit register clears the upper half, which gives the
+     * shortest encoding of non-negative values */
+    int64_t imm = src->imm;
+    if (size == 4 || (imm >= 0 && imm <= UINT32_MAX)) {
+      encode_plus_reg(e, 4, 0xB8, dst->reg);
+      emit_le(e, imm, 4);
+    } else if (fits_int32(imm)) {
+      encode_rm(e, 8, (uint8_t[]){ 0xC7 }, 1, 0, true, dst, 4, imm);
+    } else {
+      encode_plus_reg(e, 8, 0xB8, dst->reg);
+      emit_le(e, imm, 8);
+    }
+  } else {
+    if (!fits_int32(src->imm))
+      LOG_FATAL("immediate %lld does not fit in a memory move", (long long)src->imm);
+    if (size == 1)
+      encode_rm(e, 1, (uint8_t[]){ 0xC6 }, 1, 0, true, dst, 1, src->imm);
+    else
+      encode_rm(e, size, (uint8_t[]){ 0xC7 }, 1, 0, true, dst, 4, src->imm);
+  }
+}
+
+/* add, sub, xor & cmp share their encodings, only the opcodes differ */
+static void encode_alu(Encoder *e, MInst *inst) {
+  static const struct {
+    uint8_t rm_reg, reg_rm, ext;
+  } ALU[NUM_MOPCODES] = {
+    [MI_ADD] = { 0x01, 0x03, 0 },
+    [MI_SUB] = { 0x29, 0x2B, 5 },
+    [MI_XOR] = { 0x31, 0x33, 6 },
+    [MI_CMP] = { 0x39, 0x3B, 7 },
+  };
+
+  MOperand *dst = &inst->operands[0], *src = &inst->operands[1];
+  int size = inst->size;
+
+  if (src->kind == MO_REG) {
+    encode_rm(e, size, &ALU[inst->op].rm_reg, 1, src->reg, false, dst, 0, 0);
+  } else if (src->kind == MO_MEM) {
+    encode_rm(e, size, &ALU[inst->op].reg_rm, 1, dst->reg, false, src, 0, 0);
+  } else if (fits_int8(src->imm)) {
+    encode_rm(e, size, (uint8_t[]){ 0x83 }, 1, ALU[inst->op].ext, true, dst, 1, src->imm);
+  } else {
+    encode_rm(e, size, (uint8_t[]){ 0x81 }, 1, ALU[inst->op].ext, true, dst, 4, src->imm);
+  }
+}
+
+static void encode_imul(Encoder *e, MInst *inst) {
+  MOperand *dst = &inst->operands[0], *src = &inst->operands[1];
+  int size = inst->size;
+
+  /* imul r, imm is imul r, r, imm */
+  MOperand *imm = NULL;
+  if (inst->nopers == 3) {
+    imm = &inst->operands[2];
+  } else if (src->kind == MO_IMM) {
+    imm = src;
+    src = dst;
+  }
+
+  if (!imm)
+    encode_rm(e, size, (uint8_t[]){ 0x0F, 0xAF }, 2, dst->reg, false, src, 0, 0);
+  else if (fits_int8(imm->imm))
+    encode_rm(e, size, (uint8_t[]){ 0x6B }, 1, dst->reg, false, src, 1, imm->imm);
+  else
+    encode_rm(e, size, (uint8_t[]){ 0x69 }, 1, dst->reg, false, src, 4, imm->imm);
+}
+
+/* Scalar SSE instructions: a mandatory prefix (0x66, 0xF2, 0xF3 or none),
+ * which goes before REX, & a two-byte opcode. `reg` is the ModRM reg operand
+ * & `size` 8 sets REX.W for 64-bit integer operands. */
+static void encode_sse(Encoder *e, uint8_t prefix, uint8_t opcode, int size, int reg, MOperand *rm) {
+  if (prefix)
+    emit_u8(e, prefix);
+  encode_rm(e, size == 8 ? 8 : 4, (uint8_t[]){ 0x0F, opcode }, 2, reg, false, rm, 0, 0);
+}
+
+static void encode_sse_minst(Encoder *e, MInst *inst) {
+  static const struct {
+    uint8_t prefix, opcode;
+  } SSE[NUM_MOPCODES] = {
+    [MI_MOVSS]     = { 0xF3, 0x10 },
+    [MI_MOVSD]     = { 0xF2, 0x10 },
+    [MI_ADDSS]     = { 0xF3, 0x58 },
+    [MI_ADDSD]     = { 0xF2, 0x58 },
+    [MI_SUBSS]     = { 0xF3, 0x5C },
+    [MI_SUBSD]     = { 0xF2, 0x5C },
+    [MI_MULSS]     = { 0xF3, 0x59 },
+    [MI_MULSD]     = { 0xF2, 0x59 },
+    [MI_DIVSS]     = { 0xF3, 0x5E },
+    [MI_DIVSD]     = { 0xF2, 0x5E },
+    [MI_UCOMISS]   = { 0x00, 0x2E },
+    [MI_UCOMISD]   = { 0x66, 0x2E },
+    [MI_CVTSI2SS]  = { 0xF3, 0x2A },
+    [MI_CVTSI2SD]  = { 0xF2, 0x2A },
+    [MI_CVTTSS2SI] = { 0xF3, 0x2C },
+    [MI_CVTTSD2SI] = { 0xF2, 0x2C },
+    [MI_CVTSS2SD]  = { 0xF3, 0x5A },
+    [MI_CVTSD2SS]  = { 0xF2, 0x5A },
+    [MI_XORPS]     = { 0x00, 0x57 },
+  };
+
+  MOperand *dst = &inst->operands[0], *src = &inst->operands[1];
+  uint8_t prefix = SSE[inst->op].prefix;
+
+  /* Stores are the only moves into memory, with an opcode of their own */
+  if ((inst->op == MI_MOVSS || inst->op == MI_MOVSD) && dst->kind == MO_MEM) {
+    encode_sse(e, prefix, 0x11, 4, src->reg, dst);
+    return;
+  }
+
+  /* Only conversions have an integer operand needing REX.W */
+  int size = inst->op >= MI_CVTSI2SS && inst->op <= MI_CVTTSD2SI ? inst->size : 4;
+  encode_sse(e, prefix, SSE[inst->op].opcode, size, dst->reg, src);
+}
+
+/* Jumps are emitted with a zero displacement, patched once the final
+ * offsets of the labels are known */
+static void encode_jump(Encoder *e, MInst *inst, bool near) {
+  if (inst->op == MI_JMP) {
+    emit_u8(e, near ? 0xE9 : 0xEB);
+  } else if (near) {
+    emit_u8(e, 0x0F);
+    emit_u8(e, 0x80 + inst->cc);
+  } else {
+    emit_u8(e, 0x70 + inst->cc);
+  }
+  emit_le(e, 0, near ? 4 : 1);
+}
+
+static size_t jump_target(Encoder *e, MInst *inst) {
+  void *label = hashmap_lookup(&e->labels, inst->operands[0].sym);
+  if (!label)
+    LOG_FATAL("jump to undefined label '%s'", inst->operands[0].sym);
+  return e->offsets[(intptr_t)label - 1];
+}
+
+static void encode_minst(Encoder *e, MInst *inst) {
+  MOperand *dst = &inst->operands[0], *src = &inst->operands[1];
+  int size = inst->size;
+
+  switch (inst->op) {
+    case MI_LABEL:
+      /* Defined once the offsets are final */
+      break;
+    case MI_JMP:
+    case MI_JCC:
+      encode_jump(e, inst, e->near[inst - e->insts]);
+      break;
+    case MI_CALL:
+      /* Every function is in this object, so calls are resolved like jumps */
+      emit_u8(e, 0xE8);
+      emit_le(e, 0, 4);
+      break;
+    case MI_RET:
+      emit_u8(e, 0xC3);
+      break;
+    case MI_MOV:
+      encode_mov(e, inst);
+      break;
+    case MI_MOVSXD:
+      encode_rm(e, 8, (uint8_t[]){ 0x63 }, 1, dst->reg, false, src, 0, 0);
+      break;
+    case MI_LEA:
+      encode_rm(e, size, (uint8_t[]){ 0x8D }, 1, dst->reg, false, src, 0, 0);
+      break;
+    case MI_ADD:
+    case MI_SUB:
+    case MI_XOR:
+    case MI_CMP:
+      encode_alu(e, inst);
+      break;
+    case MI_INC:
+    case MI_DEC:
+      encode_rm(e, size, (uint8_t[]){ 0xFF }, 1, inst->op == MI_INC ? 0 : 1, true, dst, 0, 0);
+      break;
+    case MI_IMUL:
+      encode_imul(e, inst);
+      break;
+    case MI_IDIV:
+      encode_rm(e, size, (uint8_t[]){ 0xF7 }, 1, 7, true, dst, 0, 0);
+      break;
+    case MI_DIV:
+      encode_rm(e, size, (uint8_t[]){ 0xF7 }, 1, 6, true, dst, 0, 0);
+      break;
+    case MI_CDQ:
+      if (size == 8)
+        emit_u8(e, REX | REX_W);
+      emit_u8(e, 0x99);
+      break;
+    case MI_SHL:
+    case MI_SHR:
+    case MI_SAR: {
+      uint8_t ext = inst->op == MI_SHL ? 4 : inst->op == MI_SHR ? 5 : 7;
+      encode_rm(e, size, (uint8_t[]){ 0xC1 }, 1, ext, true, dst, 1, src->imm);
+      break;
+    }
+    case MI_PUSH:
+      encode_plus_reg(e, 4, 0x50, dst->reg);
+      break;
+    case MI_POP:
+      encode_plus_reg(e, 4, 0x58, dst->reg);
+      break;
+    case MI_SYSCALL:
+      emit_le(e, 0x050F, 2);
+      break;
+    case MI_RDTSC:
+      emit_le(e, 0x310F, 2);
+      break;
+    case MI_RDTSCP:
+      emit_le(e, 0xF9010F, 3);
+      break;
+    case MI_TEST:
+      encode_rm(e, size, (uint8_t[]){ 0x85 }, 1, src->reg, false, dst, 0, 0);
+      break;
+    case MI_MOVZX:
+    case MI_MOVSX:
+      /* Into a 32-bit register, so only the byte source decides on REX */
+      encode_rm(e, 1, (uint8_t[]){ 0x0F, inst->op == MI_MOVZX ? 0xB6 : 0xBE }, 2, dst->reg, false, src, 0, 0);
+      break;
+    case MI_SETCC:
+      encode_rm(e, 1, (uint8_t[]){ 0x0F, 0x90 + inst->cc }, 2, 0, true, dst, 0, 0);
+      break;
+    case MI_CMOV:
+      encode_rm(e, size, (uint8_t[]){ 0x0F, 0x40 + inst->cc }, 2, dst->reg, false, src, 0, 0);
+      break;
+    case MI_NEG:
+      encode_rm(e, size, (uint8_t[]){ 0xF7 }, 1, 3, true, dst, 0, 0);
+      break;
+    case MI_MOVSS:
+    case MI_MOVSD:
+    case MI_ADDSS:
+    case MI_ADDSD:
+    case MI_SUBSS:
+    case MI_SUBSD:
+    case MI_MULSS:
+    case MI_MULSD:
+    case MI_DIVSS:
+    case MI_DIVSD:
+    case MI_UCOMISS:
+    case MI_UCOMISD:
+    case MI_CVTSI2SS:
+    case MI_CVTSI2SD:
+    case MI_CVTTSS2SI:
+    case MI_CVTTSD2SI:
+    case MI_CVTSS2SD:
+    case MI_CVTSD2SS:
+    case MI_XORPS:
+      encode_sse_minst(e, inst);
+      break;
+    default:
+      LOG_FATAL("encoding not supported for instruction: %s", MOPCODES[inst->op]);
+  }
+}
+
+/* Encodes the text once, returning whether a short jump fell out of range */
+static bool encode_text(Encoder *e, MProgram *mp) {
+  e->text->size = 0;
+
+  /* Relocations of .data are kept, they don't move with the text */
+  ObjectFile *obj = e->obj;
+  size_t nrelocs = 0;
+  for (size_t i = 0; i < obj->nrelocs; i++) {
+    if (obj->relocs[i].section != SEC_TEXT)
+      obj->relocs[nrelocs++] = obj->relocs[i];
+  }
+  obj->nrelocs = nrelocs;
+
+  for (size_t i = 0; i < mp->ninsts; i++) {
+    e->offsets[i] = e->text->size;
+    encode_minst(e, &mp->insts[i]);
+  }
+
+  bool grown = false;
+  for (size_t i = 0; i < mp->ninsts; i++) {
+    MInst *inst = &mp->insts[i];
+    if ((inst->op != MI_JMP && inst->op != MI_JCC) || e->near[i])
+      continue;
+
+    int64_t disp = (int64_t)jump_target(e, inst) - (int64_t)(e->offsets[i] + 2);
+    if (!fits_int8(disp)) {
+      e->near[i] = true;
+      grown = true;
+    }
+  }
+  return grown;
+}
+
+void x86_64_encode(MProgram *mp, ObjectFile *obj) {
+  object_init(obj);
+  Encoder e = { .obj = obj, .text = &obj->sections[SEC_TEXT], .insts = mp->insts };
+
+  e.offsets = malloc(sizeof(size_t) * (mp->ninsts + 1));
+  e.near = calloc(mp->ninsts + 1, sizeof(bool));
+  if (!e.offsets || !e.near)
+    LOG_FATAL("allocation failed in x86_64_encode");
+
+  hashmap_init(&e.labels);
+  for (size_t i = 0; i < mp->ninsts; i++) {
+    if (mp->insts[i].op == MI_LABEL)
+      hashmap_insert(&e.labels, mp->insts[i].operands[0].sym, (void *)(intptr_t)(i + 1));
+  }
+
+  /* .bss has no contents, its symbols are laid out by size */
+  Section *bss = &obj->sections[SEC_BSS];
+  for (size_t i = 0; i < mp->nbss; i++) {
+    MData *data = &mp->bss[i];
+    bss->size = (bss->size + data->align - 1) / data->align * data->align;
+    if (data->align > bss->align)
+      bss->align = data->align;
+
+    int symbol = object_symbol(obj, data->name);
+    object_define(obj, symbol, SEC_BSS, bss->size, data->size);
+    bss->size += data->size;
+  }
+
+  Section *data = &obj->sections[SEC_DATA];
+  for (size_t i = 0; i < mp->ndata; i++) {
+    MData *var = &mp->data[i];
+    section_align(data, var->align);
+
+    int symbol = object_symbol(obj, var->name);
+    object_define(obj, symbol, SEC_DATA, data->size, var->size);
+
+    if (var->label)
+      object_relocate(obj, SEC_DATA, data->size, object_symbol(obj, var->label), RELOC_ABS64, 0);
+
+    uint8_t bytes[8] = { 0 };
+    for (size_t k = 0; k < 8; k++)
+      bytes[k] = (uint8_t)(var->bits >> (8 * k));
+    section_emit(data, bytes, var->size);
+  }
+
+  /* Constants are aligned to their size, as packed operands must be */
+  Section *rodata = &obj->sections[SEC_RODATA];
+  for (size_t i = 0; i < mp->nconsts; i++) {
+    MConst *c = &mp->consts[i];
+    section_align(rodata, c->size);
+
+    int symbol = object_symbol(obj, c->name);
+    object_define(obj, symbol, SEC_RODATA, rodata->size, c->size);
+
+    uint8_t bytes[16] = { 0 };
+    for (size_t k = 0; k < 8; k++)
+      bytes[k] = (uint8_t)(c->bits >> (8 * k));
+    section_emit(rodata, bytes, c->size);
+  }
+
+  /* String literals, merged suffixes pointing inside the strings they end */
+  StringPool *pool = mp->strings;
+  if (pool && pool->size) {
+    Section *strs = &obj->sections[SEC_RODATA_STR];
+    section_emit(strs, pool->data, pool->size);
+    for (size_t i = 0; i < pool->norder; i++) {
+      PooledString *s = &pool->strings[pool->order[i]];
+      int symbol = object_symbol(obj, s->label);
+      object_define(obj, symbol, SEC_RODATA_STR, s->offset, s->len + 1);
+    }
+  }
+
+  while (encode_text(&e, mp))
+    ;
+
+  for (size_t i = 0; i < mp->ninsts; i++) {
+    MInst *inst = &mp->insts[i];
+    if (inst->op == MI_JMP || inst->op == MI_JCC || inst->op == MI_CALL) {
+      /* The displacement ends the instruction */
+      size_t end = i + 1 < mp->ninsts ? e.offsets[i + 1] : e.text->size;
+      int width = e.near[i] || inst->op == MI_CALL ? 4 : 1;
+      uint64_t disp = (uint64_t)((int64_t)jump_target(&e, inst) - (int64_t)end);
+      for (int k = 0; k < width; k++)
+        e.text->data[end - width + k] = (uint8_t)(disp >> (8 * k));
+    } else if (inst->op == MI_LABEL && strncmp(inst->operands[0].sym, LOCAL_LABEL_PREFIX, strlen(LOCAL_LABEL_PREFIX))) {
+      int symbol = object_symbol(obj, inst->operands[0].sym);
+      object_define(obj, symbol, SEC_TEXT, e.offsets[i], 0);
+      obj->symbols[symbol].global = inst->global;
+      obj->symbols[symbol].function = true;
+    }
+  }
+
+  hashmap_free(&e.labels);
+  free(e.offsets);
+  free(e.near);
+}
@@ -0,0 +1,600 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "x86_64.h"
+
+/* x86_64 Peephole Optimizer
+ *
+ * Instruction selection works one IR instruction at a time, so operands are
+ * loaded into registers & results stored back even when a neighbouring
+ * instruction could have used them in place. The peephole optimizer walks
+ * the machine instructions once per round, appending each one to the output
+ * and rewriting the last few instructions of the output while a rule
+ * matches. Rules that need a register or the flags to be dead look ahead in
+ * the instructions not yet visited. */
+
+#define FLAGS (1ULL << NUM_REGISTERS)
+
+/* How far ahead liveness is looked for before assuming a value is used */
+#define SCAN_LIMIT 64
+
+typedef struct {
+  MProgram *mp;
+  size_t out;    /* Instructions kept so far; the window is their tail */
+  size_t next;   /* First instruction not visited yet */
+} Peephole;
+
+typedef bool (*Rule)(Peephole *p);
+
+/* rbp holds the frame of every function, which debuggers & profilers walk
+ * at any instruction, so it is never dead */
+static bool frame_pointer;
+
+static uint64_t reg_bit(int reg) {
+  return reg == NO_REG ? 0 : 1ULL << reg;
+}
+
+static bool fits_int32(int64_t v) {
+  return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+static bool is_reg(MOperand *operand) {
+  return operand->kind == MO_REG;
+}
+
+static bool is_imm(MOperand *operand, int64_t v) {
+  return operand->kind == MO_IMM && operand->imm == v;
+}
+
+static bool same_operand(MOperand *a, MOperand *b) {
+  if (a->kind != b->kind)
+    return false;
+
+  switch (a->kind) {
+    case MO_REG: return a->reg == b->reg;
+    case MO_IMM: return a->imm == b->imm;
+    case MO_MEM:
+      if ((a->sym == NULL) != (b->sym == NULL) || (a->sym && strcmp(a->sym, b->sym) != 0))
+        return false;
+      return a->reg == b->reg && a->index == b->index && a->disp == b->disp
+        && (a->index == NO_REG || a->scale == b->scale);
+    default: return false;
+  }
+}
+
+/* Registers read by an operand used as a source */
+static uint64_t operand_reads(MOperand *operand) {
+  switch (operand->kind) {
+    case MO_REG: return reg_bit(operand->reg);
+    case MO_MEM: return reg_bit(operand->reg) | reg_bit(operand->index);
+    default:     return 0;
+  }
+}
+
+/* Destination registers are written (& read by read-modify-write
+ * instructions), while memory destinations only read their address */
+static void destination_effects(MOperand *operand, bool modify, uint64_t *reads, uint64_t *writes) {
+  if (operand->kind != MO_REG) {
+    *reads |= operand_reads(operand);
+    return;
+  }
+
+  *writes |= reg_bit(operand->reg);
+  if (modify)
+    *reads |= reg_bit(operand->reg);
+}
+
+/* Registers of the arguments of a call, & everything a call may change */
+#define ARGUMENT_REGISTERS (reg_bit(RDI) | reg_bit(RSI) | reg_bit(RDX) | reg_bit(RCX) \
+    | reg_bit(R8) | reg_bit(R9) | (((1ULL << 8) - 1) << XMM0))
+#define CALL_CLOBBERED (reg_bit(RAX) | reg_bit(RCX) | reg_bit(RDX) | reg_bit(RSI) \
+    | reg_bit(RDI) | reg_bit(R8) | reg_bit(R9) | reg_bit(R10) | reg_bit(R11) \
+    | (((1ULL << 16) - 1) << XMM0) | FLAGS)
+
+/* Registers (& FLAGS) an instruction reads and writes. 32-bit writes clear
+ * the upper half of their register, so every write is a full write. */
+static void effects(MInst *inst, uint64_t *reads, uint64_t *writes) {
+  MOperand *operands = inst->operands;
+  *reads = *writes = 0;
+
+  switch (inst->op) {
+    case MI_MOV:
+    case MI_MOVSXD:
+    case MI_LEA:
+      destination_effects(&operands[0], false, reads, writes);
+      *reads |= operand_reads(&operands[1]);
+      break;
+    case MI_ADD:
+    case MI_SUB:
+    case MI_XOR:
+    case MI_IMUL:
+    case MI_SHL:
+    case MI_SHR:
+    case MI_SAR:
+    case MI_INC:
+    case MI_DEC:
+      /* xor r, r does not depend on r */
+      if (inst->op == MI_XOR && same_operand(&operands[0], &operands[1])) {
+        *writes |= reg_bit(operands[0].reg) | FLAGS;
+        break;
+      }
+
+      /* imul r, r/m, imm only writes its destination */
+      destination_effects(&operands[0], inst->nopers != 3, reads, writes);
+      if (inst->nopers > 1)
+        *reads |= operand_reads(&operands[1]);
+      *writes |= FLAGS;
+      break;
+    case MI_IDIV:
+    case MI_DIV:
+      *reads |= operand_reads(&operands[0]) | reg_bit(RAX) | reg_bit(RDX);
+      *writes |= reg_bit(RAX) | reg_bit(RDX) | FLAGS;
+      break;
+    case MI_CDQ:
+      *reads |= reg_bit(RAX);
+      *writes |= reg_bit(RDX);
+      break;
+    case MI_PUSH:
+      *reads |= operand_reads(&operands[0]) | reg_bit(RSP);
+      *writes |= reg_bit(RSP);
+      break;
+    case MI_POP:
+      destination_effects(&operands[0], false, reads, writes);
+      *reads |= reg_bit(RSP);
+      *writes |= reg_bit(RSP);
+      break;
+    case MI_SYSCALL:
+      *reads |= reg_bit(RAX) | reg_bit(RDI) | reg_bit(RSI) | reg_bit(RDX)
+        | reg_bit(R10) | reg_bit(R8) | reg_bit(R9);
+      *writes |= reg_bit(RAX) | reg_bit(RCX) | reg_bit(R11);
+      break;
+    case MI_RDTSC:
+      *writes |= reg_bit(RAX) | reg_bit(RDX);
+      break;
+    case MI_RDTSCP:
+      *writes |= reg_bit(RAX) | reg_bit(RDX) | reg_bit(RCX);
+      break;
+    case MI_CMP:
+    case MI_TEST:
+      *reads |= operand_reads(&operands[0]) | operand_reads(&operands[1]);
+      *writes |= FLAGS;
+      break;
+    case MI_MOVZX:
+    case MI_MOVSX:
+      destination_effects(&operands[0], false, reads, writes);
+      *reads |= operand_reads(&operands[1]);
+      break;
+    case MI_SETCC:
+      /* Only the low byte is written */
+      destination_effects(&operands[0], true, reads, writes);
+      *reads |= FLAGS;
+      break;
+    case MI_CMOV:
+      destination_effects(&operands[0], true, reads, writes);
+      *reads |= operand_reads(&operands[1]) | FLAGS;
+      break;
+    case MI_JCC:
+      *reads |= FLAGS;
+      break;
+    case MI_NEG:
+      destination_effects(&operands[0], true, reads, writes);
+      *writes |= FLAGS;
+      break;
+    case MI_MOVSS:
+    case MI_MOVSD:
+    case MI_CVTSI2SS:
+    case MI_CVTSI2SD:
+    case MI_CVTTSS2SI:
+    case MI_CVTTSD2SI:
+    case MI_CVTSS2SD:
+    case MI_CVTSD2SS:
+      /* Only the low lane of XMM registers is ever used, so these are
+       * treated as full writes */
+      destination_effects(&operands[0], false, reads, writes);
+      *reads |= operand_reads(&operands[1]);
+      break;
+    case MI_XORPS:
+    case MI_ADDSS:
+    case MI_ADDSD:
+    case MI_SUBSS:
+    case MI_SUBSD:
+    case MI_MULSS:
+    case MI_MULSD:
+    case MI_DIVSS:
+    case MI_DIVSD:
+      /* xorps r, r does not depend on r */
+      if (inst->op == MI_XORPS && same_operand(&operands[0], &operands[1])) {
+        *writes |= reg_bit(operands[0].reg);
+        break;
+      }
+
+      destination_effects(&operands[0], true, reads, writes);
+      *reads |= operand_reads(&operands[1]);
+      break;
+    case MI_UCOMISS:
+    case MI_UCOMISD:
+      *reads |= operand_reads(&operands[0]) | operand_reads(&operands[1]);
+      *writes |= FLAGS;
+      break;
+    case MI_CALL:
+      *reads |= ARGUMENT_REGISTERS | reg_bit(RSP);
+      *writes |= CALL_CLOBBERED;
+      break;
+    case MI_RET:
+      /* The caller reads the result & the registers it expects preserved */
+      *reads |= reg_bit(RAX) | reg_bit(XMM0) | reg_bit(RSP) | reg_bit(RBP) | reg_bit(RBX)
+        | reg_bit(R12) | reg_bit(R13) | reg_bit(R14) | reg_bit(R15);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Registers that never hold a value across a jump */
+#define NOT_LIVE_ACROSS_JUMPS (reg_bit(SCRATCH) | reg_bit(SCRATCH2) \
+    | reg_bit(SCRATCH_XMM) | reg_bit(SCRATCH_XMM2) | FLAGS)
+
+/* Whether none of `mask` is read after the window before being written.
+ * Scanning follows the fallthrough path; variables may live across a jump,
+ * but the scratch registers & the flags never do, & a ret reads all that
+ * outlives the function. */
+static bool dead(Peephole *p, uint64_t mask) {
+  MProgram *mp = p->mp;
+  size_t limit = p->next + SCAN_LIMIT;
+
+  if (frame_pointer && (mask & reg_bit(RBP)))
+    return false;
+
+  for (size_t i = p->next; i < mp->ninsts; i++) {
+    if (i == limit)
+      return false;
+
+    MInst *inst = &mp->insts[i];
+    uint64_t reads, writes;
+    effects(inst, &reads, &writes);
+    if (reads & mask)
+      return false;
+
+    if (inst->op == MI_JMP || inst->op == MI_JCC)
+      return !(mask & ~NOT_LIVE_ACROSS_JUMPS);
+    if (inst->op == MI_RET)
+      return true;
+    mask &= ~writes;
+    if (!mask)
+      return true;
+  }
+  return true;
+}
+
+/* The k-th instruction from the end of the output, or NULL */
+static MInst *tail(Peephole *p, size_t k) {
+  return k < p->out ? &p->mp->insts[p->out - 1 - k] : NULL;
+}
+
+/* Removes the k-th instruction from the end of the output */
+static void drop(Peephole *p, size_t k) {
+  MInst *inst = tail(p, k);
+  memmove(inst, inst + 1, sizeof(MInst) * k);
+  p->out--;
+}
+
+/* mov r, X */
+static bool is_move_to_reg(MInst *inst) {
+  return inst && inst->op == MI_MOV && inst->size == 8 && is_reg(&inst->operands[0]);
+}
+
+/* mov r, r */
+static bool drop_self_move(Peephole *p) {
+  MInst *t0 = tail(p, 0);
+  if (!is_move_to_reg(t0) || !same_operand(&t0->operands[0], &t0->operands[1]))
+    return false;
+
+  drop(p, 0);
+  return true;
+}
+
+/* mov X, Y; mov Y, X: the second move copies back what is already there,
+ * as in a store of a result followed by a load of the same variable */
+static bool drop_reload(Peephole *p) {
+  MInst *t0 = tail(p, 0), *t1 = tail(p, 1);
+  if (!t1 || t0->op != MI_MOV || t1->op != MI_MOV || t0->size != 8 || t1->size != 8)
+    return false;
+
+  MOperand *x = &t1->operands[0], *y = &t1->operands[1];
+  if (!same_operand(&t0->operands[0], y) || !same_operand(&t0->operands[1], x))
+    return false;
+
+  /* mov r, [r]; mov [r], r stores to a different address */
+  if (is_reg(x) && (operand_reads(y) & reg_bit(x->reg)))
+    return false;
+
+  drop(p, 0);
+  return true;
+}
+
+/* mov r, X; op Y, r => op Y, X when r is dead afterwards */
+static bool forward_move(Peephole *p) {
+  MInst *t0 = tail(p, 0), *t1 = tail(p, 1);
+  if (!is_move_to_reg(t1) || t0->nopers < 2)
+    return false;
+
+  switch (t0->op) {
+    case MI_MOV:
+    case MI_MOVSXD:
+    case MI_ADD:
+    case MI_SUB:
+    case MI_XOR:
+    case MI_IMUL:
+    case MI_CMP:
+      break;
+    default:
+      return false;
+  }
+
+  int r = t1->operands[0].reg;
+  MOperand *x = &t1->operands[1], *dst = &t0->operands[0];
+  if (!is_reg(&t0->operands[1]) || t0->operands[1].reg != r)
+    return false;
+
+  /* r must only be read as the source */
+  MInst rest = *t0;
+  rest.operands[1].kind = MO_NONE;
+  uint64_t reads, writes;
+  effects(&rest, &reads, &writes);
+  if ((reads | writes) & reg_bit(r))
+    return false;
+
+  if (x->kind == MO_IMM) {
+    if (t0->op == MI_MOVSXD || (t0->op == MI_IMUL && t0->nopers == 3))
+      return false;
+    bool movabs = t0->op == MI_MOV && is_reg(dst) && t0->size == 8;
+    if (!movabs && !fits_int32(x->imm))
+      return false;
+    if (t0->size == 1 && (x->imm < INT8_MIN || x->imm > INT8_MAX))
+      return false;
+  } else if (x->kind == MO_MEM && !is_reg(dst)) {
+    return false;
+  }
+
+  if (!dead(p, reg_bit(r)))
+    return false;
+
+  t0->operands[1] = *x;
+  drop(p, 1);
+  return true;
+}
+
+/* op r, X; mov Y, r => op Y, X when op only writes its destination & r is
+ * dead afterwards */
+static bool retarget_move(Peephole *p) {
+  MInst *t0 = tail(p, 0), *t1 = tail(p, 1);
+  if (!t1 || !is_move_to_reg(t0) || !is_reg(&t0->operands[1]) || !is_reg(&t1->operands[0]))
+    return false;
+
+  bool pure = t1->op == MI_MOV || t1->op == MI_MOVSXD || t1->op == MI_LEA
+    || (t1->op == MI_IMUL && t1->nopers == 3);
+  int r = t1->operands[0].reg;
+  if (!pure || t0->operands[1].reg != r || !dead(p, reg_bit(r)))
+    return false;
+
+  t1->operands[0] = t0->operands[0];
+  drop(p, 0);
+  return true;
+}
+
+/* mov r, s; add r, X => lea r, [s + X] */
+static bool fold_lea(Peephole *p) {
+  MInst *t0 = tail(p, 0), *t1 = tail(p, 1);
+  if (!is_move_to_reg(t1) || !is_reg(&t1->operands[1]))
+    return false;
+  if ((t0->op != MI_ADD && t0->op != MI_SUB) || t0->size != 8 || t0->nopers != 2)
+    return false;
+
+  int r = t1->operands[0].reg, s = t1->operands[1].reg;
+  MOperand *dst = &t0->operands[0], *x = &t0->operands[1];
+  if (!is_reg(dst) || dst->reg != r || s == r)
+    return false;
+
+  MOperand address = { .kind = MO_MEM, .reg = s, .index = NO_REG, .scale = 1 };
+  if (x->kind == MO_IMM) {
+    int64_t disp = t0->op == MI_ADD ? x->imm : -x->imm;
+    if (!fits_int32(disp))
+      return false;
+    address.disp = disp;
+  } else if (t0->op == MI_ADD && is_reg(x)) {
+    /* r holds s by now, & rsp can only be a base */
+    address.index = x->reg == r ? s : x->reg;
+    if (address.index == RSP) {
+      address.index = address.reg;
+      address.reg = RSP;
+    }
+    if (address.index == RSP)
+      return false;
+  } else {
+    return false;
+  }
+
+  if (!dead(p, FLAGS))
+    return false;
+
+  t0->op = MI_LEA;
+  t0->operands[1] = address;
+  drop(p, 1);
+  return true;
+}
+
+/* mov r, [m]; op r, X; mov [m], r => op [m], X */
+static bool fold_memory_operand(Peephole *p) {
+  MInst *t0 = tail(p, 0), *t1 = tail(p, 1), *t2 = tail(p, 2);
+  if (!t2 || !is_move_to_reg(t2) || t2->operands[1].kind != MO_MEM)
+    return false;
+  if (t0->op != MI_MOV || t0->size != 8 || t1->size != 8)
+    return false;
+
+  int r = t2->operands[0].reg;
+  MOperand *m = &t2->operands[1];
+  if (!same_operand(&t0->operands[0], m) || !is_reg(&t0->operands[1]) || t0->operands[1].reg != r)
+    return false;
+  if (operand_reads(m) & reg_bit(r))
+    return false;
+
+  MOperand *dst = &t1->operands[0];
+  if (!is_reg(dst) || dst->reg != r)
+    return false;
+
+  switch (t1->op) {
+    case MI_ADD:
+    case MI_SUB:
+    case MI_XOR: {
+      MOperand *x = &t1->operands[1];
+      if (x->kind == MO_MEM || (is_reg(x) && x->reg == r) || (x->kind == MO_IMM && !fits_int32(x->imm)))
+        return false;
+      break;
+    }
+    case MI_INC:
+    case MI_DEC:
+      break;
+    default:
+      return false;
+  }
+
+  if (!dead(p, reg_bit(r)))
+    return false;
+
+  /* m points into t2 */
+  MOperand mem = *m;
+  *t2 = *t1;
+  t2->operands[0] = mem;
+  drop(p, 0);
+  drop(p, 0);
+  return true;
+}
+
+/* add X, 0, sub X, 0 & imul r, 1 */
+static bool drop_identity(Peephole *p) {
+  MInst *t0 = tail(p, 0);
+  MOperand *dst = &t0->operands[0];
+
+  bool identity = false;
+  switch (t0->op) {
+    case MI_ADD:
+    case MI_SUB:
+    case MI_XOR:
+      identity = is_imm(&t0->operands[1], 0);
+      break;
+    case MI_IMUL:
+      identity = t0->nopers == 2 && is_imm(&t0->operands[1], 1);
+      break;
+    default:
+      break;
+  }
+
+  /* 32-bit operations still clear the upper half of registers */
+  if (!identity || (is_reg(dst) && t0->size != 8) || !dead(p, FLAGS))
+    return false;
+
+  drop(p, 0);
+  return true;
+}
+
+/* Registers written by mov, movsxd, lea & xor r, r that are never read */
+static bool drop_dead_def(Peephole *p) {
+  MInst *t0 = tail(p, 0);
+  MOperand *dst = &t0->operands[0];
+  if (!is_reg(dst))
+    return false;
+
+  uint64_t mask = reg_bit(dst->reg);
+  switch (t0->op) {
+    case MI_MOV:
+    case MI_MOVSXD:
+    case MI_LEA:
+      break;
+    case MI_XOR:
+      if (!same_operand(dst, &t0->operands[1]))
+        return false;
+      mask |= FLAGS;
+      break;
+    default:
+      return false;
+  }
+
+  if (!dead(p, mask))
+    return false;
+
+  drop(p, 0);
+  return true;
+}
+
+/* mov r, 0 => xor r32, r32 */
+static bool zero_with_xor(Peephole *p) {
+  MInst *t0 = tail(p, 0);
+  if (t0->op != MI_MOV || !is_reg(&t0->operands[0]) || !is_imm(&t0->operands[1], 0))
+    return false;
+  if (!dead(p, FLAGS))
+    return false;
+
+  t0->op = MI_XOR;
+  t0->size = 4;
+  t0->operands[1] = t0->operands[0];
+  return true;
+}
+
+/* add X, 1 => inc X & sub X, 1 => dec X */
+static bool step_with_inc(Peephole *p) {
+  MInst *t0 = tail(p, 0);
+  if ((t0->op != MI_ADD && t0->op != MI_SUB) || t0->nopers != 2 || t0->operands[1].kind != MO_IMM)
+    return false;
+
+  int64_t step = t0->op == MI_ADD ? t0->operands[1].imm : -t0->operands[1].imm;
+  if ((step != 1 && step != -1) || !dead(p, FLAGS))
+    return false;
+
+  t0->op = step == 1 ? MI_INC : MI_DEC;
+  t0->nopers = 1;
+  return true;
+}
+
+/* Combining rules run first, so that e.g. mov r, 0 is forwarded into a
+ * store before it turns into xor r, r */
+static const Rule COMBINE[] = {
+  drop_self_move,
+  drop_reload,
+  drop_identity,
+  forward_move,
+  retarget_move,
+  fold_lea,
+  fold_memory_operand,
+  drop_dead_def,
+};
+
+static const Rule STRENGTH[] = {
+  zero_with_xor,
+  step_with_inc,
+};
+
+static void run_rules(MProgram *mp, const Rule *rules, size_t nrules) {
+  Peephole p = { .mp = mp };
+
+  while (p.next < mp->ninsts) {
+    mp->insts[p.out++] = mp->insts[p.next++];
+
+    /* Rewriting the window may let an earlier instruction match */
+    bool changed = true;
+    while (changed && p.out > 0) {
+      changed = false;
+      for (size_t i = 0; i < nrules && !changed; i++)
+        changed = rules[i](&p);
+    }
+  }
+
+  mp->ninsts = p.out;
+}
+
+void x86_64_peephole(MProgram *mp) {
+  frame_pointer = mp->frame_pointer;
+  run_rules(mp, COMBINE, sizeof(COMBINE) / sizeof(COMBINE[0]));
+  run_rules(mp, STRENGTH, sizeof(STRENGTH) / sizeof(STRENGTH[0]));
+}
@@ -0,0 +1,487 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "profile.h"
+#include "symtab.h"
+#include "types.h"
+#include "util.h"
+#include "x86_64.h"
+
+const RegisterID ALLOCATABLE[NUM_ALLOCATABLE] = {
+  RAX, RCX, RDX, RSI, RDI, R8, R9, RBX, R12, R13, R14, R15,
+  XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7, XMM8, XMM9, XMM10, XMM11, XMM12, XMM13
+};
+
+const uint32_t CLASS_REGISTERS[NUM_REGCLASSES] = {
+  [RC_GPR] = (1u << 12) - 1,
+  [RC_XMM] = ((1u << 14) - 1) << 12,
+};
+
+/* RBX & R12-R15 */
+const uint32_t CALLEE_SAVED = ((1u << 5) - 1) << 7;
+
+int argument_register(RegClass cls, int index) {
+  static const RegisterID GPR_ARGS[] = { RDI, RSI, RDX, RCX, R8, R9 };
+  if (index < 0 || index >= NUM_ARG_REGISTERS(cls))
+    return -1;
+  return cls == RC_XMM ? XMM0 + index : GPR_ARGS[index];
+}
+
+int parameter_register(const char *func, int index, int *stack) {
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)func, strlen(func));
+  if (!symbol || symbol->kind != SYM_FUNC)
+    LOG_FATAL("'%s' is not a function", func);
+
+  int counts[NUM_REGCLASSES] = { 0 };
+  *stack = 0;
+  int i = 0;
+  for (Node *param = symbol->node->func.params; param; param = param->next, i++) {
+    RegClass cls = IS_FLOATING(param->var.type->kind) ? RC_XMM : RC_GPR;
+    int rid = argument_register(cls, counts[cls]++);
+    if (i == index)
+      return rid;
+    *stack += rid < 0;
+  }
+  LOG_FATAL("function '%s' has no parameter %d", func, index);
+}
+
+int register_priority(RegisterID rid) {
+  static const int priorities[NUM_REGISTERS] = {
+    [RAX] = 1, [RCX] = 2, [RDX] = 3, [RSI] = 4, [RDI] = 5, [R8] = 6,
+    [R9] = 7, [RBX] = 8, [R12] = 9, [R13] = 10, [R14] = 11, [R15] = 12,
+    [XMM0] = 13, [XMM1] = 14, [XMM2] = 15, [XMM3] = 16, [XMM4] = 17,
+    [XMM5] = 18, [XMM6] = 19, [XMM7] = 20, [XMM8] = 21, [XMM9] = 22,
+    [XMM10] = 23, [XMM11] = 24, [XMM12] = 25, [XMM13] = 26,
+  };
+  return rid < NUM_REGISTERS ? priorities[rid] - 1 : -1;
+}
+
+const char *regname(RegisterID rid) {
+  switch (rid) {
+    case RAX: return "rax";
+    case RBX: return "rbx";
+    case RCX: return "rcx";
+    case RDX: return "rdx";
+    case RSP: return "rsp";
+    case RBP: return "rbp";
+    case RSI: return "rsi";
+    case RDI: return "rdi";
+    case R8:  return  "r8";
+    case R9:  return  "r9";
+    case R10: return "r10";
+    case R11: return "r11";
+    case R12: return "r12";
+    case R13: return "r13";
+    case R14: return "r14";
+    case R15: return "r15";
+    default:
+      if (rid >= XMM0 && rid <= XMM15) {
+        static const char *xmm[] = {
+          "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+          "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+        };
+        return xmm[rid - XMM0];
+      }
+      return "???";
+  }
+}
+
+/* 32-bit views of the registers, for operations on `int`/`uint` values whose
+ * result depends on the upper half being clear (shifts, multiply-high) */
+const char *regname32(RegisterID rid) {
+  static const char *names[NUM_REGISTERS] = {
+    [RAX] = "eax", [RBX] = "ebx", [RCX] = "ecx", [RDX] = "edx",
+    [RSP] = "esp", [RBP] = "ebp", [RSI] = "esi", [RDI] = "edi",
+    [R8] = "r8d", [R9] = "r9d", [R10] = "r10d", [R11] = "r11d",
+    [R12] = "r12d", [R13] = "r13d", [R14] = "r14d", [R15] = "r15d",
+  };
+  return rid < XMM0 ? names[rid] : regname(rid);
+}
+
+/* RegisterData is recycled across functions instead of being allocated for
+ * every variable of every function */
+#define POOL_CHUNK 256
+
+static RegisterData *pool = NULL;
+
+static RegisterData *regdata_new(int start, int end) {
+  if (!pool) {
+    RegisterData *chunk = calloc(POOL_CHUNK, sizeof(RegisterData));
+    if (!chunk)
+      LOG_FATAL("calloc failed in regdata_new");
+
+    for (int i = 0; i < POOL_CHUNK - 1; i++)
+      chunk[i].next = &chunk[i + 1];
+    pool = chunk;
+  }
+
+  RegisterData *data = pool;
+  pool = data->next;
+
+  data->start = start;
+  data->end = end;
+  data->uses = 0;
+  data->cost = 0;
+  data->var = NULL;
+  data->type = NULL;
+  data->cls = RC_GPR;
+  data->global = false;
+  data->crosses_call = false;
+  data->hint = -1;
+  data->slot = -1;
+  data->rid = -1;
+  data->next = NULL;
+  return data;
+}
+
+static void regdata_free(RegisterData *data) {
+  data->next = pool;
+  pool = data;
+}
+
+static Symbol *global_variable(const char *var) {
+  Symbol *symbol = find_symbol(&SYMTAB, (char *)var, strlen(var));
+  return symbol && symbol->kind == SYM_VAR ? symbol : NULL;
+}
+
+static int add_occurrence(Allocation *alloc, HashMap *vregs, char *var, int pos, double weight) {
+  int vreg = (int)(intptr_t)hashmap_lookup(vregs, var) - 1;
+  if (vreg < 0) {
+    RegisterData *data = regdata_new(pos, pos);
+    Symbol *symbol = global_variable(var);
+    data->var = var;
+    data->global = symbol != NULL;
+    if (symbol)
+      data->type = symbol->node->var.type;
+
+    RegisterData **tmp = realloc(alloc->intervals, sizeof(RegisterData *) * (alloc->nintervals + 1));
+    if (!tmp)
+      LOG_FATAL("realloc failed in add_occurrence");
+
+    vreg = alloc->nintervals++;
+    tmp[vreg] = data;
+    alloc->intervals = tmp;
+    hashmap_insert(vregs, var, (void *)(intptr_t)(vreg + 1));
+  }
+
+  RegisterData *data = alloc->intervals[vreg];
+  data->end = pos;
+  data->uses++;
+  data->cost += weight;
+  return vreg;
+}
+
+/* Type of the value an instruction assigns. The optimizer rewrites
+ * instructions in place, e.g. a comparison folded into a copy of its result
+ * keeps the type of its operands, so copies take the type of their source. */
+static const Type *assigned_type(Allocation *alloc, Instruction *inst) {
+  if (IS_COMPARISON_OP(inst->opcode))
+    return &PRIMITIVES[TY_BOOL];
+
+  if (inst->opcode == OP_ASSIGN && inst->nopers == 1) {
+    Operand *src = &inst->operands[0];
+    const Type *type = IS_VALUE((*src)) ? value_type(&src->val) : alloc->intervals[src->vreg]->type;
+    if (type)
+      return type;
+  }
+  return inst->type;
+}
+
+static void set_hint(Allocation *alloc, Operand *operand, int index) {
+  if (!IS_VARIABLE((*operand)))
+    return;
+
+  RegisterData *data = alloc->intervals[operand->vreg];
+  if (data->hint < 0)
+    data->hint = index >= 0 ? argument_register(data->cls, index) : RETURN_REGISTER(data->cls);
+}
+
+/* Variables passed to or returned from a call, or bound to a parameter, are
+ * hinted to the register of the calling convention, so that they are
+ * computed right where they need to be */
+static void collect_hints(Allocation *alloc, BasicBlock *entry, BasicBlock *end) {
+  const char *func = entry->head->operands[0].label;
+  int args[NUM_REGCLASSES] = { 0 };
+
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_DEAD)
+        continue;
+
+      RegisterData *data = inst->assignee ? alloc->intervals[inst->vreg] : NULL;
+      int stack;
+      switch (inst->opcode) {
+        case OP_PARAM:
+          if (data->hint < 0)
+            data->hint = parameter_register(func, inst->operands[0].val.i_val, &stack);
+          break;
+        case OP_ARG:
+          if (IS_VARIABLE(inst->operands[0])) {
+            RegClass cls = alloc->intervals[inst->operands[0].vreg]->cls;
+            set_hint(alloc, &inst->operands[0], args[cls]++);
+          } else {
+            args[IS_FLOATING(value_type(&inst->operands[0].val)->kind) ? RC_XMM : RC_GPR]++;
+          }
+          break;
+        case OP_CALL:
+          memset(args, 0, sizeof(args));
+          if (data && data->hint < 0)
+            data->hint = RETURN_REGISTER(data->cls);
+          break;
+        case OP_RET:
+          if (inst->nopers)
+            set_hint(alloc, &inst->operands[0], -1);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+/* Every variable of a function gets a single live interval from its first
+ * to its last occurrence; control flow only ever moves forward, so the
+ * interval covers every point where the variable may be live. Names are
+ * resolved to virtual registers here, once, so the allocators & codegen
+ * never compare strings. A variable is typed by its first assignment, which
+ * decides on its register class, & an interval containing a call crosses
+ * it. */
+static void collect_intervals(Allocation *alloc, BasicBlock *entry, BasicBlock *end) {
+  HashMap vregs;
+  hashmap_init(&vregs);
+
+  /* Number of calls before every position */
+  int *calls = NULL;
+  int ncalls = 0, capacity = 0;
+
+  int pos = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    double weight = block_frequency(entry, block);
+    for (Instruction *inst = block->head; inst; inst = inst->next) {
+      if (inst->opcode == OP_DEAD)
+        continue;
+
+      if (pos + 2 > capacity) {
+        capacity = capacity ? capacity << 1 : 256;
+        int *tmp = realloc(calls, sizeof(int) * capacity);
+        if (!tmp)
+          LOG_FATAL("realloc failed in collect_intervals");
+        calls = tmp;
+      }
+      calls[pos] = ncalls;
+      ncalls += inst->opcode == OP_CALL;
+      calls[pos + 1] = ncalls;
+
+      for (int i = 0; i < inst->nopers; i++) {
+        Operand *operand = &inst->operands[i];
+        if (IS_VARIABLE((*operand)))
+          operand->vreg = add_occurrence(alloc, &vregs, operand->var, pos, weight);
+      }
+      if (inst->assignee) {
+        inst->vreg = add_occurrence(alloc, &vregs, inst->assignee, pos, weight);
+        RegisterData *data = alloc->intervals[inst->vreg];
+        if (!data->type)
+          data->type = assigned_type(alloc, inst);
+      }
+      pos++;
+    }
+  }
+
+  for (size_t i = 0; i < alloc->nintervals; i++) {
+    RegisterData *data = alloc->intervals[i];
+    if (!data->type)
+      data->type = &PRIMITIVES[TY_INT];
+    data->cls = IS_FLOATING(data->type->kind) ? RC_XMM : RC_GPR;
+    /* A call's result starts at the call, & its arguments end before it */
+    data->crosses_call = calls && calls[data->end] - calls[data->start + 1] > 0;
+  }
+
+  free(calls);
+  hashmap_free(&vregs);
+  collect_hints(alloc, entry, end);
+}
+
+/* Linear Scan Register Allocation (Poletto & Sarkar)
+ *
+ * Intervals are visited by increasing start point, and the active list keeps
+ * the ones currently holding a register sorted by end point. When no register
+ * is free, the interval used least densely is spilled to a stack slot for
+ * its whole lifetime. Intervals crossing a call may only take callee-saved
+ * registers, & take their hint when it is free. */
+
+typedef struct {
+  Allocation *alloc;
+  uint32_t free;         /* Bit i is set while ALLOCATABLE[i] is available */
+  RegisterData *active;  /* Intervals holding a register, by increasing end point */
+  int *slot_ends;        /* End point of the interval occupying each spill slot */
+} LinearScan;
+
+/* Cost of keeping a variable in memory: every use of a spilled variable
+ * turns into a load or a store, so densely used intervals cost the most.
+ * Uses count as often as their block runs in the profile. */
+static double spill_weight(RegisterData *data) {
+  return data->cost / (double)(data->end - data->start + 1);
+}
+
+static void insert_active(LinearScan *ls, RegisterData *data) {
+  RegisterData **link = &ls->active;
+  while (*link && (*link)->end <= data->end)
+    link = &(*link)->next;
+
+  data->next = *link;
+  *link = data;
+}
+
+static void remove_active(LinearScan *ls, RegisterData *data) {
+  RegisterData **link = &ls->active;
+  while (*link != data)
+    link = &(*link)->next;
+
+  *link = data->next;
+  data->next = NULL;
+}
+
+static void release_register(LinearScan *ls, RegisterID rid) {
+  ls->free |= 1u << register_priority(rid);
+}
+
+static void assign_register(LinearScan *ls, RegisterID rid, RegisterData *data) {
+  ls->free &= ~(1u << register_priority(rid));
+  data->rid = rid;
+  insert_active(ls, data);
+#ifdef DEBUG
+  printf("-> assigned register '%s' to variable '%s' [%d, %d]\n",
+      regname(rid), data->var, data->start, data->end);
+#endif
+}
+
+static void expire_old_intervals(LinearScan *ls, RegisterData *current) {
+  while (ls->active && ls->active->end < current->start) {
+    RegisterData *data = ls->active;
+    ls->active = data->next;
+    data->next = NULL;
+    release_register(ls, data->rid);
+  }
+}
+
+/* Registers an interval may be assigned */
+static uint32_t candidate_registers(RegisterData *data) {
+  uint32_t mask = CLASS_REGISTERS[data->cls];
+  return data->crosses_call ? mask & CALLEE_SAVED : mask;
+}
+
+/* The lowest set bit is the free register with the highest priority */
+static int find_available_register(LinearScan *ls, RegisterData *data) {
+  uint32_t free = ls->free & candidate_registers(data);
+  if (data->hint >= 0 && (free & (1u << register_priority(data->hint))))
+    return data->hint;
+  return free ? (int)ALLOCATABLE[__builtin_ctz(free)] : -1;
+}
+
+/* Slots are shared by intervals that do not overlap */
+static int find_spill_slot(LinearScan *ls, RegisterData *data) {
+  Allocation *alloc = ls->alloc;
+  for (int i = 0; i < alloc->nslots; i++) {
+    if (ls->slot_ends[i] < data->start) {
+      ls->slot_ends[i] = data->end;
+      return i;
+    }
+  }
+
+  int *tmp = realloc(ls->slot_ends, sizeof(int) * (alloc->nslots + 1));
+  if (!tmp)
+    LOG_FATAL("realloc failed in find_spill_slot");
+  tmp[alloc->nslots] = data->end;
+  ls->slot_ends = tmp;
+  return alloc->nslots++;
+}
+
+static void spill_interval(LinearScan *ls, RegisterData *data) {
+  data->rid = -1;
+  data->slot = find_spill_slot(ls, data);
+#ifdef DEBUG
+  printf("-> spilled variable '%s' [%d, %d] to slot %d\n",
+      data->var, data->start, data->end, data->slot);
+#endif
+}
+
+static void spill_at_interval(LinearScan *ls, RegisterData *current) {
+  /* Keep whichever of the competing intervals holding a register the
+   * current one may take is used most densely */
+  RegisterData *victim = current;
+  uint32_t candidates = candidate_registers(current);
+  for (RegisterData *data = ls->active; data; data = data->next) {
+    if (!(candidates & (1u << register_priority(data->rid))))
+      continue;
+
+    double weight = spill_weight(data), victim_weight = spill_weight(victim);
+    if (weight < victim_weight || (weight == victim_weight && data->end > victim->end))
+      victim = data;
+  }
+
+  if (victim == current) {
+    spill_interval(ls, current);
+    return;
+  }
+
+  RegisterID rid = victim->rid;
+  remove_active(ls, victim);
+  spill_interval(ls, victim);
+  assign_register(ls, rid, current);
+}
+
+void linear_scan(Allocation *alloc) {
+  LinearScan ls = { .alloc = alloc, .free = (1u << NUM_ALLOCATABLE) - 1 };
+
+  for (size_t i = 0; i < alloc->nintervals; i++) {
+    RegisterData *current = alloc->intervals[i];
+    if (current->global)
+      continue;
+
+    expire_old_intervals(&ls, current);
+    int rid = find_available_register(&ls, current);
+    if (rid >= 0)
+      assign_register(&ls, rid, current);
+    else
+      spill_at_interval(&ls, current);
+  }
+
+  free(ls.slot_ends);
+}
+
+void allocate_registers(Allocation *alloc, RegAllocKind kind, BasicBlock *entry, BasicBlock *end) {
+  alloc->intervals = NULL;
+  alloc->nintervals = 0;
+  alloc->nslots = 0;
+
+  collect_intervals(alloc, entry, end);
+
+  switch (kind) {
+    case REGALLOC_LINEAR:
+      linear_scan(alloc);
+      break;
+    case REGALLOC_GRAPH:
+      color_graph(alloc, entry, end);
+      break;
+    default: LOG_FATAL("invalid register allocator: %d", kind);
+  }
+}
+
+void free_allocation(Allocation *alloc) {
+  for (size_t i = 0; i < alloc->nintervals; i++)
+    regdata_free(alloc->intervals[i]);
+  free(alloc->intervals);
+
+  alloc->intervals = NULL;
+  alloc->nintervals = 0;
+  alloc->nslots = 0;
+}
+
+RegisterData *allocation_lookup(Allocation *alloc, int vreg) {
+  if (vreg < 0 || (size_t)vreg >= alloc->nintervals)
+    LOG_FATAL("no location was allocated for virtual register %d", vreg);
+  return alloc->intervals[vreg];
+}
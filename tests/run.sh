@@ -0,0 +1,49 @@
+#!/bin/sh
+# Compiles & runs every test program under each optimization level & each
+# backend, checking the exit status against the `// expect: <status>` line
+# of the program.
+#
+# usage: tests/run.sh [programs...]
+
+NEO=${NEO:-build/neo}
+OUT=${TMPDIR:-/tmp}/neo-test.$$
+
+[ $# -gt 0 ] || set -- tests/*.ns
+
+fail=0
+check() {
+  program=$1 expect=$2 mode=$3 status=$4
+  if [ "$status" != "$expect" ]; then
+    echo "FAIL $program ($mode): exit status $status, expected $expect"
+    fail=1
+  fi
+}
+
+for program in "$@"; do
+  expect=$(sed -n 's|^// expect: *\([0-9]*\).*|\1|p' "$program")
+  if [ -z "$expect" ]; then
+    echo "FAIL $program: no '// expect:' line"
+    fail=1
+    continue
+  fi
+
+  for opt in -O0 -O1 -O2 "-O2 -fno-inline"; do
+    if "$NEO" $opt -o "$OUT" "$program" >/dev/null 2>&1; then
+      "$OUT"; check "$program" "$expect" "$opt" $?
+    else
+      check "$program" "$expect" "$opt" "compile error"
+    fi
+    "$NEO" $opt --interp "$program" >/dev/null 2>&1
+    check "$program" "$expect" "$opt --interp" $?
+  done
+
+  if "$NEO" -O2 --target=c -o "$OUT" "$program" >/dev/null 2>&1; then
+    "$OUT"; check "$program" "$expect" "-O2 --target=c" $?
+  else
+    check "$program" "$expect" "-O2 --target=c" "compile error"
+  fi
+done
+
+rm -f "$OUT"
+[ $fail -eq 0 ] && echo "all tests passed"
+exit $fail